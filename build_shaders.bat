@@ -2,7 +2,7 @@
 
 pushd resources\shaders\
 del /Q *.spv
-for %%v in (*.frag *.vert *.rchit *.rgen *.rmiss) do (
+for %%v in (*.frag *.vert *.comp *.rchit *.rgen *.rmiss) do (
     echo %%v
     "D:/VulkanSDK/1.2.162.0/Bin32/glslc.exe" "%%v" --target-env=vulkan1.2 -o "%%v".spv || goto :error
 )
@@ -17,3 +17,15 @@ clang %args% %include_path% src/tests/unit_test.c -o tmp/test.exe %linker_option
 IF !ERRORLEVEL! == 0 (
     ECHO BUILD OK
 )
+
+ECHO Building mat4_bench.exe
+clang %args% -O2 %include_path% src/tests/mat4_bench.c -o tmp/mat4_bench.exe %linker_options% -Xlinker -SUBSYSTEM:CONSOLE
+IF !ERRORLEVEL! == 0 (
+    ECHO BUILD OK
+)
+
+ECHO Building fog_diff.exe
+clang %args% -O2 %include_path% src/tests/fog_diff.c -o tmp/fog_diff.exe %linker_options% -Xlinker -SUBSYSTEM:CONSOLE
+IF !ERRORLEVEL! == 0 (
+    ECHO BUILD OK
+)
@@ -0,0 +1,28 @@
+#version 460
+
+// Size of the block of pixels under each fog texel
+layout(constant_id = 0) const uint DOWNSCALE = 2;
+
+layout(binding = 0) uniform sampler2D depth_map;
+
+layout(location = 0) in vec2 uv;
+
+layout(location = 0) out float out_depth;
+
+// Nearest depth of the block on even texels and farthest on odd ones, so that the fog is marched
+// up to both sides of an edge and the upsample finds a texel matching each pixel
+void main() {
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    ivec2 last = textureSize(depth_map, 0) - 1;
+    float nearest = 1.0;
+    float farthest = 0.0;
+    for(uint y = 0; y < DOWNSCALE; y++) {
+        for(uint x = 0; x < DOWNSCALE; x++) {
+            ivec2 pixel = min(texel * int(DOWNSCALE) + ivec2(x, y), last);
+            float depth = texelFetch(depth_map, pixel, 0).r;
+            nearest = min(nearest, depth);
+            farthest = max(farthest, depth);
+        }
+    }
+    out_depth = ((texel.x + texel.y) & 1) == 0 ? nearest : farthest;
+}
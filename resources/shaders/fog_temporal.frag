@@ -0,0 +1,65 @@
+#version 460
+
+#define MAX_CASCADES 4
+
+// Weight of the new frame, the history holds about the last 1 / BLEND frames
+#define BLEND 0.1
+
+layout (binding = 0) uniform CameraMatrices {
+	mat4 proj;
+    mat4 proj_inverse;
+	mat4 view;
+	mat4 view_inverse;
+	mat4 light_vp[MAX_CASCADES];
+	vec4 cascade_splits;
+	vec3 view_pos;
+	vec3 light_dir;
+	uint shadow_mode;
+	uint cascade_count;
+	mat4 previous_proj;
+	mat4 previous_view;
+	uint fog_frame;
+} cam;
+layout(binding = 1) uniform sampler2D fog_depth;
+layout(binding = 2) uniform sampler2D fog_color;
+layout(binding = 3) uniform sampler2D history;
+
+layout(location = 0) in vec2 uv;
+
+layout(location = 0) out vec4 out_color;
+
+// Finds where the surface under the fog texel was last frame and blends the fog it had there
+// with the new one. The history is clamped to the range of the new fog around the texel so that
+// what got uncovered or changed doesn't leave a trail.
+void main() {
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    ivec2 last = textureSize(fog_color, 0) - 1;
+    vec3 current = texelFetch(fog_color, texel, 0).rgb;
+
+    vec3 lowest = current;
+    vec3 highest = current;
+    for(int y = -1; y <= 1; y++) {
+        for(int x = -1; x <= 1; x++) {
+            ivec2 neighbor_texel = clamp(texel + ivec2(x, y), ivec2(0), last);
+            vec3 neighbor = texelFetch(fog_color, neighbor_texel, 0).rgb;
+            lowest = min(lowest, neighbor);
+            highest = max(highest, neighbor);
+        }
+    }
+
+    float depth = texelFetch(fog_depth, texel, 0).r;
+    vec4 view_space_pos = cam.proj_inverse * vec4(uv, depth, 1.0);
+    vec4 world_space_pos = cam.view_inverse * (view_space_pos / view_space_pos.w);
+    vec4 previous = cam.previous_proj * cam.previous_view * world_space_pos;
+    vec2 previous_uv = (previous.xy / previous.w + vec2(1.0)) * 0.5;
+
+    // The history is cleared to 0 when it is created, it has 1 in alpha once written
+    vec4 old = texture(history, previous_uv);
+    bool on_screen = all(greaterThanEqual(previous_uv, vec2(0.0))) &&
+                     all(lessThanEqual(previous_uv, vec2(1.0)));
+    if(!on_screen || previous.w <= 0.0 || old.a == 0.0) {
+        out_color = vec4(current, 1.0);
+        return;
+    }
+    out_color = vec4(mix(clamp(old.rgb, lowest, highest), current, BLEND), 1.0);
+}
@@ -0,0 +1,68 @@
+#version 460
+
+#define MAX_CASCADES 4
+
+// Past this relative difference of view depth no fog texel is on the surface of the pixel
+#define DEPTH_TOLERANCE 0.1
+
+layout (binding = 0) uniform CameraMatrices {
+	mat4 proj;
+    mat4 proj_inverse;
+	mat4 view;
+	mat4 view_inverse;
+	mat4 light_vp[MAX_CASCADES];
+	vec4 cascade_splits;
+	vec3 view_pos;
+	vec3 light_dir;
+	uint shadow_mode;
+	uint cascade_count;
+} cam;
+layout(binding = 1) uniform sampler2D depth_map;
+layout(binding = 2) uniform sampler2D fog_depth;
+layout(binding = 3) uniform sampler2D fog_color;
+
+layout(location = 0) in vec2 uv;
+
+layout(location = 0) out vec4 out_color;
+
+float view_depth(float depth) {
+    vec4 position = cam.proj_inverse * vec4(0.0, 0.0, depth, 1.0);
+    return abs(position.z / position.w);
+}
+
+// Joint bilateral upsample : the bilinear weights of the 4 nearest fog texels are scaled down by
+// how far their depth is from the one of the pixel
+void main() {
+    float depth = view_depth(texelFetch(depth_map, ivec2(gl_FragCoord.xy), 0).r);
+
+    ivec2 fog_size = textureSize(fog_color, 0);
+    vec2 position = (uv + vec2(1.0)) * 0.5 * vec2(fog_size) - vec2(0.5);
+    ivec2 base = ivec2(floor(position));
+    vec2 fraction = position - vec2(base);
+
+    vec3 color = vec3(0.0);
+    float total_weight = 0.0;
+    vec3 closest_color = vec3(0.0);
+    float closest_difference = 1e30;
+    for(int i = 0; i < 4; i++) {
+        ivec2 offset = ivec2(i & 1, i >> 1);
+        ivec2 texel = clamp(base + offset, ivec2(0), fog_size - 1);
+        vec2 bilinear = mix(vec2(1.0) - fraction, fraction, vec2(offset));
+
+        vec3 texel_color = texelFetch(fog_color, texel, 0).rgb;
+        float difference = abs(view_depth(texelFetch(fog_depth, texel, 0).r) - depth) / depth;
+        float weight = bilinear.x * bilinear.y / (difference + 1e-3);
+        color += texel_color * weight;
+        total_weight += weight;
+        if(difference < closest_difference) {
+            closest_difference = difference;
+            closest_color = texel_color;
+        }
+    }
+    if(closest_difference > DEPTH_TOLERANCE || total_weight <= 0.0) {
+        color = closest_color;
+    } else {
+        color /= total_weight;
+    }
+    out_color = vec4(color, 1.0);
+}
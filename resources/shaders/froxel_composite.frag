@@ -0,0 +1,46 @@
+#version 460
+
+#define MAX_CASCADES 4
+
+layout(constant_id = 0) const float MAX_DISTANCE = 500.0;
+
+layout (binding = 0) uniform CameraMatrices {
+	mat4 proj;
+    mat4 proj_inverse;
+	mat4 view;
+	mat4 view_inverse;
+	mat4 light_vp[MAX_CASCADES];
+	vec4 cascade_splits;
+	vec3 view_pos;
+	vec3 light_dir;
+	uint shadow_mode;
+	uint cascade_count;
+} cam;
+layout(binding = 1) uniform sampler2D depth_map;
+layout(binding = 2) uniform sampler3D integrated;
+
+layout(location = 0) in vec2 uv;
+
+layout(location = 0) out vec4 out_color;
+
+vec3 Density = vec3(.005, .005, .004);
+
+vec3 calculate_world_position(vec2 uv, float depth) {
+    vec4 view_space_pos = cam.proj_inverse * vec4(uv, depth, 1.0);
+    view_space_pos /= view_space_pos.w;
+    return (cam.view_inverse * view_space_pos).xyz;
+}
+
+// One trilinear fetch of the integrated froxels at the distance of the pixel
+void main() {
+    float depth = texelFetch(depth_map, ivec2(gl_FragCoord.xy), 0).r;
+    float distance = min(length(calculate_world_position(uv, depth) - cam.view_pos), MAX_DISTANCE);
+
+    // The value of a froxel is the one at its far side
+    float slice_count = float(textureSize(integrated, 0).z);
+    float slice = slice_count * sqrt(distance / MAX_DISTANCE);
+    vec3 coords = vec3((uv + vec2(1.0)) * 0.5, (slice - 0.5) / slice_count);
+    vec3 accum = texture(integrated, coords).rgb * clamp(slice, 0.0, 1.0);
+
+    out_color = vec4(accum * exp(-Density * distance), 1.0);
+}
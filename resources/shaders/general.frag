@@ -1,10 +1,18 @@
 #version 460
 #extension GL_EXT_nonuniform_qualifier : enable
 #extension GL_ARB_shader_clock : enable
+#extension GL_EXT_ray_query : enable
 
 #define M_PI 3.141592653589793
 #define UINT_MAX 4294967295
 
+#define SHADOW_MODE_MAP 0
+#define SHADOW_MODE_RAY_QUERY 1
+#define MAX_CASCADES 4
+
+// Writes the motion vectors to the second attachment, in TAA only
+layout(constant_id = 0) const bool VELOCITY = false;
+
 struct Material {
     vec3 base_color;
     uint base_color_texture;
@@ -14,28 +22,35 @@ struct Material {
     uint normal_texture;
     uint ao_texture;
     uint emissive_texture;
+    vec4 base_color_uv; // xy : scale, zw : offset inside an atlas page
 };
 
 layout(location = 0) in vec3 in_worldpos;
 layout(location = 1) in vec3 in_normal;
 layout(location = 2) in vec2 in_texcoord;
 layout(location = 4) flat in uint material_id;
-layout(location = 5) in vec4 in_shadow_map_texcoord;
+layout(location = 5) in vec4 in_clip_pos;
+layout(location = 6) in vec4 in_previous_clip_pos;
 
 layout (binding = 0) uniform CameraMatrices {
 	mat4 proj;
-
+	mat4 proj_inverse;
 	mat4 view;
 	mat4 view_inverse;
-	mat4 light_vp;
+	mat4 light_vp[MAX_CASCADES];
+	vec4 cascade_splits; // View depth where each cascade ends
 	vec3 view_pos;
 	vec3 light_dir;
+	uint shadow_mode;
+	uint cascade_count;
 } cam;
 layout(binding = 1) buffer Materials { Material m[]; } materials;
 layout(binding = 2) uniform sampler2D textures[];
-layout(binding = 3) uniform sampler2D shadow_map;
+layout(binding = 3) uniform sampler2DArray shadow_map;
+layout(binding = 4) uniform accelerationStructureEXT tlas;
 
 layout(location = 0) out vec4 out_color;
+layout(location = 1) out vec2 out_velocity;
 
 vec3 get_normal(Material mat) {
     return in_normal.xyz;
@@ -56,25 +71,41 @@ vec3 get_normal(Material mat) {
         return in_normal.xyz;
     }
 }
+// First cascade that reaches the fragment, cascade_count past the last one
+uint get_cascade() {
+    float view_depth = abs((cam.view * vec4(in_worldpos, 1.0)).z);
+    uint cascade = 0;
+    while(cascade < cam.cascade_count && view_depth > cam.cascade_splits[cascade]) {
+        cascade++;
+    }
+    return cascade;
+}
 float get_shadow(float bias) {
+    uint cascade = get_cascade();
+    if(cascade >= cam.cascade_count) {
+        return 1.0;
+    }
+
     float shadow = 1.0;
-    vec4 proj_coords = in_shadow_map_texcoord / in_shadow_map_texcoord.w;
+    vec4 shadow_coords = cam.light_vp[cascade] * vec4(in_worldpos, 1.0);
+    vec4 proj_coords = shadow_coords / shadow_coords.w;
     float current_depth = proj_coords.z;
     proj_coords = proj_coords * 0.5 + 0.5;
 
     if(1 == 0) {
-        float closest_depth = texture(shadow_map, proj_coords.xy).r;
+        float closest_depth = texture(shadow_map, vec3(proj_coords.xy, cascade)).r;
         shadow = closest_depth > current_depth - bias ? 1.0 : 0.1;
     } else {
         shadow = 0.0;
-        vec2 tex_dim = 1.0 / textureSize(shadow_map, 0);
+        vec2 tex_dim = 1.0 / textureSize(shadow_map, 0).xy;
         float scale = 1.0;
         int samples = int(scale);
         int count = 0;
 
         for(int x = -samples; x <= samples; ++x) {
             for(int y = -samples; y <= samples; ++y) {
-                float closest_depth = texture(shadow_map, proj_coords.xy + vec2(x, y) * tex_dim).r;
+                vec2 offset = proj_coords.xy + vec2(x, y) * tex_dim;
+                float closest_depth = texture(shadow_map, vec3(offset, cascade)).r;
                 shadow += closest_depth > current_depth - bias ? 1.0 : 0.0;
                 count ++;
             }
@@ -83,6 +114,17 @@ float get_shadow(float bias) {
     }
     return shadow;
 }
+// Traces towards the sun, any hit is enough
+float get_ray_shadow(vec3 N, vec3 L) {
+    // Pushed off the surface so it doesn't hit its own triangle
+    vec3 origin = in_worldpos + N * 0.01;
+    rayQueryEXT query;
+    rayQueryInitializeEXT(query, tlas, gl_RayFlagsOpaqueEXT | gl_RayFlagsTerminateOnFirstHitEXT,
+                          0xFF, origin, 0.001, L, 1000.0);
+    while(rayQueryProceedEXT(query)) {
+    }
+    return rayQueryGetIntersectionTypeEXT(query, true) == gl_RayQueryCommittedIntersectionNoneEXT ? 1.0 : 0.0;
+}
 vec3 base_color(Material mat) {
 
     const int steps = 4;
@@ -94,6 +136,8 @@ vec3 base_color(Material mat) {
     float pixel_size = 1024;
     if(mat.base_color_texture < UINT_MAX) {
         pos = floor(in_texcoord * pixel_size) / pixel_size;
+        // Wrap before moving to the atlas rect, the sampler can't repeat a region
+        pos = fract(pos) * mat.base_color_uv.xy + mat.base_color_uv.zw;
         diffuse = texture(textures[mat.base_color_texture], pos).rgb;
     } else if(mat.emissive_texture < UINT_MAX) {
         diffuse = texture(textures[mat.emissive_texture], pos).rgb;
@@ -110,8 +154,8 @@ void main() {
 
     Material mat = materials.m[material_id];
 
-    vec3 N = get_normal(mat);
-    vec3 L = cam.light_dir;
+    vec3 N = normalize(get_normal(mat));
+    vec3 L = -cam.light_dir; // Towards the sun
     float NdotL = max(dot(N, L), 0.0);
 
     vec3 base_color = base_color(mat);
@@ -121,7 +165,7 @@ void main() {
     vec3 ambient = skycolor * ambient_intensity * base_color;
 
     float bias = ( 1 - NdotL) * 0.0001;
-    float shadow = get_shadow(bias);
+    float shadow = cam.shadow_mode == SHADOW_MODE_RAY_QUERY ? get_ray_shadow(N, L) : get_shadow(bias);
 
     float cam_distance = length(cam.view_pos - in_worldpos);
     float fog = pow(cam_distance / 20, 2);
@@ -129,5 +173,11 @@ void main() {
     vec3 color = (ambient + shadow * diffuse);
 
     out_color = vec4(color, 1.0);
+    if(VELOCITY) {
+        // In uv units, from where the surface was last frame to where it is now
+        vec2 current = in_clip_pos.xy / in_clip_pos.w;
+        vec2 previous = in_previous_clip_pos.xy / in_previous_clip_pos.w;
+        out_velocity = (current - previous) * 0.5;
+    }
     //out_color = vec4(in_worldpos, 1.0);
 }
\ No newline at end of file
@@ -3,43 +3,55 @@
 layout (location = 0) in vec3 in_position;
 layout (location = 1) in vec3 in_normal;
 layout (location = 2) in vec2 in_texcoord;
+layout (location = 3) in mat4 in_transform;
+layout (location = 7) in mat3 in_normal_matrix;
+layout (location = 10) in mat4 in_previous_transform;
+
+#define MAX_CASCADES 4
 
 layout (binding = 0) uniform CameraMatrices {
 	mat4 proj;
     mat4 proj_inverse;
 	mat4 view;
 	mat4 view_inverse;
-	mat4 light_vp;
+	mat4 light_vp[MAX_CASCADES];
+	vec4 cascade_splits;
 	vec3 view_pos;
 	vec3 light_dir;
+	uint shadow_mode;
+	uint cascade_count;
+	mat4 previous_proj;
+	mat4 previous_view;
+	uint fog_frame;
+	vec2 jitter;
 } cam;
 
 layout(location = 0) out vec3 worldpos;
 layout(location = 1) out vec3 normal;
 layout(location = 2) out vec2 texcoord;
 layout(location = 4) out uint material_id;
-layout(location = 5) out vec4 shadow_map_texcoord;
+// Without the jitter, for the motion vectors
+layout(location = 5) out vec4 clip_pos;
+layout(location = 6) out vec4 previous_clip_pos;
 
 layout(push_constant) uniform PushConstants {
-	mat4 transform;
 	uint material_id;
 } constants;
 
-const mat4 bias = mat4 (
-0.5,0.0,0.0,0.0,
-0.0,0.5,0.0,0.0,
-0.0,0.0,1.0,0.0,
-0.5,0.5,0.0,1.0 );
+// The depth prepass runs this shader alone, the main pass tests its depth for equality
+invariant gl_Position;
 
 void main() {
 
-	vec4 pos = constants.transform * vec4(in_position, 1.0);
+	vec4 pos = in_transform * vec4(in_position, 1.0);
 
-	gl_Position = cam.proj * cam.view * pos;
-    //gl_Position = cam.light_vp * pos;
+	clip_pos = cam.proj * cam.view * pos;
+	previous_clip_pos = cam.previous_proj * cam.previous_view * in_previous_transform *
+		vec4(in_position, 1.0);
+	gl_Position = clip_pos;
+	gl_Position.xy += cam.jitter * clip_pos.w;
 	worldpos = pos.xyz;
-	normal = normalize(transpose(inverse(mat3(constants.transform))) * in_normal);
+	normal = normalize(in_normal_matrix * in_normal);
 	texcoord = in_texcoord;
 	material_id = constants.material_id;
-	shadow_map_texcoord = (cam.light_vp) * pos;
 }
\ No newline at end of file
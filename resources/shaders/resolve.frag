@@ -0,0 +1,58 @@
+#version 460
+
+// Accumulates the jittered frames in a history, otherwise copies the color image
+layout(constant_id = 0) const bool TEMPORAL = false;
+
+// Weight of the new frame, the history holds about the last 1 / BLEND frames
+#define BLEND 0.1
+
+layout(binding = 0) uniform sampler2D color;
+layout(binding = 1) uniform sampler2D velocity;
+layout(binding = 2) uniform sampler2D history;
+
+layout(location = 0) in vec2 uv;
+
+layout(location = 0) out vec4 out_color;
+layout(location = 1) out vec4 out_history;
+
+// Follows the motion vector of the pixel back to where its surface was in the history and blends
+// it with the new frame. The history is clamped to the range of the colors around the pixel so
+// that what got uncovered or changed doesn't leave a trail.
+void main() {
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    vec3 current = texelFetch(color, texel, 0).rgb;
+    if(!TEMPORAL) {
+        out_color = vec4(current, 1.0);
+        return;
+    }
+
+    // The longest motion around the pixel keeps the edges of moving objects with them
+    ivec2 last = textureSize(color, 0) - 1;
+    vec3 lowest = current;
+    vec3 highest = current;
+    vec2 motion = vec2(0.0);
+    for(int y = -1; y <= 1; y++) {
+        for(int x = -1; x <= 1; x++) {
+            ivec2 neighbor_texel = clamp(texel + ivec2(x, y), ivec2(0), last);
+            vec3 neighbor = texelFetch(color, neighbor_texel, 0).rgb;
+            lowest = min(lowest, neighbor);
+            highest = max(highest, neighbor);
+            vec2 neighbor_motion = texelFetch(velocity, neighbor_texel, 0).xy;
+            if(dot(neighbor_motion, neighbor_motion) > dot(motion, motion)) {
+                motion = neighbor_motion;
+            }
+        }
+    }
+
+    // The history is cleared to 0 when it is created, it has 1 in alpha once written
+    vec2 previous_uv = (uv + vec2(1.0)) * 0.5 - motion;
+    vec4 old = texture(history, previous_uv);
+    bool on_screen = all(greaterThanEqual(previous_uv, vec2(0.0))) &&
+                     all(lessThanEqual(previous_uv, vec2(1.0)));
+    vec3 result = current;
+    if(on_screen && old.a != 0.0) {
+        result = mix(clamp(old.rgb, lowest, highest), current, BLEND);
+    }
+    out_color = vec4(result, 1.0);
+    out_history = vec4(result, 1.0);
+}
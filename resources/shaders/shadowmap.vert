@@ -1,26 +1,30 @@
 #version 460
 
+#define MAX_CASCADES 4
+
 layout (location = 0) in vec3 in_position;
 layout (location = 1) in vec3 in_normal;
 layout (location = 2) in vec2 in_texcoord;
+layout (location = 3) in mat4 in_transform;
 
 layout (binding = 0) uniform CameraMatrices {
 	mat4 proj;
     mat4 proj_inverse;
 	mat4 view;
     mat4 view_inverse;
-    mat4 light_vp;
+    mat4 light_vp[MAX_CASCADES];
+    vec4 cascade_splits;
 	vec3 view_pos;
 	vec3 light_dir;
 } cam;
 
 layout(push_constant) uniform PushConstants {
-	mat4 transform;
 	uint material_id;
+	uint cascade;
 } constants;
 
 void main() {
 
-    gl_Position = cam.light_vp * constants.transform * vec4(in_position, 1.0);
+    gl_Position = cam.light_vp[constants.cascade] * in_transform * vec4(in_position, 1.0);
 
 }
\ No newline at end of file
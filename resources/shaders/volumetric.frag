@@ -1,20 +1,37 @@
 #version 460
+#extension GL_EXT_ray_query : enable
 
 #define M_PI 3.141592653589793
 
+#define SHADOW_MODE_MAP 0
+#define SHADOW_MODE_RAY_QUERY 1
+#define MAX_CASCADES 4
 
+// See FogMarch in fog_march.h, the defaults are overridden by the pipeline
+layout(constant_id = 0) const uint MAX_STEPS = 128;
+layout(constant_id = 1) const float MIN_STEP = 0.5;
+layout(constant_id = 2) const float STEP_GROWTH = 0.03;
+layout(constant_id = 3) const float MIN_TRANSMITTANCE = 0.01;
+layout(constant_id = 4) const float MAX_DISTANCE = 500.0;
 
 layout (binding = 0) uniform CameraMatrices {
 	mat4 proj;
     mat4 proj_inverse;
 	mat4 view;
 	mat4 view_inverse;
-	mat4 light_vp;
+	mat4 light_vp[MAX_CASCADES];
+	vec4 cascade_splits;
 	vec3 view_pos;
 	vec3 light_dir;
+	uint shadow_mode;
+	uint cascade_count;
+	mat4 previous_proj;
+	mat4 previous_view;
+	uint fog_frame;
 } cam;
 layout(binding = 1) uniform sampler2D depth_map;
-layout(binding = 2) uniform sampler2D shadow_map;
+layout(binding = 2) uniform sampler2DArray shadow_map;
+layout(binding = 3) uniform accelerationStructureEXT tlas;
 
 layout(location = 0) in vec2 uv;
 
@@ -62,52 +79,79 @@ vec3 calculate_world_position(vec2 uv, float depth) {
     return world_space_pos.xyz;
 }
 
+// True if the sun reaches position
+bool sun_visible(vec3 position, vec3 L) {
+    if(cam.shadow_mode == SHADOW_MODE_RAY_QUERY) {
+        rayQueryEXT query;
+        rayQueryInitializeEXT(query, tlas, gl_RayFlagsOpaqueEXT | gl_RayFlagsTerminateOnFirstHitEXT,
+                              0xFF, position, 0.0, -L, 1000.0);
+        while(rayQueryProceedEXT(query)) {
+        }
+        return rayQueryGetIntersectionTypeEXT(query, true) == gl_RayQueryCommittedIntersectionNoneEXT;
+    }
+    float view_depth = abs((cam.view * vec4(position, 1.0)).z);
+    uint cascade = 0;
+    while(cascade < cam.cascade_count && view_depth > cam.cascade_splits[cascade]) {
+        cascade++;
+    }
+    if(cascade >= cam.cascade_count) {
+        return true;
+    }
+    vec4 shadow_coords = cam.light_vp[cascade] * vec4(position, 1.0);
+    vec4 proj_coords = shadow_coords / shadow_coords.w;
+    float current_depth = proj_coords.z;
+
+    proj_coords = proj_coords * 0.5 + 0.5;
+    float closest_depth = texture(shadow_map, vec3(proj_coords.xy, cascade)).r;
+    return closest_depth > current_depth;
+}
+
 vec3 light_color = vec3(0.99, .72, 0.07);
 float light_intensity = 5.0f;
 
+// Steps get longer with the distance from the camera, the far fog changes slowly on screen. The
+// march stops once the fog in front hides the rest, the transmittance of what is left is
+// accounted for without sampling it.
 vec3 volumetric_fog(vec3 L, vec3 frag_worldpos) {
-
-    //int steps = 32;
     vec3 start = cam.view_pos;
 
     vec3 dir = normalize(frag_worldpos - cam.view_pos);
     float frag_distance = length(frag_worldpos - cam.view_pos);
+    float total_dist = min(frag_distance, MAX_DISTANCE);
 
-    float max_step_length = 0.5;
-    float total_dist = min(frag_distance, 500);
-
-    float step_length = .5;
-    int step_amount = int(total_dist / step_length);
-    vec3 ray_step = dir * step_length;
-
-    vec3 step_abs = exp(-Density * step_length);
-    vec3 step_color = (vec3(1.0) - step_abs) * henyey_greenstein(-L, dir);
+    float phase = henyey_greenstein(-L, dir);
     vec3 vol_abs = vec3(1.0);
 
     vec3 rnd_v = (frag_worldpos + cam.view_pos) * 100.0;
     float a = (rnd_v.x * rnd_v.y * rnd_v.z) / 100.0;
-    uint seed = tea(0, int(a));
-
-    vec3 current_position = start + (ray_step * rnd(seed));
+    uint seed = tea(cam.fog_frame, int(a));
+    float jitter = rnd(seed);
 
     vec3 accum = vec3(0.0);
-    for (int i = 0; i < step_amount; i++) {
-
-        vec4 shadow_coords = cam.light_vp * vec4(current_position, 1.0);
-        vec4 proj_coords = shadow_coords / shadow_coords.w;
-        float current_depth = proj_coords.z;
-
-        proj_coords = proj_coords * 0.5 + 0.5;
-        float closest_depth = texture(shadow_map, proj_coords.xy).r;
-        vol_abs *= step_abs;
-        if(closest_depth > current_depth){ // ! shadow
+    // Long rays take longer steps to stay within the budget
+    float min_step = max(MIN_STEP, total_dist / float(MAX_STEPS));
+    float t = 0.0;
+    for(uint i = 0; i < MAX_STEPS && t < total_dist; i++) {
+        float step_length = min(max(min_step, t * STEP_GROWTH), total_dist - t);
+        vec3 current_position = start + dir * (t + step_length * jitter);
+
+        // Integral of the light scattered along the step, seen through the fog before it
+        vec3 step_abs = exp(-Density * step_length);
+        vec3 step_color = (vec3(1.0) - step_abs) * phase;
+        if(sun_visible(current_position, L)){ // ! shadow
             accum += step_color * vol_abs * light_intensity * light_color;
         } else { // shadow
             accum += step_color * vol_abs * .1;
         }
+        vol_abs *= step_abs;
+        t += step_length;
 
-        current_position += ray_step;
+        if(max(vol_abs.r, max(vol_abs.g, vol_abs.b)) < MIN_TRANSMITTANCE) {
+            break;
+        }
     }
+    // Hidden behind the fog that was marched
+    vol_abs *= exp(-Density * max(total_dist - t, 0.0));
     return accum * vol_abs;
 }
 
@@ -1,4 +1,6 @@
+#include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include <sl3dge-utils/sl3dge.h>
@@ -16,16 +18,39 @@ DLL_EXPORT void GameStart(GameData *game_data) {
     */
     game_data->renderer_api.SetSunDirection(game_data->renderer,
                                             vec3_normalize(vec3_fmul(game_data->light_pos, -1.0)));
+    game_data->shadow_mode = SHADOW_MODE_MAP;
+    game_data->renderer_api.SetShadowMode(game_data->renderer, game_data->shadow_mode);
+    game_data->fog_resolution = FOG_RESOLUTION_HALF;
+    game_data->renderer_api.SetFogResolution(game_data->renderer, game_data->fog_resolution);
+    game_data->fog_technique = FOG_TECHNIQUE_FROXELS;
+    game_data->renderer_api.SetFogTechnique(game_data->renderer, game_data->fog_technique);
+    game_data->fog_temporal = true;
+    game_data->renderer_api.SetFogTemporal(game_data->renderer, game_data->fog_temporal);
+    game_data->anti_aliasing = ANTI_ALIASING_TAA;
+    game_data->renderer_api.SetAntiAliasing(game_data->renderer, game_data->anti_aliasing);
+    game_data->depth_prepass = true;
+    game_data->renderer_api.SetDepthPrepass(game_data->renderer, game_data->depth_prepass);
     //game_data->renderer_api.LoadMesh(game_data->renderer, "resources/models/gltf_samples/Sponza/glTF/Sponza.gltf");
-    game_data->renderer_api.LoadMesh(game_data->renderer,
-                                     "resources/3d/Motorcycle/motorcycle.gltf");
-    game_data->moto = game_data->renderer_api.InstantiateMesh(game_data->renderer, 0);
+    game_data->moto_load = game_data->renderer_api.LoadMeshAsync(
+        game_data->renderer, "resources/3d/Motorcycle/motorcycle.gltf");
 }
 
 DLL_EXPORT void GameLoop(float delta_time, GameData *game_data, GameInput *input) {
     f32 move_speed = 0.1f;
     f32 look_speed = 0.01f;
 
+    if(game_data->moto_load != UINT_MAX) {
+        const MeshLoadState state = game_data->renderer_api.PollMesh(
+            game_data->renderer, game_data->moto_load, &game_data->moto_mesh);
+        if(state == MESH_LOAD_READY) {
+            game_data->moto =
+                game_data->renderer_api.InstantiateMesh(game_data->renderer, game_data->moto_mesh);
+            game_data->moto_load = UINT_MAX;
+        } else if(state == MESH_LOAD_FAILED || state == MESH_LOAD_INVALID) {
+            game_data->moto_load = UINT_MAX;
+        }
+    }
+
     if(input->mouse & MOUSE_RIGHT) {
         if(input->mouse_delta_x != 0) {
             game_data->spherical_coordinates.x += look_speed * input->mouse_delta_x;
@@ -75,7 +100,12 @@ DLL_EXPORT void GameLoop(float delta_time, GameData *game_data, GameInput *input
     if(input->keyboard[SCANCODE_SPACE] & KEY_PRESSED) {
         // GameStart(game_data);
         game_data->position = (Vec3){0.0f, 0, 0};
-        *game_data->moto.transform = mat4_identity();
+        game_data->renderer_api.SetInstancePosition(
+            game_data->renderer, game_data->moto, (Vec3){0.0f, 0.0f, 0.0f});
+        game_data->renderer_api.SetInstanceRotation(
+            game_data->renderer, game_data->moto, (Quat){0.0f, 0.0f, 0.0f, 1.0f});
+        game_data->renderer_api.SetInstanceScale(
+            game_data->renderer, game_data->moto, (Vec3){1.0f, 1.0f, 1.0f});
     }
 
     if(input->keyboard[SCANCODE_P] & KEY_PRESSED) {
@@ -100,8 +130,114 @@ DLL_EXPORT void GameLoop(float delta_time, GameData *game_data, GameInput *input
             game_data->renderer, vec3_normalize(vec3_fmul(game_data->light_pos, -1.0)));
     }
 
-    if(input->keyboard[SCANCODE_M] & KEY_PRESSED) {
-        game_data->renderer_api.InstantiateMesh(game_data->renderer, 0);
+    if(input->keyboard[SCANCODE_M] & KEY_PRESSED && game_data->moto_load == UINT_MAX) {
+        game_data->renderer_api.InstantiateMesh(game_data->renderer, game_data->moto_mesh);
+    }
+
+    // Removes the instance under the cursor
+    if(input->keyboard[SCANCODE_X] & KEY_DOWN) {
+        Vec3 origin, direction;
+        game_data->renderer_api.ScreenRay(
+            game_data->renderer, input->cursor_x, input->cursor_y, &origin, &direction);
+        RaycastHit hit;
+        if(game_data->renderer_api.Raycast(
+               game_data->renderer, origin, direction, 1000.0f, &hit)) {
+            sLog("Picked primitive %d at %.2f", hit.primitive, hit.distance);
+            game_data->renderer_api.DestroyInstance(game_data->renderer, hit.instance);
+        }
+    }
+
+    // Saves a ray traced shadow mask of the view, to check the shadow map against
+    if(input->keyboard[SCANCODE_T] & KEY_DOWN) {
+        const u32 width = 320;
+        const u32 height = 180;
+        u8 *mask = (u8 *)sMalloc(width * height);
+        const u32 shadowed =
+            game_data->renderer_api.TraceShadowMask(game_data->renderer, width, height, mask);
+        FILE *file;
+        if(fopen_s(&file, "shadow_reference.pgm", "wb") == 0) {
+            fprintf(file, "P5 %u %u 255\n", width, height);
+            fwrite(mask, 1, width * height, file);
+            fclose(file);
+            sLog("Shadow reference saved, %u shadowed pixels", shadowed);
+        }
+        sFree(mask);
+    }
+
+    // Switches between the shadow map and ray query shadows
+    if(input->keyboard[SCANCODE_R] & KEY_DOWN) {
+        game_data->shadow_mode = game_data->shadow_mode == SHADOW_MODE_MAP
+                                     ? SHADOW_MODE_RAY_QUERY
+                                     : SHADOW_MODE_MAP;
+        game_data->renderer_api.SetShadowMode(game_data->renderer, game_data->shadow_mode);
+        sLog("Shadows: %s", game_data->shadow_mode == SHADOW_MODE_MAP ? "map" : "ray query");
+    }
+
+    // Cycles the fog between full, half and quarter resolution
+    if(input->keyboard[SCANCODE_F] & KEY_DOWN) {
+        game_data->fog_resolution = game_data->fog_resolution == FOG_RESOLUTION_QUARTER
+                                        ? FOG_RESOLUTION_FULL
+                                        : game_data->fog_resolution * 2;
+        game_data->renderer_api.SetFogResolution(game_data->renderer, game_data->fog_resolution);
+        sLog("Fog resolution: 1/%u", (u32)game_data->fog_resolution);
+    }
+
+    if(input->keyboard[SCANCODE_G] & KEY_DOWN) {
+        game_data->fog_technique = game_data->fog_technique == FOG_TECHNIQUE_FROXELS
+                                       ? FOG_TECHNIQUE_RAYMARCH
+                                       : FOG_TECHNIQUE_FROXELS;
+        game_data->renderer_api.SetFogTechnique(game_data->renderer, game_data->fog_technique);
+        sLog("Fog: %s", game_data->fog_technique == FOG_TECHNIQUE_FROXELS ? "froxels" : "raymarch");
+    }
+
+    if(input->keyboard[SCANCODE_H] & KEY_DOWN) {
+        game_data->fog_temporal = !game_data->fog_temporal;
+        game_data->renderer_api.SetFogTemporal(game_data->renderer, game_data->fog_temporal);
+        sLog("Fog history: %s", game_data->fog_temporal ? "on" : "off");
+    }
+
+    // Cycles through MSAA 1x, 2x, 4x, 8x and TAA, skipping the sample counts the device lacks
+    if(input->keyboard[SCANCODE_J] & KEY_DOWN) {
+        u64 memory = 0;
+        while(memory == 0) {
+            if(game_data->anti_aliasing == ANTI_ALIASING_TAA) {
+                game_data->anti_aliasing = ANTI_ALIASING_MSAA_1;
+            } else if(game_data->anti_aliasing == ANTI_ALIASING_MSAA_8) {
+                game_data->anti_aliasing = ANTI_ALIASING_TAA;
+            } else {
+                game_data->anti_aliasing = game_data->anti_aliasing * 2;
+            }
+            memory = game_data->renderer_api.GetAntiAliasingMemory(game_data->renderer,
+                                                                   game_data->anti_aliasing);
+        }
+        game_data->renderer_api.SetAntiAliasing(game_data->renderer, game_data->anti_aliasing);
+        if(game_data->anti_aliasing == ANTI_ALIASING_TAA) {
+            sLog("Anti aliasing: TAA, %llu KB of targets", memory / 1024);
+        } else {
+            sLog("Anti aliasing: MSAA %ux, %llu KB of targets",
+                 (u32)game_data->anti_aliasing,
+                 memory / 1024);
+        }
+    }
+
+    if(input->keyboard[SCANCODE_K] & KEY_DOWN) {
+        game_data->depth_prepass = !game_data->depth_prepass;
+        game_data->renderer_api.SetDepthPrepass(game_data->renderer, game_data->depth_prepass);
+        sLog("Depth prepass: %s", game_data->depth_prepass ? "on" : "off");
+    }
+
+    if(input->keyboard[SCANCODE_L] & KEY_DOWN) {
+        const DrawStats stats = game_data->renderer_api.GetDrawStats(game_data->renderer);
+        const char *names[DRAW_PASS_COUNT] = {"Depth prepass", "Color", "Shadows"};
+        for(u32 i = 0; i < DRAW_PASS_COUNT; ++i) {
+            const DrawPassStats *pass = &stats.passes[i];
+            sLog("%s: %u primitives, %u binds, %u pushes, %u draws",
+                 names[i],
+                 pass->primitives,
+                 pass->binds,
+                 pass->pushes,
+                 pass->draws);
+        }
     }
 
     game_data->position = vec3_add(game_data->position, movement);
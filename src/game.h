@@ -13,6 +13,14 @@ typedef struct GameData {
     Vec2f spherical_coordinates;
     Vec3 light_pos;
     f32 cos;
+    ShadowMode shadow_mode;
+    FogResolution fog_resolution;
+    FogTechnique fog_technique;
+    bool fog_temporal;
+    AntiAliasing anti_aliasing;
+    bool depth_prepass;
+    u32 moto_load; // Pending load handle, UINT_MAX once loaded
+    u32 moto_mesh;
     MeshInstance moto;
 } GameData;
 
@@ -20,11 +20,24 @@ DLL_EXPORT PlatformGetInstanceExtensions_t PlatformGetInstanceExtensions;
 typedef void PlatformSetCaptureMouse_t(bool val);
 DLL_EXPORT PlatformSetCaptureMouse_t PlatformSetCaptureMouse;
 
+// Runs the job on a worker thread, or on a thread waiting on jobs. Jobs are started in the order
+// they are pushed.
+typedef void PlatformJob_t(void *data);
+typedef void PlatformPushJob_t(PlatformJob_t *job, void *data);
+DLL_EXPORT PlatformPushJob_t PlatformPushJob;
+// Runs a queued job on the calling thread, or gives up its time slice when the queue is empty.
+// Threads waiting on jobs call it instead of spinning.
+typedef void PlatformRunJob_t();
+DLL_EXPORT PlatformRunJob_t PlatformRunJob;
+
 typedef struct PlatformAPI {
     PlatformReadBinary_t *ReadBinary;
     PlatformCreateVkSurface_t *CreateVkSurface;
     PlatformGetInstanceExtensions_t *GetInstanceExtensions;
     PlatformSetCaptureMouse_t *SetCaptureMouse;
+    PlatformPushJob_t *PushJob;
+    PlatformRunJob_t *RunJob;
+    u32 worker_count; // Threads running the pushed jobs, the main thread isn't one of them
 } PlatformAPI;
 
 #define MOUSE_LEFT 1
@@ -42,13 +55,22 @@ enum ScanCodes {
     SCANCODE_Q = 0x10,
     SCANCODE_W = 0x11,
     SCANCODE_E = 0x12,
+    SCANCODE_R = 0x13,
+    SCANCODE_T = 0x14,
     SCANCODE_O = 0x18,
     SCANCODE_P = 0x19,
     SCANCODE_A = 0x1E,
     SCANCODE_S = 0x1F,
     SCANCODE_D = 0x20,
+    SCANCODE_F = 0x21,
+    SCANCODE_G = 0x22,
+    SCANCODE_H = 0x23,
+    SCANCODE_J = 0x24,
+    SCANCODE_K = 0x25,
+    SCANCODE_L = 0x26,
     SCANCODE_M = 0x27,
     SCANCODE_LSHIFT = 0x2A,
+    SCANCODE_X = 0x2D,
     SCANCODE_SPACE = 0x39
 };
 
@@ -61,6 +83,8 @@ typedef struct GameInput {
     i32 mouse_delta_x;
     i32 mouse_y;
     i32 mouse_delta_y;
+    i32 cursor_x; // Position of the cursor in the window
+    i32 cursor_y;
 } GameInput;
 
 #endif
\ No newline at end of file
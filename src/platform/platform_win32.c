@@ -32,6 +32,21 @@ typedef struct PlatformWindow {
     HINSTANCE hinstance;
 } PlatformWindow;
 
+typedef struct Win32JobEntry {
+    PlatformJob_t *job;
+    void *data;
+} Win32JobEntry;
+
+// Single producer (the main thread), multiple consumers ring buffer
+typedef struct Win32JobQueue {
+    volatile LONG next_write;
+    volatile LONG next_read;
+    HANDLE semaphore;
+    Win32JobEntry entries[256];
+} Win32JobQueue;
+
+global Win32JobQueue job_queue;
+
 void Win32GameLoadFunctions(Module *dll) {
     pfn_GameStart = (GameStart_t *)GetProcAddress(dll->dll, "GameStart");
     pfn_GameLoop = (GameLoop_t *)GetProcAddress(dll->dll, "GameLoop");
@@ -42,18 +57,87 @@ void Win32GameLoadRendererAPI(Renderer *renderer, Module *renderer_module, GameD
     game_data->renderer_api.LoadMesh =
         (LoadMesh_t *)GetProcAddress(renderer_module->dll, "RendererLoadMesh");
     ASSERT(game_data->renderer_api.LoadMesh);
+    game_data->renderer_api.LoadMeshAsync =
+        (LoadMeshAsync_t *)GetProcAddress(renderer_module->dll, "RendererLoadMeshAsync");
+    ASSERT(game_data->renderer_api.LoadMeshAsync);
+    game_data->renderer_api.PollMesh =
+        (PollMesh_t *)GetProcAddress(renderer_module->dll, "RendererPollMesh");
+    ASSERT(game_data->renderer_api.PollMesh);
+    game_data->renderer_api.WaitMesh =
+        (WaitMesh_t *)GetProcAddress(renderer_module->dll, "RendererWaitMesh");
+    ASSERT(game_data->renderer_api.WaitMesh);
     game_data->renderer_api.DestroyMesh =
         (DestroyMesh_t *)GetProcAddress(renderer_module->dll, "RendererDestroyMesh");
     ASSERT(game_data->renderer_api.DestroyMesh);
     game_data->renderer_api.InstantiateMesh =
         (InstantiateMesh_t *)GetProcAddress(renderer_module->dll, "RendererInstantiateMesh");
     ASSERT(game_data->renderer_api.InstantiateMesh);
+    game_data->renderer_api.DestroyInstance =
+        (DestroyInstance_t *)GetProcAddress(renderer_module->dll, "RendererDestroyInstance");
+    ASSERT(game_data->renderer_api.DestroyInstance);
+    game_data->renderer_api.SetInstancePosition = (SetInstancePosition_t *)GetProcAddress(
+        renderer_module->dll, "RendererSetInstancePosition");
+    ASSERT(game_data->renderer_api.SetInstancePosition);
+    game_data->renderer_api.SetInstanceRotation = (SetInstanceRotation_t *)GetProcAddress(
+        renderer_module->dll, "RendererSetInstanceRotation");
+    ASSERT(game_data->renderer_api.SetInstanceRotation);
+    game_data->renderer_api.SetInstanceScale =
+        (SetInstanceScale_t *)GetProcAddress(renderer_module->dll, "RendererSetInstanceScale");
+    ASSERT(game_data->renderer_api.SetInstanceScale);
+    game_data->renderer_api.GetCullStats =
+        (GetCullStats_t *)GetProcAddress(renderer_module->dll, "RendererGetCullStats");
+    ASSERT(game_data->renderer_api.GetCullStats);
+    game_data->renderer_api.GetDrawStats =
+        (GetDrawStats_t *)GetProcAddress(renderer_module->dll, "RendererGetDrawStats");
+    ASSERT(game_data->renderer_api.GetDrawStats);
+    game_data->renderer_api.QueryBox =
+        (QueryBox_t *)GetProcAddress(renderer_module->dll, "RendererQueryBox");
+    ASSERT(game_data->renderer_api.QueryBox);
+    game_data->renderer_api.QuerySphere =
+        (QuerySphere_t *)GetProcAddress(renderer_module->dll, "RendererQuerySphere");
+    ASSERT(game_data->renderer_api.QuerySphere);
+    game_data->renderer_api.QueryRay =
+        (QueryRay_t *)GetProcAddress(renderer_module->dll, "RendererQueryRay");
+    ASSERT(game_data->renderer_api.QueryRay);
+    game_data->renderer_api.QueryView =
+        (QueryView_t *)GetProcAddress(renderer_module->dll, "RendererQueryView");
+    ASSERT(game_data->renderer_api.QueryView);
+    game_data->renderer_api.Raycast =
+        (Raycast_t *)GetProcAddress(renderer_module->dll, "RendererRaycast");
+    ASSERT(game_data->renderer_api.Raycast);
+    game_data->renderer_api.ScreenRay =
+        (ScreenRay_t *)GetProcAddress(renderer_module->dll, "RendererScreenRay");
+    ASSERT(game_data->renderer_api.ScreenRay);
+    game_data->renderer_api.TraceShadowMask =
+        (TraceShadowMask_t *)GetProcAddress(renderer_module->dll, "RendererTraceShadowMask");
+    ASSERT(game_data->renderer_api.TraceShadowMask);
     game_data->renderer_api.SetCamera =
         (SetCamera_t *)GetProcAddress(renderer_module->dll, "RendererSetCamera");
     ASSERT(game_data->renderer_api.SetCamera);
     game_data->renderer_api.SetSunDirection =
         (SetSunDirection_t *)GetProcAddress(renderer_module->dll, "RendererSetSunDirection");
     ASSERT(game_data->renderer_api.SetSunDirection);
+    game_data->renderer_api.SetShadowMode =
+        (SetShadowMode_t *)GetProcAddress(renderer_module->dll, "RendererSetShadowMode");
+    ASSERT(game_data->renderer_api.SetShadowMode);
+    game_data->renderer_api.SetFogResolution =
+        (SetFogResolution_t *)GetProcAddress(renderer_module->dll, "RendererSetFogResolution");
+    ASSERT(game_data->renderer_api.SetFogResolution);
+    game_data->renderer_api.SetFogTechnique =
+        (SetFogTechnique_t *)GetProcAddress(renderer_module->dll, "RendererSetFogTechnique");
+    ASSERT(game_data->renderer_api.SetFogTechnique);
+    game_data->renderer_api.SetFogTemporal =
+        (SetFogTemporal_t *)GetProcAddress(renderer_module->dll, "RendererSetFogTemporal");
+    ASSERT(game_data->renderer_api.SetFogTemporal);
+    game_data->renderer_api.SetAntiAliasing =
+        (SetAntiAliasing_t *)GetProcAddress(renderer_module->dll, "RendererSetAntiAliasing");
+    ASSERT(game_data->renderer_api.SetAntiAliasing);
+    game_data->renderer_api.GetAntiAliasingMemory = (GetAntiAliasingMemory_t *)GetProcAddress(
+        renderer_module->dll, "RendererGetAntiAliasingMemory");
+    ASSERT(game_data->renderer_api.GetAntiAliasingMemory);
+    game_data->renderer_api.SetDepthPrepass =
+        (SetDepthPrepass_t *)GetProcAddress(renderer_module->dll, "RendererSetDepthPrepass");
+    ASSERT(game_data->renderer_api.SetDepthPrepass);
 }
 
 void Win32RendererLoadFunctions(Module *dll) {
@@ -127,6 +211,67 @@ void PlatformReadBinary(const char *path, i64 *file_size, u32 *result) {
     fclose(file);
 }
 
+void PlatformPushJob(PlatformJob_t *job, void *data) {
+    const LONG write = job_queue.next_write;
+    const LONG next_write = (write + 1) % ARRAY_SIZE(job_queue.entries);
+    ASSERT_MSG(next_write != job_queue.next_read, "Job queue is full");
+
+    job_queue.entries[write] = (Win32JobEntry){job, data};
+    // The entry must be visible before the workers see the new index
+    MemoryBarrier();
+    job_queue.next_write = next_write;
+    ReleaseSemaphore(job_queue.semaphore, 1, NULL);
+}
+
+// Returns false when the queue is empty. Losing the entry to another thread still counts as work
+// left, the caller tries again.
+bool Win32TryRunJob() {
+    const LONG read = job_queue.next_read;
+    if(read == job_queue.next_write) {
+        return false;
+    }
+    const Win32JobEntry entry = job_queue.entries[read];
+    const LONG next_read = (read + 1) % ARRAY_SIZE(job_queue.entries);
+    if(InterlockedCompareExchange(&job_queue.next_read, next_read, read) == read) {
+        entry.job(entry.data);
+    }
+    return true;
+}
+
+// The semaphore count isn't taken for the jobs run here, a worker woken for one finds the queue
+// empty and waits again
+void PlatformRunJob() {
+    if(!Win32TryRunJob()) {
+        SwitchToThread();
+    }
+}
+
+DWORD WINAPI Win32WorkerThread(LPVOID param) {
+    while(true) {
+        if(!Win32TryRunJob()) {
+            WaitForSingleObjectEx(job_queue.semaphore, INFINITE, FALSE);
+        }
+    }
+    return 0;
+}
+
+// Returns the number of threads started
+u32 Win32StartWorkerThreads() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    // Keep a core for the main thread
+    const u32 thread_count = info.dwNumberOfProcessors > 1 ? info.dwNumberOfProcessors - 1 : 1;
+
+    job_queue.semaphore = CreateSemaphoreEx(
+        NULL, 0, ARRAY_SIZE(job_queue.entries), NULL, 0, SEMAPHORE_ALL_ACCESS);
+    for(u32 i = 0; i < thread_count; ++i) {
+        HANDLE thread = CreateThread(NULL, 0, Win32WorkerThread, NULL, 0, NULL);
+        CloseHandle(thread);
+    }
+    sLog("%d worker threads started", thread_count);
+    return thread_count;
+}
+
 // TODO : Handle UTF8
 void Win32Log(const char *message, u8 level) {
     unsigned long charsWritten;
@@ -233,6 +378,9 @@ i32 WINAPI WinMain(HINSTANCE instance, HINSTANCE prev_instance, PSTR cmd_line, I
     platform_api.CreateVkSurface = &PlatformCreateVkSurface;
     platform_api.GetInstanceExtensions = &PlatformGetInstanceExtensions;
     platform_api.SetCaptureMouse = &PlatformSetCaptureMouse;
+    platform_api.PushJob = &PlatformPushJob;
+    platform_api.RunJob = &PlatformRunJob;
+    platform_api.worker_count = Win32StartWorkerThreads();
 
     Module renderer_module = {0};
     Win32LoadModule(&renderer_module, "renderer");
@@ -304,6 +452,9 @@ i32 WINAPI WinMain(HINSTANCE instance, HINSTANCE prev_instance, PSTR cmd_line, I
                 input.mouse_x = pos.x;
                 input.mouse_y = pos.y;
             }
+            ScreenToClient(window.hwnd, &pos);
+            input.cursor_x = pos.x;
+            input.cursor_y = pos.y;
         }
 
         MSG msg = {0};
@@ -0,0 +1,424 @@
+#include <sl3dge-utils/sl3dge.h>
+
+// Dynamic bounding volume hierarchy over the instances, kept balanced with rotations as leaves
+// come and go. Leaves store a fattened box so small moves don't touch the tree, a leaf is only
+// reinserted once its object leaves the fat box.
+
+#define BVH_NULL UINT_MAX
+#define BVH_FAT_MARGIN 0.1f // Fraction of the extent added on each side of a leaf box
+#define BVH_STACK_SIZE 128
+
+typedef struct Aabb {
+    Vec3 min;
+    Vec3 max;
+} Aabb;
+
+typedef struct BvhNode {
+    Aabb box;
+    u32 parent; // Next free node when unused
+    u32 children[2];
+    i32 height; // 0 for leaves, -1 for free nodes
+    u64 user;
+} BvhNode;
+
+typedef struct Bvh {
+    u32 root;
+    u32 node_capacity;
+    u32 node_count;
+    BvhNode *nodes;
+    u32 free_node;
+    u32 leaf_count;
+} Bvh;
+
+// Returns false to stop the query
+typedef bool BvhQuery_t(void *data, const u64 user);
+// t is where the ray enters the box of the leaf
+typedef bool BvhRayQuery_t(void *data, const u64 user, const f32 t);
+
+internal Aabb AabbUnion(const Aabb *a, const Aabb *b) {
+    Aabb result;
+    result.min.x = fminf(a->min.x, b->min.x);
+    result.min.y = fminf(a->min.y, b->min.y);
+    result.min.z = fminf(a->min.z, b->min.z);
+    result.max.x = fmaxf(a->max.x, b->max.x);
+    result.max.y = fmaxf(a->max.y, b->max.y);
+    result.max.z = fmaxf(a->max.z, b->max.z);
+    return result;
+}
+
+internal f32 AabbArea(const Aabb *a) {
+    const Vec3 d = vec3_sub(a->max, a->min);
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+internal bool AabbContains(const Aabb *outer, const Aabb *inner) {
+    return outer->min.x <= inner->min.x && outer->min.y <= inner->min.y &&
+           outer->min.z <= inner->min.z && inner->max.x <= outer->max.x &&
+           inner->max.y <= outer->max.y && inner->max.z <= outer->max.z;
+}
+
+internal bool AabbOverlaps(const Aabb *a, const Aabb *b) {
+    return a->min.x <= b->max.x && b->min.x <= a->max.x && a->min.y <= b->max.y &&
+           b->min.y <= a->max.y && a->min.z <= b->max.z && b->min.z <= a->max.z;
+}
+
+internal bool AabbOverlapsSphere(const Aabb *a, const Vec3 center, const f32 radius) {
+    const f32 dx = fmaxf(fmaxf(a->min.x - center.x, 0.0f), center.x - a->max.x);
+    const f32 dy = fmaxf(fmaxf(a->min.y - center.y, 0.0f), center.y - a->max.y);
+    const f32 dz = fmaxf(fmaxf(a->min.z - center.z, 0.0f), center.z - a->max.z);
+    return dx * dx + dy * dy + dz * dz <= radius * radius;
+}
+
+// False if the box is fully behind one of the planes
+internal bool AabbInsidePlanes(const Aabb *a, const Vec4 *planes, const u32 plane_count) {
+    for(u32 p = 0; p < plane_count; ++p) {
+        // Corner furthest along the plane normal
+        const f32 x = planes[p].x >= 0.0f ? a->max.x : a->min.x;
+        const f32 y = planes[p].y >= 0.0f ? a->max.y : a->min.y;
+        const f32 z = planes[p].z >= 0.0f ? a->max.z : a->min.z;
+        if(planes[p].x * x + planes[p].y * y + planes[p].z * z + planes[p].w < 0.0f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Slab test, returns where the ray enters the box or a negative value if it misses it
+internal f32
+AabbRayEnter(const Aabb *a, const Vec3 origin, const Vec3 inv_direction, const f32 max_t) {
+    f32 t0 = (a->min.x - origin.x) * inv_direction.x;
+    f32 t1 = (a->max.x - origin.x) * inv_direction.x;
+    f32 enter = fminf(t0, t1);
+    f32 exit = fmaxf(t0, t1);
+    t0 = (a->min.y - origin.y) * inv_direction.y;
+    t1 = (a->max.y - origin.y) * inv_direction.y;
+    enter = fmaxf(enter, fminf(t0, t1));
+    exit = fminf(exit, fmaxf(t0, t1));
+    t0 = (a->min.z - origin.z) * inv_direction.z;
+    t1 = (a->max.z - origin.z) * inv_direction.z;
+    enter = fmaxf(enter, fminf(t0, t1));
+    exit = fminf(exit, fmaxf(t0, t1));
+
+    enter = fmaxf(enter, 0.0f);
+    if(enter > exit || enter > max_t) {
+        return -1.0f;
+    }
+    return enter;
+}
+
+internal void BvhInit(Bvh *tree, const u32 capacity) {
+    *tree = (Bvh){0};
+    tree->root = BVH_NULL;
+    tree->free_node = BVH_NULL;
+    tree->node_capacity = capacity;
+    tree->nodes = (BvhNode *)sCalloc(capacity, sizeof(BvhNode));
+}
+
+internal void BvhFree(Bvh *tree) {
+    sFree(tree->nodes);
+    *tree = (Bvh){0};
+}
+
+internal u32 BvhAllocateNode(Bvh *tree) {
+    u32 node = tree->free_node;
+    if(node != BVH_NULL) {
+        tree->free_node = tree->nodes[node].parent;
+    } else {
+        if(tree->node_count == tree->node_capacity) {
+            const u32 new_capacity = tree->node_capacity * 2;
+            BvhNode *new_nodes = (BvhNode *)sRealloc(tree->nodes, new_capacity * sizeof(BvhNode));
+            ASSERT(new_nodes);
+            tree->nodes = new_nodes;
+            tree->node_capacity = new_capacity;
+        }
+        node = tree->node_count++;
+    }
+    tree->nodes[node] = (BvhNode){0};
+    tree->nodes[node].parent = BVH_NULL;
+    tree->nodes[node].children[0] = BVH_NULL;
+    tree->nodes[node].children[1] = BVH_NULL;
+    return node;
+}
+
+internal void BvhFreeNode(Bvh *tree, const u32 node) {
+    tree->nodes[node].parent = tree->free_node;
+    tree->nodes[node].height = -1;
+    tree->free_node = node;
+}
+
+internal void BvhRefit(Bvh *tree, const u32 index) {
+    BvhNode *node = &tree->nodes[index];
+    const BvhNode *a = &tree->nodes[node->children[0]];
+    const BvhNode *b = &tree->nodes[node->children[1]];
+    node->box = AabbUnion(&a->box, &b->box);
+    node->height = 1 + (a->height > b->height ? a->height : b->height);
+}
+
+// Promotes the taller grandchild when the children heights differ by more than one, returns the
+// node now at the place of a
+internal u32 BvhBalance(Bvh *tree, const u32 a) {
+    BvhNode *node_a = &tree->nodes[a];
+    if(node_a->height < 2) {
+        return a;
+    }
+
+    const u32 b = node_a->children[0];
+    const u32 c = node_a->children[1];
+    const i32 balance = tree->nodes[c].height - tree->nodes[b].height;
+    if(balance >= -1 && balance <= 1) {
+        return a;
+    }
+
+    // The tall child moves up in place of a, a takes its shorter grandchild's place
+    const u32 tall = balance > 1 ? c : b;
+    const u32 short_child = balance > 1 ? b : c;
+    BvhNode *node_tall = &tree->nodes[tall];
+    const u32 f = node_tall->children[0];
+    const u32 g = node_tall->children[1];
+
+    node_tall->children[0] = a;
+    node_tall->parent = node_a->parent;
+    node_a->parent = tall;
+    if(node_tall->parent != BVH_NULL) {
+        BvhNode *parent = &tree->nodes[node_tall->parent];
+        parent->children[parent->children[0] == a ? 0 : 1] = tall;
+    } else {
+        tree->root = tall;
+    }
+
+    const bool f_taller = tree->nodes[f].height > tree->nodes[g].height;
+    const u32 keep = f_taller ? f : g;
+    const u32 give = f_taller ? g : f;
+    node_tall->children[1] = keep;
+    node_a->children[0] = short_child;
+    node_a->children[1] = give;
+    tree->nodes[give].parent = a;
+
+    BvhRefit(tree, a);
+    BvhRefit(tree, tall);
+    return tall;
+}
+
+internal void BvhInsertLeaf(Bvh *tree, const u32 leaf) {
+    if(tree->root == BVH_NULL) {
+        tree->root = leaf;
+        tree->nodes[leaf].parent = BVH_NULL;
+        return;
+    }
+
+    // Walk down to the sibling that grows the total area the least
+    const Aabb box = tree->nodes[leaf].box;
+    u32 index = tree->root;
+    while(tree->nodes[index].height > 0) {
+        const BvhNode *node = &tree->nodes[index];
+        const Aabb combined = AabbUnion(&node->box, &box);
+        const f32 area = AabbArea(&node->box);
+        const f32 combined_area = AabbArea(&combined);
+
+        // Cost of pairing with this node, and the growth pushed onto the ancestors otherwise
+        const f32 cost = 2.0f * combined_area;
+        const f32 inheritance_cost = 2.0f * (combined_area - area);
+
+        f32 child_costs[2];
+        for(u32 i = 0; i < 2; ++i) {
+            const BvhNode *child = &tree->nodes[node->children[i]];
+            const Aabb child_combined = AabbUnion(&child->box, &box);
+            child_costs[i] = AabbArea(&child_combined) + inheritance_cost;
+            if(child->height > 0) {
+                child_costs[i] -= AabbArea(&child->box);
+            }
+        }
+
+        if(cost < child_costs[0] && cost < child_costs[1]) {
+            break;
+        }
+        index = node->children[child_costs[0] < child_costs[1] ? 0 : 1];
+    }
+
+    const u32 sibling = index;
+    const u32 old_parent = tree->nodes[sibling].parent;
+    const u32 new_parent = BvhAllocateNode(tree);
+    tree->nodes[new_parent].parent = old_parent;
+    tree->nodes[new_parent].children[0] = sibling;
+    tree->nodes[new_parent].children[1] = leaf;
+    tree->nodes[sibling].parent = new_parent;
+    tree->nodes[leaf].parent = new_parent;
+    if(old_parent != BVH_NULL) {
+        BvhNode *parent = &tree->nodes[old_parent];
+        parent->children[parent->children[0] == sibling ? 0 : 1] = new_parent;
+    } else {
+        tree->root = new_parent;
+    }
+
+    for(index = new_parent; index != BVH_NULL; index = tree->nodes[index].parent) {
+        index = BvhBalance(tree, index);
+        BvhRefit(tree, index);
+    }
+}
+
+internal void BvhRemoveLeaf(Bvh *tree, const u32 leaf) {
+    if(leaf == tree->root) {
+        tree->root = BVH_NULL;
+        return;
+    }
+
+    const u32 parent = tree->nodes[leaf].parent;
+    const u32 grand_parent = tree->nodes[parent].parent;
+    const BvhNode *parent_node = &tree->nodes[parent];
+    const u32 sibling = parent_node->children[parent_node->children[0] == leaf ? 1 : 0];
+
+    tree->nodes[sibling].parent = grand_parent;
+    BvhFreeNode(tree, parent);
+    if(grand_parent == BVH_NULL) {
+        tree->root = sibling;
+        return;
+    }
+
+    BvhNode *grand_parent_node = &tree->nodes[grand_parent];
+    grand_parent_node->children[grand_parent_node->children[0] == parent ? 0 : 1] = sibling;
+    for(u32 index = grand_parent; index != BVH_NULL; index = tree->nodes[index].parent) {
+        index = BvhBalance(tree, index);
+        BvhRefit(tree, index);
+    }
+}
+
+internal Aabb BvhFatten(const Aabb *box) {
+    const Vec3 margin = vec3_fmul(vec3_sub(box->max, box->min), BVH_FAT_MARGIN);
+    return (Aabb){vec3_sub(box->min, margin), vec3_add(box->max, margin)};
+}
+
+// Returns the leaf holding the object
+internal u32 BvhInsert(Bvh *tree, const Aabb *box, const u64 user) {
+    const u32 leaf = BvhAllocateNode(tree);
+    tree->nodes[leaf].box = BvhFatten(box);
+    tree->nodes[leaf].user = user;
+    tree->nodes[leaf].height = 0;
+    BvhInsertLeaf(tree, leaf);
+    tree->leaf_count++;
+    return leaf;
+}
+
+internal void BvhRemove(Bvh *tree, const u32 leaf) {
+    BvhRemoveLeaf(tree, leaf);
+    BvhFreeNode(tree, leaf);
+    tree->leaf_count--;
+}
+
+// Reinserts the leaf if the object left its fat box, returns true if the tree changed
+internal bool BvhMove(Bvh *tree, const u32 leaf, const Aabb *box) {
+    if(AabbContains(&tree->nodes[leaf].box, box)) {
+        return false;
+    }
+    BvhRemoveLeaf(tree, leaf);
+    tree->nodes[leaf].box = BvhFatten(box);
+    BvhInsertLeaf(tree, leaf);
+    return true;
+}
+
+// The queries test the fat boxes, callers wanting exact results test the objects themselves
+
+internal void BvhQueryBox(const Bvh *tree, const Aabb *box, BvhQuery_t *callback, void *data) {
+    u32 stack[BVH_STACK_SIZE];
+    u32 top = 0;
+    if(tree->root != BVH_NULL) {
+        stack[top++] = tree->root;
+    }
+    while(top > 0) {
+        const BvhNode *node = &tree->nodes[stack[--top]];
+        if(!AabbOverlaps(&node->box, box)) {
+            continue;
+        }
+        if(node->height == 0) {
+            if(!callback(data, node->user)) {
+                return;
+            }
+        } else {
+            ASSERT(top + 2 <= BVH_STACK_SIZE);
+            stack[top++] = node->children[0];
+            stack[top++] = node->children[1];
+        }
+    }
+}
+
+internal void BvhQuerySphere(
+    const Bvh *tree, const Vec3 center, const f32 radius, BvhQuery_t *callback, void *data) {
+    u32 stack[BVH_STACK_SIZE];
+    u32 top = 0;
+    if(tree->root != BVH_NULL) {
+        stack[top++] = tree->root;
+    }
+    while(top > 0) {
+        const BvhNode *node = &tree->nodes[stack[--top]];
+        if(!AabbOverlapsSphere(&node->box, center, radius)) {
+            continue;
+        }
+        if(node->height == 0) {
+            if(!callback(data, node->user)) {
+                return;
+            }
+        } else {
+            ASSERT(top + 2 <= BVH_STACK_SIZE);
+            stack[top++] = node->children[0];
+            stack[top++] = node->children[1];
+        }
+    }
+}
+
+// Planes point inwards, like the ones from CullExtractPlanes
+internal void BvhQueryPlanes(const Bvh *tree,
+                             const Vec4 *planes,
+                             const u32 plane_count,
+                             BvhQuery_t *callback,
+                             void *data) {
+    u32 stack[BVH_STACK_SIZE];
+    u32 top = 0;
+    if(tree->root != BVH_NULL) {
+        stack[top++] = tree->root;
+    }
+    while(top > 0) {
+        const BvhNode *node = &tree->nodes[stack[--top]];
+        if(!AabbInsidePlanes(&node->box, planes, plane_count)) {
+            continue;
+        }
+        if(node->height == 0) {
+            if(!callback(data, node->user)) {
+                return;
+            }
+        } else {
+            ASSERT(top + 2 <= BVH_STACK_SIZE);
+            stack[top++] = node->children[0];
+            stack[top++] = node->children[1];
+        }
+    }
+}
+
+// direction doesn't need to be normalized, t is expressed in multiples of it
+internal void BvhQueryRay(const Bvh *tree,
+                          const Vec3 origin,
+                          const Vec3 direction,
+                          const f32 max_t,
+                          BvhRayQuery_t *callback,
+                          void *data) {
+    const Vec3 inv_direction = {1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z};
+    u32 stack[BVH_STACK_SIZE];
+    u32 top = 0;
+    if(tree->root != BVH_NULL) {
+        stack[top++] = tree->root;
+    }
+    while(top > 0) {
+        const BvhNode *node = &tree->nodes[stack[--top]];
+        const f32 t = AabbRayEnter(&node->box, origin, inv_direction, max_t);
+        if(t < 0.0f) {
+            continue;
+        }
+        if(node->height == 0) {
+            if(!callback(data, node->user, t)) {
+                return;
+            }
+        } else {
+            ASSERT(top + 2 <= BVH_STACK_SIZE);
+            stack[top++] = node->children[0];
+            stack[top++] = node->children[1];
+        }
+    }
+}
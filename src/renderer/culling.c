@@ -0,0 +1,227 @@
+#include <sl3dge-utils/sl3dge.h>
+
+#include "renderer/simd.h"
+
+// Bounding sphere tests against the view and shadow volumes. The spheres are packed in separate
+// x, y, z and radius arrays so the SIMD kernels test 4 or 8 of them per iteration. Each sphere
+// gets a byte holding a bit per volume it touches.
+
+#define CULL_PLANE_COUNT 6
+#define CULL_MAX_VOLUMES 5 // The view volume then one per shadow cascade
+#define CULL_VISIBLE_COLOR 1
+#define CULL_VISIBLE_SHADOW(cascade) (2 << (cascade))
+
+// Planes of the clip volume of a view projection matrix, pointing inwards and normalized. The
+// near plane uses -w <= z which is conservative for both the [0, 1] and [-1, 1] depth ranges.
+void CullExtractPlanes(const Mat4 *vp, Vec4 planes[CULL_PLANE_COUNT]) {
+    Vec4 rows[4];
+    for(u32 r = 0; r < 4; ++r) {
+        rows[r] = (Vec4){vp->m[0][r], vp->m[1][r], vp->m[2][r], vp->m[3][r]};
+    }
+    const Vec4 w = rows[3];
+    for(u32 i = 0; i < 3; ++i) {
+        const Vec4 a = rows[i];
+        planes[i * 2 + 0] = (Vec4){w.x + a.x, w.y + a.y, w.z + a.z, w.w + a.w};
+        planes[i * 2 + 1] = (Vec4){w.x - a.x, w.y - a.y, w.z - a.z, w.w - a.w};
+    }
+    for(u32 i = 0; i < CULL_PLANE_COUNT; ++i) {
+        Vec4 *p = &planes[i];
+        const f32 length = sqrtf(p->x * p->x + p->y * p->y + p->z * p->z);
+        const f32 inv_length = length > 0.0f ? 1.0f / length : 0.0f;
+        *p = (Vec4){p->x * inv_length, p->y * inv_length, p->z * inv_length, p->w * inv_length};
+    }
+}
+
+// planes holds CULL_PLANE_COUNT planes for each volume, bit v of the visibility is set when the
+// sphere touches volume v
+typedef void CullSpheres_t(const u32 count,
+                           const f32 *x,
+                           const f32 *y,
+                           const f32 *z,
+                           const f32 *radius,
+                           const Vec4 *planes,
+                           const u32 volume_count,
+                           u8 *visibility);
+
+internal bool
+CullSphereInside(const Vec4 *planes, const f32 x, const f32 y, const f32 z, const f32 radius) {
+    for(u32 p = 0; p < CULL_PLANE_COUNT; ++p) {
+        if(planes[p].x * x + planes[p].y * y + planes[p].z * z + planes[p].w <= -radius) {
+            return false;
+        }
+    }
+    return true;
+}
+
+internal void CullSpheresScalar(const u32 count,
+                                const f32 *x,
+                                const f32 *y,
+                                const f32 *z,
+                                const f32 *radius,
+                                const Vec4 *planes,
+                                const u32 volume_count,
+                                u8 *visibility) {
+    for(u32 i = 0; i < count; ++i) {
+        u8 result = 0;
+        for(u32 v = 0; v < volume_count; ++v) {
+            if(CullSphereInside(planes + v * CULL_PLANE_COUNT, x[i], y[i], z[i], radius[i])) {
+                result |= 1 << v;
+            }
+        }
+        visibility[i] = result;
+    }
+}
+
+#if SIMD_SSE
+internal __m128 CullInsideSSE(
+    const Vec4 *planes, const __m128 x, const __m128 y, const __m128 z, const __m128 neg_radius) {
+    __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    for(u32 p = 0; p < CULL_PLANE_COUNT; ++p) {
+        __m128 d = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes[p].x), x), _mm_set1_ps(planes[p].w));
+        d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(planes[p].y), y));
+        d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(planes[p].z), z));
+        inside = _mm_and_ps(inside, _mm_cmpgt_ps(d, neg_radius));
+    }
+    return inside;
+}
+
+internal void CullSpheresSSE(const u32 count,
+                             const f32 *x,
+                             const f32 *y,
+                             const f32 *z,
+                             const f32 *radius,
+                             const Vec4 *planes,
+                             const u32 volume_count,
+                             u8 *visibility) {
+    u32 i = 0;
+    for(; i + 4 <= count; i += 4) {
+        const __m128 vx = _mm_loadu_ps(&x[i]);
+        const __m128 vy = _mm_loadu_ps(&y[i]);
+        const __m128 vz = _mm_loadu_ps(&z[i]);
+        const __m128 neg_radius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&radius[i]));
+        u8 result[4] = {0};
+        for(u32 v = 0; v < volume_count; ++v) {
+            const u32 inside = _mm_movemask_ps(
+                CullInsideSSE(planes + v * CULL_PLANE_COUNT, vx, vy, vz, neg_radius));
+            for(u32 k = 0; k < 4; ++k) {
+                result[k] |= ((inside >> k) & 1) << v;
+            }
+        }
+        for(u32 k = 0; k < 4; ++k) {
+            visibility[i + k] = result[k];
+        }
+    }
+    CullSpheresScalar(
+        count - i, &x[i], &y[i], &z[i], &radius[i], planes, volume_count, &visibility[i]);
+}
+#endif
+
+#if SIMD_AVX2
+SIMD_TARGET_AVX2 internal __m256 CullInsideAVX2(
+    const Vec4 *planes, const __m256 x, const __m256 y, const __m256 z, const __m256 neg_radius) {
+    __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    for(u32 p = 0; p < CULL_PLANE_COUNT; ++p) {
+        __m256 d = _mm256_fmadd_ps(_mm256_set1_ps(planes[p].x), x, _mm256_set1_ps(planes[p].w));
+        d = _mm256_fmadd_ps(_mm256_set1_ps(planes[p].y), y, d);
+        d = _mm256_fmadd_ps(_mm256_set1_ps(planes[p].z), z, d);
+        inside = _mm256_and_ps(inside, _mm256_cmp_ps(d, neg_radius, _CMP_GT_OQ));
+    }
+    return inside;
+}
+
+SIMD_TARGET_AVX2 internal void CullSpheresAVX2(const u32 count,
+                                               const f32 *x,
+                                               const f32 *y,
+                                               const f32 *z,
+                                               const f32 *radius,
+                                               const Vec4 *planes,
+                                               const u32 volume_count,
+                                               u8 *visibility) {
+    u32 i = 0;
+    for(; i + 8 <= count; i += 8) {
+        const __m256 vx = _mm256_loadu_ps(&x[i]);
+        const __m256 vy = _mm256_loadu_ps(&y[i]);
+        const __m256 vz = _mm256_loadu_ps(&z[i]);
+        const __m256 neg_radius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(&radius[i]));
+        u8 result[8] = {0};
+        for(u32 v = 0; v < volume_count; ++v) {
+            const u32 inside = _mm256_movemask_ps(
+                CullInsideAVX2(planes + v * CULL_PLANE_COUNT, vx, vy, vz, neg_radius));
+            for(u32 k = 0; k < 8; ++k) {
+                result[k] |= ((inside >> k) & 1) << v;
+            }
+        }
+        for(u32 k = 0; k < 8; ++k) {
+            visibility[i + k] = result[k];
+        }
+    }
+    CullSpheresScalar(
+        count - i, &x[i], &y[i], &z[i], &radius[i], planes, volume_count, &visibility[i]);
+}
+#endif
+
+#if SIMD_NEON
+internal uint32x4_t CullInsideNEON(const Vec4 *planes,
+                                   const float32x4_t x,
+                                   const float32x4_t y,
+                                   const float32x4_t z,
+                                   const float32x4_t neg_radius) {
+    uint32x4_t inside = vdupq_n_u32(~0u);
+    for(u32 p = 0; p < CULL_PLANE_COUNT; ++p) {
+        float32x4_t d = vfmaq_n_f32(vdupq_n_f32(planes[p].w), x, planes[p].x);
+        d = vfmaq_n_f32(d, y, planes[p].y);
+        d = vfmaq_n_f32(d, z, planes[p].z);
+        inside = vandq_u32(inside, vcgtq_f32(d, neg_radius));
+    }
+    return inside;
+}
+
+internal void CullSpheresNEON(const u32 count,
+                              const f32 *x,
+                              const f32 *y,
+                              const f32 *z,
+                              const f32 *radius,
+                              const Vec4 *planes,
+                              const u32 volume_count,
+                              u8 *visibility) {
+    u32 i = 0;
+    for(; i + 4 <= count; i += 4) {
+        const float32x4_t vx = vld1q_f32(&x[i]);
+        const float32x4_t vy = vld1q_f32(&y[i]);
+        const float32x4_t vz = vld1q_f32(&z[i]);
+        const float32x4_t neg_radius = vnegq_f32(vld1q_f32(&radius[i]));
+        // Each lane gathers the bit of every volume it is inside
+        uint32x4_t result = vdupq_n_u32(0);
+        for(u32 v = 0; v < volume_count; ++v) {
+            const uint32x4_t inside =
+                CullInsideNEON(planes + v * CULL_PLANE_COUNT, vx, vy, vz, neg_radius);
+            result = vorrq_u32(result, vandq_u32(inside, vdupq_n_u32(1u << v)));
+        }
+        const uint16x4_t bits = vmovn_u32(result);
+        visibility[i + 0] = (u8)vget_lane_u16(bits, 0);
+        visibility[i + 1] = (u8)vget_lane_u16(bits, 1);
+        visibility[i + 2] = (u8)vget_lane_u16(bits, 2);
+        visibility[i + 3] = (u8)vget_lane_u16(bits, 3);
+    }
+    CullSpheresScalar(
+        count - i, &x[i], &y[i], &z[i], &radius[i], planes, volume_count, &visibility[i]);
+}
+#endif
+
+global CullSpheres_t *cull_spheres = CullSpheresScalar;
+
+// Picks the widest kernel available
+void CullInit() {
+    cull_spheres = CullSpheresScalar;
+#if SIMD_SSE
+    cull_spheres = CullSpheresSSE;
+#endif
+#if SIMD_AVX2
+    if(SimdHasAVX2()) {
+        cull_spheres = CullSpheresAVX2;
+    }
+#endif
+#if SIMD_NEON
+    cull_spheres = CullSpheresNEON;
+#endif
+}
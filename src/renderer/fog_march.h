@@ -0,0 +1,24 @@
+#ifndef FOG_MARCH_H
+#define FOG_MARCH_H
+
+#include <sl3dge-utils/sl3dge.h>
+
+// Raymarch of the volumetric fog, given to volumetric.frag as specialization constants in the
+// order of the fields. Steps start at min_step, or longer when the ray wouldn't fit in max_steps,
+// and grow with the distance marched. The march ends at the first surface, at max_distance or
+// once less than min_transmittance of the light gets through.
+typedef struct FogMarch {
+    u32 max_steps;
+    f32 min_step;
+    f32 step_growth; // Step length per unit of distance marched
+    f32 min_transmittance;
+    f32 max_distance;
+} FogMarch;
+
+#define FOG_MARCH_DEFAULT ((FogMarch){128, 0.5f, 0.03f, 0.01f, 500.0f})
+// With the fog history, the jitter changes every frame and the history averages the samples
+#define FOG_MARCH_TEMPORAL ((FogMarch){24, 0.5f, 0.03f, 0.01f, 500.0f})
+// The fixed 0.5 unit steps the fog used to take, to compare against
+#define FOG_MARCH_REFERENCE ((FogMarch){1000, 0.5f, 0.0f, 0.0f, 500.0f})
+
+#endif
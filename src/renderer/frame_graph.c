@@ -0,0 +1,313 @@
+#include <sl3dge-utils/sl3dge.h>
+
+// A frame as passes declaring the resources they read and write, in the order they are recorded.
+// Compiled, the graph drops the passes whose writes nothing reads, and gives each kept pass the
+// barriers its resources need before it, from the way the last pass left them. Transient resources
+// don't keep their contents across frames, FrameGraphAlias places the ones that are never in use
+// at the same time over each other in a single block of memory.
+// The uses are abstract, the renderer maps them to its layouts, stages and accesses.
+
+#define GRAPH_MAX_PASSES 16
+#define GRAPH_MAX_RESOURCES 16
+#define GRAPH_MAX_ACCESSES 64
+#define GRAPH_MAX_BARRIERS 64
+#define GRAPH_NO_PASS UINT_MAX
+
+typedef enum GraphUse {
+    GRAPH_USE_NONE,          // Contents undefined, before the first use of a transient resource
+    GRAPH_USE_COLOR_WRITE,   // Color attachment cleared or written whole
+    GRAPH_USE_COLOR_BLEND,   // Color attachment loaded and drawn over
+    GRAPH_USE_DEPTH_WRITE,   // Depth attachment cleared, tested and written
+    GRAPH_USE_DEPTH_TEST,    // Depth attachment loaded, tested and stored
+    GRAPH_USE_DEPTH_RESOLVE, // Written whole by the resolve of a multisampled depth
+    GRAPH_USE_SAMPLED,       // Read by fragment shaders
+    GRAPH_USE_STORAGE_WRITE, // Storage image written whole by compute shaders
+    GRAPH_USE_STORAGE_READ,  // Storage image read by compute or fragment shaders
+    GRAPH_USE_PRESENT,
+    GRAPH_USE_COUNT
+} GraphUse;
+
+#define GRAPH_RESOURCE_DECLARED 1
+#define GRAPH_RESOURCE_TRANSIENT 2 // Contents don't outlive the frame, the memory can be shared
+#define GRAPH_RESOURCE_OUTPUT 4    // Read after the frame, the passes writing it are kept
+
+typedef struct GraphResource {
+    u32 flags;
+    GraphUse initial_use; // Imported resources are left by the last frame as the next one expects
+    GraphUse final_use;
+    u64 size; // Transient resources, in the block of memory placed by FrameGraphAlias
+    u64 alignment;
+    u64 offset;
+    u32 first_pass; // Kept passes using it, GRAPH_NO_PASS if none does
+    u32 last_pass;
+} GraphResource;
+
+typedef struct GraphAccess {
+    u32 resource;
+    GraphUse use;
+} GraphAccess;
+
+typedef struct GraphPass {
+    u32 id; // Of the renderer, to record it
+    const char *name;
+    u32 access_first;
+    u32 access_count;
+    bool culled;
+    u32 barrier_first; // Recorded before the pass
+    u32 barrier_count;
+} GraphPass;
+
+typedef struct GraphBarrier {
+    u32 resource;
+    u32 src_uses;     // The uses to wait for, one bit per GraphUse
+    GraphUse old_use; // GRAPH_USE_NONE when the contents are discarded
+    GraphUse new_use;
+} GraphBarrier;
+
+typedef struct FrameGraph {
+    GraphResource resources[GRAPH_MAX_RESOURCES];
+    u32 pass_count;
+    GraphPass passes[GRAPH_MAX_PASSES];
+    u32 access_count;
+    GraphAccess accesses[GRAPH_MAX_ACCESSES];
+    u32 barrier_count;
+    GraphBarrier barriers[GRAPH_MAX_BARRIERS];
+    u32 final_barrier_first; // Give the imported resources back as the next frame expects them
+    u32 final_barrier_count;
+} FrameGraph;
+
+internal bool GraphUseReads(const GraphUse use) {
+    return use == GRAPH_USE_COLOR_BLEND || use == GRAPH_USE_DEPTH_TEST ||
+           use == GRAPH_USE_SAMPLED || use == GRAPH_USE_STORAGE_READ || use == GRAPH_USE_PRESENT;
+}
+
+internal bool GraphUseWrites(const GraphUse use) {
+    return use == GRAPH_USE_COLOR_WRITE || use == GRAPH_USE_COLOR_BLEND ||
+           use == GRAPH_USE_DEPTH_WRITE || use == GRAPH_USE_DEPTH_TEST ||
+           use == GRAPH_USE_DEPTH_RESOLVE || use == GRAPH_USE_STORAGE_WRITE;
+}
+
+// The previous contents are never read
+internal bool GraphUseDiscards(const GraphUse use) {
+    return GraphUseWrites(use) && !GraphUseReads(use);
+}
+
+internal void FrameGraphClear(FrameGraph *graph) {
+    for(u32 i = 0; i < GRAPH_MAX_RESOURCES; ++i) {
+        graph->resources[i] = (GraphResource){0};
+    }
+    graph->pass_count = 0;
+    graph->access_count = 0;
+    graph->barrier_count = 0;
+    graph->final_barrier_first = 0;
+    graph->final_barrier_count = 0;
+}
+
+// A resource living across frames, flags can add GRAPH_RESOURCE_OUTPUT
+internal void FrameGraphImport(FrameGraph *graph,
+                               const u32 resource,
+                               const GraphUse initial_use,
+                               const GraphUse final_use,
+                               const u32 flags) {
+    ASSERT(resource < GRAPH_MAX_RESOURCES);
+    GraphResource *r = &graph->resources[resource];
+    *r = (GraphResource){0};
+    r->flags = GRAPH_RESOURCE_DECLARED | flags;
+    r->initial_use = initial_use;
+    r->final_use = final_use;
+}
+
+// Offset is where FrameGraphAlias placed it, 0 before
+internal void FrameGraphTransient(FrameGraph *graph,
+                                  const u32 resource,
+                                  const u64 size,
+                                  const u64 alignment,
+                                  const u64 offset) {
+    ASSERT(resource < GRAPH_MAX_RESOURCES && alignment > 0);
+    GraphResource *r = &graph->resources[resource];
+    *r = (GraphResource){0};
+    r->flags = GRAPH_RESOURCE_DECLARED | GRAPH_RESOURCE_TRANSIENT;
+    r->size = size;
+    r->alignment = alignment;
+    r->offset = offset;
+}
+
+// The next FrameGraphUse calls are the accesses of this pass
+internal void FrameGraphAddPass(FrameGraph *graph, const u32 id, const char *name) {
+    ASSERT(graph->pass_count < GRAPH_MAX_PASSES);
+    GraphPass *pass = &graph->passes[graph->pass_count++];
+    *pass = (GraphPass){0};
+    pass->id = id;
+    pass->name = name;
+    pass->access_first = graph->access_count;
+}
+
+// Once per resource and pass
+internal void FrameGraphUse(FrameGraph *graph, const u32 resource, const GraphUse use) {
+    ASSERT(graph->pass_count > 0 && graph->access_count < GRAPH_MAX_ACCESSES);
+    ASSERT(graph->resources[resource].flags & GRAPH_RESOURCE_DECLARED);
+    GraphPass *pass = &graph->passes[graph->pass_count - 1];
+    for(u32 a = pass->access_first; a < graph->access_count; ++a) {
+        ASSERT(graph->accesses[a].resource != resource);
+    }
+    graph->accesses[graph->access_count++] = (GraphAccess){resource, use};
+    ++pass->access_count;
+}
+
+internal void FrameGraphPushBarrier(FrameGraph *graph,
+                                    const u32 resource,
+                                    const u32 src_uses,
+                                    const GraphUse old_use,
+                                    const GraphUse new_use) {
+    ASSERT(graph->barrier_count < GRAPH_MAX_BARRIERS);
+    graph->barriers[graph->barrier_count++] = (GraphBarrier){resource, src_uses, old_use, new_use};
+}
+
+internal bool FrameGraphOverlap(const GraphResource *a, const GraphResource *b) {
+    return a->offset < b->offset + b->size && b->offset < a->offset + a->size;
+}
+
+internal void FrameGraphCompile(FrameGraph *graph) {
+    // From the last pass back, a pass is kept if a resource it writes is read after it. A write
+    // that discards the contents ends the search for the passes writing them before.
+    bool needed[GRAPH_MAX_RESOURCES];
+    for(u32 r = 0; r < GRAPH_MAX_RESOURCES; ++r) {
+        needed[r] = graph->resources[r].flags & GRAPH_RESOURCE_OUTPUT;
+    }
+    for(u32 p = graph->pass_count; p-- > 0;) {
+        GraphPass *pass = &graph->passes[p];
+        const GraphAccess *accesses = &graph->accesses[pass->access_first];
+        pass->culled = true;
+        for(u32 a = 0; a < pass->access_count; ++a) {
+            if(GraphUseWrites(accesses[a].use) && needed[accesses[a].resource]) {
+                pass->culled = false;
+            }
+        }
+        if(pass->culled) {
+            continue;
+        }
+        for(u32 a = 0; a < pass->access_count; ++a) {
+            if(GraphUseDiscards(accesses[a].use)) {
+                needed[accesses[a].resource] = false;
+            }
+        }
+        for(u32 a = 0; a < pass->access_count; ++a) {
+            if(GraphUseReads(accesses[a].use)) {
+                needed[accesses[a].resource] = true;
+            }
+        }
+    }
+
+    // Then forward, with the use each resource is in and the uses since its last barrier
+    GraphUse uses[GRAPH_MAX_RESOURCES];
+    u32 src_uses[GRAPH_MAX_RESOURCES];
+    for(u32 r = 0; r < GRAPH_MAX_RESOURCES; ++r) {
+        GraphResource *resource = &graph->resources[r];
+        resource->first_pass = GRAPH_NO_PASS;
+        resource->last_pass = GRAPH_NO_PASS;
+        uses[r] = resource->flags & GRAPH_RESOURCE_TRANSIENT ? GRAPH_USE_NONE
+                                                             : resource->initial_use;
+        src_uses[r] = 1u << uses[r];
+    }
+    graph->barrier_count = 0;
+    for(u32 p = 0; p < graph->pass_count; ++p) {
+        GraphPass *pass = &graph->passes[p];
+        pass->barrier_first = graph->barrier_count;
+        pass->barrier_count = 0;
+        if(pass->culled) {
+            continue;
+        }
+        for(u32 a = 0; a < pass->access_count; ++a) {
+            const GraphAccess *access = &graph->accesses[pass->access_first + a];
+            const u32 r = access->resource;
+            GraphResource *resource = &graph->resources[r];
+            u32 src = src_uses[r];
+            if(resource->first_pass == GRAPH_NO_PASS) {
+                resource->first_pass = p;
+                // Its memory may still be in use by the resources placed there before it
+                if(resource->flags & GRAPH_RESOURCE_TRANSIENT) {
+                    for(u32 o = 0; o < GRAPH_MAX_RESOURCES; ++o) {
+                        const GraphResource *other = &graph->resources[o];
+                        if(o != r && (other->flags & GRAPH_RESOURCE_TRANSIENT) &&
+                           other->last_pass != GRAPH_NO_PASS && other->last_pass < p &&
+                           FrameGraphOverlap(resource, other)) {
+                            src |= 1u << uses[o];
+                        }
+                    }
+                }
+            }
+            resource->last_pass = p;
+            // Reading on as the pass before did
+            if(access->use == uses[r] && !GraphUseWrites(access->use)) {
+                continue;
+            }
+            const GraphUse old_use = GraphUseDiscards(access->use) ? GRAPH_USE_NONE : uses[r];
+            FrameGraphPushBarrier(graph, r, src, old_use, access->use);
+            ++pass->barrier_count;
+            uses[r] = access->use;
+            src_uses[r] = 1u << access->use;
+        }
+    }
+
+    graph->final_barrier_first = graph->barrier_count;
+    for(u32 r = 0; r < GRAPH_MAX_RESOURCES; ++r) {
+        const GraphResource *resource = &graph->resources[r];
+        const bool imported = (resource->flags & GRAPH_RESOURCE_DECLARED) &&
+                              !(resource->flags & GRAPH_RESOURCE_TRANSIENT);
+        if(imported && resource->final_use != GRAPH_USE_NONE && uses[r] != resource->final_use) {
+            FrameGraphPushBarrier(graph, r, src_uses[r], uses[r], resource->final_use);
+        }
+    }
+    graph->final_barrier_count = graph->barrier_count - graph->final_barrier_first;
+}
+
+internal bool FrameGraphLiveTogether(const GraphResource *a, const GraphResource *b) {
+    return a->first_pass <= b->last_pass && b->first_pass <= a->last_pass;
+}
+
+// Places the transient resources of a compiled graph in one block of memory and returns its size.
+// Biggest first, each goes at the lowest offset clear of the resources placed before it that are
+// in use at the same time. Unused ones go at 0, nothing ever reads or writes them.
+internal u64 FrameGraphAlias(FrameGraph *graph) {
+    u32 order[GRAPH_MAX_RESOURCES];
+    u32 count = 0;
+    for(u32 r = 0; r < GRAPH_MAX_RESOURCES; ++r) {
+        GraphResource *resource = &graph->resources[r];
+        if(!(resource->flags & GRAPH_RESOURCE_TRANSIENT)) {
+            continue;
+        }
+        resource->offset = 0;
+        if(resource->first_pass == GRAPH_NO_PASS) {
+            continue;
+        }
+        u32 i = count++;
+        while(i > 0 && graph->resources[order[i - 1]].size < resource->size) {
+            order[i] = order[i - 1];
+            --i;
+        }
+        order[i] = r;
+    }
+
+    u64 size = 0;
+    for(u32 i = 0; i < count; ++i) {
+        GraphResource *resource = &graph->resources[order[i]];
+        // Past every placed resource in the way until none is, the offset only grows
+        for(bool moved = true; moved;) {
+            moved = false;
+            for(u32 j = 0; j < i; ++j) {
+                const GraphResource *placed = &graph->resources[order[j]];
+                if(FrameGraphLiveTogether(resource, placed) &&
+                   FrameGraphOverlap(resource, placed)) {
+                    const u64 end = placed->offset + placed->size;
+                    resource->offset =
+                        (end + resource->alignment - 1) / resource->alignment * resource->alignment;
+                    moved = true;
+                }
+            }
+        }
+        if(resource->offset + resource->size > size) {
+            size = resource->offset + resource->size;
+        }
+    }
+    return size;
+}
@@ -62,6 +62,14 @@ inline u32 GLTFGetTextureID(cgltf_texture *texture) {
     return texture->id;
 }
 
+// Returns the renderer texture slot for a gltf texture
+inline u32 GLTFGetTextureSlot(cgltf_texture *texture, const u32 *texture_map) {
+    if(!texture)
+        return UINT_MAX;
+
+    return texture_map[texture->id];
+}
+
 void GLTFLoadVertexAndIndexBuffer(cgltf_primitive *prim,
                                   Primitive *primitive,
                                   const u32 offset,
@@ -97,7 +105,25 @@ void GLTFLoadVertexAndIndexBuffer(cgltf_primitive *prim,
     }
 }
 
-void GLTFLoadMaterialBuffer(cgltf_data *data, Material *buffer) {
+// True if the texture is only sampled as a base color, other textures share the mesh uvs and
+// can't be moved to an atlas.
+bool GLTFIsBaseColorOnly(cgltf_data *data, const u32 texture_id) {
+    cgltf_texture *texture = &data->textures[texture_id];
+    for(u32 i = 0; i < data->materials_count; ++i) {
+        cgltf_material *mat = &data->materials[i];
+        if(mat->pbr_metallic_roughness.metallic_roughness_texture.texture == texture ||
+           mat->normal_texture.texture == texture || mat->occlusion_texture.texture == texture ||
+           mat->emissive_texture.texture == texture) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void GLTFLoadMaterialBuffer(cgltf_data *data,
+                            const u32 *texture_map,
+                            const Vec4 *texture_rects,
+                            Material *buffer) {
     for(u32 i = 0; i < data->materials_count; ++i) {
         cgltf_material *mat = &data->materials[i];
         Material dst = {0};
@@ -116,14 +142,17 @@ void GLTFLoadMaterialBuffer(cgltf_data *data, Material *buffer) {
         Vec3 base_color = {color[0], color[1], color[2]};
         dst.base_color = base_color;
         dst.base_color_texture =
-            GLTFGetTextureID(mat->pbr_metallic_roughness.base_color_texture.texture);
-        dst.metallic_roughness_texture =
-            GLTFGetTextureID(mat->pbr_metallic_roughness.metallic_roughness_texture.texture);
+            GLTFGetTextureSlot(mat->pbr_metallic_roughness.base_color_texture.texture, texture_map);
+        dst.metallic_roughness_texture = GLTFGetTextureSlot(
+            mat->pbr_metallic_roughness.metallic_roughness_texture.texture, texture_map);
         dst.metallic_factor = mat->pbr_metallic_roughness.metallic_factor;
         dst.roughness_factor = mat->pbr_metallic_roughness.roughness_factor;
-        dst.normal_texture = GLTFGetTextureID(mat->normal_texture.texture);
-        dst.ao_texture = GLTFGetTextureID(mat->occlusion_texture.texture);
-        dst.emissive_texture = GLTFGetTextureID(mat->emissive_texture.texture);
+        dst.normal_texture = GLTFGetTextureSlot(mat->normal_texture.texture, texture_map);
+        dst.ao_texture = GLTFGetTextureSlot(mat->occlusion_texture.texture, texture_map);
+        dst.emissive_texture = GLTFGetTextureSlot(mat->emissive_texture.texture, texture_map);
+        cgltf_texture *base_color_texture = mat->pbr_metallic_roughness.base_color_texture.texture;
+        dst.base_color_uv = base_color_texture ? texture_rects[base_color_texture->id]
+                                               : (Vec4){1.0f, 1.0f, 0.0f, 0.0f};
         // sLog("%f, %f, %f, metallic : %f, roughness : %f", color[0], color[1],color[2],
         // dst.metallic, dst.roughness);
 
@@ -0,0 +1,88 @@
+#include <sl3dge-utils/sl3dge.h>
+
+#include "renderer/renderer.h"
+
+// Generation checked handles to densely packed items. The owner keeps its items in arrays indexed
+// by the dense index and mirrors the swap-removes; the map only tracks where each handle points.
+
+internal void HandleMapInit(HandleMap *map, const u32 capacity) {
+    map->slot_capacity = capacity;
+    map->slot_count = 0;
+    map->slots = (HandleSlot *)sCalloc(capacity, sizeof(HandleSlot));
+    map->free_slot = UINT_MAX;
+    map->dense_capacity = capacity;
+    map->slot_of = (u32 *)sCalloc(capacity, sizeof(u32));
+}
+
+internal void HandleMapFree(HandleMap *map) {
+    sFree(map->slots);
+    sFree(map->slot_of);
+    *map = (HandleMap){0};
+}
+
+// Returns a handle to the item at dense index
+internal u32 HandleMapAdd(HandleMap *map, const u32 index) {
+    if(index >= map->dense_capacity) {
+        u32 new_capacity = map->dense_capacity * 2;
+        while(new_capacity <= index) {
+            new_capacity *= 2;
+        }
+        u32 *new_slot_of = (u32 *)sRealloc(map->slot_of, new_capacity * sizeof(u32));
+        ASSERT(new_slot_of);
+        map->slot_of = new_slot_of;
+        map->dense_capacity = new_capacity;
+    }
+
+    u32 slot = map->free_slot;
+    if(slot != UINT_MAX) {
+        map->free_slot = map->slots[slot].index;
+    } else {
+        if(map->slot_count == map->slot_capacity) {
+            const u32 new_capacity = map->slot_capacity * 2;
+            HandleSlot *new_slots =
+                (HandleSlot *)sRealloc(map->slots, new_capacity * sizeof(HandleSlot));
+            ASSERT(new_slots);
+            map->slots = new_slots;
+            map->slot_capacity = new_capacity;
+        }
+        ASSERT_MSG(map->slot_count <= HANDLE_INDEX_MASK, "Out of handles");
+        slot = map->slot_count++;
+        map->slots[slot].generation = 1; // 0 is never valid
+    }
+
+    map->slots[slot].index = index;
+    map->slot_of[index] = slot;
+    return map->slots[slot].generation << HANDLE_INDEX_BITS | slot;
+}
+
+// Returns the dense index of the handle, UINT_MAX if it was removed
+internal u32 HandleMapGet(const HandleMap *map, const u32 handle) {
+    const u32 slot = handle & HANDLE_INDEX_MASK;
+    if(slot >= map->slot_count || map->slots[slot].generation != handle >> HANDLE_INDEX_BITS) {
+        return UINT_MAX;
+    }
+    return map->slots[slot].index;
+}
+
+internal u32 HandleMapHandleOf(const HandleMap *map, const u32 index) {
+    const u32 slot = map->slot_of[index];
+    return map->slots[slot].generation << HANDLE_INDEX_BITS | slot;
+}
+
+// The owner has moved its item at dense index last into the removed one's place
+internal void HandleMapRemove(HandleMap *map, const u32 handle, const u32 last) {
+    const u32 slot = handle & HANDLE_INDEX_MASK;
+    HandleSlot *removed = &map->slots[slot];
+    const u32 index = removed->index;
+    if(index != last) {
+        map->slot_of[index] = map->slot_of[last];
+        map->slots[map->slot_of[index]].index = index;
+    }
+
+    removed->generation = (removed->generation + 1) & (UINT_MAX >> HANDLE_INDEX_BITS);
+    if(removed->generation == 0) {
+        removed->generation = 1;
+    }
+    removed->index = map->free_slot;
+    map->free_slot = slot;
+}
@@ -0,0 +1,251 @@
+#include <sl3dge-utils/sl3dge.h>
+
+#include "renderer/simd.h"
+
+// Batched matrix kernels for the instance transforms. The multiply is picked at startup by
+// Mat4BatchInit from what the cpu supports : AVX2 + FMA, SSE or NEON, with a scalar fallback.
+// Strides are in bytes so the kernels can read and write matrices inside bigger structs, a
+// stride of 0 reuses the same matrix for the whole batch.
+
+#define MAT4_AT(base, stride, i) ((Mat4 *)((u8 *)(base) + (size_t)(i) * (stride)))
+
+typedef enum Mat4Kernel {
+    MAT4_KERNEL_SCALAR,
+    MAT4_KERNEL_SSE,
+    MAT4_KERNEL_AVX2,
+    MAT4_KERNEL_NEON,
+    MAT4_KERNEL_COUNT,
+} Mat4Kernel;
+
+global const char *mat4_kernel_names[] = {"Scalar", "SSE", "AVX2", "NEON"};
+
+// out[i] = lhs[i] * rhs[i]. out must not alias the inputs.
+typedef void Mat4BatchMul_t(const u32 count,
+                            const Mat4 *lhs,
+                            const size_t lhs_stride,
+                            const Mat4 *rhs,
+                            const size_t rhs_stride,
+                            Mat4 *out,
+                            const size_t out_stride);
+
+internal void Mat4BatchMulScalar(const u32 count,
+                                 const Mat4 *lhs,
+                                 const size_t lhs_stride,
+                                 const Mat4 *rhs,
+                                 const size_t rhs_stride,
+                                 Mat4 *out,
+                                 const size_t out_stride) {
+    for(u32 i = 0; i < count; ++i) {
+        *MAT4_AT(out, out_stride, i) =
+            mat4_mul(MAT4_AT(lhs, lhs_stride, i), MAT4_AT(rhs, rhs_stride, i));
+    }
+}
+
+#if SIMD_SSE
+// Each column of the result is the lhs columns weighted by the matching rhs column
+internal void Mat4BatchMulSSE(const u32 count,
+                              const Mat4 *lhs,
+                              const size_t lhs_stride,
+                              const Mat4 *rhs,
+                              const size_t rhs_stride,
+                              Mat4 *out,
+                              const size_t out_stride) {
+    for(u32 i = 0; i < count; ++i) {
+        const Mat4 *a = MAT4_AT(lhs, lhs_stride, i);
+        const Mat4 *b = MAT4_AT(rhs, rhs_stride, i);
+        Mat4 *r = MAT4_AT(out, out_stride, i);
+
+        const __m128 a0 = _mm_loadu_ps(a->m[0]);
+        const __m128 a1 = _mm_loadu_ps(a->m[1]);
+        const __m128 a2 = _mm_loadu_ps(a->m[2]);
+        const __m128 a3 = _mm_loadu_ps(a->m[3]);
+        for(u32 c = 0; c < 4; ++c) {
+            const __m128 bc = _mm_loadu_ps(b->m[c]);
+            __m128 col = _mm_mul_ps(a0, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(0, 0, 0, 0)));
+            col = _mm_add_ps(col, _mm_mul_ps(a1, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(1, 1, 1, 1))));
+            col = _mm_add_ps(col, _mm_mul_ps(a2, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(2, 2, 2, 2))));
+            col = _mm_add_ps(col, _mm_mul_ps(a3, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(3, 3, 3, 3))));
+            _mm_storeu_ps(r->m[c], col);
+        }
+    }
+}
+#endif
+
+#if SIMD_AVX2
+// Same as SSE with two result columns per register : the lhs columns are duplicated in both
+// lanes and the in-lane shuffle broadcasts the weights of two rhs columns at once.
+SIMD_TARGET_AVX2 internal void Mat4BatchMulAVX2(const u32 count,
+                                                const Mat4 *lhs,
+                                                const size_t lhs_stride,
+                                                const Mat4 *rhs,
+                                                const size_t rhs_stride,
+                                                Mat4 *out,
+                                                const size_t out_stride) {
+    for(u32 i = 0; i < count; ++i) {
+        const Mat4 *a = MAT4_AT(lhs, lhs_stride, i);
+        const Mat4 *b = MAT4_AT(rhs, rhs_stride, i);
+        Mat4 *r = MAT4_AT(out, out_stride, i);
+
+        const __m256 a0 = _mm256_broadcast_ps((const __m128 *)a->m[0]);
+        const __m256 a1 = _mm256_broadcast_ps((const __m128 *)a->m[1]);
+        const __m256 a2 = _mm256_broadcast_ps((const __m128 *)a->m[2]);
+        const __m256 a3 = _mm256_broadcast_ps((const __m128 *)a->m[3]);
+        for(u32 c = 0; c < 4; c += 2) {
+            const __m256 bc = _mm256_loadu_ps(b->m[c]);
+            __m256 col = _mm256_mul_ps(a0, _mm256_shuffle_ps(bc, bc, _MM_SHUFFLE(0, 0, 0, 0)));
+            col = _mm256_fmadd_ps(a1, _mm256_shuffle_ps(bc, bc, _MM_SHUFFLE(1, 1, 1, 1)), col);
+            col = _mm256_fmadd_ps(a2, _mm256_shuffle_ps(bc, bc, _MM_SHUFFLE(2, 2, 2, 2)), col);
+            col = _mm256_fmadd_ps(a3, _mm256_shuffle_ps(bc, bc, _MM_SHUFFLE(3, 3, 3, 3)), col);
+            _mm256_storeu_ps(r->m[c], col);
+        }
+    }
+}
+#endif
+
+#if SIMD_NEON
+internal void Mat4BatchMulNEON(const u32 count,
+                               const Mat4 *lhs,
+                               const size_t lhs_stride,
+                               const Mat4 *rhs,
+                               const size_t rhs_stride,
+                               Mat4 *out,
+                               const size_t out_stride) {
+    for(u32 i = 0; i < count; ++i) {
+        const Mat4 *a = MAT4_AT(lhs, lhs_stride, i);
+        const Mat4 *b = MAT4_AT(rhs, rhs_stride, i);
+        Mat4 *r = MAT4_AT(out, out_stride, i);
+
+        const float32x4_t a0 = vld1q_f32(a->m[0]);
+        const float32x4_t a1 = vld1q_f32(a->m[1]);
+        const float32x4_t a2 = vld1q_f32(a->m[2]);
+        const float32x4_t a3 = vld1q_f32(a->m[3]);
+        for(u32 c = 0; c < 4; ++c) {
+            const float32x4_t bc = vld1q_f32(b->m[c]);
+            float32x4_t col = vmulq_laneq_f32(a0, bc, 0);
+            col = vfmaq_laneq_f32(col, a1, bc, 1);
+            col = vfmaq_laneq_f32(col, a2, bc, 2);
+            col = vfmaq_laneq_f32(col, a3, bc, 3);
+            vst1q_f32(r->m[c], col);
+        }
+    }
+}
+#endif
+
+global Mat4BatchMul_t *mat4_batch_mul = Mat4BatchMulScalar;
+global Mat4Kernel mat4_batch_kernel = MAT4_KERNEL_SCALAR;
+
+// Returns false if the kernel isn't available on this cpu
+bool Mat4BatchUseKernel(const Mat4Kernel kernel) {
+    Mat4BatchMul_t *function = NULL;
+    switch(kernel) {
+    case MAT4_KERNEL_SCALAR: function = Mat4BatchMulScalar; break;
+#if SIMD_SSE
+    case MAT4_KERNEL_SSE: function = Mat4BatchMulSSE; break;
+#endif
+#if SIMD_AVX2
+    case MAT4_KERNEL_AVX2: function = SimdHasAVX2() ? Mat4BatchMulAVX2 : NULL; break;
+#endif
+#if SIMD_NEON
+    case MAT4_KERNEL_NEON: function = Mat4BatchMulNEON; break;
+#endif
+    default: break;
+    }
+    if(!function) {
+        return false;
+    }
+    mat4_batch_mul = function;
+    mat4_batch_kernel = kernel;
+    return true;
+}
+
+// Picks the fastest kernel available
+void Mat4BatchInit() {
+    for(i32 kernel = MAT4_KERNEL_COUNT - 1; kernel >= 0; --kernel) {
+        if(Mat4BatchUseKernel((Mat4Kernel)kernel)) {
+            break;
+        }
+    }
+    sLog("Matrix kernel : %s", mat4_kernel_names[mat4_batch_kernel]);
+}
+
+void Mat4BatchMul(const u32 count,
+                  const Mat4 *lhs,
+                  const size_t lhs_stride,
+                  const Mat4 *rhs,
+                  const size_t rhs_stride,
+                  Mat4 *out,
+                  const size_t out_stride) {
+    mat4_batch_mul(count, lhs, lhs_stride, rhs, rhs_stride, out, out_stride);
+}
+
+// The rows of the inverse of the 3x3 part are the cross products of its columns divided by the
+// determinant. Only valid for matrices whose last row is (0, 0, 0, 1), cheaper than mat4_inverse.
+void Mat4AffineInverse(const Mat4 *m, Mat4 *out) {
+    const Vec3 c0 = {m->m[0][0], m->m[0][1], m->m[0][2]};
+    const Vec3 c1 = {m->m[1][0], m->m[1][1], m->m[1][2]};
+    const Vec3 c2 = {m->m[2][0], m->m[2][1], m->m[2][2]};
+    const Vec3 t = {m->m[3][0], m->m[3][1], m->m[3][2]};
+
+    Vec3 r0 = vec3_cross(c1, c2);
+    Vec3 r1 = vec3_cross(c2, c0);
+    Vec3 r2 = vec3_cross(c0, c1);
+    const f32 inv_det = 1.0f / (c0.x * r0.x + c0.y * r0.y + c0.z * r0.z);
+    r0 = vec3_fmul(r0, inv_det);
+    r1 = vec3_fmul(r1, inv_det);
+    r2 = vec3_fmul(r2, inv_det);
+
+    *out = (Mat4){0};
+    out->m[0][0] = r0.x;
+    out->m[1][0] = r0.y;
+    out->m[2][0] = r0.z;
+    out->m[0][1] = r1.x;
+    out->m[1][1] = r1.y;
+    out->m[2][1] = r1.z;
+    out->m[0][2] = r2.x;
+    out->m[1][2] = r2.y;
+    out->m[2][2] = r2.z;
+    out->m[3][0] = -(r0.x * t.x + r0.y * t.y + r0.z * t.z);
+    out->m[3][1] = -(r1.x * t.x + r1.y * t.y + r1.z * t.z);
+    out->m[3][2] = -(r2.x * t.x + r2.y * t.y + r2.z * t.z);
+    out->m[3][3] = 1.0f;
+}
+
+// transpose(inverse(mat3(m))) up to a positive scale, the shader normalizes the normals anyway.
+// Its columns are the rows of the inverse, the determinant only matters for its sign.
+void Mat4NormalMatrix(const Mat4 *m, Mat4 *out) {
+    const Vec3 c0 = {m->m[0][0], m->m[0][1], m->m[0][2]};
+    const Vec3 c1 = {m->m[1][0], m->m[1][1], m->m[1][2]};
+    const Vec3 c2 = {m->m[2][0], m->m[2][1], m->m[2][2]};
+
+    Vec3 n0 = vec3_cross(c1, c2);
+    Vec3 n1 = vec3_cross(c2, c0);
+    Vec3 n2 = vec3_cross(c0, c1);
+    const f32 det = c0.x * n0.x + c0.y * n0.y + c0.z * n0.z;
+    if(det < 0.0f) { // Mirrored
+        n0 = vec3_fmul(n0, -1.0f);
+        n1 = vec3_fmul(n1, -1.0f);
+        n2 = vec3_fmul(n2, -1.0f);
+    }
+
+    *out = (Mat4){0};
+    out->m[0][0] = n0.x;
+    out->m[0][1] = n0.y;
+    out->m[0][2] = n0.z;
+    out->m[1][0] = n1.x;
+    out->m[1][1] = n1.y;
+    out->m[1][2] = n1.z;
+    out->m[2][0] = n2.x;
+    out->m[2][1] = n2.y;
+    out->m[2][2] = n2.z;
+    out->m[3][3] = 1.0f;
+}
+
+void Mat4BatchNormalMatrix(const u32 count,
+                           const Mat4 *in,
+                           const size_t in_stride,
+                           Mat4 *out,
+                           const size_t out_stride) {
+    for(u32 i = 0; i < count; ++i) {
+        Mat4NormalMatrix(MAT4_AT(in, in_stride, i), MAT4_AT(out, out_stride, i));
+    }
+}
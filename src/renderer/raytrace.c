@@ -0,0 +1,718 @@
+#include <sl3dge-utils/sl3dge.h>
+
+#include <stdatomic.h>
+
+#include "platform/platform.h"
+#include "renderer/simd.h"
+
+// Cpu ray tracing against the triangles of the meshes. Each mesh gets a BVH in mesh space with
+// the node transforms applied, instances reuse the BVH of their mesh by moving the rays into
+// mesh space.
+//
+// The build bins the triangle centroids and splits with the surface area heuristic. Nodes bigger
+// than RT_PARALLEL_TRIANGLES are split by whichever build job picks them up and their children
+// are shared again, smaller nodes are finished by one job. The trace mesh is built on the
+// workers so it sticks to the C allocator. Nodes at RT_MAX_DEPTH stay leaves whatever their size,
+// which bounds the traversal stacks.
+
+#define RT_BIN_COUNT 16
+#define RT_LEAF_SIZE 4      // Nodes this small stay leaves
+#define RT_MAX_LEAF_SIZE 16 // Nodes bigger than this are always split
+#define RT_PARALLEL_TRIANGLES 8192
+#define RT_MAX_DEPTH 64
+#define RT_STACK_SIZE (RT_MAX_DEPTH + 1) // A node pops before its two children push
+#define RT_PACKET_SIZE 4
+#define RT_EPSILON 1e-7f
+
+typedef struct RtTriangle {
+    Vec3 v0;
+    Vec3 e1; // v1 - v0
+    Vec3 e2; // v2 - v0
+} RtTriangle;
+
+typedef struct RtNode {
+    Aabb box;
+    u32 first; // First triangle of a leaf, left child of an inner node. The right one follows it.
+    u32 count; // 0 for inner nodes
+} RtNode;
+
+typedef struct RtMesh {
+    u32 triangle_count;
+    RtTriangle *triangles;
+    u32 *primitives; // Primitive of each triangle
+    u32 node_count;
+    RtNode *nodes; // Root first
+} RtMesh;
+
+typedef struct RtHit {
+    f32 t; // Only hits closer than this are reported
+    u32 triangle;
+    f32 u; // Barycentrics of v1 and v2
+    f32 v;
+} RtHit;
+
+typedef struct RtBuildTask {
+    u32 node;
+    u32 begin;
+    u32 end;
+    u32 depth;
+} RtBuildTask;
+
+typedef struct RtBuild {
+    RtMesh mesh;
+    RtTriangle *input; // Triangles in mesh order, reordered once the tree is built
+    u32 *input_primitives;
+    Aabb *boxes;
+    Vec3 *centroids;
+    u32 *order; // Triangles of the nodes, partitioned in place
+
+    _Atomic u32 node_count;
+    atomic_flag task_lock;
+    u32 task_count;
+    RtBuildTask *tasks;
+    _Atomic u32 pending_tasks; // Pushed and not done yet
+    _Atomic u32 running_jobs;
+    _Atomic bool finished;
+    PlatformRunJob_t *run_job; // Helps with the other jobs while a big node is being split
+} RtBuild;
+
+// Rays of a packet are traced together, a node is visited if any of them enters it
+typedef struct RtPacket {
+    alignas(16) f32 ox[RT_PACKET_SIZE];
+    alignas(16) f32 oy[RT_PACKET_SIZE];
+    alignas(16) f32 oz[RT_PACKET_SIZE];
+    alignas(16) f32 dx[RT_PACKET_SIZE];
+    alignas(16) f32 dy[RT_PACKET_SIZE];
+    alignas(16) f32 dz[RT_PACKET_SIZE];
+    alignas(16) f32 inv_x[RT_PACKET_SIZE];
+    alignas(16) f32 inv_y[RT_PACKET_SIZE];
+    alignas(16) f32 inv_z[RT_PACKET_SIZE];
+    alignas(16) f32 t[RT_PACKET_SIZE]; // Max distance, shrinks to the closest hit
+    u32 triangle[RT_PACKET_SIZE];      // UINT_MAX until hit
+    u32 active;                        // Lanes still tracing, one bit each
+} RtPacket;
+
+internal f32 RtAxis(const Vec3 v, const u32 axis) {
+    return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+
+internal Vec3 RtTransformPoint(const Mat4 *m, const Vec3 p) {
+    return (Vec3){m->m[0][0] * p.x + m->m[1][0] * p.y + m->m[2][0] * p.z + m->m[3][0],
+                  m->m[0][1] * p.x + m->m[1][1] * p.y + m->m[2][1] * p.z + m->m[3][1],
+                  m->m[0][2] * p.x + m->m[1][2] * p.y + m->m[2][2] * p.z + m->m[3][2]};
+}
+
+internal Vec3 RtTransformVector(const Mat4 *m, const Vec3 v) {
+    return (Vec3){m->m[0][0] * v.x + m->m[1][0] * v.y + m->m[2][0] * v.z,
+                  m->m[0][1] * v.x + m->m[1][1] * v.y + m->m[2][1] * v.z,
+                  m->m[0][2] * v.x + m->m[1][2] * v.y + m->m[2][2] * v.z};
+}
+
+void RtMeshFree(RtMesh *mesh) {
+    free(mesh->triangles);
+    free(mesh->primitives);
+    free(mesh->nodes);
+    *mesh = (RtMesh){0};
+}
+
+// ========================
+//
+// BUILD
+//
+// ========================
+
+// Allocates the build for triangle_count triangles, fill them with RtBuildSetTriangle
+bool RtBuildInit(RtBuild *build, const u32 triangle_count) {
+    *build = (RtBuild){0};
+    atomic_flag_clear(&build->task_lock);
+    build->mesh.triangle_count = triangle_count;
+    if(triangle_count == 0) {
+        return true;
+    }
+    build->input = (RtTriangle *)malloc(triangle_count * sizeof(RtTriangle));
+    build->input_primitives = (u32 *)malloc(triangle_count * sizeof(u32));
+    build->boxes = (Aabb *)malloc(triangle_count * sizeof(Aabb));
+    build->centroids = (Vec3 *)malloc(triangle_count * sizeof(Vec3));
+    build->order = (u32 *)malloc(triangle_count * sizeof(u32));
+    build->mesh.nodes = (RtNode *)malloc(2 * triangle_count * sizeof(RtNode));
+    // Only nodes above RT_PARALLEL_TRIANGLES push tasks, there are fewer than 2n / threshold
+    const u32 task_capacity = 4 * (triangle_count / RT_PARALLEL_TRIANGLES) + 4;
+    build->tasks = (RtBuildTask *)malloc(task_capacity * sizeof(RtBuildTask));
+    return build->input && build->input_primitives && build->boxes && build->centroids &&
+           build->order && build->mesh.nodes && build->tasks;
+}
+
+void RtBuildSetTriangle(
+    RtBuild *build, const u32 i, const Vec3 a, const Vec3 b, const Vec3 c, const u32 primitive) {
+    build->input[i] = (RtTriangle){a, vec3_sub(b, a), vec3_sub(c, a)};
+    build->input_primitives[i] = primitive;
+
+    Aabb *box = &build->boxes[i];
+    box->min = (Vec3){fminf(a.x, fminf(b.x, c.x)),
+                      fminf(a.y, fminf(b.y, c.y)),
+                      fminf(a.z, fminf(b.z, c.z))};
+    box->max = (Vec3){fmaxf(a.x, fmaxf(b.x, c.x)),
+                      fmaxf(a.y, fmaxf(b.y, c.y)),
+                      fmaxf(a.z, fmaxf(b.z, c.z))};
+    build->centroids[i] = vec3_fmul(vec3_add(box->min, box->max), 0.5f);
+    build->order[i] = i;
+}
+
+internal void RtBuildPushTask(RtBuild *build, const RtBuildTask task) {
+    while(atomic_flag_test_and_set(&build->task_lock)) {
+    }
+    build->tasks[build->task_count++] = task;
+    atomic_flag_clear(&build->task_lock);
+}
+
+internal bool RtBuildPopTask(RtBuild *build, RtBuildTask *task) {
+    while(atomic_flag_test_and_set(&build->task_lock)) {
+    }
+    const bool found = build->task_count > 0;
+    if(found) {
+        *task = build->tasks[--build->task_count];
+    }
+    atomic_flag_clear(&build->task_lock);
+    return found;
+}
+
+internal u32 RtBinOf(const f32 centroid, const f32 min, const f32 scale) {
+    const u32 bin = (u32)((centroid - min) * scale);
+    return bin < RT_BIN_COUNT ? bin : RT_BIN_COUNT - 1;
+}
+
+// Fits the node around its triangles. Returns false if it stays a leaf, otherwise partitions the
+// triangles and writes where the right child starts.
+internal bool RtBuildSplit(RtBuild *build, const RtBuildTask *task, u32 *mid) {
+    RtNode *node = &build->mesh.nodes[task->node];
+    const u32 count = task->end - task->begin;
+
+    Aabb box = build->boxes[build->order[task->begin]];
+    Aabb centroid_box = {build->centroids[build->order[task->begin]],
+                         build->centroids[build->order[task->begin]]};
+    for(u32 i = task->begin + 1; i < task->end; ++i) {
+        const u32 t = build->order[i];
+        box = AabbUnion(&box, &build->boxes[t]);
+        const Aabb centroid = {build->centroids[t], build->centroids[t]};
+        centroid_box = AabbUnion(&centroid_box, &centroid);
+    }
+    *node = (RtNode){box, task->begin, count};
+    if(count <= RT_LEAF_SIZE || task->depth >= RT_MAX_DEPTH) {
+        return false;
+    }
+
+    // Costs leave out the traversal constant and the parent area, they are the same everywhere
+    f32 best_cost = FLT_MAX;
+    u32 best_axis = UINT_MAX;
+    u32 best_bin = 0;
+    for(u32 axis = 0; axis < 3; ++axis) {
+        const f32 min = RtAxis(centroid_box.min, axis);
+        const f32 extent = RtAxis(centroid_box.max, axis) - min;
+        if(extent <= 0.0f) {
+            continue;
+        }
+        const f32 scale = RT_BIN_COUNT / extent;
+
+        u32 bin_counts[RT_BIN_COUNT] = {0};
+        Aabb bin_boxes[RT_BIN_COUNT];
+        for(u32 i = task->begin; i < task->end; ++i) {
+            const u32 t = build->order[i];
+            const u32 b = RtBinOf(RtAxis(build->centroids[t], axis), min, scale);
+            bin_boxes[b] = bin_counts[b] == 0 ? build->boxes[t]
+                                              : AabbUnion(&bin_boxes[b], &build->boxes[t]);
+            bin_counts[b]++;
+        }
+
+        // Left side of each split, then sweep the right side back
+        f32 left_area[RT_BIN_COUNT - 1];
+        u32 left_count[RT_BIN_COUNT - 1];
+        Aabb side = {0};
+        u32 side_count = 0;
+        for(u32 b = 0; b < RT_BIN_COUNT - 1; ++b) {
+            if(bin_counts[b] > 0) {
+                side = side_count == 0 ? bin_boxes[b] : AabbUnion(&side, &bin_boxes[b]);
+                side_count += bin_counts[b];
+            }
+            left_area[b] = side_count > 0 ? AabbArea(&side) : 0.0f;
+            left_count[b] = side_count;
+        }
+        side_count = 0;
+        for(u32 b = RT_BIN_COUNT - 1; b > 0; --b) {
+            if(bin_counts[b] > 0) {
+                side = side_count == 0 ? bin_boxes[b] : AabbUnion(&side, &bin_boxes[b]);
+                side_count += bin_counts[b];
+            }
+            if(side_count == 0 || left_count[b - 1] == 0) {
+                continue;
+            }
+            const f32 cost = left_area[b - 1] * left_count[b - 1] + AabbArea(&side) * side_count;
+            if(cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b - 1;
+            }
+        }
+    }
+
+    const bool worth_it = best_axis != UINT_MAX && best_cost < AabbArea(&box) * count;
+    if(!worth_it && count <= RT_MAX_LEAF_SIZE) {
+        return false;
+    }
+
+    u32 i = task->begin;
+    if(best_axis != UINT_MAX) {
+        const f32 min = RtAxis(centroid_box.min, best_axis);
+        const f32 scale = RT_BIN_COUNT / (RtAxis(centroid_box.max, best_axis) - min);
+        u32 j = task->end;
+        while(i < j) {
+            const u32 t = build->order[i];
+            if(RtBinOf(RtAxis(build->centroids[t], best_axis), min, scale) <= best_bin) {
+                ++i;
+            } else {
+                build->order[i] = build->order[--j];
+                build->order[j] = t;
+            }
+        }
+    }
+    // Same centroids everywhere, any half is as good as the other
+    if(i == task->begin || i == task->end) {
+        i = task->begin + count / 2;
+    }
+    *mid = i;
+    return true;
+}
+
+internal u32 RtBuildMakeInner(RtBuild *build, const u32 node) {
+    const u32 children = atomic_fetch_add(&build->node_count, 2);
+    build->mesh.nodes[node].first = children;
+    build->mesh.nodes[node].count = 0;
+    return children;
+}
+
+internal void RtBuildSubtree(RtBuild *build, const RtBuildTask root) {
+    RtBuildTask stack[RT_STACK_SIZE];
+    u32 top = 0;
+    stack[top++] = root;
+    while(top > 0) {
+        const RtBuildTask task = stack[--top];
+        u32 mid;
+        if(!RtBuildSplit(build, &task, &mid)) {
+            continue;
+        }
+        const u32 children = RtBuildMakeInner(build, task.node);
+        ASSERT_MSG(top + 2 <= RT_STACK_SIZE, "Mesh BVH is too deep");
+        stack[top++] = (RtBuildTask){children + 1, mid, task.end, task.depth + 1};
+        stack[top++] = (RtBuildTask){children, task.begin, mid, task.depth + 1};
+    }
+}
+
+// Moves the triangles in leaf order and releases the scratch memory
+internal void RtBuildFinalize(RtBuild *build) {
+    RtMesh *mesh = &build->mesh;
+    mesh->node_count = atomic_load(&build->node_count);
+    mesh->triangles = (RtTriangle *)malloc(mesh->triangle_count * sizeof(RtTriangle));
+    mesh->primitives = (u32 *)malloc(mesh->triangle_count * sizeof(u32));
+    ASSERT(mesh->triangles && mesh->primitives);
+    for(u32 i = 0; i < mesh->triangle_count; ++i) {
+        mesh->triangles[i] = build->input[build->order[i]];
+        mesh->primitives[i] = build->input_primitives[build->order[i]];
+    }
+    free(build->input);
+    free(build->input_primitives);
+    free(build->boxes);
+    free(build->centroids);
+    free(build->order);
+    free(build->tasks);
+    build->input = NULL;
+    build->input_primitives = NULL;
+    build->boxes = NULL;
+    build->centroids = NULL;
+    build->order = NULL;
+    build->tasks = NULL;
+    atomic_store(&build->finished, true);
+}
+
+// Call once the triangles are set, before running the build or pushing its jobs
+void RtBuildStart(RtBuild *build, const u32 job_count, PlatformRunJob_t *run_job) {
+    atomic_store(&build->running_jobs, job_count);
+    build->run_job = run_job;
+    if(build->mesh.triangle_count == 0) {
+        atomic_store(&build->finished, true);
+        return;
+    }
+    atomic_store(&build->node_count, 1);
+    atomic_store(&build->pending_tasks, 1);
+    build->tasks[build->task_count++] = (RtBuildTask){0, 0, build->mesh.triangle_count, 0};
+}
+
+// Builds until no node is left. Any number of threads can run it at the same time.
+void RtBuildRun(RtBuild *build) {
+    if(atomic_load(&build->finished)) {
+        return;
+    }
+    for(;;) {
+        RtBuildTask task;
+        if(!RtBuildPopTask(build, &task)) {
+            if(atomic_load(&build->pending_tasks) == 0) {
+                break;
+            }
+            build->run_job(); // Someone is splitting a big node
+            continue;
+        }
+
+        u32 mid;
+        if(task.end - task.begin <= RT_PARALLEL_TRIANGLES) {
+            RtBuildSubtree(build, task);
+        } else if(RtBuildSplit(build, &task, &mid)) {
+            const u32 children = RtBuildMakeInner(build, task.node);
+            atomic_fetch_add(&build->pending_tasks, 2);
+            RtBuildPushTask(build, (RtBuildTask){children, task.begin, mid, task.depth + 1});
+            RtBuildPushTask(build, (RtBuildTask){children + 1, mid, task.end, task.depth + 1});
+        }
+
+        if(atomic_fetch_sub(&build->pending_tasks, 1) == 1) {
+            RtBuildFinalize(build);
+        }
+    }
+}
+
+// Worker thread, the build must have been started with the number of jobs pushed
+void RtBuildJob(void *data) {
+    RtBuild *build = (RtBuild *)data;
+    RtBuildRun(build);
+    atomic_fetch_sub(&build->running_jobs, 1);
+}
+
+// True once the tree is built and no job touches the build anymore
+bool RtBuildDone(RtBuild *build) {
+    return atomic_load(&build->finished) && atomic_load(&build->running_jobs) == 0;
+}
+
+// Moves the finished mesh out of the build
+void RtBuildTake(RtBuild *build, RtMesh *mesh) {
+    ASSERT(RtBuildDone(build));
+    *mesh = build->mesh;
+    build->mesh = (RtMesh){0};
+}
+
+// Frees a build that was never taken
+void RtBuildFree(RtBuild *build) {
+    free(build->input);
+    free(build->input_primitives);
+    free(build->boxes);
+    free(build->centroids);
+    free(build->order);
+    free(build->tasks);
+    RtMeshFree(&build->mesh);
+    *build = (RtBuild){0};
+}
+
+// ========================
+//
+// SINGLE RAYS
+//
+// ========================
+
+// Möller-Trumbore, returns the distance along the ray or -1
+internal f32 RtIntersectTriangle(
+    const RtTriangle *tri, const Vec3 origin, const Vec3 dir, f32 *u, f32 *v) {
+    const Vec3 p = vec3_cross(dir, tri->e2);
+    const f32 det = tri->e1.x * p.x + tri->e1.y * p.y + tri->e1.z * p.z;
+    if(fabsf(det) < RT_EPSILON) {
+        return -1.0f;
+    }
+    const f32 inv_det = 1.0f / det;
+    const Vec3 s = vec3_sub(origin, tri->v0);
+    *u = (s.x * p.x + s.y * p.y + s.z * p.z) * inv_det;
+    if(*u < 0.0f || *u > 1.0f) {
+        return -1.0f;
+    }
+    const Vec3 q = vec3_cross(s, tri->e1);
+    *v = (dir.x * q.x + dir.y * q.y + dir.z * q.z) * inv_det;
+    if(*v < 0.0f || *u + *v > 1.0f) {
+        return -1.0f;
+    }
+    const f32 t = (tri->e2.x * q.x + tri->e2.y * q.y + tri->e2.z * q.z) * inv_det;
+    return t > 0.0f ? t : -1.0f;
+}
+
+// Looks for a hit closer than hit->t, any_hit stops at the first one found. dir doesn't need to
+// be normalized, distances are in units of its length. Returns true if hit was updated.
+bool RtMeshTrace(
+    const RtMesh *mesh, const Vec3 origin, const Vec3 dir, const bool any_hit, RtHit *hit) {
+    if(mesh->node_count == 0) {
+        return false;
+    }
+    const Vec3 inv_dir = {1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z};
+
+    struct {
+        u32 node;
+        f32 t;
+    } stack[RT_STACK_SIZE];
+    u32 top = 0;
+    const f32 root_t = AabbRayEnter(&mesh->nodes[0].box, origin, inv_dir, hit->t);
+    if(root_t < 0.0f) {
+        return false;
+    }
+    stack[top].node = 0;
+    stack[top++].t = root_t;
+
+    bool found = false;
+    while(top > 0) {
+        --top;
+        if(stack[top].t > hit->t) {
+            continue;
+        }
+        const RtNode *node = &mesh->nodes[stack[top].node];
+        if(node->count > 0) {
+            for(u32 i = node->first; i < node->first + node->count; ++i) {
+                f32 u, v;
+                const f32 t = RtIntersectTriangle(&mesh->triangles[i], origin, dir, &u, &v);
+                if(t >= 0.0f && t < hit->t) {
+                    *hit = (RtHit){t, i, u, v};
+                    found = true;
+                    if(any_hit) {
+                        return true;
+                    }
+                }
+            }
+            continue;
+        }
+
+        // Visit the nearest child first
+        u32 near = node->first;
+        u32 far = node->first + 1;
+        f32 near_t = AabbRayEnter(&mesh->nodes[near].box, origin, inv_dir, hit->t);
+        f32 far_t = AabbRayEnter(&mesh->nodes[far].box, origin, inv_dir, hit->t);
+        if(far_t >= 0.0f && (near_t < 0.0f || far_t < near_t)) {
+            const u32 node_swap = near;
+            near = far;
+            far = node_swap;
+            const f32 t_swap = near_t;
+            near_t = far_t;
+            far_t = t_swap;
+        }
+        ASSERT_MSG(top + 2 <= RT_STACK_SIZE, "Mesh BVH is too deep");
+        if(far_t >= 0.0f) {
+            stack[top].node = far;
+            stack[top++].t = far_t;
+        }
+        if(near_t >= 0.0f) {
+            stack[top].node = near;
+            stack[top++].t = near_t;
+        }
+    }
+    return found;
+}
+
+// ========================
+//
+// PACKETS
+//
+// ========================
+
+// Call once the origins, directions and distances are set
+void RtPacketPrepare(RtPacket *packet, const u32 active) {
+    for(u32 i = 0; i < RT_PACKET_SIZE; ++i) {
+        packet->inv_x[i] = 1.0f / packet->dx[i];
+        packet->inv_y[i] = 1.0f / packet->dy[i];
+        packet->inv_z[i] = 1.0f / packet->dz[i];
+        packet->triangle[i] = UINT_MAX;
+    }
+    packet->active = active;
+}
+
+// Moves the rays of src by m, distances are kept since the directions aren't normalized again
+void RtPacketTransform(const RtPacket *src, const Mat4 *m, RtPacket *dst) {
+    for(u32 i = 0; i < RT_PACKET_SIZE; ++i) {
+        const Vec3 o = RtTransformPoint(m, (Vec3){src->ox[i], src->oy[i], src->oz[i]});
+        const Vec3 d = RtTransformVector(m, (Vec3){src->dx[i], src->dy[i], src->dz[i]});
+        dst->ox[i] = o.x;
+        dst->oy[i] = o.y;
+        dst->oz[i] = o.z;
+        dst->dx[i] = d.x;
+        dst->dy[i] = d.y;
+        dst->dz[i] = d.z;
+        dst->t[i] = src->t[i];
+    }
+    RtPacketPrepare(dst, src->active);
+}
+
+// Lanes entering the box before their max distance
+#if SIMD_SSE
+internal u32 RtPacketEnters(const RtPacket *p, const Aabb *box) {
+    const __m128 ox = _mm_load_ps(p->ox);
+    const __m128 oy = _mm_load_ps(p->oy);
+    const __m128 oz = _mm_load_ps(p->oz);
+    const __m128 ix = _mm_load_ps(p->inv_x);
+    const __m128 iy = _mm_load_ps(p->inv_y);
+    const __m128 iz = _mm_load_ps(p->inv_z);
+    const __m128 x0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box->min.x), ox), ix);
+    const __m128 x1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box->max.x), ox), ix);
+    const __m128 y0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box->min.y), oy), iy);
+    const __m128 y1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box->max.y), oy), iy);
+    const __m128 z0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box->min.z), oz), iz);
+    const __m128 z1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box->max.z), oz), iz);
+    __m128 enter = _mm_max_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1));
+    enter = _mm_max_ps(enter, _mm_max_ps(_mm_min_ps(z0, z1), _mm_setzero_ps()));
+    __m128 exit = _mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1));
+    exit = _mm_min_ps(exit, _mm_min_ps(_mm_max_ps(z0, z1), _mm_load_ps(p->t)));
+    return (u32)_mm_movemask_ps(_mm_cmple_ps(enter, exit)) & p->active;
+}
+#elif SIMD_NEON
+internal u32 RtPacketEnters(const RtPacket *p, const Aabb *box) {
+    const float32x4_t ix = vld1q_f32(p->inv_x);
+    const float32x4_t iy = vld1q_f32(p->inv_y);
+    const float32x4_t iz = vld1q_f32(p->inv_z);
+    const float32x4_t x0 = vmulq_f32(vsubq_f32(vdupq_n_f32(box->min.x), vld1q_f32(p->ox)), ix);
+    const float32x4_t x1 = vmulq_f32(vsubq_f32(vdupq_n_f32(box->max.x), vld1q_f32(p->ox)), ix);
+    const float32x4_t y0 = vmulq_f32(vsubq_f32(vdupq_n_f32(box->min.y), vld1q_f32(p->oy)), iy);
+    const float32x4_t y1 = vmulq_f32(vsubq_f32(vdupq_n_f32(box->max.y), vld1q_f32(p->oy)), iy);
+    const float32x4_t z0 = vmulq_f32(vsubq_f32(vdupq_n_f32(box->min.z), vld1q_f32(p->oz)), iz);
+    const float32x4_t z1 = vmulq_f32(vsubq_f32(vdupq_n_f32(box->max.z), vld1q_f32(p->oz)), iz);
+    float32x4_t enter = vmaxq_f32(vminq_f32(x0, x1), vminq_f32(y0, y1));
+    enter = vmaxq_f32(enter, vmaxq_f32(vminq_f32(z0, z1), vdupq_n_f32(0.0f)));
+    float32x4_t exit = vminq_f32(vmaxq_f32(x0, x1), vmaxq_f32(y0, y1));
+    exit = vminq_f32(exit, vminq_f32(vmaxq_f32(z0, z1), vld1q_f32(p->t)));
+    const uint32x4_t bits = {1, 2, 4, 8};
+    return vaddvq_u32(vandq_u32(vcleq_f32(enter, exit), bits)) & p->active;
+}
+#else
+internal u32 RtPacketEnters(const RtPacket *p, const Aabb *box) {
+    u32 mask = 0;
+    for(u32 i = 0; i < RT_PACKET_SIZE; ++i) {
+        const Vec3 origin = {p->ox[i], p->oy[i], p->oz[i]};
+        const Vec3 inv_dir = {p->inv_x[i], p->inv_y[i], p->inv_z[i]};
+        if(AabbRayEnter(box, origin, inv_dir, p->t[i]) >= 0.0f) {
+            mask |= 1u << i;
+        }
+    }
+    return mask & p->active;
+}
+#endif
+
+// Tests one triangle against the lanes in mask, returns the lanes it got closer for
+#if SIMD_SSE
+internal u32
+RtPacketIntersect(RtPacket *p, const RtTriangle *tri, const u32 index, const u32 mask) {
+    const __m128 dx = _mm_load_ps(p->dx);
+    const __m128 dy = _mm_load_ps(p->dy);
+    const __m128 dz = _mm_load_ps(p->dz);
+    const __m128 e1x = _mm_set1_ps(tri->e1.x);
+    const __m128 e1y = _mm_set1_ps(tri->e1.y);
+    const __m128 e1z = _mm_set1_ps(tri->e1.z);
+    const __m128 e2x = _mm_set1_ps(tri->e2.x);
+    const __m128 e2y = _mm_set1_ps(tri->e2.y);
+    const __m128 e2z = _mm_set1_ps(tri->e2.z);
+
+    // p = d x e2
+    const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    const __m128 det =
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    const __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+    // s = o - v0, q = s x e1
+    const __m128 sx = _mm_sub_ps(_mm_load_ps(p->ox), _mm_set1_ps(tri->v0.x));
+    const __m128 sy = _mm_sub_ps(_mm_load_ps(p->oy), _mm_set1_ps(tri->v0.y));
+    const __m128 sz = _mm_sub_ps(_mm_load_ps(p->oz), _mm_set1_ps(tri->v0.z));
+    const __m128 u = _mm_mul_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)),
+        inv_det);
+    const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    const __m128 v = _mm_mul_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)),
+        inv_det);
+    const __m128 t = _mm_mul_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)),
+        inv_det);
+
+    const __m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+    __m128 hit = _mm_cmpge_ps(abs_det, _mm_set1_ps(RT_EPSILON));
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(u, _mm_setzero_ps()));
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(v, _mm_setzero_ps()));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+    hit = _mm_and_ps(hit, _mm_cmpgt_ps(t, _mm_setzero_ps()));
+    hit = _mm_and_ps(hit, _mm_cmplt_ps(t, _mm_load_ps(p->t)));
+    const u32 hits = (u32)_mm_movemask_ps(hit) & mask;
+    if(hits) {
+        alignas(16) f32 hit_t[RT_PACKET_SIZE];
+        _mm_store_ps(hit_t, t);
+        for(u32 i = 0; i < RT_PACKET_SIZE; ++i) {
+            if(hits & (1u << i)) {
+                p->t[i] = hit_t[i];
+                p->triangle[i] = index;
+            }
+        }
+    }
+    return hits;
+}
+#else
+internal u32
+RtPacketIntersect(RtPacket *p, const RtTriangle *tri, const u32 index, const u32 mask) {
+    u32 hits = 0;
+    for(u32 i = 0; i < RT_PACKET_SIZE; ++i) {
+        if(!(mask & (1u << i))) {
+            continue;
+        }
+        f32 u, v;
+        const Vec3 origin = {p->ox[i], p->oy[i], p->oz[i]};
+        const Vec3 dir = {p->dx[i], p->dy[i], p->dz[i]};
+        const f32 t = RtIntersectTriangle(tri, origin, dir, &u, &v);
+        if(t >= 0.0f && t < p->t[i]) {
+            p->t[i] = t;
+            p->triangle[i] = index;
+            hits |= 1u << i;
+        }
+    }
+    return hits;
+}
+#endif
+
+// Traces the active lanes together, a node is skipped once none of them enters it. With any_hit
+// a lane stops at its first hit and is removed from packet->active.
+void RtMeshTracePacket(const RtMesh *mesh, RtPacket *packet, const bool any_hit) {
+    if(mesh->node_count == 0) {
+        return;
+    }
+    u32 stack[RT_STACK_SIZE];
+    u32 top = 0;
+    stack[top++] = 0;
+    while(top > 0 && packet->active) {
+        const RtNode *node = &mesh->nodes[stack[--top]];
+        const u32 mask = RtPacketEnters(packet, &node->box);
+        if(!mask) {
+            continue;
+        }
+        if(node->count > 0) {
+            for(u32 i = node->first; i < node->first + node->count; ++i) {
+                const u32 hits = RtPacketIntersect(packet, &mesh->triangles[i], i, mask);
+                if(any_hit) {
+                    packet->active &= ~hits;
+                }
+            }
+            continue;
+        }
+        // Order the children along the axis that separates them most, with the direction of the
+        // first lane since the packet is coherent
+        u32 lane = 0;
+        while(!(mask & (1u << lane))) {
+            ++lane;
+        }
+        const Aabb *left = &mesh->nodes[node->first].box;
+        const Aabb *right = &mesh->nodes[node->first + 1].box;
+        const Vec3 offset =
+            vec3_sub(vec3_add(right->min, right->max), vec3_add(left->min, left->max));
+        const Vec3 dir = {packet->dx[lane], packet->dy[lane], packet->dz[lane]};
+        u32 axis = fabsf(offset.x) > fabsf(offset.y) ? 0 : 1;
+        axis = fabsf(offset.z) > fabsf(RtAxis(offset, axis)) ? 2 : axis;
+        const bool left_first = (RtAxis(offset, axis) >= 0.0f) == (RtAxis(dir, axis) >= 0.0f);
+
+        ASSERT_MSG(top + 2 <= RT_STACK_SIZE, "Mesh BVH is too deep");
+        stack[top++] = left_first ? node->first + 1 : node->first;
+        stack[top++] = left_first ? node->first : node->first + 1;
+    }
+}
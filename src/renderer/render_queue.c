@@ -0,0 +1,136 @@
+#include <sl3dge-utils/sl3dge.h>
+
+// Draws of a frame as 64 bit keys, sorted so the passes come in order and each pass changes as
+// little state as possible from one draw to the next. From the most significant bits down:
+//   pass (4) | pipeline (4) | material (16) | depth bucket (16) | mesh (24)
+// Fields a pass doesn't sort on are left to 0. The sort is stable, draws with equal keys keep the
+// order they were pushed in.
+
+#define RENDER_KEY_PASS_SHIFT 60
+#define RENDER_KEY_PIPELINE_SHIFT 56
+#define RENDER_KEY_MATERIAL_SHIFT 40
+#define RENDER_KEY_DEPTH_SHIFT 24
+#define RENDER_KEY_MESH_MASK 0xFFFFFF
+
+// Fields a pass orders its draws by, besides the pass and the pipeline
+#define RENDER_SORT_MATERIAL 1
+#define RENDER_SORT_DEPTH 2
+
+typedef struct RenderDraw {
+    u64 key;
+    u32 mesh;
+    u32 primitive;
+} RenderDraw;
+
+typedef struct RenderQueue {
+    u32 count;
+    u32 capacity;
+    RenderDraw *draws;
+    RenderDraw *scratch; // Other half of the radix sort
+} RenderQueue;
+
+internal u64 RenderKey(
+    const u32 pass, const u32 pipeline, const u32 material, const u16 depth, const u32 mesh) {
+    ASSERT(pass < 16 && pipeline < 16 && material <= 0xFFFF && mesh <= RENDER_KEY_MESH_MASK);
+    return (u64)pass << RENDER_KEY_PASS_SHIFT | (u64)pipeline << RENDER_KEY_PIPELINE_SHIFT |
+           (u64)material << RENDER_KEY_MATERIAL_SHIFT | (u64)depth << RENDER_KEY_DEPTH_SHIFT |
+           mesh;
+}
+
+internal u32 RenderKeyPass(const u64 key) {
+    return (u32)(key >> RENDER_KEY_PASS_SHIFT);
+}
+
+// The bits of a positive float sort like its value, the top 16 keep about 1% of precision over
+// any range. Distances of 0 and below, the eye is inside the bounds, go first.
+internal u16 RenderDepthBucket(const f32 distance) {
+    if(!(distance > 0.0f)) {
+        return 0;
+    }
+    u32 bits;
+    memcpy(&bits, &distance, sizeof(bits));
+    return (u16)(bits >> 16);
+}
+
+internal void RenderQueueClear(RenderQueue *queue) {
+    queue->count = 0;
+}
+
+internal void
+RenderQueuePush(RenderQueue *queue, const u64 key, const u32 mesh, const u32 primitive) {
+    if(queue->count == queue->capacity) {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 256;
+        queue->draws =
+            (RenderDraw *)sRealloc(queue->draws, queue->capacity * sizeof(RenderDraw));
+        queue->scratch =
+            (RenderDraw *)sRealloc(queue->scratch, queue->capacity * sizeof(RenderDraw));
+    }
+    queue->draws[queue->count++] = (RenderDraw){key, mesh, primitive};
+}
+
+// LSD radix sort on the 8 bytes of the keys. The histograms of every byte are gathered in one
+// read, the bytes shared by every key (the pass of a single pass queue, unused fields) are
+// skipped.
+internal void RenderQueueSort(RenderQueue *queue) {
+    if(queue->count < 2) {
+        return;
+    }
+    u32 histograms[8][256] = {0};
+    for(u32 i = 0; i < queue->count; ++i) {
+        const u64 key = queue->draws[i].key;
+        for(u32 b = 0; b < 8; ++b) {
+            ++histograms[b][(key >> (b * 8)) & 0xFF];
+        }
+    }
+    for(u32 b = 0; b < 8; ++b) {
+        u32 *histogram = histograms[b];
+        const u32 shift = b * 8;
+        if(histogram[(queue->draws[0].key >> shift) & 0xFF] == queue->count) {
+            continue;
+        }
+        u32 offset = 0;
+        for(u32 v = 0; v < 256; ++v) {
+            const u32 count = histogram[v];
+            histogram[v] = offset;
+            offset += count;
+        }
+        for(u32 i = 0; i < queue->count; ++i) {
+            const RenderDraw *draw = &queue->draws[i];
+            queue->scratch[histogram[(draw->key >> shift) & 0xFF]++] = *draw;
+        }
+        RenderDraw *sorted = queue->scratch;
+        queue->scratch = queue->draws;
+        queue->draws = sorted;
+    }
+}
+
+// Draws [*first, *end) of the pass in the sorted queue
+internal void RenderQueueRange(const RenderQueue *queue, const u32 pass, u32 *first, u32 *end) {
+    u32 low = 0;
+    u32 high = queue->count;
+    while(low < high) {
+        const u32 middle = low + (high - low) / 2;
+        if(RenderKeyPass(queue->draws[middle].key) < pass) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *first = low;
+    high = queue->count;
+    while(low < high) {
+        const u32 middle = low + (high - low) / 2;
+        if(RenderKeyPass(queue->draws[middle].key) <= pass) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *end = low;
+}
+
+internal void RenderQueueFree(RenderQueue *queue) {
+    sFree(queue->draws);
+    sFree(queue->scratch);
+    *queue = (RenderQueue){0};
+}
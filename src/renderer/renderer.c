@@ -1,296 +1,2501 @@
 #include <sl3dge-utils/sl3dge.h>
 
+#include <float.h>
+
 #include "renderer/renderer.h"
+#include "renderer/handles.c"
+#include "renderer/mat4_batch.c"
+#include "renderer/culling.c"
+#include "renderer/bvh.c"
+#include "renderer/render_queue.c"
+#include "renderer/frame_graph.c"
+#include "renderer/raytrace.c"
 
 //#if defined(RENDERER_VULKAN)
 #include "renderer/vulkan/vulkan_renderer.c"
 
 //#endif
 
-void RendererLoadMaterialsAndTextures(Renderer *context, cgltf_data *data, const char *directory) {
-    // Copy material data
-    void *mapped_mat_buffer;
-    //const u32 offset = context->materials_count * sizeof(Material);
-    MapBuffer(context->device, &context->mat_buffer, &mapped_mat_buffer);
-    GLTFLoadMaterialBuffer(data, (Material *)mapped_mat_buffer);
-    UnmapBuffer(context->device, &context->mat_buffer);
+// ========================
+//
+// TEXTURES
+//
+// ========================
+
+#define HASH_SEED 0xCBF29CE484222325ull
+
+// 64bit hash, consumes 8 bytes at a time so that hashing decoded images stays cheap
+internal u64 HashBytes(u64 hash, const void *data, const u64 size) {
+    const u8 *bytes = (const u8 *)data;
+    u64 i = 0;
+    for(; i + 8 <= size; i += 8) {
+        u64 word;
+        memcpy(&word, bytes + i, sizeof(u64));
+        hash = (hash ^ word) * 0x100000001B3ull;
+        hash ^= hash >> 29;
+    }
+    for(; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
 
-    context->materials_count += data->materials_count;
+// Called from the workers, so it sticks to the C allocator
+internal u64 HashFile(PlatformAPI *platform, const char *path) {
+    i64 size = 0;
+    platform->ReadBinary(path, &size, NULL);
+    u32 *content = (u32 *)malloc((size + 3) & ~3);
+    platform->ReadBinary(path, &size, content);
+    u64 hash = HashBytes(HASH_SEED, content, size);
+    free(content);
+    return hash;
+}
 
-    sLog("Loading textures...");
-    u32 texture_start = context->textures_count;
-    context->textures_count += data->textures_count;
+// Collapses "." and ".." segments, uses '/' as the separator and lowercases everything so
+// that the same file referenced from two directories gives the same string.
+internal void NormalizePath(const char *path, char *out, const u32 out_size) {
+    u32 len = 0;
+    if(*path == '/' || *path == '\\') {
+        out[len++] = '/';
+    }
 
-    if(data->textures_count > 0) {
-        // TODO : move that elsewhere, and recreate the pipeline because we have more textures now
-        if(context->textures_count > context->textures_capacity) {
-            Image *new_buffer =
-                (Image *)sRealloc(context->textures, context->textures_count * sizeof(Image));
-            ASSERT(new_buffer);
-            context->textures = new_buffer;
+    const char *c = path;
+    while(*c) {
+        const char *end = c;
+        while(*end && *end != '/' && *end != '\\') {
+            ++end;
         }
-        Buffer *image_buffers = (Buffer *)sCalloc(data->textures_count, sizeof(Buffer));
-        VkCommandBuffer *cmds =
-            (VkCommandBuffer *)sCalloc(data->textures_count, sizeof(VkCommandBuffer));
+        const u32 segment_length = (u32)(end - c);
 
-        AllocateCommandBuffers(
-            context->device, context->graphics_command_pool, data->textures_count, cmds);
-
-        for(u32 i = 0; i < data->textures_count; ++i) {
-            u32 j = texture_start + i;
-
-            char *image_path = data->textures[i].image->uri;
-            ASSERT_MSG(image_path,
-                       "Attempting to load an embedded texture. "
-                       "This isn't supported yet");
-            char full_image_path[256] = {0};
-            strcat_s(full_image_path, 256, directory);
-            strcat_s(full_image_path, 256, image_path);
-
-            u32 w = 0;
-            u32 h = 0;
-            if(!sQueryImageSize(full_image_path, &w, &h)) {
-                sError("Unable to load image %s", image_path);
-                continue;
+        if(segment_length == 0 || (segment_length == 1 && c[0] == '.')) {
+            // Skip
+        } else if(segment_length == 2 && c[0] == '.' && c[1] == '.' && len > 0 &&
+                  !(len >= 3 && out[len - 3] == '.' && out[len - 2] == '.' &&
+                    (len == 3 || out[len - 4] == '/'))) {
+            // Pop the previous segment
+            --len;
+            while(len > 0 && out[len - 1] != '/') {
+                --len;
             }
+        } else if(len + segment_length + 1 < out_size) {
+            for(u32 i = 0; i < segment_length; ++i) {
+                char ch = c[i];
+                out[len++] = (ch >= 'A' && ch <= 'Z') ? ch - 'A' + 'a' : ch;
+            }
+            out[len++] = '/';
+        }
+        c = *end ? end + 1 : end;
+    }
+
+    if(len > 1 && out[len - 1] == '/') {
+        --len;
+    }
+    out[len] = '\0';
+}
+
+internal u32 TextureFindByFile(Renderer *renderer, const u64 file_hash, const VkFormat format) {
+    for(u32 i = 0; i < renderer->textures_count; ++i) {
+        const TextureEntry *entry = &renderer->texture_entries[i];
+        if(entry->ref_count > 0 && !entry->pending_load && entry->file_hash == file_hash &&
+           entry->format == format) {
+            return i;
+        }
+    }
+    return UINT_MAX;
+}
+
+internal u32 TextureFindByPixels(Renderer *renderer,
+                                 const u64 pixel_hash,
+                                 const VkFormat format,
+                                 const VkExtent2D extent) {
+    for(u32 i = 0; i < renderer->textures_count; ++i) {
+        const TextureEntry *entry = &renderer->texture_entries[i];
+        if(entry->ref_count > 0 && !entry->pending_load && entry->pixel_hash == pixel_hash &&
+           entry->format == format && entry->extent.width == extent.width &&
+           entry->extent.height == extent.height) {
+            return i;
+        }
+    }
+    return UINT_MAX;
+}
+
+// Returns a free slot, growing the texture arrays if needed
+internal u32 TextureAllocateSlot(Renderer *renderer) {
+    for(u32 i = 0; i < renderer->textures_count; ++i) {
+        if(renderer->texture_entries[i].ref_count == 0) {
+            return i;
+        }
+    }
+
+    if(renderer->textures_count == renderer->textures_capacity) {
+        const u32 new_capacity = renderer->textures_capacity * 2;
+        Image *new_textures = (Image *)sRealloc(renderer->textures, new_capacity * sizeof(Image));
+        ASSERT(new_textures);
+        TextureEntry *new_entries = (TextureEntry *)sRealloc(renderer->texture_entries,
+                                                             new_capacity * sizeof(TextureEntry));
+        ASSERT(new_entries);
+        memset(new_textures + renderer->textures_capacity,
+               0,
+               (new_capacity - renderer->textures_capacity) * sizeof(Image));
+        memset(new_entries + renderer->textures_capacity,
+               0,
+               (new_capacity - renderer->textures_capacity) * sizeof(TextureEntry));
+        renderer->textures = new_textures;
+        renderer->texture_entries = new_entries;
+        renderer->textures_capacity = new_capacity;
+    }
+    return renderer->textures_count++;
+}
+
+// ========================
+//
+// ATLAS
+//
+// ========================
+
+#define ATLAS_PAGE_SIZE 2048
+#define ATLAS_MAX_TEXTURE_SIZE 256 // Both sides must be at most this size to be packed
+#define ATLAS_PADDING 4
+
+internal u32 AtlasFindByFile(Renderer *renderer, const u64 file_hash, const VkFormat format) {
+    for(u32 i = 0; i < renderer->atlas_region_count; ++i) {
+        const AtlasRegion *region = &renderer->atlas_regions[i];
+        if(!region->pending_load && region->file_hash == file_hash && region->format == format) {
+            return i;
+        }
+    }
+    return UINT_MAX;
+}
+
+internal u32 AtlasFindByPixels(Renderer *renderer,
+                               const u64 pixel_hash,
+                               const VkFormat format,
+                               const VkExtent2D extent) {
+    for(u32 i = 0; i < renderer->atlas_region_count; ++i) {
+        const AtlasRegion *region = &renderer->atlas_regions[i];
+        if(!region->pending_load && region->pixel_hash == pixel_hash && region->format == format &&
+           region->extent.width == extent.width && region->extent.height == extent.height) {
+            return i;
+        }
+    }
+    return UINT_MAX;
+}
+
+// Copies the image into dst surrounded by ATLAS_PADDING pixels wrapped from the opposite side,
+// so that filtering at the edges of a repeating texture doesn't bleed its neighbours in.
+internal void AtlasCopyPadded(const u32 *src, const u32 w, const u32 h, u32 *dst) {
+    const u32 padded_width = w + 2 * ATLAS_PADDING;
+    const u32 padded_height = h + 2 * ATLAS_PADDING;
+    for(u32 y = 0; y < padded_height; ++y) {
+        const u32 src_y = (y + h * ATLAS_PADDING - ATLAS_PADDING) % h;
+        for(u32 x = 0; x < padded_width; ++x) {
+            const u32 src_x = (x + w * ATLAS_PADDING - ATLAS_PADDING) % w;
+            dst[y * padded_width + x] = src[src_y * w + src_x];
+        }
+    }
+}
+
+// Reserves a w * h rect in the page. Returns false if it doesn't fit.
+internal bool AtlasPageAllocate(AtlasPage *page, const u32 w, const u32 h, VkOffset2D *offset) {
+    u32 x = page->shelf_x;
+    u32 y = page->shelf_y;
+    u32 shelf_height = page->shelf_height;
+    if(x + w > ATLAS_PAGE_SIZE) {
+        // Open a new shelf
+        x = 0;
+        y += shelf_height;
+        shelf_height = 0;
+    }
+    if(w > ATLAS_PAGE_SIZE || y + h > ATLAS_PAGE_SIZE) {
+        return false;
+    }
+
+    *offset = (VkOffset2D){x, y};
+    page->shelf_x = x + w;
+    page->shelf_y = y;
+    page->shelf_height = h > shelf_height ? h : shelf_height;
+    page->used_pixels += w * h;
+    page->region_count++;
+    return true;
+}
+
+internal AtlasPage *AtlasAddPage(Renderer *renderer, const VkFormat format) {
+    if(renderer->atlas_page_count == renderer->atlas_page_capacity) {
+        const u32 new_capacity = renderer->atlas_page_capacity * 2;
+        AtlasPage *new_pages =
+            (AtlasPage *)sRealloc(renderer->atlas_pages, new_capacity * sizeof(AtlasPage));
+        ASSERT(new_pages);
+        renderer->atlas_pages = new_pages;
+        renderer->atlas_page_capacity = new_capacity;
+    }
+
+    const u32 slot = TextureAllocateSlot(renderer);
+    const VkExtent2D extent = {ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE};
+    CreateImage(renderer->device,
+                &renderer->memory_properties,
+                format,
+                extent,
+                VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                &renderer->textures[slot]);
+    DEBUGNameImage(renderer->device, &renderer->textures[slot], "ATLAS PAGE");
+
+    // The slot stays at a ref_count of 0 until the caller adds its first region
+    TextureEntry *entry = &renderer->texture_entries[slot];
+    *entry = (TextureEntry){0};
+    entry->format = format;
+    entry->extent = extent;
+    entry->is_atlas = true;
+
+    AtlasPage *page = &renderer->atlas_pages[renderer->atlas_page_count++];
+    *page = (AtlasPage){0};
+    page->slot = slot;
+    page->format = format;
+    return page;
+}
+
+// Packs an image padded by AtlasCopyPadded in the first page with enough room, opening a new
+// page if needed. Returns the index of the new region.
+internal u32 AtlasInsert(Renderer *renderer,
+                         VkCommandBuffer cmd,
+                         Buffer *padded_buffer,
+                         const VkFormat format,
+                         const VkExtent2D extent,
+                         const u64 path_hash,
+                         const u64 file_hash,
+                         const u64 pixel_hash) {
+    const VkExtent2D padded_extent = {extent.width + 2 * ATLAS_PADDING,
+                                      extent.height + 2 * ATLAS_PADDING};
+    VkOffset2D offset = {0};
+    AtlasPage *page = NULL;
+    for(u32 i = 0; i < renderer->atlas_page_count; ++i) {
+        if(renderer->atlas_pages[i].format == format &&
+           AtlasPageAllocate(
+               &renderer->atlas_pages[i], padded_extent.width, padded_extent.height, &offset)) {
+            page = &renderer->atlas_pages[i];
+            break;
+        }
+    }
+    if(!page) {
+        page = AtlasAddPage(renderer, format);
+        const bool fits =
+            AtlasPageAllocate(page, padded_extent.width, padded_extent.height, &offset);
+        ASSERT(fits);
+    }
+
+    CopyBufferToImageRegion(cmd,
+                            offset,
+                            padded_extent,
+                            page->written ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+                                          : VK_IMAGE_LAYOUT_UNDEFINED,
+                            padded_buffer,
+                            &renderer->textures[page->slot]);
+    page->written = true;
+
+    if(renderer->atlas_region_count == renderer->atlas_region_capacity) {
+        const u32 new_capacity = renderer->atlas_region_capacity * 2;
+        AtlasRegion *new_regions =
+            (AtlasRegion *)sRealloc(renderer->atlas_regions, new_capacity * sizeof(AtlasRegion));
+        ASSERT(new_regions);
+        renderer->atlas_regions = new_regions;
+        renderer->atlas_region_capacity = new_capacity;
+    }
+
+    const u32 id = renderer->atlas_region_count++;
+    AtlasRegion *region = &renderer->atlas_regions[id];
+    region->path_hash = path_hash;
+    region->file_hash = file_hash;
+    region->pixel_hash = pixel_hash;
+    region->format = format;
+    region->extent = extent;
+    region->slot = page->slot;
+    const f32 size = (f32)ATLAS_PAGE_SIZE;
+    region->uv_rect = (Vec4){extent.width / size,
+                             extent.height / size,
+                             (offset.x + ATLAS_PADDING) / size,
+                             (offset.y + ATLAS_PADDING) / size};
+    return id;
+}
 
-            VkDeviceSize image_size = w * h * 4;
-            VkExtent2D extent = {w, h};
-
-            VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
-            if(data->textures[i].type == cgltf_texture_type_base_color)
-                format = VK_FORMAT_R8G8B8A8_SRGB;
-
-            CreateImage(context->device,
-                        &context->memory_properties,
-                        format,
-                        extent,
-                        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                        &context->textures[j]);
-            DEBUGNameImage(context->device, &context->textures[j], data->textures[i].image->uri);
-            CreateBuffer(context->device,
-                         &context->memory_properties,
-                         image_size,
-                         VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                         &image_buffers[i]);
-
-            void *dst;
-            VkResult result = vkMapMemory(
-                context->device, image_buffers[i].memory, 0, image_buffers[i].size, 0, &dst);
-            AssertVkResult(result);
-            // Load image directly to the buffer
-            if(!sLoadImageTo(full_image_path, dst)) {
-                sError("Unable to load image %s", image_path);
+// Forgets the page and its regions, the image itself is destroyed with its texture slot
+internal void AtlasRemovePage(Renderer *renderer, const u32 slot) {
+    u32 kept = 0;
+    for(u32 i = 0; i < renderer->atlas_region_count; ++i) {
+        if(renderer->atlas_regions[i].slot != slot) {
+            renderer->atlas_regions[kept++] = renderer->atlas_regions[i];
+        }
+    }
+    renderer->atlas_region_count = kept;
+
+    for(u32 i = 0; i < renderer->atlas_page_count; ++i) {
+        if(renderer->atlas_pages[i].slot == slot) {
+            renderer->atlas_pages[i] = renderer->atlas_pages[--renderer->atlas_page_count];
+            break;
+        }
+    }
+}
+
+internal void AtlasLogOccupancy(Renderer *renderer) {
+    const f32 page_area = (f32)ATLAS_PAGE_SIZE * ATLAS_PAGE_SIZE;
+    for(u32 i = 0; i < renderer->atlas_page_count; ++i) {
+        const AtlasPage *page = &renderer->atlas_pages[i];
+        const u32 shelved = page->shelf_y + page->shelf_height;
+        sLog("Atlas page %d (slot %d) : %d textures, %.1f%% used, %d/%d rows shelved",
+             i,
+             page->slot,
+             page->region_count,
+             100.0f * page->used_pixels / page_area,
+             shelved,
+             ATLAS_PAGE_SIZE);
+    }
+}
+
+internal void RendererReleaseTexture(Renderer *renderer, const u32 slot) {
+    if(slot == UINT_MAX) {
+        return;
+    }
+    TextureEntry *entry = &renderer->texture_entries[slot];
+    ASSERT(entry->ref_count > 0);
+    entry->ref_count--;
+    if(entry->ref_count == 0) {
+        if(entry->is_atlas) {
+            AtlasRemovePage(renderer, slot);
+        }
+        DestroyImage(renderer->device, &renderer->textures[slot]);
+        renderer->textures[slot] = (Image){0};
+        *entry = (TextureEntry){0};
+    }
+}
+
+// Main thread : the loaded textures, for a load about to be queued. Those of loads still copying
+// them are left out, they can't be shared yet.
+internal TextureFile *TextureListFiles(Renderer *renderer, u32 *count) {
+    TextureFile *files = (TextureFile *)sCalloc(
+        renderer->textures_count + renderer->atlas_region_count + 1, sizeof(TextureFile));
+    u32 file_count = 0;
+    for(u32 i = 0; i < renderer->textures_count; ++i) {
+        const TextureEntry *entry = &renderer->texture_entries[i];
+        if(entry->ref_count > 0 && !entry->is_atlas && !entry->pending_load) {
+            files[file_count++] = (TextureFile){
+                entry->path_hash, entry->file_hash, entry->format, entry->extent, false};
+        }
+    }
+    for(u32 i = 0; i < renderer->atlas_region_count; ++i) {
+        const AtlasRegion *region = &renderer->atlas_regions[i];
+        if(!region->pending_load) {
+            files[file_count++] = (TextureFile){
+                region->path_hash, region->file_hash, region->format, region->extent, true};
+        }
+    }
+    *count = file_count;
+    return files;
+}
+
+// Looks the resolved path up in the textures loaded when the load was queued
+internal const TextureFile *TextureFindKnownFile(const MeshLoad *load, const u64 path_hash) {
+    for(u32 i = 0; i < load->known_file_count; ++i) {
+        if(load->known_files[i].path_hash == path_hash) {
+            return &load->known_files[i];
+        }
+    }
+    return NULL;
+}
+
+// Full path of the image of a gltf texture. Returns false for embedded images.
+internal bool TextureImagePath(const MeshLoad *load, const u32 i, char *path, const u32 size) {
+    const char *uri = load->data->textures[i].image->uri;
+    if(!uri) {
+        return false;
+    }
+    path[0] = '\0';
+    strcat_s(path, size, load->directory);
+    strcat_s(path, size, uri);
+    return true;
+}
+
+// Reads the pixels at texture->extent and hashes them for the pixel deduplication. Called from
+// the workers, so it sticks to the C allocator.
+internal bool TextureDecodePixels(Renderer *renderer, const char *path, DecodedTexture *texture) {
+    const u64 image_size = (u64)texture->extent.width * texture->extent.height * 4;
+    texture->pixels = (u32 *)malloc(image_size);
+    if(!sLoadImageTo(path, texture->pixels)) {
+        free(texture->pixels);
+        texture->pixels = NULL;
+        return false;
+    }
+    if(renderer->texture_pixel_dedup) {
+        texture->pixel_hash = HashBytes(HASH_SEED, texture->pixels, image_size);
+    }
+    return true;
+}
+
+internal bool TextureUsesAtlas(Renderer *renderer,
+                               cgltf_data *data,
+                               const u32 i,
+                               const VkExtent2D extent) {
+    return renderer->texture_atlas_enabled &&
+           data->textures[i].type == cgltf_texture_type_base_color &&
+           extent.width <= ATLAS_MAX_TEXTURE_SIZE && extent.height <= ATLAS_MAX_TEXTURE_SIZE &&
+           GLTFIsBaseColorOnly(data, i);
+}
+
+// Worker side : reads and decodes every texture of the gltf. Nothing is shared with the renderer
+// here, deduplication happens when uploading.
+internal void DecodeTextures(Renderer *renderer, const MeshLoad *load, DecodedTexture *textures) {
+    cgltf_data *data = load->data;
+    for(u32 i = 0; i < data->textures_count; ++i) {
+        DecodedTexture *texture = &textures[i];
+
+        char full_image_path[256];
+        if(!TextureImagePath(load, i, full_image_path, ARRAY_SIZE(full_image_path))) {
+            sError("Attempting to load an embedded texture. This isn't supported yet");
+            continue;
+        }
+        char resolved_path[256];
+        NormalizePath(full_image_path, resolved_path, ARRAY_SIZE(resolved_path));
+
+        texture->format = VK_FORMAT_R8G8B8A8_UNORM;
+        if(data->textures[i].type == cgltf_texture_type_base_color)
+            texture->format = VK_FORMAT_R8G8B8A8_SRGB;
+        texture->path_hash = HashBytes(HASH_SEED, resolved_path, strlen(resolved_path));
+
+        // A loaded file is neither hashed again nor decoded if it is shared as it is
+        const TextureFile *known = TextureFindKnownFile(load, texture->path_hash);
+        if(known && known->format == texture->format &&
+           known->in_atlas == TextureUsesAtlas(renderer, data, i, known->extent)) {
+            texture->extent = known->extent;
+            texture->use_atlas = known->in_atlas;
+            texture->file_hash = known->file_hash;
+            texture->known = true;
+            continue;
+        }
+
+        u32 w = 0;
+        u32 h = 0;
+        if(!sQueryImageSize(full_image_path, &w, &h)) {
+            sError("Unable to load image %s", full_image_path);
+            continue;
+        }
+        texture->extent = (VkExtent2D){w, h};
+        texture->use_atlas = TextureUsesAtlas(renderer, data, i, texture->extent);
+        texture->file_hash =
+            known ? known->file_hash : HashFile(renderer->platform, full_image_path);
+        if(!TextureDecodePixels(renderer, full_image_path, texture)) {
+            sError("Unable to load image %s", full_image_path);
+        }
+    }
+}
+
+// Returns a slot in the list of buffers destroyed when the load completes
+internal Buffer *MeshLoadPushBuffer(MeshLoad *load) {
+    if(load->staging_count == load->staging_capacity) {
+        load->staging_capacity = load->staging_capacity ? load->staging_capacity * 2 : 8;
+        Buffer *new_buffers =
+            (Buffer *)sRealloc(load->staging_buffers, load->staging_capacity * sizeof(Buffer));
+        ASSERT(new_buffers);
+        load->staging_buffers = new_buffers;
+    }
+    return &load->staging_buffers[load->staging_count++];
+}
+
+// Returns a new staging buffer, destroyed when the load completes
+internal Buffer *MeshLoadAddStaging(Renderer *renderer, MeshLoad *load, const VkDeviceSize size) {
+    Buffer *buffer = MeshLoadPushBuffer(load);
+    CreateBuffer(renderer->device,
+                 &renderer->memory_properties,
+                 size,
+                 VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 buffer);
+    return buffer;
+}
+
+// Grows the BLAS scratch buffer to at least size. The previous one may still be used by the
+// builds of other loads : it is destroyed with this load, whose fence comes after theirs.
+internal void MeshLoadReserveScratch(Renderer *renderer, MeshLoad *load, const VkDeviceSize size) {
+    if(renderer->accel_scratch.size >= size) {
+        return;
+    }
+    if(renderer->accel_scratch.size > 0) {
+        *MeshLoadPushBuffer(load) = renderer->accel_scratch;
+    }
+    CreateBuffer(renderer->device,
+                 &renderer->memory_properties,
+                 size,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 &renderer->accel_scratch);
+    DEBUGNameBuffer(renderer->device, &renderer->accel_scratch, "BLAS Scratch");
+}
+
+// Fills mesh->textures with the renderer slot of each gltf texture. Textures that are already
+// loaded (same file contents, or same pixels) are shared instead of being uploaded again, those
+// of loads still copying them are uploaded again.
+// Small base color textures are packed in atlas pages, mesh->texture_rects holds where.
+// New images are copied on the transfer queue, atlas pages are written on the graphics queue as
+// they may already be sampled by the frames in flight.
+internal void RendererUploadTextures(Renderer *context, MeshLoad *load) {
+    cgltf_data *data = load->data;
+    Mesh *mesh = load->mesh;
+    mesh->texture_count = data->textures_count;
+    mesh->textures = (u32 *)sCalloc(data->textures_count, sizeof(u32));
+    mesh->texture_rects = (Vec4 *)sCalloc(data->textures_count, sizeof(Vec4));
+
+    u32 upload_count = 0;
+    u32 shared_count = 0;
+    u32 atlas_count = 0;
+
+    for(u32 i = 0; i < data->textures_count; ++i) {
+        DecodedTexture *texture = &load->textures[i];
+        mesh->textures[i] = UINT_MAX;
+        mesh->texture_rects[i] = (Vec4){1.0f, 1.0f, 0.0f, 0.0f};
+        if(!texture->pixels && !texture->known) {
+            continue;
+        }
+
+        // Same file, or different file but the same pixels, already uploaded
+        u32 slot = UINT_MAX;
+        if(texture->use_atlas) {
+            u32 region = AtlasFindByFile(context, texture->file_hash, texture->format);
+            if(region == UINT_MAX && context->texture_pixel_dedup && texture->pixels) {
+                region = AtlasFindByPixels(
+                    context, texture->pixel_hash, texture->format, texture->extent);
+            }
+            if(region != UINT_MAX) {
+                slot = context->atlas_regions[region].slot;
+                mesh->texture_rects[i] = context->atlas_regions[region].uv_rect;
+            }
+        } else {
+            slot = TextureFindByFile(context, texture->file_hash, texture->format);
+            if(slot == UINT_MAX && context->texture_pixel_dedup && texture->pixels) {
+                slot = TextureFindByPixels(
+                    context, texture->pixel_hash, texture->format, texture->extent);
+            }
+        }
+        if(slot != UINT_MAX) {
+            context->texture_entries[slot].ref_count++;
+            mesh->textures[i] = slot;
+            shared_count++;
+            continue;
+        }
+        // The known texture was released since the load was queued, decode it after all
+        if(!texture->pixels) {
+            char path[256];
+            TextureImagePath(load, i, path, ARRAY_SIZE(path));
+            if(!TextureDecodePixels(context, path, texture)) {
+                sError("Unable to load image %s", path);
                 continue;
             }
-            vkUnmapMemory(context->device, image_buffers[i].memory);
+        }
 
-            BeginCommandBuffer(cmds[i], VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
-            CopyBufferToImage(cmds[i], extent, &image_buffers[i], &context->textures[i]);
-            vkEndCommandBuffer(cmds[i]);
-            VkSubmitInfo si = {
-                VK_STRUCTURE_TYPE_SUBMIT_INFO, NULL, 0, NULL, 0, 1, &cmds[i], 0, NULL};
-            vkQueueSubmit(context->graphics_queue, 1, &si, VK_NULL_HANDLE);
+        const u32 w = texture->extent.width;
+        const u32 h = texture->extent.height;
+
+        if(texture->use_atlas) {
+            Buffer *staging = MeshLoadAddStaging(
+                context, load, (w + 2 * ATLAS_PADDING) * (h + 2 * ATLAS_PADDING) * 4);
+            void *padded;
+            MapBuffer(context->device, staging, &padded);
+            AtlasCopyPadded(texture->pixels, w, h, (u32 *)padded);
+            UnmapBuffer(context->device, staging);
+
+            const u32 region = AtlasInsert(context,
+                                           load->graphics_cmd,
+                                           staging,
+                                           texture->format,
+                                           texture->extent,
+                                           texture->path_hash,
+                                           texture->file_hash,
+                                           texture->pixel_hash);
+            context->atlas_regions[region].pending_load = load;
+            slot = context->atlas_regions[region].slot;
+            mesh->texture_rects[i] = context->atlas_regions[region].uv_rect;
+            context->texture_entries[slot].ref_count++;
+            mesh->textures[i] = slot;
+            atlas_count++;
+            continue;
         }
-        vkQueueWaitIdle(context->graphics_queue);
 
-        DestroyRenderGroup(context, &context->main_render_group);
-        CreateMainRenderGroup(context, &context->main_render_group);
-        VulkanUpdateTextureDescriptorSet(context->device,
-                                         context->main_render_group.descriptor_sets[0],
-                                         context->texture_sampler,
-                                         context->textures_count,
-                                         context->textures);
+        Buffer *staging = MeshLoadAddStaging(context, load, w * h * 4);
+        UploadToBuffer(context->device, staging, texture->pixels, w * h * 4);
 
-        vkFreeCommandBuffers(
-            context->device, context->graphics_command_pool, data->textures_count, cmds);
-        sFree(cmds);
-        for(u32 i = 0; i < data->textures_count; ++i) {
-            DestroyBuffer(context->device, &image_buffers[i]);
+        slot = TextureAllocateSlot(context);
+        CreateImage(context->device,
+                    &context->memory_properties,
+                    texture->format,
+                    texture->extent,
+                    VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    &context->textures[slot]);
+        DEBUGNameImage(context->device, &context->textures[slot], data->textures[i].image->uri);
+
+        TextureEntry *entry = &context->texture_entries[slot];
+        entry->path_hash = texture->path_hash;
+        entry->file_hash = texture->file_hash;
+        entry->pixel_hash = texture->pixel_hash;
+        entry->format = texture->format;
+        entry->extent = texture->extent;
+        entry->ref_count = 1;
+        entry->pending_load = load;
+
+        CopyBufferToImageAcrossQueues(load->transfer_cmd,
+                                      load->graphics_cmd,
+                                      context->transfer_queue_id,
+                                      context->graphics_queue_id,
+                                      texture->extent,
+                                      staging,
+                                      &context->textures[slot]);
+        mesh->textures[i] = slot;
+        upload_count++;
+    }
+
+    sLog("%d textures uploaded, %d packed in the atlas, %d shared with already loaded meshes",
+         upload_count,
+         atlas_count,
+         shared_count);
+    if(atlas_count > 0) {
+        AtlasLogOccupancy(context);
+    }
+}
+
+// The copies of the load are done, its new textures and atlas regions can be shared
+internal void TextureClearPending(Renderer *renderer, const MeshLoad *load) {
+    for(u32 i = 0; i < renderer->textures_count; ++i) {
+        if(renderer->texture_entries[i].pending_load == load) {
+            renderer->texture_entries[i].pending_load = NULL;
+        }
+    }
+    for(u32 i = 0; i < renderer->atlas_region_count; ++i) {
+        if(renderer->atlas_regions[i].pending_load == load) {
+            renderer->atlas_regions[i].pending_load = NULL;
         }
-        sFree(image_buffers);
     }
 }
 
-u32 RendererLoadMesh(Renderer *renderer, const char *path) {
-    sLog("Loading Mesh...");
-    Mesh *mesh = (Mesh *)sMalloc(sizeof(Mesh));
-    *mesh = (Mesh){0};
-    renderer->mesh_count++;
+// Rebuilds the main render group if the texture array grew, and rewrites the texture descriptors
+internal void RendererUpdateTextureDescriptors(Renderer *renderer) {
+    if(renderer->textures_count > renderer->bound_textures_count) {
+        DestroyRenderGroup(renderer, &renderer->main_render_group);
+        CreateMainRenderGroup(renderer, &renderer->main_render_group);
+    }
+    VulkanUpdateTextureDescriptorSet(renderer->device,
+                                     renderer->main_render_group.descriptor_sets[0],
+                                     renderer->texture_sampler,
+                                     renderer->textures_count,
+                                     renderer->textures,
+                                     &renderer->fallback_texture);
+}
 
-    char directory[64] = {0};
-    const char *last_sep = strrchr(path, '/');
-    u32 size = last_sep - path;
-    strncpy_s(directory, ARRAY_SIZE(directory), path, size);
-    directory[size] = '/';
-    directory[size + 1] = '\0';
+// ========================
+//
+// MATERIALS
+//
+// ========================
 
-    cgltf_data *data;
-    cgltf_options options = {0};
-    cgltf_result result = cgltf_parse_file(&options, path, &data);
-    if(result != cgltf_result_success) {
-        sError("Error reading mesh");
-        ASSERT(0);
+internal bool MaterialEquals(const Material *a, const Material *b) {
+    return a->base_color.x == b->base_color.x && a->base_color.y == b->base_color.y &&
+           a->base_color.z == b->base_color.z && a->base_color_texture == b->base_color_texture &&
+           a->metallic_roughness_texture == b->metallic_roughness_texture &&
+           a->metallic_factor == b->metallic_factor &&
+           a->roughness_factor == b->roughness_factor &&
+           a->normal_texture == b->normal_texture && a->ao_texture == b->ao_texture &&
+           a->emissive_texture == b->emissive_texture &&
+           a->base_color_uv.x == b->base_color_uv.x && a->base_color_uv.y == b->base_color_uv.y &&
+           a->base_color_uv.z == b->base_color_uv.z && a->base_color_uv.w == b->base_color_uv.w;
+}
+
+internal u32 FindMaterial(const Material *materials, const u32 count, const Material *material) {
+    for(u32 i = 0; i < count; ++i) {
+        if(MaterialEquals(&materials[i], material)) {
+            return i;
+        }
     }
+    return UINT_MAX;
+}
 
-    cgltf_load_buffers(&options, data, path);
+// Reallocates the material buffer with at least min_capacity entries, the current materials are
+// copied on the gpu.
+internal void RendererGrowMaterialBuffer(Renderer *renderer, const u32 min_capacity) {
+    u32 new_capacity = renderer->materials_capacity;
+    while(new_capacity < min_capacity) {
+        new_capacity *= 2;
+    }
+    sLog("Resizing material buffer from %d to %d", renderer->materials_capacity, new_capacity);
 
-    // Transforms
-    mesh->primitive_nodes_count = data->nodes_count;
-    mesh->primitive_transforms = (Mat4 *)sCalloc(mesh->primitive_nodes_count, sizeof(Mat4));
-    GLTFLoadTransforms(data, mesh->primitive_transforms);
+    Material *new_materials =
+        (Material *)sRealloc(renderer->materials, new_capacity * sizeof(Material));
+    ASSERT_MSG(new_materials, "Unable to size up the material array");
+    renderer->materials = new_materials;
+
+    Buffer new_buffer;
+    CreateBuffer(renderer->device,
+                 &renderer->memory_properties,
+                 new_capacity * sizeof(Material),
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 &new_buffer);
+    DEBUGNameBuffer(renderer->device, &new_buffer, "SCENE MATS");
+
+    VkCommandBuffer cmd;
+    AllocateAndBeginCommandBuffer(renderer->device, renderer->graphics_command_pool, &cmd);
+    VkBufferCopy region = {0, 0, renderer->materials_count * sizeof(Material)};
+    vkCmdCopyBuffer(cmd, renderer->mat_buffer.buffer, new_buffer.buffer, 1, &region);
+    EndAndExecuteCommandBuffer(
+        renderer->device, renderer->graphics_queue, renderer->graphics_command_pool, cmd);
+
+    DestroyBuffer(renderer->device, &renderer->mat_buffer);
+    renderer->mat_buffer = new_buffer;
+    renderer->materials_capacity = new_capacity;
+
+    VulkanUpdateMaterialDescriptorSet(
+        renderer->device, renderer->main_render_group.descriptor_sets[0], &renderer->mat_buffer);
+}
+
+// Appends the materials of the gltf that aren't known yet, and fills material_map with the
+// renderer material id of each gltf material.
+internal void RendererLoadMaterials(Renderer *renderer,
+                                    cgltf_data *data,
+                                    const u32 *texture_map,
+                                    const Vec4 *texture_rects,
+                                    u32 *material_map) {
+    if(data->materials_count == 0) {
+        return;
+    }
+
+    Material *materials = (Material *)sCalloc(data->materials_count, sizeof(Material));
+    GLTFLoadMaterialBuffer(data, texture_map, texture_rects, materials);
+
+    // Compact the new materials at the start of the array
+    const u32 first_new = renderer->materials_count;
+    u32 new_count = 0;
+    for(u32 i = 0; i < data->materials_count; ++i) {
+        u32 id = FindMaterial(renderer->materials, renderer->materials_count, &materials[i]);
+        if(id == UINT_MAX) {
+            id = FindMaterial(materials, new_count, &materials[i]);
+            if(id == UINT_MAX) {
+                materials[new_count] = materials[i];
+                id = new_count++;
+            }
+            id += first_new;
+        }
+        material_map[i] = id;
+    }
+
+    sLog("%d materials added, %d shared",
+         new_count,
+         (u32)data->materials_count - new_count);
+
+    if(new_count > 0) {
+        if(first_new + new_count > renderer->materials_capacity) {
+            RendererGrowMaterialBuffer(renderer, first_new + new_count);
+        }
+        memcpy(&renderer->materials[first_new], materials, new_count * sizeof(Material));
+        renderer->materials_count += new_count;
+
+        UploadToDeviceBuffer(renderer->device,
+                             &renderer->memory_properties,
+                             renderer->graphics_command_pool,
+                             renderer->graphics_queue,
+                             &renderer->mat_buffer,
+                             first_new * sizeof(Material),
+                             materials,
+                             new_count * sizeof(Material));
+    }
+    sFree(materials);
+}
+
+// ========================
+//
+// MESHES
+//
+// ========================
+
+// Worker side : gives the triangles to the trace build, in mesh space like the instance bounds.
+// The tree itself is built by jobs pushed from the main thread with the uploads.
+internal void MeshLoadPrepareTrace(MeshLoad *load) {
+    cgltf_data *data = load->data;
+    Mat4 *node_transforms = (Mat4 *)malloc(data->nodes_count * sizeof(Mat4));
+    GLTFLoadTransforms(data, node_transforms);
+
+    const u32 *indices = (u32 *)((Vertex *)load->geometry + load->vertex_count);
+    const bool allocated = RtBuildInit(&load->trace_build, load->index_count / 3);
+    ASSERT_MSG(allocated, "Unable to allocate the mesh BVH");
+
+    u32 triangle = 0;
+    for(u32 p = 0; p < load->primitive_count; ++p) {
+        const Primitive *primitive = &load->primitives[p];
+        const Vertex *vertices = (Vertex *)load->geometry + primitive->vertex_offset;
+        const Mat4 identity = mat4_identity();
+        const bool has_node = primitive->node_id < data->nodes_count;
+        const Mat4 *m = has_node ? &node_transforms[primitive->node_id] : &identity;
+        for(u32 i = 0; i + 2 < primitive->index_count; i += 3) {
+            Vec3 corners[3];
+            for(u32 k = 0; k < 3; ++k) {
+                corners[k] =
+                    RtTransformPoint(m, vertices[indices[primitive->index_offset + i + k]].pos);
+            }
+            RtBuildSetTriangle(
+                &load->trace_build, triangle++, corners[0], corners[1], corners[2], p);
+        }
+    }
+    load->trace_build.mesh.triangle_count = triangle;
+    free(node_transforms);
+}
+
+// Worker side : parses the gltf, builds the geometry and decodes the textures.
+// Workers stick to the C allocator, the sl3dge allocators are only used from the main thread.
+internal void MeshLoadJob(void *job_data) {
+    MeshLoad *load = (MeshLoad *)job_data;
+
+    cgltf_options options = {0};
+    cgltf_result result = cgltf_parse_file(&options, load->path, &load->data);
+    if(result == cgltf_result_success) {
+        result = cgltf_load_buffers(&options, load->data, load->path);
+    }
+    if(result != cgltf_result_success) {
+        sError("Error reading mesh %s", load->path);
+        atomic_store(&load->state, MESH_LOAD_FAILED);
+        return;
+    }
+    cgltf_data *data = load->data;
 
     // Primitives
-    mesh->total_primitives_count = 0;
+    load->primitive_count = 0;
     for(u32 m = 0; m < data->meshes_count; ++m) {
-        mesh->total_primitives_count += data->meshes[m].primitives_count;
+        load->primitive_count += data->meshes[m].primitives_count;
     };
-    mesh->primitives = (Primitive *)sCalloc(mesh->total_primitives_count, sizeof(Primitive));
+    load->primitives = (Primitive *)calloc(load->primitive_count, sizeof(Primitive));
 
     u32 i = 0;
     for(u32 m = 0; m < data->meshes_count; ++m) {
         for(u32 p = 0; p < data->meshes[m].primitives_count; p++) {
             cgltf_primitive *prim = &data->meshes[m].primitives[p];
 
-            Primitive *primitive = &mesh->primitives[i];
+            Primitive *primitive = &load->primitives[i];
 
             primitive->vertex_count = (u32)prim->attributes[0].data->count;
-            primitive->vertex_offset = mesh->total_vertex_count;
-            mesh->total_vertex_count += (u32)prim->attributes[0].data->count;
+            primitive->vertex_offset = load->vertex_count;
+            load->vertex_count += (u32)prim->attributes[0].data->count;
 
             primitive->index_count += prim->indices->count;
-            primitive->index_offset = mesh->total_index_count;
-            mesh->total_index_count += (u32)prim->indices->count;
+            primitive->index_offset = load->index_count;
+            load->index_count += (u32)prim->indices->count;
 
-            primitive->material_id = GLTFGetMaterialID(prim->material) + renderer->materials_count;
+            // gltf local for now, remapped once the materials are loaded
+            primitive->material_id = GLTFGetMaterialID(prim->material);
 
             ++i;
         }
     }
-    mesh->all_index_offset = mesh->total_vertex_count * sizeof(Vertex);
-    const u32 buffer_size =
-        mesh->total_vertex_count * sizeof(Vertex) + mesh->total_index_count * sizeof(u32);
-
-    // TODO : Move that into something like this : RendererLoadGLTF(renderer, data);
-    {
-        // Vertex & Index Buffer
-        mesh->buffer = (Buffer *)sMalloc(sizeof(Buffer));
-        CreateBuffer(renderer->device,
-                     &renderer->memory_properties,
-                     buffer_size,
-                     VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
-                         VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR |
-                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                     mesh->buffer);
-        DEBUGNameBuffer(renderer->device, mesh->buffer, "GLTF VTX/IDX");
-
-        void *mapped_buffer;
-        MapBuffer(renderer->device, mesh->buffer, &mapped_buffer);
-        i = 0;
-        for(u32 m = 0; m < data->meshes_count; ++m) {
-            for(u32 p = 0; p < data->meshes[m].primitives_count; ++p) {
-                GLTFLoadVertexAndIndexBuffer(&data->meshes[m].primitives[p],
-                                             &mesh->primitives[i],
-                                             mesh->total_vertex_count * sizeof(Vertex),
-                                             mapped_buffer);
-                ++i;
-            }
+
+    // Vertex & Index Buffer
+    load->geometry_size = load->vertex_count * sizeof(Vertex) + load->index_count * sizeof(u32);
+    load->geometry = malloc(load->geometry_size);
+    i = 0;
+    for(u32 m = 0; m < data->meshes_count; ++m) {
+        for(u32 p = 0; p < data->meshes[m].primitives_count; ++p) {
+            GLTFLoadVertexAndIndexBuffer(&data->meshes[m].primitives[p],
+                                         &load->primitives[i],
+                                         load->vertex_count * sizeof(Vertex),
+                                         load->geometry);
+            ++i;
         }
-        UnmapBuffer(renderer->device, mesh->buffer);
+    }
 
-        // Materials
-        RendererLoadMaterialsAndTextures(renderer, data, directory);
+    // Bounding spheres around the box of each primitive
+    for(u32 p = 0; p < load->primitive_count; ++p) {
+        Primitive *primitive = &load->primitives[p];
+        const Vertex *vertices = (Vertex *)load->geometry + primitive->vertex_offset;
+        Vec3 min = {FLT_MAX, FLT_MAX, FLT_MAX};
+        Vec3 max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+        for(u32 v = 0; v < primitive->vertex_count; ++v) {
+            const Vec3 pos = vertices[v].pos;
+            min = (Vec3){fminf(min.x, pos.x), fminf(min.y, pos.y), fminf(min.z, pos.z)};
+            max = (Vec3){fmaxf(max.x, pos.x), fmaxf(max.y, pos.y), fmaxf(max.z, pos.z)};
+        }
+        if(primitive->vertex_count == 0) {
+            min = max = (Vec3){0.0f, 0.0f, 0.0f};
+        }
+        primitive->bounds_center = vec3_fmul(vec3_add(min, max), 0.5f);
+        primitive->bounds_radius = vec3_length(vec3_sub(max, primitive->bounds_center));
     }
-    mesh->instance_capacity = 1;
-    mesh->instance_transforms = (Mat4 *)sCalloc(1, sizeof(Mat4));
 
-    cgltf_free(data);
+    MeshLoadPrepareTrace(load);
 
-    // TEMP: hardcoded mesh id
-    renderer->meshes[0] = mesh;
-    sLog("Loading done");
-    return 0;
+    // Textures
+    load->textures = (DecodedTexture *)calloc(data->textures_count, sizeof(DecodedTexture));
+    DecodeTextures(load->renderer, load, load->textures);
+
+    atomic_store(&load->state, MESH_LOAD_DECODED);
 }
 
-void RendererDestroyMesh(Renderer *renderer, u32 id) {
-    Mesh *mesh = renderer->meshes[id];
+// Main thread : creates the gpu resources and submits the copies
+internal void MeshLoadRecordUploads(Renderer *renderer, MeshLoad *load) {
+    cgltf_data *data = load->data;
 
-    sFree(mesh->primitives);
+    Mesh *mesh = (Mesh *)sCalloc(1, sizeof(Mesh));
+    load->mesh = mesh;
 
-    sFree(mesh->instance_transforms);
+    // Transforms
+    mesh->primitive_nodes_count = data->nodes_count;
+    mesh->primitive_transforms = (Mat4 *)sCalloc(mesh->primitive_nodes_count, sizeof(Mat4));
+    GLTFLoadTransforms(data, mesh->primitive_transforms);
 
-    DestroyBuffer(renderer->device, mesh->buffer);
-    sFree(mesh->buffer);
+    // Primitives
+    mesh->total_primitives_count = load->primitive_count;
+    mesh->primitives = (Primitive *)sCalloc(mesh->total_primitives_count, sizeof(Primitive));
+    memcpy(mesh->primitives, load->primitives, load->primitive_count * sizeof(Primitive));
+    mesh->total_vertex_count = load->vertex_count;
+    mesh->total_index_count = load->index_count;
+    mesh->all_index_offset = mesh->total_vertex_count * sizeof(Vertex);
 
-    sFree(mesh->primitive_transforms);
-    sFree(mesh);
-}
+    AllocateCommandBuffers(
+        renderer->device, renderer->transfer_command_pool, 1, &load->transfer_cmd);
+    BeginCommandBuffer(load->transfer_cmd, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    AllocateCommandBuffers(
+        renderer->device, renderer->graphics_command_pool, 1, &load->graphics_cmd);
+    BeginCommandBuffer(load->graphics_cmd, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
 
-void RendererDrawMesh(Frame *frame,
-                      Mesh *mesh,
-                      const u32 instance_count,
-                      const Mat4 *instance_transforms) {
-    VkDeviceSize offset = 0;
-    vkCmdBindVertexBuffers(frame->cmd, 0, 1, &mesh->buffer->buffer, &offset);
-    vkCmdBindIndexBuffer(
-        frame->cmd, mesh->buffer->buffer, mesh->all_index_offset, VK_INDEX_TYPE_UINT32);
+    // Vertex & Index Buffer
+    mesh->buffer = (Buffer *)sMalloc(sizeof(Buffer));
+    CreateBuffer(renderer->device,
+                 &renderer->memory_properties,
+                 load->geometry_size,
+                 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+                     VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR |
+                     VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 mesh->buffer);
+    DEBUGNameBuffer(renderer->device, mesh->buffer, "GLTF VTX/IDX");
 
-    u32 primitive_count = mesh->total_primitives_count;
+    Buffer *staging = MeshLoadAddStaging(renderer, load, load->geometry_size);
+    UploadToBuffer(renderer->device, staging, load->geometry, load->geometry_size);
+    CopyBufferAcrossQueues(load->transfer_cmd,
+                           load->graphics_cmd,
+                           renderer->transfer_queue_id,
+                           renderer->graphics_queue_id,
+                           staging,
+                           mesh->buffer,
+                           load->geometry_size,
+                           VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+                               VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                           VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT |
+                               VK_ACCESS_SHADER_READ_BIT);
 
-    for(u32 i = 0; i < instance_count; i++) {
-        for(u32 p = 0; p < primitive_count; p++) {
-            const Primitive *prim = &mesh->primitives[p];
+    // All the BLAS of the mesh in one go, compacted once the fence is signaled
+    if(mesh->total_primitives_count > 0) {
+        const VkDeviceSize scratch_size = BlasBatchPrepare(renderer, &load->blas_batch, mesh);
+        MeshLoadReserveScratch(renderer, load, scratch_size);
+        BlasBatchRecord(&load->blas_batch, load->graphics_cmd, &renderer->accel_scratch);
+    }
 
-            Mat4 mat =
-                mat4_mul(&instance_transforms[i], &mesh->primitive_transforms[prim->node_id]);
-            PushConstant push = {mat, prim->material_id};
-            vkCmdPushConstants(frame->cmd,
-                               frame->layout,
-                               VK_SHADER_STAGE_VERTEX_BIT,
-                               0,
-                               sizeof(PushConstant),
-                               &push);
-            vkCmdDrawIndexed(
-                frame->cmd, prim->index_count, 1, prim->index_offset, prim->vertex_offset, 0);
-        }
+    RendererUploadTextures(renderer, load);
+
+    // Small meshes are built by a single job
+    const u32 trace_jobs = load->trace_build.mesh.triangle_count > RT_PARALLEL_TRIANGLES
+                               ? renderer->trace_job_count
+                               : 1;
+    RtBuildStart(&load->trace_build, trace_jobs, renderer->platform->RunJob);
+    for(u32 i = 0; i < trace_jobs; ++i) {
+        renderer->platform->PushJob(&RtBuildJob, &load->trace_build);
     }
+
+    AssertVkResult(vkEndCommandBuffer(load->transfer_cmd));
+    AssertVkResult(vkEndCommandBuffer(load->graphics_cmd));
+
+    VkSemaphoreCreateInfo semaphore_ci = {0};
+    semaphore_ci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    AssertVkResult(vkCreateSemaphore(renderer->device, &semaphore_ci, NULL, &load->transfer_done));
+    VkFenceCreateInfo fence_ci = {0};
+    fence_ci.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    AssertVkResult(vkCreateFence(renderer->device, &fence_ci, NULL, &load->fence));
+
+    VkSubmitInfo transfer_submit = {0};
+    transfer_submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    transfer_submit.commandBufferCount = 1;
+    transfer_submit.pCommandBuffers = &load->transfer_cmd;
+    transfer_submit.signalSemaphoreCount = 1;
+    transfer_submit.pSignalSemaphores = &load->transfer_done;
+    AssertVkResult(vkQueueSubmit(renderer->transfer_queue, 1, &transfer_submit, VK_NULL_HANDLE));
+
+    const VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    VkSubmitInfo graphics_submit = {0};
+    graphics_submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    graphics_submit.waitSemaphoreCount = 1;
+    graphics_submit.pWaitSemaphores = &load->transfer_done;
+    graphics_submit.pWaitDstStageMask = &wait_stage;
+    graphics_submit.commandBufferCount = 1;
+    graphics_submit.pCommandBuffers = &load->graphics_cmd;
+    AssertVkResult(vkQueueSubmit(renderer->graphics_queue, 1, &graphics_submit, load->fence));
+
+    atomic_store(&load->state, MESH_LOAD_UPLOADING);
 }
 
-MeshInstance RendererInstantiateMesh(Renderer *renderer, u32 mesh_id) {
-    MeshInstance result = {0};
+// Frees everything the load owns. The mesh is freed too if it wasn't published.
+internal void MeshLoadRelease(Renderer *renderer, MeshLoad *load) {
+    for(u32 i = 0; i < load->staging_count; ++i) {
+        DestroyBuffer(renderer->device, &load->staging_buffers[i]);
+    }
+    sFree(load->staging_buffers);
+    if(load->transfer_cmd) {
+        vkFreeCommandBuffers(
+            renderer->device, renderer->transfer_command_pool, 1, &load->transfer_cmd);
+    }
+    if(load->graphics_cmd) {
+        vkFreeCommandBuffers(
+            renderer->device, renderer->graphics_command_pool, 1, &load->graphics_cmd);
+    }
+    if(load->compact_cmd) {
+        vkFreeCommandBuffers(
+            renderer->device, renderer->graphics_command_pool, 1, &load->compact_cmd);
+    }
+    BlasBatchFree(renderer, &load->blas_batch);
+    vkDestroySemaphore(renderer->device, load->transfer_done, NULL);
+    vkDestroyFence(renderer->device, load->fence, NULL);
 
-    Mesh *mesh = renderer->meshes[mesh_id];
-    if(mesh->instance_count == mesh->instance_capacity) {
-        // Resize the buffer
-        u32 new_capacity = mesh->instance_capacity * 2;
-        sLog("Resizing mesh buffer from %d to %d", mesh->instance_capacity, new_capacity);
-        Mat4 *new_buffer = (Mat4 *)sRealloc(mesh->instance_transforms, new_capacity * sizeof(Mat4));
-        ASSERT_MSG(new_buffer, "Unable to size up the instance buffer");
-        mesh->instance_transforms = new_buffer;
-        mesh->instance_capacity = new_capacity;
+    if(load->textures) {
+        for(u32 i = 0; i < load->data->textures_count; ++i) {
+            free(load->textures[i].pixels);
+        }
+        free(load->textures);
+    }
+    sFree(load->known_files);
+    RtBuildFree(&load->trace_build);
+    free(load->geometry);
+    free(load->primitives);
+    if(load->data) {
+        cgltf_free(load->data);
     }
-    u32 instance_id = mesh->instance_count++;
-    mesh->instance_transforms[instance_id] = mat4_identity();
-    result.transform = &mesh->instance_transforms[instance_id];
-    mat4_translate(&mesh->instance_transforms[instance_id],
-                   (Vec3){(f32)instance_id * 20.f, 0.f, 0.f});
-    return result;
 }
 
-void RendererSetCamera(Renderer *renderer, const Vec3 position, const Vec3 forward, const Vec3 up) {
-    renderer->camera_info.pos = position;
-    renderer->camera_info.view = mat4_look_at(vec3_add(position, forward), position, up);
-    mat4_inverse(&renderer->camera_info.view, &renderer->camera_info.view_inverse);
+// Moves the mesh into the registry and frees the struct, returns its id
+internal u32 RendererPublishMesh(Renderer *renderer, Mesh *mesh) {
+    if(renderer->mesh_count == renderer->mesh_capacity) {
+        const u32 new_capacity = renderer->mesh_capacity * 2;
+        Mesh *new_meshes = (Mesh *)sRealloc(renderer->meshes, new_capacity * sizeof(Mesh));
+        ASSERT(new_meshes);
+        renderer->meshes = new_meshes;
+        renderer->mesh_capacity = new_capacity;
+    }
+
+    const u32 index = renderer->mesh_count++;
+    renderer->meshes[index] = *mesh;
+    sFree(mesh);
+    return HandleMapAdd(&renderer->mesh_handles, index);
 }
 
-void RendererSetSunDirection(Renderer *renderer, const Vec3 direction) {
-    const Mat4 a = mat4_ortho_zoom(1.0f / 1.0f, 20.0f, -600.0f, 600.0f);
-    Mat4 b = mat4_look_at(
-        (Vec3){0.0f, 0.0f, 0.0f}, vec3_fmul(direction, -1.0f), (Vec3){0.0f, 1.0f, 0.0f});
+// Returns NULL if the mesh was destroyed
+internal Mesh *RendererGetMesh(Renderer *renderer, const u32 id) {
+    const u32 index = HandleMapGet(&renderer->mesh_handles, id);
+    return index == UINT_MAX ? NULL : &renderer->meshes[index];
+}
+
+// Main thread : the copies are done, the mesh can be drawn
+internal void MeshLoadFinish(Renderer *renderer, MeshLoad *load) {
+    cgltf_data *data = load->data;
+    Mesh *mesh = load->mesh;
+
+    // Materials
+    u32 *material_map = (u32 *)sCalloc(data->materials_count, sizeof(u32));
+    RendererLoadMaterials(renderer, data, mesh->textures, mesh->texture_rects, material_map);
+    for(u32 p = 0; p < mesh->total_primitives_count; ++p) {
+        Primitive *primitive = &mesh->primitives[p];
+        primitive->material_id =
+            primitive->material_id == UINT_MAX ? 0 : material_map[primitive->material_id];
+    }
+    sFree(material_map);
+
+    TextureClearPending(renderer, load);
+    RendererUpdateTextureDescriptors(renderer);
 
-    renderer->camera_info.shadow_mvp = mat4_mul(&a, &b);
-    renderer->camera_info.light_dir = direction;
-}
\ No newline at end of file
+    mesh->instance_capacity = 1;
+    mesh->instance_positions = (Vec3 *)sCalloc(mesh->instance_capacity, sizeof(Vec3));
+    mesh->instance_rotations = (Quat *)sCalloc(mesh->instance_capacity, sizeof(Quat));
+    mesh->instance_scales = (Vec3 *)sCalloc(mesh->instance_capacity, sizeof(Vec3));
+    mesh->instance_transforms = (Mat4 *)sCalloc(mesh->instance_capacity, sizeof(Mat4));
+    mesh->instance_previous_transforms =
+        (Mat4 *)sCalloc(mesh->instance_capacity, sizeof(Mat4));
+    HandleMapInit(&mesh->instance_handles, mesh->instance_capacity);
+    mesh->instance_dirty = (bool *)sCalloc(mesh->instance_capacity, sizeof(bool));
+    mesh->instance_leaves = (u32 *)sCalloc(mesh->instance_capacity, sizeof(u32));
+    mesh->instance_dynamic = (bool *)sCalloc(mesh->instance_capacity, sizeof(bool));
+    MeshCreateInstanceBuffer(renderer, mesh);
+
+    mesh->trace_mesh = (RtMesh *)sCalloc(1, sizeof(RtMesh));
+    RtBuildTake(&load->trace_build, mesh->trace_mesh);
+
+    const u32 mesh_id = RendererPublishMesh(renderer, mesh);
+    sLog("Mesh %s loaded", load->path);
+
+    MeshLoadRelease(renderer, load);
+    load->mesh_id = mesh_id;
+    atomic_store(&load->state, MESH_LOAD_READY);
+}
+
+// Main thread : the BLAS are built, copies them to their compacted size. The fence is reused for
+// the copies, meshes without primitives go straight to MESH_LOAD_COMPACTING with it signaled.
+internal void MeshLoadRecordCompaction(Renderer *renderer, MeshLoad *load) {
+    BlasBatch *batch = &load->blas_batch;
+    if(batch->count > 0) {
+        Mesh *mesh = load->mesh;
+        mesh->blas = (BlasSet *)sCalloc(1, sizeof(BlasSet));
+
+        AllocateCommandBuffers(
+            renderer->device, renderer->graphics_command_pool, 1, &load->compact_cmd);
+        BeginCommandBuffer(load->compact_cmd, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+        BlasBatchCompact(renderer, batch, load->compact_cmd, mesh->blas);
+        AssertVkResult(vkEndCommandBuffer(load->compact_cmd));
+
+        AssertVkResult(vkResetFences(renderer->device, 1, &load->fence));
+        VkSubmitInfo submit = {0};
+        submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit.commandBufferCount = 1;
+        submit.pCommandBuffers = &load->compact_cmd;
+        AssertVkResult(vkQueueSubmit(renderer->graphics_queue, 1, &submit, load->fence));
+
+        const VkDeviceSize saved = batch->build_size - batch->compacted_size;
+        renderer->blas_memory += batch->compacted_size;
+        renderer->blas_memory_saved += saved;
+        sLog("BLAS of %s : %u primitives, %llu KB compacted to %llu KB, %llu KB saved (%llu KB "
+             "in total)",
+             load->path,
+             batch->count,
+             batch->build_size / 1024,
+             batch->compacted_size / 1024,
+             saved / 1024,
+             renderer->blas_memory_saved / 1024);
+    }
+    atomic_store(&load->state, MESH_LOAD_COMPACTING);
+}
+
+internal void RendererAdvanceMeshLoad(Renderer *renderer, MeshLoad *load) {
+    switch(atomic_load(&load->state)) {
+    case MESH_LOAD_DECODED: MeshLoadRecordUploads(renderer, load); break;
+    case MESH_LOAD_UPLOADING:
+        if(vkGetFenceStatus(renderer->device, load->fence) == VK_SUCCESS) {
+            MeshLoadRecordCompaction(renderer, load);
+        }
+        break;
+    case MESH_LOAD_COMPACTING:
+        if(vkGetFenceStatus(renderer->device, load->fence) == VK_SUCCESS &&
+           RtBuildDone(&load->trace_build)) {
+            MeshLoadFinish(renderer, load);
+        }
+        break;
+    default: break;
+    }
+}
+
+void RendererUpdateMeshLoads(Renderer *renderer) {
+    for(u32 i = 0; i < renderer->mesh_load_capacity; ++i) {
+        if(renderer->mesh_loads[i]) {
+            RendererAdvanceMeshLoad(renderer, renderer->mesh_loads[i]);
+        }
+    }
+}
+
+DLL_EXPORT u32 RendererLoadMeshAsync(Renderer *renderer, const char *path) {
+    u32 handle = 0;
+    while(handle < renderer->mesh_load_capacity && renderer->mesh_loads[handle]) {
+        ++handle;
+    }
+    if(handle == renderer->mesh_load_capacity) {
+        const u32 new_capacity = renderer->mesh_load_capacity * 2;
+        MeshLoad **new_loads =
+            (MeshLoad **)sRealloc(renderer->mesh_loads, new_capacity * sizeof(MeshLoad *));
+        ASSERT(new_loads);
+        memset(new_loads + renderer->mesh_load_capacity,
+               0,
+               (new_capacity - renderer->mesh_load_capacity) * sizeof(MeshLoad *));
+        renderer->mesh_loads = new_loads;
+        renderer->mesh_load_capacity = new_capacity;
+    }
+
+    sLog("Loading Mesh %s...", path);
+    MeshLoad *load = (MeshLoad *)sCalloc(1, sizeof(MeshLoad));
+    load->renderer = renderer;
+    strcpy_s(load->path, ARRAY_SIZE(load->path), path);
+
+    const char *last_sep = strrchr(path, '/');
+    u32 size = last_sep - path;
+    strncpy_s(load->directory, ARRAY_SIZE(load->directory), path, size);
+    load->directory[size] = '/';
+    load->directory[size + 1] = '\0';
+    load->known_files = TextureListFiles(renderer, &load->known_file_count);
+
+    atomic_store(&load->state, MESH_LOAD_DECODING);
+    renderer->mesh_loads[handle] = load;
+    renderer->platform->PushJob(&MeshLoadJob, load);
+    return handle;
+}
+
+DLL_EXPORT MeshLoadState RendererPollMesh(Renderer *renderer, u32 handle, u32 *mesh_id) {
+    if(handle >= renderer->mesh_load_capacity || !renderer->mesh_loads[handle]) {
+        return MESH_LOAD_INVALID;
+    }
+    MeshLoad *load = renderer->mesh_loads[handle];
+    RendererAdvanceMeshLoad(renderer, load);
+
+    const MeshLoadState state = atomic_load(&load->state);
+    if(state == MESH_LOAD_READY || state == MESH_LOAD_FAILED) {
+        if(state == MESH_LOAD_FAILED) {
+            MeshLoadRelease(renderer, load);
+        } else if(mesh_id) {
+            *mesh_id = load->mesh_id;
+        }
+        sFree(load);
+        renderer->mesh_loads[handle] = NULL;
+    }
+    return state;
+}
+
+DLL_EXPORT u32 RendererWaitMesh(Renderer *renderer, u32 handle) {
+    u32 mesh_id = UINT_MAX;
+    MeshLoadState state;
+    do {
+        MeshLoad *load =
+            handle < renderer->mesh_load_capacity ? renderer->mesh_loads[handle] : NULL;
+        const MeshLoadState load_state = load ? atomic_load(&load->state) : MESH_LOAD_INVALID;
+        if(load_state == MESH_LOAD_UPLOADING || load_state == MESH_LOAD_COMPACTING) {
+            vkWaitForFences(renderer->device, 1, &load->fence, VK_TRUE, UINT64_MAX);
+        }
+        // Decoding and the trace build run on the workers, help them instead of spinning
+        if(load_state == MESH_LOAD_DECODING ||
+           (load_state == MESH_LOAD_COMPACTING && !RtBuildDone(&load->trace_build))) {
+            renderer->platform->RunJob();
+        }
+        state = RendererPollMesh(renderer, handle, &mesh_id);
+    } while(state == MESH_LOAD_DECODING || state == MESH_LOAD_DECODED ||
+            state == MESH_LOAD_UPLOADING || state == MESH_LOAD_COMPACTING);
+    return mesh_id;
+}
+
+DLL_EXPORT u32 RendererLoadMesh(Renderer *renderer, const char *path) {
+    return RendererWaitMesh(renderer, RendererLoadMeshAsync(renderer, path));
+}
+
+void RendererDestroyMesh(Renderer *renderer, u32 id) {
+    Mesh *mesh = RendererGetMesh(renderer, id);
+    if(!mesh) {
+        sError("Destroying an invalid mesh : %x", id);
+        return;
+    }
+
+    for(u32 i = 0; i < mesh->texture_count; ++i) {
+        RendererReleaseTexture(renderer, mesh->textures[i]);
+    }
+    sFree(mesh->textures);
+    sFree(mesh->texture_rects);
+    RendererUpdateTextureDescriptors(renderer);
+
+    sFree(mesh->primitives);
+
+    for(u32 i = 0; i < mesh->instance_count; ++i) {
+        if(mesh->instance_leaves[i] != BVH_NULL) {
+            BvhRemove(&renderer->scene_tree, mesh->instance_leaves[i]);
+        }
+        if(mesh->instance_dynamic[i]) {
+            --renderer->shadow_dynamic_count;
+        } else {
+            renderer->shadow_static_dirty = true;
+        }
+    }
+    sFree(mesh->instance_leaves);
+    sFree(mesh->instance_dynamic);
+    sFree(mesh->instance_positions);
+    sFree(mesh->instance_rotations);
+    sFree(mesh->instance_scales);
+    sFree(mesh->instance_transforms);
+    sFree(mesh->instance_previous_transforms);
+    sFree(mesh->instance_dirty);
+    HandleMapFree(&mesh->instance_handles);
+    MeshDestroyInstanceBuffer(renderer, mesh);
+
+    DestroyBuffer(renderer->device, mesh->buffer);
+    sFree(mesh->buffer);
+
+    sFree(mesh->primitive_transforms);
+
+    RtMeshFree(mesh->trace_mesh);
+    sFree(mesh->trace_mesh);
+
+    if(mesh->blas) {
+        renderer->blas_memory -= mesh->blas->buffer.size;
+        BlasSetDestroy(renderer, mesh->blas);
+        sFree(mesh->blas);
+    }
+
+    // Keep the dense array packed
+    renderer->tlas.layout_dirty = true;
+    const u32 index = HandleMapGet(&renderer->mesh_handles, id);
+    const u32 last = --renderer->mesh_count;
+    renderer->meshes[index] = renderer->meshes[last];
+    HandleMapRemove(&renderer->mesh_handles, id, last);
+}
+
+internal bool
+FrameDrawsInstance(const Frame *frame, const Mesh *mesh, const u8 *visibility, const u32 i) {
+    if(!(visibility[i] & frame->cull_mask)) {
+        return false;
+    }
+    return frame->filter == DRAW_ALL ||
+           mesh->instance_dynamic[i] == (frame->filter == DRAW_DYNAMIC);
+}
+
+// Keys the primitives with an instance the frame draws. Their depth is the distance to the
+// nearest of these instances, a primitive spread over the scene still hides the ones after it
+// where it is near. sort holds the RENDER_SORT_* fields the pass orders its draws by.
+void RendererQueuePass(Renderer *renderer,
+                       const Frame *frame,
+                       const DrawPass pass,
+                       const u32 sort) {
+    const Vec3 eye = renderer->camera_info.pos;
+    for(u32 m = 0; m < renderer->mesh_count; ++m) {
+        const Mesh *mesh = &renderer->meshes[m];
+        for(u32 p = 0; p < mesh->total_primitives_count; ++p) {
+            const u32 base = p * mesh->instance_capacity;
+            const u8 *visibility = &mesh->visibility[base];
+            bool drawn = false;
+            f32 nearest = FLT_MAX;
+            for(u32 i = 0; i < mesh->instance_count; ++i) {
+                if(!FrameDrawsInstance(frame, mesh, visibility, i)) {
+                    continue;
+                }
+                drawn = true;
+                if(!(sort & RENDER_SORT_DEPTH)) {
+                    break;
+                }
+                const Vec3 to_bounds = {mesh->bounds_x[base + i] - eye.x,
+                                        mesh->bounds_y[base + i] - eye.y,
+                                        mesh->bounds_z[base + i] - eye.z};
+                const f32 distance = vec3_length(to_bounds) - mesh->bounds_radius[base + i];
+                nearest = distance < nearest ? distance : nearest;
+            }
+            if(!drawn) {
+                continue;
+            }
+            // Materials past the field share its last value, they are still pushed when they
+            // change
+            const u32 material_id = mesh->primitives[p].material_id;
+            const u32 material =
+                !(sort & RENDER_SORT_MATERIAL) ? 0 : material_id < 0xFFFF ? material_id : 0xFFFF;
+            const u16 depth = (sort & RENDER_SORT_DEPTH) ? RenderDepthBucket(nearest) : 0;
+            RenderQueuePush(
+                &renderer->render_queue, RenderKey(pass, 0, material, depth, m), m, p);
+        }
+    }
+}
+
+// Records the draws [first, end) of a pass from the sorted queue, each one a run of consecutive
+// instances that passed the culling and the filter. The instance buffer is primitive major so a
+// mesh binds its buffers once and picks the primitive with the first instance. The material is
+// pushed again only when it changes, and only once in the passes whose shaders don't read it.
+// Only reads the renderer, the workers record their chunks of a pass with it.
+void RendererRecordDraws(Renderer *renderer,
+                         Frame *frame,
+                         const DrawPass pass,
+                         const u32 first,
+                         const u32 end,
+                         DrawPassStats *stats) {
+    const RenderQueue *queue = &renderer->render_queue;
+    const bool reads_material = pass == DRAW_PASS_COLOR;
+    u32 bound_mesh = UINT_MAX;
+    u32 pushed_material = UINT_MAX;
+    for(u32 d = first; d < end; ++d) {
+        const RenderDraw *draw = &queue->draws[d];
+        Mesh *mesh = &renderer->meshes[draw->mesh];
+        const Primitive *prim = &mesh->primitives[draw->primitive];
+        ++stats->primitives;
+
+        if(draw->mesh != bound_mesh) {
+            const VkBuffer buffers[] = {mesh->buffer->buffer, mesh->instance_buffer->buffer};
+            const VkDeviceSize offsets[] = {0, 0};
+            vkCmdBindVertexBuffers(frame->cmd, 0, 2, buffers, offsets);
+            vkCmdBindIndexBuffer(
+                frame->cmd, mesh->buffer->buffer, mesh->all_index_offset, VK_INDEX_TYPE_UINT32);
+            bound_mesh = draw->mesh;
+            stats->binds += 2;
+        }
+        if(pushed_material == UINT_MAX ||
+           (reads_material && prim->material_id != pushed_material)) {
+            PushConstant push = {prim->material_id};
+            vkCmdPushConstants(frame->cmd,
+                               frame->layout,
+                               VK_SHADER_STAGE_VERTEX_BIT,
+                               0,
+                               sizeof(PushConstant),
+                               &push);
+            pushed_material = prim->material_id;
+            ++stats->pushes;
+        }
+
+        const u32 base = draw->primitive * mesh->instance_capacity;
+        const u8 *visibility = &mesh->visibility[base];
+        u32 i = 0;
+        while(i < mesh->instance_count) {
+            if(!FrameDrawsInstance(frame, mesh, visibility, i)) {
+                ++i;
+                continue;
+            }
+            const u32 first = i;
+            while(i < mesh->instance_count && FrameDrawsInstance(frame, mesh, visibility, i)) {
+                ++i;
+            }
+            vkCmdDrawIndexed(frame->cmd,
+                             prim->index_count,
+                             i - first,
+                             prim->index_offset,
+                             prim->vertex_offset,
+                             base + first);
+            frame->visible_count += i - first;
+            frame->draw_count++;
+            ++stats->draws;
+        }
+    }
+}
+
+// ========================
+//
+// CULLING
+//
+// ========================
+
+// Only split the work when there is enough of it to pay for waking the workers
+#define CULL_UNIT_SIZE 4096
+#define CULL_PARALLEL_THRESHOLD (4 * CULL_UNIT_SIZE)
+
+// Workers busy decoding a mesh would keep us waiting for them to pick up our jobs
+bool RendererIsLoading(Renderer *renderer) {
+    for(u32 i = 0; i < renderer->mesh_load_capacity; ++i) {
+        if(renderer->mesh_loads[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void RendererWaitJobs(Renderer *renderer, _Atomic u32 *running_jobs) {
+    while(atomic_load(running_jobs) > 0) {
+        renderer->platform->RunJob();
+    }
+}
+
+internal void RendererCullUnits(Renderer *renderer) {
+    for(;;) {
+        const u32 u = atomic_fetch_add(&renderer->cull_next_unit, 1);
+        if(u >= renderer->cull_unit_count) {
+            break;
+        }
+        const CullUnit *unit = &renderer->cull_units[u];
+        const Mesh *mesh = unit->mesh;
+        cull_spheres(unit->count,
+                     &mesh->bounds_x[unit->first],
+                     &mesh->bounds_y[unit->first],
+                     &mesh->bounds_z[unit->first],
+                     &mesh->bounds_radius[unit->first],
+                     renderer->cull_planes,
+                     renderer->cull_volume_count,
+                     &mesh->visibility[unit->first]);
+    }
+}
+
+// Worker thread
+internal void CullJob(void *data) {
+    Renderer *renderer = (Renderer *)data;
+    RendererCullUnits(renderer);
+    atomic_fetch_sub(&renderer->cull_running_jobs, 1);
+}
+
+internal void
+RendererAddCullUnit(Renderer *renderer, Mesh *mesh, const u32 first, const u32 count) {
+    if(renderer->cull_unit_count == renderer->cull_unit_capacity) {
+        const u32 new_capacity = renderer->cull_unit_capacity * 2;
+        CullUnit *new_units =
+            (CullUnit *)sRealloc(renderer->cull_units, new_capacity * sizeof(CullUnit));
+        ASSERT(new_units);
+        renderer->cull_units = new_units;
+        renderer->cull_unit_capacity = new_capacity;
+    }
+    renderer->cull_units[renderer->cull_unit_count++] = (CullUnit){mesh, first, count};
+}
+
+void RendererCullInstances(Renderer *renderer) {
+    const Mat4 view_proj = mat4_mul(&renderer->camera_info.proj, &renderer->camera_info.view);
+    CullExtractPlanes(&view_proj, &renderer->cull_planes[0]);
+    // Every cascade culls its own casters, none are needed when the shadows are ray traced
+    renderer->cull_volume_count = 1;
+    if(renderer->camera_info.shadow_mode == SHADOW_MODE_MAP) {
+        for(u32 c = 0; c < renderer->camera_info.cascade_count; ++c) {
+            CullExtractPlanes(&renderer->camera_info.shadow_vp[c],
+                              &renderer->cull_planes[(1 + c) * CULL_PLANE_COUNT]);
+        }
+        renderer->cull_volume_count += renderer->camera_info.cascade_count;
+    }
+
+    renderer->cull_stats = (CullStats){0};
+    renderer->cull_unit_count = 0;
+    for(u32 m = 0; m < renderer->mesh_count; ++m) {
+        Mesh *mesh = &renderer->meshes[m];
+        for(u32 p = 0; p < mesh->total_primitives_count; ++p) {
+            const u32 base = p * mesh->instance_capacity;
+            for(u32 i = 0; i < mesh->instance_count; i += CULL_UNIT_SIZE) {
+                const u32 count = mesh->instance_count - i < CULL_UNIT_SIZE
+                                      ? mesh->instance_count - i
+                                      : CULL_UNIT_SIZE;
+                RendererAddCullUnit(renderer, mesh, base + i, count);
+            }
+        }
+        renderer->cull_stats.tested += mesh->instance_count * mesh->total_primitives_count;
+    }
+    atomic_store(&renderer->cull_next_unit, 0);
+
+    u32 job_count = 0;
+    if(!RendererIsLoading(renderer) && renderer->cull_stats.tested >= CULL_PARALLEL_THRESHOLD) {
+        job_count = renderer->cull_job_count;
+    }
+    atomic_store(&renderer->cull_running_jobs, job_count);
+    for(u32 i = 0; i < job_count; ++i) {
+        renderer->platform->PushJob(&CullJob, renderer);
+    }
+
+    RendererCullUnits(renderer);
+    // Late jobs find no unit left and return right away
+    RendererWaitJobs(renderer, &renderer->cull_running_jobs);
+}
+
+CullStats RendererGetCullStats(Renderer *renderer) {
+    return renderer->cull_stats;
+}
+
+DrawStats RendererGetDrawStats(Renderer *renderer) {
+    return renderer->draw_stats;
+}
+
+// ========================
+//
+// SCENE QUERIES
+//
+// ========================
+
+// The scene tree stores instances as their two handles
+internal u64 MeshInstancePack(const MeshInstance instance) {
+    return (u64)instance.mesh << 32 | instance.instance;
+}
+
+internal MeshInstance MeshInstanceUnpack(const u64 packed) {
+    return (MeshInstance){(u32)(packed >> 32), (u32)packed};
+}
+
+// The queries return how many instances were found, only the first max_results are written
+
+typedef struct SceneQuery {
+    MeshInstance *results;
+    u32 max_results;
+    u32 count;
+    f32 *distances; // Ray queries keep the results sorted
+} SceneQuery;
+
+internal bool SceneQueryAdd(void *data, const u64 user) {
+    SceneQuery *query = (SceneQuery *)data;
+    if(query->count < query->max_results) {
+        query->results[query->count] = MeshInstanceUnpack(user);
+    }
+    query->count++;
+    return true;
+}
+
+internal bool SceneQueryAddSorted(void *data, const u64 user, const f32 t) {
+    SceneQuery *query = (SceneQuery *)data;
+    u32 i = query->count < query->max_results ? query->count : query->max_results;
+    query->count++;
+    // Insertion sort, further hits fall off the end
+    while(i > 0 && query->distances[i - 1] > t) {
+        if(i < query->max_results) {
+            query->results[i] = query->results[i - 1];
+            query->distances[i] = query->distances[i - 1];
+        }
+        --i;
+    }
+    if(i < query->max_results) {
+        query->results[i] = MeshInstanceUnpack(user);
+        query->distances[i] = t;
+    }
+    return true;
+}
+
+u32 RendererQueryBox(Renderer *renderer,
+                     const Vec3 min,
+                     const Vec3 max,
+                     MeshInstance *results,
+                     const u32 max_results) {
+    SceneQuery query = {results, max_results, 0, NULL};
+    const Aabb box = {min, max};
+    BvhQueryBox(&renderer->scene_tree, &box, &SceneQueryAdd, &query);
+    return query.count;
+}
+
+u32 RendererQuerySphere(Renderer *renderer,
+                        const Vec3 center,
+                        const f32 radius,
+                        MeshInstance *results,
+                        const u32 max_results) {
+    SceneQuery query = {results, max_results, 0, NULL};
+    BvhQuerySphere(&renderer->scene_tree, center, radius, &SceneQueryAdd, &query);
+    return query.count;
+}
+
+// Results are sorted by the distance where the ray enters their bounds
+u32 RendererQueryRay(Renderer *renderer,
+                     const Vec3 origin,
+                     const Vec3 direction,
+                     const f32 max_distance,
+                     MeshInstance *results,
+                     const u32 max_results) {
+    f32 *distances = (f32 *)sMalloc(max_results * sizeof(f32));
+    SceneQuery query = {results, max_results, 0, distances};
+    const Vec3 dir = vec3_normalize(direction);
+    BvhQueryRay(&renderer->scene_tree, origin, dir, max_distance, &SceneQueryAddSorted, &query);
+    sFree(distances);
+    return query.count;
+}
+
+// Instances inside the view volume of the last frame
+u32 RendererQueryView(Renderer *renderer, MeshInstance *results, const u32 max_results) {
+    SceneQuery query = {results, max_results, 0, NULL};
+    BvhQueryPlanes(
+        &renderer->scene_tree, renderer->cull_planes, CULL_PLANE_COUNT, &SceneQueryAdd, &query);
+    return query.count;
+}
+
+// ========================
+//
+// INSTANCES
+//
+// ========================
+
+// Returns the dense index of the instance in its mesh, UINT_MAX if either was destroyed
+internal u32 RendererGetInstance(Renderer *renderer, const MeshInstance instance, Mesh **mesh) {
+    *mesh = RendererGetMesh(renderer, instance.mesh);
+    if(!*mesh) {
+        return UINT_MAX;
+    }
+    return HandleMapGet(&(*mesh)->instance_handles, instance.instance);
+}
+
+internal void MeshMarkInstanceDirty(Mesh *mesh, const u32 index) {
+    mesh->instance_dirty[index] = true;
+    if(mesh->dirty_begin >= mesh->dirty_end) {
+        mesh->dirty_begin = index;
+        mesh->dirty_end = index + 1;
+    } else {
+        if(index < mesh->dirty_begin) {
+            mesh->dirty_begin = index;
+        }
+        if(index >= mesh->dirty_end) {
+            mesh->dirty_end = index + 1;
+        }
+    }
+}
+
+// Placing an instance before its first frame keeps it static. Once it moves afterwards its
+// shadow can't stay in the static cache.
+internal void MeshMoveInstance(Renderer *renderer, Mesh *mesh, const u32 index) {
+    MeshMarkInstanceDirty(mesh, index);
+    if(mesh->instance_leaves[index] != BVH_NULL && !mesh->instance_dynamic[index]) {
+        mesh->instance_dynamic[index] = true;
+        ++renderer->shadow_dynamic_count;
+        renderer->shadow_static_dirty = true;
+    }
+}
+
+internal void MeshCreateInstanceBuffer(Renderer *renderer, Mesh *mesh) {
+    const VkDeviceSize size =
+        (VkDeviceSize)mesh->instance_capacity * mesh->total_primitives_count * sizeof(InstanceData);
+    mesh->instance_buffer = (Buffer *)sMalloc(sizeof(Buffer));
+    CreateBuffer(renderer->device,
+                 &renderer->memory_properties,
+                 size,
+                 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 mesh->instance_buffer);
+    DEBUGNameBuffer(renderer->device, mesh->instance_buffer, "Instances");
+    MapBuffer(renderer->device, mesh->instance_buffer, (void **)&mesh->instance_buffer_data);
+
+    // The culling data follows the same layout
+    const u32 count = mesh->instance_capacity * mesh->total_primitives_count;
+    mesh->bounds_x = (f32 *)sCalloc(count, sizeof(f32));
+    mesh->bounds_y = (f32 *)sCalloc(count, sizeof(f32));
+    mesh->bounds_z = (f32 *)sCalloc(count, sizeof(f32));
+    mesh->bounds_radius = (f32 *)sCalloc(count, sizeof(f32));
+    mesh->visibility = (u8 *)sCalloc(count, sizeof(u8));
+}
+
+internal void MeshDestroyInstanceBuffer(Renderer *renderer, Mesh *mesh) {
+    UnmapBuffer(renderer->device, mesh->instance_buffer);
+    DestroyBuffer(renderer->device, mesh->instance_buffer);
+    sFree(mesh->instance_buffer);
+    mesh->instance_buffer = NULL;
+    mesh->instance_buffer_data = NULL;
+
+    sFree(mesh->bounds_x);
+    sFree(mesh->bounds_y);
+    sFree(mesh->bounds_z);
+    sFree(mesh->bounds_radius);
+    sFree(mesh->visibility);
+}
+
+// Room for the world, normal and previous world matrices of count instances
+internal Mat4 *RendererInstanceScratch(Renderer *renderer, const u32 count) {
+    if(renderer->instance_scratch_capacity < count * 3) {
+        Mat4 *new_scratch = (Mat4 *)sRealloc(renderer->instance_scratch, count * 3 * sizeof(Mat4));
+        ASSERT(new_scratch);
+        renderer->instance_scratch = new_scratch;
+        renderer->instance_scratch_capacity = count * 3;
+    }
+    return renderer->instance_scratch;
+}
+
+// Writes the TLAS records of primitive p of instances [first, first + count). The bounds must be
+// up to date.
+internal void MeshWriteTlasRecords(Renderer *renderer,
+                                   Mesh *mesh,
+                                   const u32 p,
+                                   const u32 first,
+                                   const u32 count,
+                                   const Mat4 *transforms) {
+    const u32 record = mesh->tlas_first + p * mesh->instance_count + first;
+    const u32 base = p * mesh->instance_capacity + first;
+    for(u32 i = 0; i < count; ++i) {
+        const Vec3 center = {
+            mesh->bounds_x[base + i], mesh->bounds_y[base + i], mesh->bounds_z[base + i]};
+        TlasWriteRecord(&renderer->tlas,
+                        record + i,
+                        &transforms[i],
+                        mesh->blas->addresses[p],
+                        mesh->primitives[p].material_id,
+                        center,
+                        mesh->bounds_radius[base + i]);
+    }
+}
+
+// Writes the matrices of instances [first, first + count) of every primitive
+internal void
+RendererWriteInstances(Renderer *renderer, Mesh *mesh, const u32 first, const u32 count) {
+    Mat4 *transforms = RendererInstanceScratch(renderer, count);
+    Mat4 *normals = transforms + count;
+    Mat4 *previous = normals + count;
+
+    for(u32 p = 0; p < mesh->total_primitives_count; ++p) {
+        const Primitive *prim = &mesh->primitives[p];
+        Mat4BatchMul(count,
+                     &mesh->instance_transforms[first],
+                     sizeof(Mat4),
+                     &mesh->primitive_transforms[prim->node_id],
+                     0,
+                     transforms,
+                     sizeof(Mat4));
+        Mat4BatchNormalMatrix(count, transforms, sizeof(Mat4), normals, sizeof(Mat4));
+        Mat4BatchMul(count,
+                     &mesh->instance_previous_transforms[first],
+                     sizeof(Mat4),
+                     &mesh->primitive_transforms[prim->node_id],
+                     0,
+                     previous,
+                     sizeof(Mat4));
+
+        const u32 base = p * mesh->instance_capacity + first;
+        // The buffer is write combined : fill it in order and never read it back
+        InstanceData *dst = &mesh->instance_buffer_data[base];
+        for(u32 i = 0; i < count; ++i) {
+            dst[i].transform = transforms[i];
+            dst[i].normal_matrix = normals[i];
+            dst[i].previous_transform = previous[i];
+        }
+
+        // The radius grows with the largest scale of the basis
+        const Vec3 c = prim->bounds_center;
+        for(u32 i = 0; i < count; ++i) {
+            const Mat4 *t = &transforms[i];
+            mesh->bounds_x[base + i] =
+                t->m[0][0] * c.x + t->m[1][0] * c.y + t->m[2][0] * c.z + t->m[3][0];
+            mesh->bounds_y[base + i] =
+                t->m[0][1] * c.x + t->m[1][1] * c.y + t->m[2][1] * c.z + t->m[3][1];
+            mesh->bounds_z[base + i] =
+                t->m[0][2] * c.x + t->m[1][2] * c.y + t->m[2][2] * c.z + t->m[3][2];
+            f32 scale = 0.0f;
+            for(u32 k = 0; k < 3; ++k) {
+                const f32 length =
+                    t->m[k][0] * t->m[k][0] + t->m[k][1] * t->m[k][1] + t->m[k][2] * t->m[k][2];
+                scale = length > scale ? length : scale;
+            }
+            mesh->bounds_radius[base + i] = prim->bounds_radius * sqrtf(scale);
+        }
+
+        // Otherwise every record is written by RendererUpdateTlas
+        if(!renderer->tlas.layout_dirty) {
+            MeshWriteTlasRecords(renderer, mesh, p, first, count, transforms);
+        }
+    }
+
+    if(mesh->total_primitives_count == 0) {
+        return;
+    }
+    // Box around the spheres of the primitives, the handles stay valid when items are moved
+    const u32 mesh_id = HandleMapHandleOf(&renderer->mesh_handles, (u32)(mesh - renderer->meshes));
+    for(u32 i = first; i < first + count; ++i) {
+        Aabb box = {{FLT_MAX, FLT_MAX, FLT_MAX}, {-FLT_MAX, -FLT_MAX, -FLT_MAX}};
+        for(u32 p = 0; p < mesh->total_primitives_count; ++p) {
+            const u32 j = p * mesh->instance_capacity + i;
+            const f32 r = mesh->bounds_radius[j];
+            box.min.x = fminf(box.min.x, mesh->bounds_x[j] - r);
+            box.min.y = fminf(box.min.y, mesh->bounds_y[j] - r);
+            box.min.z = fminf(box.min.z, mesh->bounds_z[j] - r);
+            box.max.x = fmaxf(box.max.x, mesh->bounds_x[j] + r);
+            box.max.y = fmaxf(box.max.y, mesh->bounds_y[j] + r);
+            box.max.z = fmaxf(box.max.z, mesh->bounds_z[j] + r);
+        }
+
+        if(mesh->instance_leaves[i] == BVH_NULL) {
+            const MeshInstance instance = {mesh_id,
+                                           HandleMapHandleOf(&mesh->instance_handles, i)};
+            mesh->instance_leaves[i] =
+                BvhInsert(&renderer->scene_tree, &box, MeshInstancePack(instance));
+        } else {
+            BvhMove(&renderer->scene_tree, mesh->instance_leaves[i], &box);
+        }
+    }
+}
+
+// The previous matrices are the ones drawn last frame. An instance that moved is written again
+// the frame after with both matrices equal so that it stops having motion once it stands still.
+void RendererUpdateInstances(Renderer *renderer) {
+    for(u32 m = 0; m < renderer->mesh_count; ++m) {
+        Mesh *mesh = &renderer->meshes[m];
+        // Destroyed instances can leave the range past the end
+        const u32 end =
+            mesh->dirty_end < mesh->instance_count ? mesh->dirty_end : mesh->instance_count;
+        u32 settle_begin = UINT_MAX;
+        u32 settle_end = 0;
+        u32 i = mesh->dirty_begin;
+        while(i < end) {
+            if(!mesh->instance_dirty[i]) {
+                ++i;
+                continue;
+            }
+            // Batch each run of dirty instances
+            const u32 first = i;
+            for(; i < end && mesh->instance_dirty[i]; ++i) {
+                mesh->instance_dirty[i] = false;
+                trs_to_mat4(&mesh->instance_transforms[i],
+                            &mesh->instance_positions[i],
+                            &mesh->instance_rotations[i],
+                            &mesh->instance_scales[i]);
+                // Instances appear where they are placed
+                if(mesh->instance_leaves[i] == BVH_NULL) {
+                    mesh->instance_previous_transforms[i] = mesh->instance_transforms[i];
+                }
+            }
+            RendererWriteInstances(renderer, mesh, first, i - first);
+
+            for(u32 k = first; k < i; ++k) {
+                if(memcmp(&mesh->instance_previous_transforms[k],
+                          &mesh->instance_transforms[k],
+                          sizeof(Mat4)) != 0) {
+                    mesh->instance_previous_transforms[k] = mesh->instance_transforms[k];
+                    mesh->instance_dirty[k] = true;
+                    settle_begin = k < settle_begin ? k : settle_begin;
+                    settle_end = k + 1;
+                }
+            }
+        }
+        mesh->dirty_begin = settle_begin == UINT_MAX ? 0 : settle_begin;
+        mesh->dirty_end = settle_end;
+    }
+}
+
+void RendererUpdateTlas(Renderer *renderer) {
+    Tlas *tlas = &renderer->tlas;
+    if(!tlas->layout_dirty) {
+        return;
+    }
+    u32 record_count = 0;
+    for(u32 m = 0; m < renderer->mesh_count; ++m) {
+        Mesh *mesh = &renderer->meshes[m];
+        mesh->tlas_first = record_count;
+        record_count += mesh->instance_count * mesh->total_primitives_count;
+    }
+    TlasReserve(renderer, tlas, record_count);
+
+    for(u32 m = 0; m < renderer->mesh_count; ++m) {
+        Mesh *mesh = &renderer->meshes[m];
+        if(mesh->instance_count == 0) {
+            continue;
+        }
+        Mat4 *transforms = RendererInstanceScratch(renderer, mesh->instance_count);
+        for(u32 p = 0; p < mesh->total_primitives_count; ++p) {
+            Mat4BatchMul(mesh->instance_count,
+                         mesh->instance_transforms,
+                         sizeof(Mat4),
+                         &mesh->primitive_transforms[mesh->primitives[p].node_id],
+                         0,
+                         transforms,
+                         sizeof(Mat4));
+            MeshWriteTlasRecords(renderer, mesh, p, 0, mesh->instance_count, transforms);
+        }
+    }
+}
+
+MeshInstance RendererInstantiateMesh(Renderer *renderer, u32 mesh_id) {
+    MeshInstance result = {0};
+
+    Mesh *mesh = RendererGetMesh(renderer, mesh_id);
+    if(!mesh) {
+        sError("Instantiating an invalid mesh : %x", mesh_id);
+        return result;
+    }
+    if(mesh->instance_count == mesh->instance_capacity) {
+        // Resize the streams
+        u32 new_capacity = mesh->instance_capacity * 2;
+        sLog("Resizing mesh buffer from %d to %d", mesh->instance_capacity, new_capacity);
+        Vec3 *new_positions =
+            (Vec3 *)sRealloc(mesh->instance_positions, new_capacity * sizeof(Vec3));
+        Quat *new_rotations =
+            (Quat *)sRealloc(mesh->instance_rotations, new_capacity * sizeof(Quat));
+        Vec3 *new_scales = (Vec3 *)sRealloc(mesh->instance_scales, new_capacity * sizeof(Vec3));
+        Mat4 *new_transforms =
+            (Mat4 *)sRealloc(mesh->instance_transforms, new_capacity * sizeof(Mat4));
+        Mat4 *new_previous_transforms =
+            (Mat4 *)sRealloc(mesh->instance_previous_transforms, new_capacity * sizeof(Mat4));
+        bool *new_dirty = (bool *)sRealloc(mesh->instance_dirty, new_capacity * sizeof(bool));
+        u32 *new_leaves = (u32 *)sRealloc(mesh->instance_leaves, new_capacity * sizeof(u32));
+        bool *new_dynamic =
+            (bool *)sRealloc(mesh->instance_dynamic, new_capacity * sizeof(bool));
+        ASSERT_MSG(new_positions && new_rotations && new_scales && new_transforms &&
+                       new_previous_transforms && new_dirty && new_leaves && new_dynamic,
+                   "Unable to size up the instance buffer");
+        mesh->instance_positions = new_positions;
+        mesh->instance_rotations = new_rotations;
+        mesh->instance_scales = new_scales;
+        mesh->instance_transforms = new_transforms;
+        mesh->instance_previous_transforms = new_previous_transforms;
+        mesh->instance_dirty = new_dirty;
+        mesh->instance_leaves = new_leaves;
+        mesh->instance_dynamic = new_dynamic;
+        mesh->instance_capacity = new_capacity;
+
+        // The stride of the gpu buffer changed, everything has to be written again. The previous
+        // frame is done with the old buffer since frames wait for the queues to be idle.
+        MeshDestroyInstanceBuffer(renderer, mesh);
+        MeshCreateInstanceBuffer(renderer, mesh);
+        for(u32 i = 0; i < mesh->instance_count; ++i) {
+            MeshMarkInstanceDirty(mesh, i);
+        }
+    }
+    const u32 index = mesh->instance_count++;
+    mesh->instance_positions[index] = (Vec3){(f32)index * 20.f, 0.f, 0.f};
+    mesh->instance_rotations[index] = (Quat){0.0f, 0.0f, 0.0f, 1.0f};
+    mesh->instance_scales[index] = (Vec3){1.0f, 1.0f, 1.0f};
+    mesh->instance_leaves[index] = BVH_NULL; // Inserted once its bounds are known
+    mesh->instance_dynamic[index] = false;
+    MeshMarkInstanceDirty(mesh, index);
+    renderer->tlas.layout_dirty = true;
+    renderer->shadow_static_dirty = true;
+
+    result.mesh = mesh_id;
+    result.instance = HandleMapAdd(&mesh->instance_handles, index);
+    return result;
+}
+
+void RendererDestroyInstance(Renderer *renderer, MeshInstance instance) {
+    Mesh *mesh;
+    const u32 index = RendererGetInstance(renderer, instance, &mesh);
+    if(index == UINT_MAX) {
+        sError("Destroying an invalid instance");
+        return;
+    }
+
+    if(mesh->instance_leaves[index] != BVH_NULL) {
+        BvhRemove(&renderer->scene_tree, mesh->instance_leaves[index]);
+    }
+    if(mesh->instance_dynamic[index]) {
+        --renderer->shadow_dynamic_count;
+    } else {
+        renderer->shadow_static_dirty = true;
+    }
+
+    const u32 last = --mesh->instance_count;
+    mesh->instance_leaves[index] = mesh->instance_leaves[last];
+    mesh->instance_dynamic[index] = mesh->instance_dynamic[last];
+    mesh->instance_positions[index] = mesh->instance_positions[last];
+    mesh->instance_rotations[index] = mesh->instance_rotations[last];
+    mesh->instance_scales[index] = mesh->instance_scales[last];
+    mesh->instance_transforms[index] = mesh->instance_transforms[last];
+    mesh->instance_previous_transforms[index] = mesh->instance_previous_transforms[last];
+    mesh->instance_dirty[last] = false;
+    if(index != last) {
+        MeshMarkInstanceDirty(mesh, index);
+    }
+    HandleMapRemove(&mesh->instance_handles, instance.instance, last);
+    renderer->tlas.layout_dirty = true;
+}
+
+void RendererSetInstancePosition(Renderer *renderer, MeshInstance instance, const Vec3 position) {
+    Mesh *mesh;
+    const u32 index = RendererGetInstance(renderer, instance, &mesh);
+    if(index == UINT_MAX) {
+        return;
+    }
+    mesh->instance_positions[index] = position;
+    MeshMoveInstance(renderer, mesh, index);
+}
+
+void RendererSetInstanceRotation(Renderer *renderer, MeshInstance instance, const Quat rotation) {
+    Mesh *mesh;
+    const u32 index = RendererGetInstance(renderer, instance, &mesh);
+    if(index == UINT_MAX) {
+        return;
+    }
+    mesh->instance_rotations[index] = rotation;
+    MeshMoveInstance(renderer, mesh, index);
+}
+
+void RendererSetInstanceScale(Renderer *renderer, MeshInstance instance, const Vec3 scale) {
+    Mesh *mesh;
+    const u32 index = RendererGetInstance(renderer, instance, &mesh);
+    if(index == UINT_MAX) {
+        return;
+    }
+    mesh->instance_scales[index] = scale;
+    MeshMoveInstance(renderer, mesh, index);
+}
+
+void RendererSetCamera(Renderer *renderer, const Vec3 position, const Vec3 forward, const Vec3 up) {
+    renderer->camera_info.pos = position;
+    renderer->camera_info.view = mat4_look_at(vec3_add(position, forward), position, up);
+    Mat4AffineInverse(&renderer->camera_info.view, &renderer->camera_info.view_inverse);
+}
+
+// The cascades follow the camera, they are fitted every frame in RendererUpdateShadowCascades
+void RendererSetSunDirection(Renderer *renderer, const Vec3 direction) {
+    renderer->camera_info.light_dir = vec3_normalize(direction);
+}
+
+void RendererSetShadowMode(Renderer *renderer, const ShadowMode mode) {
+    renderer->camera_info.shadow_mode = mode;
+}
+
+void RendererSetFogResolution(Renderer *renderer, const FogResolution resolution) {
+    VulkanSetFogResolution(renderer, resolution);
+}
+
+// Both techniques keep their resources, switching only changes what the frame records
+void RendererSetFogTechnique(Renderer *renderer, const FogTechnique technique) {
+    renderer->fog_technique = technique;
+}
+
+void RendererSetFogTemporal(Renderer *renderer, const bool enabled) {
+    VulkanSetFogTemporal(renderer, enabled);
+}
+void RendererSetAntiAliasing(Renderer *renderer, const AntiAliasing mode) {
+    VulkanSetAntiAliasing(renderer, mode);
+}
+u64 RendererGetAntiAliasingMemory(Renderer *renderer, const AntiAliasing mode) {
+    return VulkanGetAntiAliasingMemory(renderer, mode);
+}
+void RendererSetDepthPrepass(Renderer *renderer, const bool enabled) {
+    VulkanSetDepthPrepass(renderer, enabled);
+}
+
+// ========================
+//
+// SHADOW CASCADES
+//
+// ========================
+
+// The view is cut in slices up to SHADOW_DISTANCE, the closer ones cover less ground with the
+// same resolution. Each cascade is an orthographic box around the bounding sphere of its slice,
+// so its size doesn't change when the camera turns, and it only moves by whole texels so the
+// shadow edges don't shimmer when the camera moves. Its depth range moves by whole
+// SHADOW_DEPTH_STEP, so the static layers aren't redrawn for every move of the camera or of a
+// dynamic caster at the edge of the scene.
+
+#define SHADOW_DISTANCE 200.0f
+#define SHADOW_SPLIT_LAMBDA 0.75f // 0 for uniform splits, 1 for logarithmic ones
+#define SHADOW_DEPTH_STEP 8.0f
+
+internal f32 ShadowDot(const Vec3 a, const Vec3 b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+// Point of the view space at the given normalized device coordinates
+internal Vec3 ShadowUnproject(const Mat4 *proj_inverse, const f32 x, const f32 y, const f32 z) {
+    const f32 ndc[4] = {x, y, z, 1.0f};
+    f32 view[4];
+    for(u32 r = 0; r < 4; ++r) {
+        view[r] = proj_inverse->m[0][r] * ndc[0] + proj_inverse->m[1][r] * ndc[1] +
+                  proj_inverse->m[2][r] * ndc[2] + proj_inverse->m[3][r] * ndc[3];
+    }
+    return (Vec3){view[0] / view[3], view[1] / view[3], view[2] / view[3]};
+}
+
+void RendererUpdateShadowCascades(Renderer *renderer) {
+    CameraMatrices *camera = &renderer->camera_info;
+    const u32 cascade_count = camera->cascade_count;
+
+    // Corner rays of the view, scaled so that their view depth is 1
+    Vec3 rays[4];
+    const f32 corners[4][2] = {{-1.0f, -1.0f}, {1.0f, -1.0f}, {-1.0f, 1.0f}, {1.0f, 1.0f}};
+    for(u32 i = 0; i < 4; ++i) {
+        const Vec3 p = ShadowUnproject(&camera->proj_inverse, corners[i][0], corners[i][1], 0.5f);
+        rays[i] = vec3_fmul(p, 1.0f / fabsf(p.z));
+    }
+    // Works with both depth directions
+    const f32 depth_0 = fabsf(ShadowUnproject(&camera->proj_inverse, 0.0f, 0.0f, 0.0f).z);
+    const f32 depth_1 = fabsf(ShadowUnproject(&camera->proj_inverse, 0.0f, 0.0f, 1.0f).z);
+    const f32 view_near = depth_0 < depth_1 ? depth_0 : depth_1;
+    f32 view_far = depth_0 < depth_1 ? depth_1 : depth_0;
+    if(view_far > SHADOW_DISTANCE) {
+        view_far = SHADOW_DISTANCE;
+    }
+
+    // Light space, z goes away from the sun
+    const Vec3 forward = camera->light_dir;
+    const Vec3 up =
+        fabsf(forward.y) > 0.99f ? (Vec3){0.0f, 0.0f, 1.0f} : (Vec3){0.0f, 1.0f, 0.0f};
+    const Vec3 right = vec3_normalize(vec3_cross(up, forward));
+    const Vec3 light_up = vec3_cross(forward, right);
+
+    // Casters between the sun and a cascade must land in its depth range
+    f32 scene_min_z = FLT_MAX;
+    const Bvh *tree = &renderer->scene_tree;
+    if(tree->root != BVH_NULL) {
+        const Aabb *box = &tree->nodes[tree->root].box;
+        for(u32 i = 0; i < 8; ++i) {
+            const Vec3 corner = {(i & 1) ? box->max.x : box->min.x,
+                                 (i & 2) ? box->max.y : box->min.y,
+                                 (i & 4) ? box->max.z : box->min.z};
+            const f32 z = ShadowDot(corner, forward);
+            scene_min_z = z < scene_min_z ? z : scene_min_z;
+        }
+    }
+
+    const f32 resolution = (f32)renderer->shadowmap_extent.width;
+    f32 slice_near = view_near;
+    for(u32 c = 0; c < cascade_count; ++c) {
+        const f32 t = (f32)(c + 1) / (f32)cascade_count;
+        const f32 uniform = view_near + (view_far - view_near) * t;
+        const f32 logarithmic = view_near * powf(view_far / view_near, t);
+        const f32 slice_far = uniform + (logarithmic - uniform) * SHADOW_SPLIT_LAMBDA;
+        camera->cascade_splits[c] = slice_far;
+
+        Vec3 points[8];
+        Vec3 center = {0.0f, 0.0f, 0.0f};
+        for(u32 i = 0; i < 4; ++i) {
+            points[i * 2 + 0] = RtTransformPoint(&camera->view_inverse,
+                                                 vec3_fmul(rays[i], slice_near));
+            points[i * 2 + 1] = RtTransformPoint(&camera->view_inverse,
+                                                 vec3_fmul(rays[i], slice_far));
+            center = vec3_add(center, vec3_add(points[i * 2], points[i * 2 + 1]));
+        }
+        center = vec3_fmul(center, 1.0f / 8.0f);
+        f32 radius = 0.0f;
+        for(u32 i = 0; i < 8; ++i) {
+            const f32 distance = vec3_length(vec3_sub(points[i], center));
+            radius = distance > radius ? distance : radius;
+        }
+        // Rounded up so float noise doesn't resize the cascade
+        radius = ceilf(radius * 16.0f) / 16.0f;
+
+        const f32 texel = 2.0f * radius / resolution;
+        const f32 x = floorf(ShadowDot(center, right) / texel) * texel;
+        const f32 y = floorf(ShadowDot(center, light_up) / texel) * texel;
+        const f32 z = ShadowDot(center, forward);
+        const f32 z_near = scene_min_z < z - radius ? scene_min_z : z - radius;
+        const f32 z_min = floorf(z_near / SHADOW_DEPTH_STEP) * SHADOW_DEPTH_STEP;
+        const f32 z_max = ceilf((z + radius) / SHADOW_DEPTH_STEP) * SHADOW_DEPTH_STEP;
+        const f32 z_range = z_max - z_min;
+
+        // x and y to [-1, 1], z to [0, 1]
+        Mat4 *m = &camera->shadow_vp[c];
+        *m = (Mat4){0};
+        m->m[0][0] = right.x / radius;
+        m->m[1][0] = right.y / radius;
+        m->m[2][0] = right.z / radius;
+        m->m[3][0] = -x / radius;
+        m->m[0][1] = light_up.x / radius;
+        m->m[1][1] = light_up.y / radius;
+        m->m[2][1] = light_up.z / radius;
+        m->m[3][1] = -y / radius;
+        m->m[0][2] = forward.x / z_range;
+        m->m[1][2] = forward.y / z_range;
+        m->m[2][2] = forward.z / z_range;
+        m->m[3][2] = -z_min / z_range;
+        m->m[3][3] = 1.0f;
+
+        slice_near = slice_far;
+    }
+}
+
+// ========================
+//
+// RAY TRACING
+//
+// ========================
+
+// Rays go through the scene tree to the instances, then through the triangle BVH of their mesh
+// in mesh space. Everything reads the transforms of the last frame.
+
+#define TRACE_MAX_DISTANCE 1000.0f // Far plane of the camera
+
+// Direction of the camera ray through a point of the screen, x and y go from 0 to 1 from the top
+// left corner
+internal Vec3 RendererCameraDirection(Renderer *renderer, const f32 x, const f32 y) {
+    const Mat4 *proj_inverse = &renderer->camera_info.proj_inverse;
+    // Any depth inside the frustum lands on the ray
+    const f32 ndc[4] = {x * 2.0f - 1.0f, y * 2.0f - 1.0f, 0.5f, 1.0f};
+    f32 view[4];
+    for(u32 r = 0; r < 4; ++r) {
+        view[r] = proj_inverse->m[0][r] * ndc[0] + proj_inverse->m[1][r] * ndc[1] +
+                  proj_inverse->m[2][r] * ndc[2] + proj_inverse->m[3][r] * ndc[3];
+    }
+    const Vec3 direction = {view[0] / view[3], view[1] / view[3], view[2] / view[3]};
+    return vec3_normalize(RtTransformVector(&renderer->camera_info.view_inverse, direction));
+}
+
+typedef struct RaycastQuery {
+    Renderer *renderer;
+    Vec3 origin;
+    Vec3 direction;
+    RaycastHit *hit; // distance is the closest hit so far
+    bool found;
+} RaycastQuery;
+
+internal bool RaycastInstance(void *data, const u64 user, const f32 t) {
+    RaycastQuery *query = (RaycastQuery *)data;
+    if(t > query->hit->distance) {
+        return true; // Starts behind the closest hit
+    }
+    const MeshInstance instance = MeshInstanceUnpack(user);
+    Mesh *mesh;
+    const u32 index = RendererGetInstance(query->renderer, instance, &mesh);
+    if(index == UINT_MAX) {
+        return true;
+    }
+
+    const Mat4 *transform = &mesh->instance_transforms[index];
+    Mat4 to_mesh;
+    Mat4AffineInverse(transform, &to_mesh);
+    const Vec3 origin = RtTransformPoint(&to_mesh, query->origin);
+    const Vec3 direction = RtTransformVector(&to_mesh, query->direction);
+    RtHit hit = {query->hit->distance, UINT_MAX, 0.0f, 0.0f};
+    if(!RtMeshTrace(mesh->trace_mesh, origin, direction, false, &hit)) {
+        return true;
+    }
+
+    const RtTriangle *triangle = &mesh->trace_mesh->triangles[hit.triangle];
+    Mat4 normal_matrix;
+    Mat4NormalMatrix(transform, &normal_matrix);
+    Vec3 normal = RtTransformVector(&normal_matrix, vec3_cross(triangle->e1, triangle->e2));
+    normal = vec3_normalize(normal);
+    const Vec3 d = query->direction;
+    if(normal.x * d.x + normal.y * d.y + normal.z * d.z > 0.0f) {
+        normal = vec3_fmul(normal, -1.0f);
+    }
+
+    query->hit->instance = instance;
+    query->hit->primitive = mesh->trace_mesh->primitives[hit.triangle];
+    query->hit->distance = hit.t;
+    query->hit->position = vec3_add(query->origin, vec3_fmul(query->direction, hit.t));
+    query->hit->normal = normal;
+    query->found = true;
+    return true;
+}
+
+bool RendererRaycast(Renderer *renderer,
+                     const Vec3 origin,
+                     const Vec3 direction,
+                     const f32 max_distance,
+                     RaycastHit *hit) {
+    RaycastHit closest = {0};
+    closest.distance = max_distance;
+    RaycastQuery query = {renderer, origin, vec3_normalize(direction), &closest, false};
+    BvhQueryRay(
+        &renderer->scene_tree, origin, query.direction, max_distance, &RaycastInstance, &query);
+    if(query.found) {
+        *hit = closest;
+    }
+    return query.found;
+}
+
+void RendererScreenRay(
+    Renderer *renderer, const i32 x, const i32 y, Vec3 *origin, Vec3 *direction) {
+    const VkExtent2D extent = renderer->swapchain.extent;
+    *origin = renderer->camera_info.pos;
+    *direction = RendererCameraDirection(
+        renderer, (x + 0.5f) / (f32)extent.width, (y + 0.5f) / (f32)extent.height);
+}
+
+typedef struct PacketQuery {
+    Renderer *renderer;
+    RtPacket *packet;
+    bool any_hit;
+} PacketQuery;
+
+internal bool TracePacketInstance(void *data, const u64 user) {
+    PacketQuery *query = (PacketQuery *)data;
+    Mesh *mesh;
+    const u32 index = RendererGetInstance(query->renderer, MeshInstanceUnpack(user), &mesh);
+    if(index == UINT_MAX) {
+        return true;
+    }
+
+    Mat4 to_mesh;
+    Mat4AffineInverse(&mesh->instance_transforms[index], &to_mesh);
+    RtPacket local;
+    RtPacketTransform(query->packet, &to_mesh, &local);
+    RtMeshTracePacket(mesh->trace_mesh, &local, query->any_hit);
+
+    RtPacket *packet = query->packet;
+    for(u32 i = 0; i < RT_PACKET_SIZE; ++i) {
+        if(local.triangle[i] != UINT_MAX) {
+            packet->t[i] = local.t[i];
+            packet->triangle[i] = local.triangle[i];
+        }
+    }
+    packet->active = local.active;
+    return packet->active != 0;
+}
+
+// Traces the packet against the instances its rays can reach
+internal void RendererTracePacket(Renderer *renderer, RtPacket *packet, const bool any_hit) {
+    Aabb box = {{FLT_MAX, FLT_MAX, FLT_MAX}, {-FLT_MAX, -FLT_MAX, -FLT_MAX}};
+    for(u32 i = 0; i < RT_PACKET_SIZE; ++i) {
+        if(!(packet->active & (1u << i))) {
+            continue;
+        }
+        const Vec3 start = {packet->ox[i], packet->oy[i], packet->oz[i]};
+        const Vec3 end = {packet->ox[i] + packet->dx[i] * packet->t[i],
+                          packet->oy[i] + packet->dy[i] * packet->t[i],
+                          packet->oz[i] + packet->dz[i] * packet->t[i]};
+        box.min.x = fminf(box.min.x, fminf(start.x, end.x));
+        box.min.y = fminf(box.min.y, fminf(start.y, end.y));
+        box.min.z = fminf(box.min.z, fminf(start.z, end.z));
+        box.max.x = fmaxf(box.max.x, fmaxf(start.x, end.x));
+        box.max.y = fmaxf(box.max.y, fmaxf(start.y, end.y));
+        box.max.z = fmaxf(box.max.z, fmaxf(start.z, end.z));
+    }
+    if(!packet->active) {
+        return;
+    }
+    PacketQuery query = {renderer, packet, any_hit};
+    BvhQueryBox(&renderer->scene_tree, &box, &TracePacketInstance, &query);
+}
+
+typedef struct ShadowMaskTrace {
+    Renderer *renderer;
+    u32 width;
+    u32 height;
+    u8 *mask;
+    Vec3 to_sun;
+    _Atomic u32 next_row;
+    _Atomic u32 running_jobs;
+    _Atomic u32 shadowed;
+} ShadowMaskTrace;
+
+// Pixels are traced in 2x2 packets : camera rays first, then shadow rays from what they hit.
+// Threads take two rows at a time.
+internal void TraceShadowRows(ShadowMaskTrace *trace) {
+    Renderer *renderer = trace->renderer;
+    const Vec3 eye = renderer->camera_info.pos;
+    const Vec3 to_sun = trace->to_sun;
+    for(;;) {
+        const u32 y = atomic_fetch_add(&trace->next_row, 2);
+        if(y >= trace->height) {
+            break;
+        }
+        u32 shadowed = 0;
+        for(u32 x = 0; x < trace->width; x += 2) {
+            RtPacket primary;
+            u32 inside = 0;
+            for(u32 i = 0; i < RT_PACKET_SIZE; ++i) {
+                const u32 px = x + (i & 1);
+                const u32 py = y + (i >> 1);
+                if(px < trace->width && py < trace->height) {
+                    inside |= 1u << i;
+                }
+                const Vec3 d = RendererCameraDirection(renderer,
+                                                       (px + 0.5f) / (f32)trace->width,
+                                                       (py + 0.5f) / (f32)trace->height);
+                primary.ox[i] = eye.x;
+                primary.oy[i] = eye.y;
+                primary.oz[i] = eye.z;
+                primary.dx[i] = d.x;
+                primary.dy[i] = d.y;
+                primary.dz[i] = d.z;
+                primary.t[i] = TRACE_MAX_DISTANCE;
+            }
+            RtPacketPrepare(&primary, inside);
+            RendererTracePacket(renderer, &primary, false);
+
+            // Start a bit towards the sun so the rays don't hit their own surface
+            RtPacket shadow;
+            u32 lit_surfaces = 0;
+            for(u32 i = 0; i < RT_PACKET_SIZE; ++i) {
+                const f32 t = primary.t[i];
+                const f32 bias = 1e-3f * (1.0f + t);
+                shadow.ox[i] = primary.ox[i] + primary.dx[i] * t + to_sun.x * bias;
+                shadow.oy[i] = primary.oy[i] + primary.dy[i] * t + to_sun.y * bias;
+                shadow.oz[i] = primary.oz[i] + primary.dz[i] * t + to_sun.z * bias;
+                shadow.dx[i] = to_sun.x;
+                shadow.dy[i] = to_sun.y;
+                shadow.dz[i] = to_sun.z;
+                shadow.t[i] = TRACE_MAX_DISTANCE;
+                if(primary.triangle[i] != UINT_MAX) {
+                    lit_surfaces |= 1u << i;
+                }
+            }
+            RtPacketPrepare(&shadow, inside & lit_surfaces);
+            RendererTracePacket(renderer, &shadow, true);
+
+            // Any hit lanes drop out of the packet when they find an occluder
+            const u32 blocked = inside & lit_surfaces & ~shadow.active;
+            for(u32 i = 0; i < RT_PACKET_SIZE; ++i) {
+                if(inside & (1u << i)) {
+                    const u32 pixel = (y + (i >> 1)) * trace->width + x + (i & 1);
+                    trace->mask[pixel] = blocked & (1u << i) ? 0 : 255;
+                    shadowed += (blocked >> i) & 1;
+                }
+            }
+        }
+        atomic_fetch_add(&trace->shadowed, shadowed);
+    }
+}
+
+// Worker thread
+internal void TraceShadowJob(void *data) {
+    ShadowMaskTrace *trace = (ShadowMaskTrace *)data;
+    TraceShadowRows(trace);
+    atomic_fetch_sub(&trace->running_jobs, 1);
+}
+
+u32 RendererTraceShadowMask(Renderer *renderer, const u32 width, const u32 height, u8 *mask) {
+    ShadowMaskTrace trace = {0};
+    trace.renderer = renderer;
+    trace.width = width;
+    trace.height = height;
+    trace.mask = mask;
+    trace.to_sun = vec3_normalize(vec3_fmul(renderer->camera_info.light_dir, -1.0f));
+    atomic_store(&trace.next_row, 0);
+    atomic_store(&trace.shadowed, 0);
+
+    const u32 job_count = RendererIsLoading(renderer) ? 0 : renderer->trace_job_count;
+    atomic_store(&trace.running_jobs, job_count);
+    for(u32 i = 0; i < job_count; ++i) {
+        renderer->platform->PushJob(&TraceShadowJob, &trace);
+    }
+    TraceShadowRows(&trace);
+    RendererWaitJobs(renderer, &trace.running_jobs);
+    return atomic_load(&trace.shadowed);
+}
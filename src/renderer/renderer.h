@@ -11,9 +11,30 @@ typedef struct Renderer Renderer;
 typedef struct GameData GameData;
 typedef struct Frame Frame;
 typedef struct Buffer Buffer;
+typedef struct RtMesh RtMesh;
+typedef struct BlasSet BlasSet;
 
 // Structures
 
+// Handles are a slot index in the low bits and the generation of the slot in the high bits, so
+// a handle outlives its item without ever pointing at a newer one.
+#define HANDLE_INDEX_BITS 16
+#define HANDLE_INDEX_MASK ((1u << HANDLE_INDEX_BITS) - 1)
+
+typedef struct HandleSlot {
+    u32 generation;
+    u32 index; // Dense index when alive, next free slot otherwise
+} HandleSlot;
+
+typedef struct HandleMap {
+    u32 slot_capacity;
+    u32 slot_count;
+    HandleSlot *slots;
+    u32 free_slot; // Head of the free list, UINT_MAX if empty
+    u32 dense_capacity;
+    u32 *slot_of; // Slot of each dense item
+} HandleMap;
+
 typedef struct Primitive {
     u32 material_id;
     u32 node_id;
@@ -21,8 +42,16 @@ typedef struct Primitive {
     u32 index_offset;
     u32 vertex_count;
     u32 vertex_offset;
+    Vec3 bounds_center; // Bounding sphere in node space
+    f32 bounds_radius;
 } Primitive;
 
+typedef struct InstanceData {
+    Mat4 transform;
+    Mat4 normal_matrix; // Only the 3x3 part is read
+    Mat4 previous_transform; // Drawn with last frame, for the motion vectors
+} InstanceData;
+
 typedef struct Mesh {
     Buffer *buffer;       // idx & vtx buffer
     u32 all_index_offset; // Indices start at this offset in the buffer
@@ -35,17 +64,62 @@ typedef struct Mesh {
     u32 primitive_nodes_count;
     Mat4 *primitive_transforms;
 
+    RtMesh *trace_mesh; // Triangle BVH for the cpu ray tracer
+    BlasSet *blas;      // Acceleration structure of each primitive, NULL without primitives
+    u32 tlas_first;     // First record of the mesh in the TLAS instances
+
+    // Instances are packed, destroying one moves the last in its place
     u32 instance_count;
     u32 instance_capacity;
-    Mat4 *instance_transforms;
+    Vec3 *instance_positions;
+    Quat *instance_rotations;
+    Vec3 *instance_scales;
+    Mat4 *instance_transforms; // World matrices built from the streams above
+    Mat4 *instance_previous_transforms; // instance_transforms as of the last frame drawn
+    HandleMap instance_handles;
+
+    // Instances whose streams changed since the last upload. Every dirty instance lies in
+    // [dirty_begin, dirty_end), so a mesh that didn't move is skipped with one compare.
+    bool *instance_dirty;
+    u32 *instance_leaves; // Leaf of each instance in the scene tree, UINT_MAX until written
+    // Moved after its first frame, drawn over the cached static shadows every frame instead of
+    // being baked in them
+    bool *instance_dynamic;
+    u32 dirty_begin;
+    u32 dirty_end;
+    // Matrices of each primitive of each instance, primitive major with a stride of
+    // instance_capacity so every primitive is drawn with a single instanced call.
+    Buffer *instance_buffer;
+    InstanceData *instance_buffer_data; // Persistently mapped, write only
+    // World bounding sphere and CULL_VISIBLE_* bits of each primitive of each instance, same
+    // layout as the instance buffer
+    f32 *bounds_x;
+    f32 *bounds_y;
+    f32 *bounds_z;
+    f32 *bounds_radius;
+    u8 *visibility;
+
+    u32 texture_count;
+    u32 *textures; // Texture slots referenced by this mesh, released on destroy
+    Vec4 *texture_rects; // uv scale (xy) and offset (zw) of each texture in its slot
 } Mesh;
 
+typedef enum MeshLoadState {
+    MESH_LOAD_INVALID = 0, // Unknown or already polled handle
+    MESH_LOAD_DECODING,    // Parsing and decoding on a worker thread
+    MESH_LOAD_DECODED,     // Waiting for the main thread to record the uploads
+    MESH_LOAD_UPLOADING,   // Copies and BLAS builds in flight on the gpu
+    MESH_LOAD_COMPACTING,  // BLAS copies to their compacted size in flight
+    MESH_LOAD_READY,       // Published in renderer->meshes
+    MESH_LOAD_FAILED,
+} MeshLoadState;
+
 typedef struct MeshInstance {
-    Mat4 *transform;
+    u32 mesh;
+    u32 instance;
 } MeshInstance;
 
 typedef struct PushConstant {
-    alignas(16) Mat4 transform;
     alignas(4) u32 material;
 } PushConstant;
 
@@ -64,16 +138,91 @@ typedef struct Material {
     alignas(4) u32 normal_texture;
     alignas(4) u32 ao_texture;
     alignas(4) u32 emissive_texture;
+    alignas(16) Vec4 base_color_uv; // xy : scale, zw : offset inside an atlas page
 } Material;
 
+typedef struct CullStats {
+    u32 tested; // Primitive instances tested against the view and shadow volumes
+    u32 color_visible;
+    u32 shadow_visible; // Summed over the shadow cascades
+    u32 color_draws;
+    u32 shadow_draws;
+    u32 shadow_baked_cascades; // Cascades whose cached static casters were drawn again
+} CullStats;
+
+typedef enum DrawPass {
+    DRAW_PASS_DEPTH_PREPASS,
+    DRAW_PASS_COLOR,
+    DRAW_PASS_SHADOW, // Summed over the cascades and their static and dynamic casters
+    DRAW_PASS_COUNT,
+} DrawPass;
+
+// Commands recorded by each pass of the last frame. Drawing each primitive on its own would bind
+// 3 buffers and push once per primitive.
+typedef struct DrawPassStats {
+    u32 primitives; // With instances drawn
+    u32 binds;      // Vertex and index buffers
+    u32 pushes;
+    u32 draws;
+} DrawPassStats;
+
+typedef struct DrawStats {
+    DrawPassStats passes[DRAW_PASS_COUNT];
+} DrawStats;
+
+typedef struct RaycastHit {
+    MeshInstance instance;
+    u32 primitive;
+    f32 distance;
+    Vec3 position;
+    Vec3 normal; // Facing the ray
+} RaycastHit;
+
+// How the sun shadows are resolved in the color and fog passes
+typedef enum ShadowMode {
+    SHADOW_MODE_MAP = 0,   // Sampled from the shadow map
+    SHADOW_MODE_RAY_QUERY, // Ray queries against the TLAS, the shadow map pass is skipped
+} ShadowMode;
+
+// Fraction of the screen size the fog is raymarched at, then brought back to full resolution
+typedef enum FogResolution {
+    FOG_RESOLUTION_FULL = 1,
+    FOG_RESOLUTION_HALF = 2,
+    FOG_RESOLUTION_QUARTER = 4,
+} FogResolution;
+
+typedef enum FogTechnique {
+    FOG_TECHNIQUE_RAYMARCH = 0, // Marched per pixel at renderer->fog_resolution
+    FOG_TECHNIQUE_FROXELS, // Lit once per froxel in compute, then read per pixel with one fetch
+} FogTechnique;
+
+typedef enum AntiAliasing {
+    ANTI_ALIASING_MSAA_1 = 1, // The MSAA modes are their sample count
+    ANTI_ALIASING_MSAA_2 = 2,
+    ANTI_ALIASING_MSAA_4 = 4,
+    ANTI_ALIASING_MSAA_8 = 8,
+    ANTI_ALIASING_TAA, // Single sample, jittered every frame and accumulated in a history
+} AntiAliasing;
+
+// The sun shadow map is split in cascades along the view, each one a layer of the same image
+#define SHADOW_MAX_CASCADES 4
+#define SHADOW_CASCADE_COUNT 3 // From 2 to SHADOW_MAX_CASCADES
+
 typedef struct CameraMatrices {
     alignas(16) Mat4 proj;
     alignas(16) Mat4 proj_inverse;
     alignas(16) Mat4 view;
     alignas(16) Mat4 view_inverse;
-    alignas(16) Mat4 shadow_mvp;
+    alignas(16) Mat4 shadow_vp[SHADOW_MAX_CASCADES];
+    alignas(16) f32 cascade_splits[SHADOW_MAX_CASCADES]; // View depth where each cascade ends
     alignas(16) Vec3 pos;
     alignas(16) Vec3 light_dir;
+    u32 shadow_mode; // ShadowMode, packed after light_dir like in std140
+    u32 cascade_count;
+    alignas(16) Mat4 previous_proj; // Camera of the last frame drawn, to reproject the fog history
+    alignas(16) Mat4 previous_view;
+    u32 fog_frame; // Reseeds the jitter of the fog, stays put when there is no history
+    alignas(8) Vec2 jitter; // Offset of the geometry in clip space, in TAA only
 } CameraMatrices;
 
 // Platform level functions
@@ -102,12 +251,37 @@ typedef struct RendererPlatformAPI {
 typedef u32 LoadMesh_t(Renderer *renderer, const char *path);
 DLL_EXPORT LoadMesh_t RendererLoadMesh;
 
+// Starts loading the mesh on the worker threads, returns a handle to poll
+typedef u32 LoadMeshAsync_t(Renderer *renderer, const char *path);
+DLL_EXPORT LoadMeshAsync_t RendererLoadMeshAsync;
+
+// Returns the state of the load. Once it is READY the mesh id is written to mesh_id and the handle
+// is released.
+typedef MeshLoadState PollMesh_t(Renderer *renderer, u32 handle, u32 *mesh_id);
+DLL_EXPORT PollMesh_t RendererPollMesh;
+
+// Blocks until the load is done, returns the mesh id or UINT_MAX if it failed
+typedef u32 WaitMesh_t(Renderer *renderer, u32 handle);
+DLL_EXPORT WaitMesh_t RendererWaitMesh;
+
 typedef void DestroyMesh_t(Renderer *renderer, u32 mesh);
 DLL_EXPORT DestroyMesh_t RendererDestroyMesh;
 
 typedef MeshInstance InstantiateMesh_t(Renderer *renderer, u32 mesh_id);
 DLL_EXPORT InstantiateMesh_t RendererInstantiateMesh;
 
+typedef void DestroyInstance_t(Renderer *renderer, MeshInstance instance);
+DLL_EXPORT DestroyInstance_t RendererDestroyInstance;
+
+typedef void SetInstancePosition_t(Renderer *renderer, MeshInstance instance, const Vec3 position);
+DLL_EXPORT SetInstancePosition_t RendererSetInstancePosition;
+
+typedef void SetInstanceRotation_t(Renderer *renderer, MeshInstance instance, const Quat rotation);
+DLL_EXPORT SetInstanceRotation_t RendererSetInstanceRotation;
+
+typedef void SetInstanceScale_t(Renderer *renderer, MeshInstance instance, const Vec3 scale);
+DLL_EXPORT SetInstanceScale_t RendererSetInstanceScale;
+
 typedef void
 SetCamera_t(Renderer *renderer, const Vec3 position, const Vec3 forward, const Vec3 up);
 DLL_EXPORT SetCamera_t RendererSetCamera;
@@ -115,19 +289,135 @@ DLL_EXPORT SetCamera_t RendererSetCamera;
 typedef void SetSunDirection_t(Renderer *renderer, const Vec3 direction);
 DLL_EXPORT SetSunDirection_t RendererSetSunDirection;
 
+typedef void SetShadowMode_t(Renderer *renderer, const ShadowMode mode);
+DLL_EXPORT SetShadowMode_t RendererSetShadowMode;
+
+typedef void SetFogResolution_t(Renderer *renderer, const FogResolution resolution);
+DLL_EXPORT SetFogResolution_t RendererSetFogResolution;
+
+typedef void SetFogTechnique_t(Renderer *renderer, const FogTechnique technique);
+DLL_EXPORT SetFogTechnique_t RendererSetFogTechnique;
+
+// Accumulates the raymarched fog over frames, which lets it take fewer steps per frame
+typedef void SetFogTemporal_t(Renderer *renderer, const bool enabled);
+DLL_EXPORT SetFogTemporal_t RendererSetFogTemporal;
+
+// Modes the device can't render fall back to the closest lower sample count
+typedef void SetAntiAliasing_t(Renderer *renderer, const AntiAliasing mode);
+DLL_EXPORT SetAntiAliasing_t RendererSetAntiAliasing;
+
+// Bytes of the screen sized targets a mode needs, 0 when the device can't render it
+typedef u64 GetAntiAliasingMemory_t(Renderer *renderer, const AntiAliasing mode);
+DLL_EXPORT GetAntiAliasingMemory_t RendererGetAntiAliasingMemory;
+
+typedef void SetDepthPrepass_t(Renderer *renderer, const bool enabled);
+DLL_EXPORT SetDepthPrepass_t RendererSetDepthPrepass;
+
+// Culling results of the last frame
+typedef CullStats GetCullStats_t(Renderer *renderer);
+DLL_EXPORT GetCullStats_t RendererGetCullStats;
+
+// State changes and draws of the last frame
+typedef DrawStats GetDrawStats_t(Renderer *renderer);
+DLL_EXPORT GetDrawStats_t RendererGetDrawStats;
+
+// Scene queries over the bounds of the instances. They return how many instances were found and
+// write the first max_results of them.
+typedef u32 QueryBox_t(
+    Renderer *renderer, const Vec3 min, const Vec3 max, MeshInstance *results, u32 max_results);
+DLL_EXPORT QueryBox_t RendererQueryBox;
+
+typedef u32 QuerySphere_t(
+    Renderer *renderer, const Vec3 center, f32 radius, MeshInstance *results, u32 max_results);
+DLL_EXPORT QuerySphere_t RendererQuerySphere;
+
+// Results are sorted from the closest
+typedef u32 QueryRay_t(Renderer *renderer,
+                       const Vec3 origin,
+                       const Vec3 direction,
+                       f32 max_distance,
+                       MeshInstance *results,
+                       u32 max_results);
+DLL_EXPORT QueryRay_t RendererQueryRay;
+
+// Instances inside the camera frustum of the last frame
+typedef u32 QueryView_t(Renderer *renderer, MeshInstance *results, u32 max_results);
+DLL_EXPORT QueryView_t RendererQueryView;
+
+// Closest triangle along the ray, traced on the cpu. Returns false if nothing is hit before
+// max_distance.
+typedef bool Raycast_t(Renderer *renderer,
+                       const Vec3 origin,
+                       const Vec3 direction,
+                       f32 max_distance,
+                       RaycastHit *hit);
+DLL_EXPORT Raycast_t RendererRaycast;
+
+// Ray from the camera through a pixel of the window
+typedef void ScreenRay_t(Renderer *renderer, i32 x, i32 y, Vec3 *origin, Vec3 *direction);
+DLL_EXPORT ScreenRay_t RendererScreenRay;
+
+// Ray traces the shadows of the current view on the cpu, as a reference for the shadow map. The
+// mask is row major from the top left, 0 where the sun is blocked and 255 elsewhere. Returns the
+// number of shadowed pixels.
+typedef u32 TraceShadowMask_t(Renderer *renderer, u32 width, u32 height, u8 *mask);
+DLL_EXPORT TraceShadowMask_t RendererTraceShadowMask;
+
 typedef struct RendererGameAPI {
     LoadMesh_t *LoadMesh;
+    LoadMeshAsync_t *LoadMeshAsync;
+    PollMesh_t *PollMesh;
+    WaitMesh_t *WaitMesh;
     DestroyMesh_t *DestroyMesh;
     InstantiateMesh_t *InstantiateMesh;
+    DestroyInstance_t *DestroyInstance;
+    SetInstancePosition_t *SetInstancePosition;
+    SetInstanceRotation_t *SetInstanceRotation;
+    SetInstanceScale_t *SetInstanceScale;
     SetCamera_t *SetCamera;
     SetSunDirection_t *SetSunDirection;
+    SetShadowMode_t *SetShadowMode;
+    SetFogResolution_t *SetFogResolution;
+    SetFogTechnique_t *SetFogTechnique;
+    SetFogTemporal_t *SetFogTemporal;
+    SetAntiAliasing_t *SetAntiAliasing;
+    GetAntiAliasingMemory_t *GetAntiAliasingMemory;
+    SetDepthPrepass_t *SetDepthPrepass;
+    GetCullStats_t *GetCullStats;
+    GetDrawStats_t *GetDrawStats;
+    QueryBox_t *QueryBox;
+    QuerySphere_t *QuerySphere;
+    QueryRay_t *QueryRay;
+    QueryView_t *QueryView;
+    Raycast_t *Raycast;
+    ScreenRay_t *ScreenRay;
+    TraceShadowMask_t *TraceShadowMask;
 } RendererGameAPI;
 
 // Other functions
 
-void RendererDrawMesh(Frame *frame,
-                      Mesh *mesh,
-                      const u32 instance_count,
-                      const Mat4 *instance_transforms);
+// Advances the asynchronous loads, called by the renderer once per frame
+void RendererUpdateMeshLoads(Renderer *renderer);
+// Rebuilds the dirty instances and writes them to the instance buffers, called once per frame
+void RendererUpdateInstances(Renderer *renderer);
+// Writes every TLAS record if instances were added or removed, called after the instance update
+void RendererUpdateTlas(Renderer *renderer);
+// Fits the shadow cascades to the view, called once per frame before culling
+void RendererUpdateShadowCascades(Renderer *renderer);
+// Tests the instances against the view and shadow volumes, called once per frame before drawing
+void RendererCullInstances(Renderer *renderer);
+// Whether meshes are still decoding on the workers
+bool RendererIsLoading(Renderer *renderer);
+// Waits for running_jobs to drop to zero, running queued jobs on this thread in the meantime
+void RendererWaitJobs(Renderer *renderer, _Atomic u32 *running_jobs);
+
+// Adds the draws of a pass to the render queue, sorted once every pass of the frame is in
+void RendererQueuePass(Renderer *renderer, const Frame *frame, const DrawPass pass, const u32 sort);
+void RendererRecordDraws(Renderer *renderer,
+                         Frame *frame,
+                         const DrawPass pass,
+                         const u32 first,
+                         const u32 end,
+                         DrawPassStats *stats);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,46 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <sl3dge-utils/sl3dge.h>
+
+// Instruction sets the cpu kernels can use. SSE is always there on x86, AVX2 has to be checked at
+// runtime with SimdHasAVX2 and the kernels compiled with a target attribute.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMD_SSE 1
+#include <immintrin.h>
+#if defined(__clang__) || defined(__GNUC__)
+#define SIMD_AVX2 1
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#include <cpuid.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if SIMD_AVX2
+internal bool SimdHasAVX2() {
+    u32 eax, ebx, ecx, edx;
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    const bool osxsave = ecx & (1u << 27);
+    const bool fma = ecx & (1u << 12);
+    if(!osxsave || !fma) {
+        return false;
+    }
+    // The os has to save the ymm registers
+    u32 xcr0, xcr0_high;
+    __asm__ volatile("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+    if((xcr0 & 0x6) != 0x6) {
+        return false;
+    }
+    if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return ebx & (1u << 5);
+}
+#endif
+
+#endif
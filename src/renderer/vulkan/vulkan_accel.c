@@ -0,0 +1,535 @@
+#include <vulkan/vulkan.h>
+#include <sl3dge-utils/sl3dge.h>
+
+#include "renderer/vulkan/vulkan_renderer.h"
+
+// Bottom level acceleration structures, one per primitive of a mesh. All the primitives of a mesh
+// are built by a single vkCmdBuildAccelerationStructuresKHR in the upload command buffer, each in
+// its own region of the renderer scratch buffer. Their compacted sizes are queried right after the
+// build and, once the upload fence is signaled, they are copied to one tightly packed buffer.
+
+#define ACCEL_OFFSET_ALIGNMENT 256 // Required for the offset of a structure in its buffer
+
+internal VkDeviceSize AccelAlign(const VkDeviceSize value, const VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+internal void AccelBarrier(VkCommandBuffer cmd,
+                           const VkPipelineStageFlags src_stage,
+                           const VkAccessFlags src_access,
+                           const VkPipelineStageFlags dst_stage,
+                           const VkAccessFlags dst_access) {
+    VkMemoryBarrier barrier = {0};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = src_access;
+    barrier.dstAccessMask = dst_access;
+    vkCmdPipelineBarrier(cmd,
+                         src_stage,
+                         dst_stage,
+                         0,
+                         1,
+                         &barrier,
+                         0,
+                         NULL,
+                         0,
+                         NULL);
+}
+
+internal void AccelCreateStructure(Renderer *renderer,
+                                   Buffer *buffer,
+                                   const VkDeviceSize offset,
+                                   const VkDeviceSize size,
+                                   const VkAccelerationStructureTypeKHR type,
+                                   VkAccelerationStructureKHR *structure) {
+    VkAccelerationStructureCreateInfoKHR create_info = {0};
+    create_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+    create_info.buffer = buffer->buffer;
+    create_info.offset = offset;
+    create_info.size = size;
+    create_info.type = type;
+    AssertVkResult(
+        pfn_vkCreateAccelerationStructureKHR(renderer->device, &create_info, NULL, structure));
+    const char *name = type == VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR ? "TLAS" : "BLAS";
+    DEBUGNameObject(
+        renderer->device, (u64)*structure, VK_OBJECT_TYPE_ACCELERATION_STRUCTURE_KHR, name);
+}
+
+// Creates the uncompacted structures of every primitive of the mesh in a single buffer.
+// Returns the scratch size the build needs, regions are aligned for the device.
+internal VkDeviceSize BlasBatchPrepare(Renderer *renderer, BlasBatch *batch, Mesh *mesh) {
+    const u32 count = mesh->total_primitives_count;
+    const VkDeviceSize scratch_alignment = renderer->accel_scratch_alignment;
+    batch->count = count;
+    batch->scratch_alignment = scratch_alignment;
+    batch->geometries = (VkAccelerationStructureGeometryKHR *)sCalloc(
+        count, sizeof(VkAccelerationStructureGeometryKHR));
+    batch->infos = (VkAccelerationStructureBuildGeometryInfoKHR *)sCalloc(
+        count, sizeof(VkAccelerationStructureBuildGeometryInfoKHR));
+    batch->ranges = (VkAccelerationStructureBuildRangeInfoKHR *)sCalloc(
+        count, sizeof(VkAccelerationStructureBuildRangeInfoKHR));
+    batch->offsets = (VkDeviceSize *)sCalloc(count, sizeof(VkDeviceSize));
+    batch->scratch_offsets = (VkDeviceSize *)sCalloc(count, sizeof(VkDeviceSize));
+    batch->sizes = (VkDeviceSize *)sCalloc(count, sizeof(VkDeviceSize));
+    batch->structures =
+        (VkAccelerationStructureKHR *)sCalloc(count, sizeof(VkAccelerationStructureKHR));
+
+    const VkDeviceAddress vertices = mesh->buffer->address;
+    const VkDeviceAddress indices = mesh->buffer->address + mesh->all_index_offset;
+    VkDeviceSize scratch_size = 0;
+    batch->build_size = 0;
+    for(u32 i = 0; i < count; ++i) {
+        const Primitive *primitive = &mesh->primitives[i];
+        const u32 triangle_count = primitive->index_count / 3;
+
+        VkAccelerationStructureGeometryKHR *geometry = &batch->geometries[i];
+        geometry->sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+        geometry->geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+        geometry->flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+        VkAccelerationStructureGeometryTrianglesDataKHR *triangles = &geometry->geometry.triangles;
+        triangles->sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
+        triangles->vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+        triangles->vertexData.deviceAddress =
+            vertices + (VkDeviceAddress)primitive->vertex_offset * sizeof(Vertex);
+        triangles->vertexStride = sizeof(Vertex);
+        triangles->maxVertex = primitive->vertex_count > 0 ? primitive->vertex_count - 1 : 0;
+        triangles->indexType = VK_INDEX_TYPE_UINT32;
+        triangles->indexData.deviceAddress =
+            indices + (VkDeviceAddress)primitive->index_offset * sizeof(u32);
+
+        VkAccelerationStructureBuildGeometryInfoKHR *info = &batch->infos[i];
+        info->sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        info->type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        info->flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR |
+                      VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+        info->mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        info->geometryCount = 1;
+        info->pGeometries = geometry;
+
+        batch->ranges[i] = (VkAccelerationStructureBuildRangeInfoKHR){triangle_count, 0, 0, 0};
+
+        VkAccelerationStructureBuildSizesInfoKHR size_info = {0};
+        size_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+        pfn_vkGetAccelerationStructureBuildSizesKHR(renderer->device,
+                                                    VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+                                                    info,
+                                                    &triangle_count,
+                                                    &size_info);
+        batch->sizes[i] = size_info.accelerationStructureSize;
+        batch->offsets[i] = batch->build_size;
+        batch->build_size += AccelAlign(batch->sizes[i], ACCEL_OFFSET_ALIGNMENT);
+        batch->scratch_offsets[i] = scratch_size;
+        scratch_size += AccelAlign(size_info.buildScratchSize, scratch_alignment);
+    }
+
+    CreateBuffer(renderer->device,
+                 &renderer->memory_properties,
+                 batch->build_size,
+                 VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR |
+                     VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 &batch->buffer);
+    DEBUGNameBuffer(renderer->device, &batch->buffer, "BLAS Build");
+    for(u32 i = 0; i < count; ++i) {
+        AccelCreateStructure(renderer,
+                             &batch->buffer,
+                             batch->offsets[i],
+                             batch->sizes[i],
+                             VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
+                             &batch->structures[i]);
+        batch->infos[i].dstAccelerationStructure = batch->structures[i];
+    }
+
+    VkQueryPoolCreateInfo query_ci = {0};
+    query_ci.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    query_ci.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+    query_ci.queryCount = count;
+    AssertVkResult(vkCreateQueryPool(renderer->device, &query_ci, NULL, &batch->query_pool));
+
+    // The scratch buffer address itself may not be aligned
+    return scratch_size + scratch_alignment;
+}
+
+// Records the builds of every structure of the batch followed by the compacted size queries.
+// The geometry must be readable by the acceleration structure build stage.
+internal void BlasBatchRecord(BlasBatch *batch, VkCommandBuffer cmd, Buffer *scratch) {
+    const VkDeviceAddress scratch_base = AccelAlign(scratch->address, batch->scratch_alignment);
+    const VkAccelerationStructureBuildRangeInfoKHR **ranges =
+        (const VkAccelerationStructureBuildRangeInfoKHR **)sCalloc(
+            batch->count, sizeof(VkAccelerationStructureBuildRangeInfoKHR *));
+    for(u32 i = 0; i < batch->count; ++i) {
+        batch->infos[i].scratchData.deviceAddress = scratch_base + batch->scratch_offsets[i];
+        ranges[i] = &batch->ranges[i];
+    }
+
+    // The scratch buffer is shared with the builds of the other loads on this queue
+    AccelBarrier(cmd,
+                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                 VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                 VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR |
+                     VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR);
+    vkCmdResetQueryPool(cmd, batch->query_pool, 0, batch->count);
+    pfn_vkCmdBuildAccelerationStructuresKHR(cmd, batch->count, batch->infos, ranges);
+    sFree(ranges);
+
+    AccelBarrier(cmd,
+                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                 VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                 VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR);
+    pfn_vkCmdWriteAccelerationStructuresPropertiesKHR(
+        cmd,
+        batch->count,
+        batch->structures,
+        VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+        batch->query_pool,
+        0);
+}
+
+// The builds are done : creates the compacted structures and records the copies into them
+internal void BlasBatchCompact(Renderer *renderer,
+                               BlasBatch *batch,
+                               VkCommandBuffer cmd,
+                               BlasSet *blas) {
+    VkDeviceSize *compacted_sizes = (VkDeviceSize *)sCalloc(batch->count, sizeof(VkDeviceSize));
+    AssertVkResult(vkGetQueryPoolResults(renderer->device,
+                                         batch->query_pool,
+                                         0,
+                                         batch->count,
+                                         batch->count * sizeof(VkDeviceSize),
+                                         compacted_sizes,
+                                         sizeof(VkDeviceSize),
+                                         VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+
+    VkDeviceSize *offsets = (VkDeviceSize *)sCalloc(batch->count, sizeof(VkDeviceSize));
+    batch->compacted_size = 0;
+    for(u32 i = 0; i < batch->count; ++i) {
+        offsets[i] = batch->compacted_size;
+        batch->compacted_size += AccelAlign(compacted_sizes[i], ACCEL_OFFSET_ALIGNMENT);
+    }
+
+    blas->count = batch->count;
+    blas->structures =
+        (VkAccelerationStructureKHR *)sCalloc(batch->count, sizeof(VkAccelerationStructureKHR));
+    blas->addresses = (VkDeviceAddress *)sCalloc(batch->count, sizeof(VkDeviceAddress));
+    CreateBuffer(renderer->device,
+                 &renderer->memory_properties,
+                 batch->compacted_size,
+                 VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR |
+                     VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 &blas->buffer);
+    DEBUGNameBuffer(renderer->device, &blas->buffer, "BLAS");
+
+    // The builds were made visible to the host by the fence, not to this submission
+    AccelBarrier(cmd,
+                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                 VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                 VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR);
+    for(u32 i = 0; i < batch->count; ++i) {
+        AccelCreateStructure(renderer,
+                             &blas->buffer,
+                             offsets[i],
+                             compacted_sizes[i],
+                             VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
+                             &blas->structures[i]);
+
+        VkAccelerationStructureDeviceAddressInfoKHR address_info = {0};
+        address_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+        address_info.accelerationStructure = blas->structures[i];
+        blas->addresses[i] =
+            pfn_vkGetAccelerationStructureDeviceAddressKHR(renderer->device, &address_info);
+
+        VkCopyAccelerationStructureInfoKHR copy = {0};
+        copy.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR;
+        copy.src = batch->structures[i];
+        copy.dst = blas->structures[i];
+        copy.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+        pfn_vkCmdCopyAccelerationStructureKHR(cmd, &copy);
+    }
+
+    sFree(offsets);
+    sFree(compacted_sizes);
+}
+
+// Destroys the uncompacted structures, valid on a zeroed batch
+internal void BlasBatchFree(Renderer *renderer, BlasBatch *batch) {
+    for(u32 i = 0; i < batch->count; ++i) {
+        pfn_vkDestroyAccelerationStructureKHR(renderer->device, batch->structures[i], NULL);
+    }
+    if(batch->count > 0) {
+        DestroyBuffer(renderer->device, &batch->buffer);
+        vkDestroyQueryPool(renderer->device, batch->query_pool, NULL);
+    }
+    sFree(batch->geometries);
+    sFree(batch->infos);
+    sFree(batch->ranges);
+    sFree(batch->offsets);
+    sFree(batch->scratch_offsets);
+    sFree(batch->sizes);
+    sFree(batch->structures);
+    *batch = (BlasBatch){0};
+}
+
+internal void BlasSetDestroy(Renderer *renderer, BlasSet *blas) {
+    for(u32 i = 0; i < blas->count; ++i) {
+        pfn_vkDestroyAccelerationStructureKHR(renderer->device, blas->structures[i], NULL);
+    }
+    if(blas->count > 0) {
+        DestroyBuffer(renderer->device, &blas->buffer);
+    }
+    sFree(blas->structures);
+    sFree(blas->addresses);
+}
+
+// Top level acceleration structure over every primitive of every instance. The records live in a
+// persistently mapped array written with the instance buffers. Moving instances only refit the
+// structure, it is built again when the records change or once refitting degraded it too much.
+
+#define TLAS_MAX_UPDATES 600 // Refits before a full build regardless of the motion
+#define TLAS_DRIFT_RATIO 8   // Full build once more than 1 / TLAS_DRIFT_RATIO records drifted
+#define TLAS_DRIFT_RADII 2.f // Drifted : moved further than this many radii from the last build
+
+// Room for count records. Their contents are lost, the caller writes all of them again.
+internal void TlasReserve(Renderer *renderer, Tlas *tlas, const u32 count) {
+    tlas->count = count;
+    if(count <= tlas->capacity) {
+        return;
+    }
+    // The frames wait for the graphics queue to be idle, nothing reads the old array
+    if(tlas->capacity > 0) {
+        UnmapBuffer(renderer->device, &tlas->instances);
+        DestroyBuffer(renderer->device, &tlas->instances);
+    }
+    u32 capacity = tlas->capacity > 0 ? tlas->capacity : 64;
+    while(capacity < count) {
+        capacity *= 2;
+    }
+    tlas->capacity = capacity;
+    CreateBuffer(renderer->device,
+                 &renderer->memory_properties,
+                 (VkDeviceSize)capacity * sizeof(VkAccelerationStructureInstanceKHR),
+                 VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
+                     VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 &tlas->instances);
+    DEBUGNameBuffer(renderer->device, &tlas->instances, "TLAS Instances");
+    MapBuffer(renderer->device, &tlas->instances, (void **)&tlas->instance_data);
+
+    sFree(tlas->centers);
+    sFree(tlas->build_centers);
+    sFree(tlas->drifted);
+    tlas->centers = (Vec3 *)sCalloc(capacity, sizeof(Vec3));
+    tlas->build_centers = (Vec3 *)sCalloc(capacity, sizeof(Vec3));
+    tlas->drifted = (bool *)sCalloc(capacity, sizeof(bool));
+}
+
+// Writes a record, transform is the world matrix of the primitive instance
+internal void TlasWriteRecord(Tlas *tlas,
+                              const u32 record,
+                              const Mat4 *transform,
+                              const VkDeviceAddress blas,
+                              const u32 custom_index,
+                              const Vec3 center,
+                              const f32 radius) {
+    VkAccelerationStructureInstanceKHR instance = {0};
+    for(u32 r = 0; r < 3; ++r) {
+        for(u32 c = 0; c < 4; ++c) {
+            instance.transform.matrix[r][c] = transform->m[c][r];
+        }
+    }
+    instance.instanceCustomIndex = custom_index;
+    instance.mask = 0xFF;
+    instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+    instance.accelerationStructureReference = blas;
+    // Write combined memory : one store of the whole record
+    tlas->instance_data[record] = instance;
+
+    tlas->centers[record] = center;
+    tlas->transforms_dirty = true;
+    if(!tlas->drifted[record] && !tlas->layout_dirty) {
+        const f32 drift = vec3_length(vec3_sub(center, tlas->build_centers[record]));
+        if(drift > radius * TLAS_DRIFT_RADII) {
+            tlas->drifted[record] = true;
+            ++tlas->drifted_count;
+        }
+    }
+}
+
+// Records the build or the refit of the structure if any record changed. The structure can be
+// read by ray queries in the fragment shaders afterwards.
+internal void TlasRecordBuild(Renderer *renderer, Tlas *tlas, VkCommandBuffer cmd) {
+    if(tlas->count == 0 || !(tlas->layout_dirty || tlas->transforms_dirty)) {
+        return;
+    }
+    const bool rebuild = tlas->layout_dirty || tlas->update_count >= TLAS_MAX_UPDATES ||
+                         tlas->drifted_count * TLAS_DRIFT_RATIO > tlas->count;
+
+    VkAccelerationStructureGeometryKHR geometry = {0};
+    geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+    geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+    geometry.geometry.instances.sType =
+        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+    geometry.geometry.instances.arrayOfPointers = VK_FALSE;
+    geometry.geometry.instances.data.deviceAddress = tlas->instances.address;
+
+    VkAccelerationStructureBuildGeometryInfoKHR info = {0};
+    info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+    info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR |
+                 VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+    info.mode = rebuild ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR
+                        : VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR;
+    info.geometryCount = 1;
+    info.pGeometries = &geometry;
+
+    if(rebuild) {
+        VkAccelerationStructureBuildSizesInfoKHR size_info = {0};
+        size_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+        pfn_vkGetAccelerationStructureBuildSizesKHR(renderer->device,
+                                                    VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+                                                    &info,
+                                                    &tlas->count,
+                                                    &size_info);
+        // Nothing reads the previous structure anymore, the last frame is done
+        if(size_info.accelerationStructureSize > tlas->buffer.size) {
+            if(tlas->buffer.size > 0) {
+                pfn_vkDestroyAccelerationStructureKHR(renderer->device, tlas->structure, NULL);
+                DestroyBuffer(renderer->device, &tlas->buffer);
+            }
+            CreateBuffer(renderer->device,
+                         &renderer->memory_properties,
+                         size_info.accelerationStructureSize,
+                         VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR |
+                             VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR,
+                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                         &tlas->buffer);
+            DEBUGNameBuffer(renderer->device, &tlas->buffer, "TLAS");
+            AccelCreateStructure(renderer,
+                                 &tlas->buffer,
+                                 0,
+                                 tlas->buffer.size,
+                                 VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR,
+                                 &tlas->structure);
+            ++tlas->generation;
+        }
+        // Refits use the scratch buffer of the build they come from
+        const VkDeviceSize scratch_size =
+            (size_info.buildScratchSize > size_info.updateScratchSize
+                 ? size_info.buildScratchSize
+                 : size_info.updateScratchSize) +
+            renderer->accel_scratch_alignment;
+        if(scratch_size > tlas->scratch.size) {
+            if(tlas->scratch.size > 0) {
+                DestroyBuffer(renderer->device, &tlas->scratch);
+            }
+            CreateBuffer(renderer->device,
+                         &renderer->memory_properties,
+                         scratch_size,
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                             VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR,
+                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                         &tlas->scratch);
+            DEBUGNameBuffer(renderer->device, &tlas->scratch, "TLAS Scratch");
+        }
+
+        memcpy(tlas->build_centers, tlas->centers, tlas->count * sizeof(Vec3));
+        memset(tlas->drifted, 0, tlas->count * sizeof(bool));
+        tlas->drifted_count = 0;
+        tlas->update_count = 0;
+        ++tlas->build_count;
+    } else {
+        info.srcAccelerationStructure = tlas->structure;
+        ++tlas->update_count;
+    }
+    info.dstAccelerationStructure = tlas->structure;
+    info.scratchData.deviceAddress =
+        AccelAlign(tlas->scratch.address, renderer->accel_scratch_alignment);
+
+    const VkAccelerationStructureBuildRangeInfoKHR range = {tlas->count, 0, 0, 0};
+    const VkAccelerationStructureBuildRangeInfoKHR *ranges[] = {&range};
+
+    // The BLAS copies of the loads and the previous build are on this queue too, the last frame
+    // traced it from the fragment shaders and the froxel injection
+    AccelBarrier(cmd,
+                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR |
+                     VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+                     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                 VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                 VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR |
+                     VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR);
+    pfn_vkCmdBuildAccelerationStructuresKHR(cmd, 1, &info, ranges);
+    AccelBarrier(cmd,
+                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                 VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+                 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                 VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR);
+
+    tlas->layout_dirty = false;
+    tlas->transforms_dirty = false;
+}
+
+// Bound while the scene has no instances, descriptors can't be null without the nullDescriptor
+// feature of robustness2. Its only record is inactive so every ray misses.
+internal void TlasCreateEmpty(Renderer *renderer, Tlas *tlas) {
+    *tlas = (Tlas){0};
+    tlas->layout_dirty = true;
+    TlasReserve(renderer, tlas, 1);
+    const Mat4 identity = mat4_identity();
+    TlasWriteRecord(tlas, 0, &identity, 0, 0, (Vec3){0.0f, 0.0f, 0.0f}, 0.0f);
+
+    VkCommandBuffer cmd;
+    AllocateAndBeginCommandBuffer(renderer->device, renderer->graphics_command_pool, &cmd);
+    TlasRecordBuild(renderer, tlas, cmd);
+    EndAndExecuteCommandBuffer(
+        renderer->device, renderer->graphics_queue, renderer->graphics_command_pool, cmd);
+}
+
+// Structure the shaders trace against. The empty one while there are no instances, the last
+// build may still reference the BLAS of destroyed meshes.
+internal VkAccelerationStructureKHR TlasShaderStructure(const Renderer *renderer) {
+    return renderer->tlas.count > 0 ? renderer->tlas.structure : renderer->empty_tlas.structure;
+}
+
+internal void TlasWriteDescriptor(Renderer *renderer, VkDescriptorSet set, const u32 binding) {
+    const VkAccelerationStructureKHR structure = TlasShaderStructure(renderer);
+
+    VkWriteDescriptorSetAccelerationStructureKHR structure_write = {0};
+    structure_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
+    structure_write.pNext = NULL;
+    structure_write.accelerationStructureCount = 1;
+    structure_write.pAccelerationStructures = &structure;
+
+    VkWriteDescriptorSet write = {0};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.pNext = &structure_write;
+    write.dstSet = set;
+    write.dstBinding = binding;
+    write.dstArrayElement = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+    vkUpdateDescriptorSets(renderer->device, 1, &write, 0, NULL);
+
+    renderer->tlas_bound = structure;
+    renderer->tlas_bound_generation = renderer->tlas.generation;
+}
+
+internal void TlasFree(Renderer *renderer, Tlas *tlas) {
+    if(tlas->capacity > 0) {
+        UnmapBuffer(renderer->device, &tlas->instances);
+        DestroyBuffer(renderer->device, &tlas->instances);
+    }
+    if(tlas->buffer.size > 0) {
+        pfn_vkDestroyAccelerationStructureKHR(renderer->device, tlas->structure, NULL);
+        DestroyBuffer(renderer->device, &tlas->buffer);
+    }
+    if(tlas->scratch.size > 0) {
+        DestroyBuffer(renderer->device, &tlas->scratch);
+    }
+    sFree(tlas->centers);
+    sFree(tlas->build_centers);
+    sFree(tlas->drifted);
+    *tlas = (Tlas){0};
+}
@@ -289,6 +289,147 @@ internal void CreateImage(const VkDevice device,
     AssertVkResult(vkCreateImageView(device, &image_view_ci, NULL, &image->image_view));
 }
 
+// Same as CreateImage with layer_count layers, image_view is a 2D array view over all of them
+internal void CreateImageArray(const VkDevice device,
+                               const VkPhysicalDeviceMemoryProperties *memory_properties,
+                               const VkFormat format,
+                               const VkExtent2D extent,
+                               const u32 layer_count,
+                               const VkImageUsageFlags usage,
+                               const VkMemoryPropertyFlags memory_flags,
+                               Image *image) {
+    VkImageCreateInfo image_ci = {0};
+    image_ci.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_ci.pNext = NULL;
+    image_ci.flags = 0;
+    image_ci.imageType = VK_IMAGE_TYPE_2D;
+    image_ci.format = format;
+    image_ci.extent = (VkExtent3D){extent.width, extent.height, 1};
+    image_ci.mipLevels = 1;
+    image_ci.arrayLayers = layer_count;
+    image_ci.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_ci.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_ci.usage = usage;
+    image_ci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_ci.queueFamilyIndexCount = 0;
+    image_ci.pQueueFamilyIndices = 0;
+    image_ci.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    AssertVkResult(vkCreateImage(device, &image_ci, NULL, &image->image));
+
+    VkMemoryRequirements requirements = {0};
+    vkGetImageMemoryRequirements(device, image->image, &requirements);
+
+    VkMemoryAllocateInfo alloc_info = {0};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.pNext = NULL;
+    alloc_info.allocationSize = requirements.size;
+    alloc_info.memoryTypeIndex =
+        FindMemoryType(memory_properties, requirements.memoryTypeBits, memory_flags);
+    AssertVkResult(vkAllocateMemory(device, &alloc_info, NULL, &image->memory));
+
+    AssertVkResult(vkBindImageMemory(device, image->image, image->memory, 0));
+
+    VkImageViewCreateInfo image_view_ci = {0};
+    image_view_ci.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    image_view_ci.pNext = NULL;
+    image_view_ci.flags = 0;
+    image_view_ci.image = image->image;
+    image_view_ci.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+    image_view_ci.format = format;
+    image_view_ci.components = (VkComponentMapping){VK_COMPONENT_SWIZZLE_IDENTITY,
+                                                    VK_COMPONENT_SWIZZLE_IDENTITY,
+                                                    VK_COMPONENT_SWIZZLE_IDENTITY,
+                                                    VK_COMPONENT_SWIZZLE_IDENTITY};
+    if(usage & VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT)
+        image_view_ci.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    else
+        image_view_ci.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    image_view_ci.subresourceRange.baseMipLevel = 0;
+    image_view_ci.subresourceRange.levelCount = 1;
+    image_view_ci.subresourceRange.baseArrayLayer = 0;
+    image_view_ci.subresourceRange.layerCount = layer_count;
+    AssertVkResult(vkCreateImageView(device, &image_view_ci, NULL, &image->image_view));
+}
+
+// Color image of depth slices, image_view is a 3D view
+internal void CreateImage3D(const VkDevice device,
+                            const VkPhysicalDeviceMemoryProperties *memory_properties,
+                            const VkFormat format,
+                            const VkExtent3D extent,
+                            const VkImageUsageFlags usage,
+                            const VkMemoryPropertyFlags memory_flags,
+                            Image *image) {
+    VkImageCreateInfo image_ci = {0};
+    image_ci.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_ci.pNext = NULL;
+    image_ci.flags = 0;
+    image_ci.imageType = VK_IMAGE_TYPE_3D;
+    image_ci.format = format;
+    image_ci.extent = extent;
+    image_ci.mipLevels = 1;
+    image_ci.arrayLayers = 1;
+    image_ci.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_ci.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_ci.usage = usage;
+    image_ci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_ci.queueFamilyIndexCount = 0;
+    image_ci.pQueueFamilyIndices = 0;
+    image_ci.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    AssertVkResult(vkCreateImage(device, &image_ci, NULL, &image->image));
+
+    VkMemoryRequirements requirements = {0};
+    vkGetImageMemoryRequirements(device, image->image, &requirements);
+
+    VkMemoryAllocateInfo alloc_info = {0};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.pNext = NULL;
+    alloc_info.allocationSize = requirements.size;
+    alloc_info.memoryTypeIndex =
+        FindMemoryType(memory_properties, requirements.memoryTypeBits, memory_flags);
+    AssertVkResult(vkAllocateMemory(device, &alloc_info, NULL, &image->memory));
+
+    AssertVkResult(vkBindImageMemory(device, image->image, image->memory, 0));
+
+    VkImageViewCreateInfo image_view_ci = {0};
+    image_view_ci.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    image_view_ci.pNext = NULL;
+    image_view_ci.flags = 0;
+    image_view_ci.image = image->image;
+    image_view_ci.viewType = VK_IMAGE_VIEW_TYPE_3D;
+    image_view_ci.format = format;
+    image_view_ci.components = (VkComponentMapping){VK_COMPONENT_SWIZZLE_IDENTITY,
+                                                    VK_COMPONENT_SWIZZLE_IDENTITY,
+                                                    VK_COMPONENT_SWIZZLE_IDENTITY,
+                                                    VK_COMPONENT_SWIZZLE_IDENTITY};
+    image_view_ci.subresourceRange =
+        (VkImageSubresourceRange){VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    AssertVkResult(vkCreateImageView(device, &image_view_ci, NULL, &image->image_view));
+}
+
+// 2D view of a single layer of an image, to render into it
+internal void CreateImageLayerView(const VkDevice device,
+                                   const Image *image,
+                                   const VkFormat format,
+                                   const VkImageAspectFlags aspect,
+                                   const u32 layer,
+                                   VkImageView *view) {
+    VkImageViewCreateInfo image_view_ci = {0};
+    image_view_ci.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    image_view_ci.pNext = NULL;
+    image_view_ci.flags = 0;
+    image_view_ci.image = image->image;
+    image_view_ci.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    image_view_ci.format = format;
+    image_view_ci.components = (VkComponentMapping){VK_COMPONENT_SWIZZLE_IDENTITY,
+                                                    VK_COMPONENT_SWIZZLE_IDENTITY,
+                                                    VK_COMPONENT_SWIZZLE_IDENTITY,
+                                                    VK_COMPONENT_SWIZZLE_IDENTITY};
+    image_view_ci.subresourceRange = (VkImageSubresourceRange){aspect, 0, 1, layer, 1};
+    AssertVkResult(vkCreateImageView(device, &image_view_ci, NULL, view));
+}
+
 internal void CreateMultiSampledImage(const VkDevice device,
                                       const VkPhysicalDeviceMemoryProperties *memory_properties,
                                       const VkFormat format,
@@ -357,29 +498,101 @@ internal void CreateMultiSampledImage(const VkDevice device,
     AssertVkResult(vkCreateImageView(device, &image_view_ci, NULL, &image->image_view));
 }
 
-internal void
-CopyBufferToImage(VkCommandBuffer cmd, VkExtent2D extent, Buffer *image_buffer, Image *image) {
+// Same as CreateMultiSampledImage without the memory, BindImage places it in memory shared with
+// other images
+internal void CreateUnboundImage(const VkDevice device,
+                                 const VkFormat format,
+                                 const VkExtent2D extent,
+                                 const VkImageUsageFlags usage,
+                                 VkSampleCountFlagBits sample_count,
+                                 Image *image,
+                                 VkMemoryRequirements *requirements) {
+    VkImageCreateInfo image_ci = {0};
+    image_ci.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_ci.pNext = NULL;
+    image_ci.flags = 0;
+    image_ci.imageType = VK_IMAGE_TYPE_2D;
+    image_ci.format = format;
+    image_ci.extent = (VkExtent3D){extent.width, extent.height, 1};
+    image_ci.mipLevels = 1;
+    image_ci.arrayLayers = 1;
+    image_ci.samples = sample_count;
+    image_ci.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_ci.usage = usage;
+    image_ci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_ci.queueFamilyIndexCount = 0;
+    image_ci.pQueueFamilyIndices = 0;
+    image_ci.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    AssertVkResult(vkCreateImage(device, &image_ci, NULL, &image->image));
+    vkGetImageMemoryRequirements(device, image->image, requirements);
+    image->memory = VK_NULL_HANDLE; // Not owned, DestroyImage leaves it
+    image->image_view = VK_NULL_HANDLE;
+}
+
+// Binds an image from CreateUnboundImage at offset in memory and creates its view
+internal void BindImage(const VkDevice device,
+                        VkDeviceMemory memory,
+                        const VkDeviceSize offset,
+                        const VkFormat format,
+                        const VkImageUsageFlags usage,
+                        Image *image) {
+    AssertVkResult(vkBindImageMemory(device, image->image, memory, offset));
+
+    VkImageViewCreateInfo image_view_ci = {0};
+    image_view_ci.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    image_view_ci.pNext = NULL;
+    image_view_ci.flags = 0;
+    image_view_ci.image = image->image;
+    image_view_ci.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    image_view_ci.format = format;
+    image_view_ci.components = (VkComponentMapping){VK_COMPONENT_SWIZZLE_IDENTITY,
+                                                    VK_COMPONENT_SWIZZLE_IDENTITY,
+                                                    VK_COMPONENT_SWIZZLE_IDENTITY,
+                                                    VK_COMPONENT_SWIZZLE_IDENTITY};
+    if(usage & VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT)
+        image_view_ci.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    else
+        image_view_ci.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    image_view_ci.subresourceRange.baseMipLevel = 0;
+    image_view_ci.subresourceRange.levelCount = 1;
+    image_view_ci.subresourceRange.baseArrayLayer = 0;
+    image_view_ci.subresourceRange.layerCount = 1;
+    AssertVkResult(vkCreateImageView(device, &image_view_ci, NULL, &image->image_view));
+}
+
+// Copies the buffer to a rect of the image. Pass VK_IMAGE_LAYOUT_UNDEFINED as old_layout if the
+// previous contents can be discarded, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL to keep them.
+internal void CopyBufferToImageRegion(VkCommandBuffer cmd,
+                                      const VkOffset2D offset,
+                                      const VkExtent2D extent,
+                                      const VkImageLayout old_layout,
+                                      Buffer *image_buffer,
+                                      Image *image) {
     VkBufferImageCopy region = {0};
     region.bufferOffset = 0;
     region.bufferRowLength = 0;
     region.bufferImageHeight = 0;
     region.imageSubresource = (VkImageSubresourceLayers){VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
-    region.imageOffset = (VkOffset3D){0, 0, 0};
+    region.imageOffset = (VkOffset3D){offset.x, offset.y, 0};
     region.imageExtent = (VkExtent3D){extent.width, extent.height, 1};
 
     VkImageMemoryBarrier barrier = {0};
     barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
     barrier.pNext = NULL;
-    barrier.srcAccessMask = 0;
+    barrier.srcAccessMask =
+        old_layout == VK_IMAGE_LAYOUT_UNDEFINED ? 0 : VK_ACCESS_SHADER_READ_BIT;
     barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.oldLayout = old_layout;
     barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
     barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     barrier.image = image->image;
     barrier.subresourceRange = (VkImageSubresourceRange){VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
     vkCmdPipelineBarrier(cmd,
-                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         old_layout == VK_IMAGE_LAYOUT_UNDEFINED
+                             ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT
+                             : VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
                          VK_PIPELINE_STAGE_TRANSFER_BIT,
                          0,
                          0,
@@ -415,6 +628,176 @@ CopyBufferToImage(VkCommandBuffer cmd, VkExtent2D extent, Buffer *image_buffer,
                          &barrier2);
 }
 
+internal void
+CopyBufferToImage(VkCommandBuffer cmd, VkExtent2D extent, Buffer *image_buffer, Image *image) {
+    CopyBufferToImageRegion(
+        cmd, (VkOffset2D){0, 0}, extent, VK_IMAGE_LAYOUT_UNDEFINED, image_buffer, image);
+}
+
+// Copies a staging buffer to a new image on the transfer queue and hands the image over to the
+// graphics queue in the SHADER_READ_ONLY layout. If both queues are from the same family there is
+// no ownership to transfer and everything is recorded in transfer_cmd.
+internal void CopyBufferToImageAcrossQueues(VkCommandBuffer transfer_cmd,
+                                            VkCommandBuffer graphics_cmd,
+                                            const u32 transfer_family,
+                                            const u32 graphics_family,
+                                            const VkExtent2D extent,
+                                            Buffer *image_buffer,
+                                            Image *image) {
+    VkBufferImageCopy region = {0};
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource = (VkImageSubresourceLayers){VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.imageOffset = (VkOffset3D){0, 0, 0};
+    region.imageExtent = (VkExtent3D){extent.width, extent.height, 1};
+
+    VkImageMemoryBarrier barrier = {0};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.pNext = NULL;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image->image;
+    barrier.subresourceRange = (VkImageSubresourceRange){VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    vkCmdPipelineBarrier(transfer_cmd,
+                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0,
+                         0,
+                         NULL,
+                         0,
+                         NULL,
+                         1,
+                         &barrier);
+
+    vkCmdCopyBufferToImage(transfer_cmd,
+                           image_buffer->buffer,
+                           image->image,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           1,
+                           &region);
+
+    VkImageMemoryBarrier release = barrier;
+    release.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    release.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    release.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    if(transfer_family == graphics_family) {
+        release.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(transfer_cmd,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                             0,
+                             0,
+                             NULL,
+                             0,
+                             NULL,
+                             1,
+                             &release);
+        return;
+    }
+
+    release.dstAccessMask = 0;
+    release.srcQueueFamilyIndex = transfer_family;
+    release.dstQueueFamilyIndex = graphics_family;
+    vkCmdPipelineBarrier(transfer_cmd,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                         0,
+                         0,
+                         NULL,
+                         0,
+                         NULL,
+                         1,
+                         &release);
+
+    VkImageMemoryBarrier acquire = release;
+    acquire.srcAccessMask = 0;
+    acquire.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(graphics_cmd,
+                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                         0,
+                         0,
+                         NULL,
+                         0,
+                         NULL,
+                         1,
+                         &acquire);
+}
+
+// Same as CopyBufferToImageAcrossQueues for buffers. dst_stage and dst_access describe how the
+// graphics queue will use the buffer.
+internal void CopyBufferAcrossQueues(VkCommandBuffer transfer_cmd,
+                                     VkCommandBuffer graphics_cmd,
+                                     const u32 transfer_family,
+                                     const u32 graphics_family,
+                                     Buffer *src,
+                                     Buffer *dst,
+                                     const VkDeviceSize size,
+                                     const VkPipelineStageFlags dst_stage,
+                                     const VkAccessFlags dst_access) {
+    VkBufferCopy region = {0, 0, size};
+    vkCmdCopyBuffer(transfer_cmd, src->buffer, dst->buffer, 1, &region);
+
+    VkBufferMemoryBarrier release = {0};
+    release.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    release.pNext = NULL;
+    release.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    release.buffer = dst->buffer;
+    release.offset = 0;
+    release.size = size;
+
+    if(transfer_family == graphics_family) {
+        release.dstAccessMask = dst_access;
+        release.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        release.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        vkCmdPipelineBarrier(transfer_cmd,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             dst_stage,
+                             0,
+                             0,
+                             NULL,
+                             1,
+                             &release,
+                             0,
+                             NULL);
+        return;
+    }
+
+    release.dstAccessMask = 0;
+    release.srcQueueFamilyIndex = transfer_family;
+    release.dstQueueFamilyIndex = graphics_family;
+    vkCmdPipelineBarrier(transfer_cmd,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                         0,
+                         0,
+                         NULL,
+                         1,
+                         &release,
+                         0,
+                         NULL);
+
+    VkBufferMemoryBarrier acquire = release;
+    acquire.srcAccessMask = 0;
+    acquire.dstAccessMask = dst_access;
+    vkCmdPipelineBarrier(graphics_cmd,
+                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         dst_stage,
+                         0,
+                         0,
+                         NULL,
+                         1,
+                         &acquire,
+                         0,
+                         NULL);
+}
+
 internal void DestroyImage(const VkDevice device, Image *image) {
     vkDestroyImage(device, image->image, NULL);
     vkDestroyImageView(device, image->image_view, NULL);
@@ -462,12 +845,60 @@ internal void EndAndExecuteCommandBuffer(const VkDevice device,
     vkFreeCommandBuffers(device, pool, 1, &cmd);
 }
 
+// Copies data into a device local buffer through a staging buffer
+internal void UploadToDeviceBuffer(const VkDevice device,
+                                   VkPhysicalDeviceMemoryProperties *memory_properties,
+                                   const VkCommandPool pool,
+                                   const VkQueue queue,
+                                   Buffer *buffer,
+                                   const VkDeviceSize offset,
+                                   void *data,
+                                   const VkDeviceSize size) {
+    Buffer staging;
+    CreateBuffer(device,
+                 memory_properties,
+                 size,
+                 VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 &staging);
+    UploadToBuffer(device, &staging, data, size);
+
+    VkCommandBuffer cmd;
+    AllocateAndBeginCommandBuffer(device, pool, &cmd);
+    VkBufferCopy region = {0, offset, size};
+    vkCmdCopyBuffer(cmd, staging.buffer, buffer->buffer, 1, &region);
+    EndAndExecuteCommandBuffer(device, queue, pool, cmd);
+
+    DestroyBuffer(device, &staging);
+}
+
+internal void
+VulkanUpdateMaterialDescriptorSet(VkDevice device, VkDescriptorSet set, Buffer *materials) {
+    VkDescriptorBufferInfo buffer_info = {materials->buffer, 0, VK_WHOLE_SIZE};
+
+    VkWriteDescriptorSet write = {0};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.pNext = NULL;
+    write.dstSet = set;
+    write.dstBinding = 1;
+    write.dstArrayElement = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    write.pImageInfo = NULL;
+    write.pBufferInfo = &buffer_info;
+    write.pTexelBufferView = NULL;
+
+    vkUpdateDescriptorSets(device, 1, &write, 0, NULL);
+}
+
 // TODO update only the new textures
+// Freed slots get the fallback image, the array is fully bound and can't hold null descriptors
 internal void VulkanUpdateTextureDescriptorSet(VkDevice device,
                                                VkDescriptorSet set,
                                                VkSampler sampler,
                                                const u32 texture_count,
-                                               Image *textures) {
+                                               Image *textures,
+                                               const Image *fallback) {
     if(texture_count != 0) {
         const u32 nb_tex = texture_count;
         u32 nb_info = nb_tex > 0 ? nb_tex : 1;
@@ -482,7 +913,9 @@ internal void VulkanUpdateTextureDescriptorSet(VkDevice device,
                 images_info[i].imageView = VK_NULL_HANDLE;
                 break;
             }
-            images_info[i].imageView = textures[i].image_view;
+            images_info[i].imageView = textures[i].image_view != VK_NULL_HANDLE
+                                           ? textures[i].image_view
+                                           : fallback->image_view;
         }
 
         VkWriteDescriptorSet textures_buffer = {0};
@@ -5,7 +5,8 @@
 #include "renderer/renderer.h"
 
 inline VkPipelineVertexInputStateCreateInfo
-PipelineGetDefaultVertexInputState(const VkVertexInputBindingDescription *vtx_input_binding,
+PipelineGetDefaultVertexInputState(const u32 vtx_binding_count,
+                                   const VkVertexInputBindingDescription *vtx_input_bindings,
                                    const u32 vtx_desc_count,
                                    const VkVertexInputAttributeDescription *vtx_descriptions) {
     VkPipelineVertexInputStateCreateInfo vertex_input = {0};
@@ -13,8 +14,8 @@ PipelineGetDefaultVertexInputState(const VkVertexInputBindingDescription *vtx_in
     vertex_input.pNext = NULL;
     vertex_input.flags = 0;
 
-    vertex_input.vertexBindingDescriptionCount = 1;
-    vertex_input.pVertexBindingDescriptions = vtx_input_binding;
+    vertex_input.vertexBindingDescriptionCount = vtx_binding_count;
+    vertex_input.pVertexBindingDescriptions = vtx_input_bindings;
     vertex_input.vertexAttributeDescriptionCount = vtx_desc_count;
     vertex_input.pVertexAttributeDescriptions = vtx_descriptions;
     return vertex_input;
@@ -113,12 +114,17 @@ PipelineGetDefaultColorBlendState(const u32 attachement_cout,
     return color_blend_state;
 }
 
+// Without a fragment shader only the depth is written, for the prepass. When depth_prepassed
+// is set the depth is already laid down and only the fragments matching it are shaded.
 void PipelineCreateDefault(VkDevice device,
                            PlatformAPI *platform,
                            const char *vertex_shader,
                            const char *fragment_shader,
                            const VkExtent2D *extent,
                            const VkSampleCountFlagBits sample_count,
+                           const VkSpecializationInfo *fragment_specialization,
+                           const u32 color_count,
+                           const bool depth_prepassed,
                            const VkPipelineLayout layout,
                            const VkRenderPass render_pass,
                            VkPipeline *pipeline) {
@@ -136,28 +142,50 @@ void PipelineCreateDefault(VkDevice device,
     stages_ci[0].pName = "main";
     stages_ci[0].pSpecializationInfo = NULL;
 
-    stages_ci[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    stages_ci[1].pNext = NULL;
-    stages_ci[1].flags = 0;
-    stages_ci[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    CreateVkShaderModule(fragment_shader, device, platform, &stages_ci[1].module);
-    stages_ci[1].pName = "main";
-    stages_ci[1].pSpecializationInfo = NULL;
-    pipeline_ci.stageCount = 2;
+    pipeline_ci.stageCount = 1;
+    if(fragment_shader) {
+        stages_ci[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        stages_ci[1].pNext = NULL;
+        stages_ci[1].flags = 0;
+        stages_ci[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+        CreateVkShaderModule(fragment_shader, device, platform, &stages_ci[1].module);
+        stages_ci[1].pName = "main";
+        stages_ci[1].pSpecializationInfo = fragment_specialization;
+        pipeline_ci.stageCount = 2;
+    }
 
     pipeline_ci.pStages = stages_ci;
 
-    VkVertexInputBindingDescription vtx_input_binding = {0};
-    vtx_input_binding.binding = 0;
-    vtx_input_binding.stride = sizeof(Vertex);
-    vtx_input_binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    // Binding 1 holds the world, normal and previous world matrices of each instance, one column
+    // per location
+    VkVertexInputBindingDescription vtx_input_bindings[] = {
+        {0, sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX},
+        {1, sizeof(InstanceData), VK_VERTEX_INPUT_RATE_INSTANCE},
+    };
+    const u32 transform_offset = offsetof(InstanceData, transform);
+    const u32 normal_offset = offsetof(InstanceData, normal_matrix);
+    const u32 previous_offset = offsetof(InstanceData, previous_transform);
     VkVertexInputAttributeDescription vtx_descriptions[] = {
         {0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, pos)},
         {1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, normal)},
         {2, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(Vertex, uv)},
+        {3, 1, VK_FORMAT_R32G32B32A32_SFLOAT, transform_offset + 0 * sizeof(Vec4)},
+        {4, 1, VK_FORMAT_R32G32B32A32_SFLOAT, transform_offset + 1 * sizeof(Vec4)},
+        {5, 1, VK_FORMAT_R32G32B32A32_SFLOAT, transform_offset + 2 * sizeof(Vec4)},
+        {6, 1, VK_FORMAT_R32G32B32A32_SFLOAT, transform_offset + 3 * sizeof(Vec4)},
+        {7, 1, VK_FORMAT_R32G32B32_SFLOAT, normal_offset + 0 * sizeof(Vec4)},
+        {8, 1, VK_FORMAT_R32G32B32_SFLOAT, normal_offset + 1 * sizeof(Vec4)},
+        {9, 1, VK_FORMAT_R32G32B32_SFLOAT, normal_offset + 2 * sizeof(Vec4)},
+        {10, 1, VK_FORMAT_R32G32B32A32_SFLOAT, previous_offset + 0 * sizeof(Vec4)},
+        {11, 1, VK_FORMAT_R32G32B32A32_SFLOAT, previous_offset + 1 * sizeof(Vec4)},
+        {12, 1, VK_FORMAT_R32G32B32A32_SFLOAT, previous_offset + 2 * sizeof(Vec4)},
+        {13, 1, VK_FORMAT_R32G32B32A32_SFLOAT, previous_offset + 3 * sizeof(Vec4)},
     };
     VkPipelineVertexInputStateCreateInfo vertex_input =
-        PipelineGetDefaultVertexInputState(&vtx_input_binding, 3, vtx_descriptions);
+        PipelineGetDefaultVertexInputState(ARRAY_SIZE(vtx_input_bindings),
+                                           vtx_input_bindings,
+                                           ARRAY_SIZE(vtx_descriptions),
+                                           vtx_descriptions);
     pipeline_ci.pVertexInputState = &vertex_input;
 
     VkPipelineInputAssemblyStateCreateInfo input_assembly_state =
@@ -188,15 +216,24 @@ void PipelineCreateDefault(VkDevice device,
     pipeline_ci.pMultisampleState = &multisample_state;
 
     VkPipelineDepthStencilStateCreateInfo stencil_state = PipelineGetDefaultDepthStencilState();
+    if(depth_prepassed) {
+        stencil_state.depthWriteEnable = VK_FALSE;
+        stencil_state.depthCompareOp = VK_COMPARE_OP_EQUAL;
+    }
     pipeline_ci.pDepthStencilState = &stencil_state;
 
-    VkPipelineColorBlendAttachmentState color_blend_attachement = {0};
-    color_blend_attachement.blendEnable = VK_FALSE;
-    color_blend_attachement.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
-                                             VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    // The color and the motion vectors
+    VkPipelineColorBlendAttachmentState color_blend_attachements[2] = {0};
+    ASSERT(color_count <= ARRAY_SIZE(color_blend_attachements));
+    for(u32 i = 0; i < color_count; ++i) {
+        color_blend_attachements[i].blendEnable = VK_FALSE;
+        color_blend_attachements[i].colorWriteMask =
+            VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT |
+            VK_COLOR_COMPONENT_A_BIT;
+    }
     VkPipelineColorBlendStateCreateInfo color_blend_state =
-        PipelineGetDefaultColorBlendState(1, &color_blend_attachement);
-    pipeline_ci.pColorBlendState = &color_blend_state;
+        PipelineGetDefaultColorBlendState(color_count, color_blend_attachements);
+    pipeline_ci.pColorBlendState = fragment_shader ? &color_blend_state : NULL;
 
     pipeline_ci.pDynamicState = NULL; // TODO: look at this
     pipeline_ci.layout = layout;
@@ -207,6 +244,116 @@ void PipelineCreateDefault(VkDevice device,
     pipeline_ci.basePipelineIndex = 0;
 
     // TODO: handle pipeline caching
+    AssertVkResult(
+        vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipeline_ci, NULL, pipeline));
+
+    vkDeviceWaitIdle(device);
+    for(u32 i = 0; i < pipeline_ci.stageCount; ++i) {
+        vkDestroyShaderModule(device, pipeline_ci.pStages[i].module, NULL);
+    }
+}
+
+// Draws the 6 vertices quad of volumetric.vert over the whole target. The fragment shader output
+// is added to the targets when additive is set.
+void PipelineCreateFullscreen(VkDevice device,
+                              PlatformAPI *platform,
+                              const char *fragment_shader,
+                              const VkSpecializationInfo *specialization,
+                              const VkExtent2D *extent,
+                              const VkSampleCountFlagBits sample_count,
+                              const bool additive,
+                              const u32 color_count,
+                              const VkPipelineLayout layout,
+                              const VkRenderPass render_pass,
+                              VkPipeline *pipeline) {
+    VkGraphicsPipelineCreateInfo pipeline_ci;
+    pipeline_ci.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipeline_ci.pNext = NULL;
+    pipeline_ci.flags = 0;
+
+    VkPipelineShaderStageCreateInfo stages_ci[2];
+    stages_ci[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    stages_ci[0].pNext = NULL;
+    stages_ci[0].flags = 0;
+    stages_ci[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    CreateVkShaderModule(
+        "resources/shaders/volumetric.vert.spv", device, platform, &stages_ci[0].module);
+    stages_ci[0].pName = "main";
+    stages_ci[0].pSpecializationInfo = NULL;
+
+    stages_ci[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    stages_ci[1].pNext = NULL;
+    stages_ci[1].flags = 0;
+    stages_ci[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    CreateVkShaderModule(fragment_shader, device, platform, &stages_ci[1].module);
+    stages_ci[1].pName = "main";
+    stages_ci[1].pSpecializationInfo = specialization;
+    pipeline_ci.stageCount = 2;
+
+    pipeline_ci.pStages = stages_ci;
+
+    VkPipelineVertexInputStateCreateInfo vertex_input =
+        PipelineGetDefaultVertexInputState(0, NULL, 0, NULL);
+    pipeline_ci.pVertexInputState = &vertex_input;
+
+    VkPipelineInputAssemblyStateCreateInfo input_assembly_state =
+        PipelineGetDefaultInputAssemblyState();
+    pipeline_ci.pInputAssemblyState = &input_assembly_state;
+
+    VkViewport viewport;
+    viewport.x = 0.f;
+    viewport.y = 0.f;
+    viewport.width = extent->width;
+    viewport.height = extent->height;
+    viewport.minDepth = 0.f;
+    viewport.maxDepth = 1.f;
+
+    VkRect2D scissor;
+    scissor.offset = (VkOffset2D){0, 0};
+    scissor.extent = *extent;
+    VkPipelineViewportStateCreateInfo viewport_state =
+        PipelineGetDefaultViewportState(1, &viewport, 1, &scissor);
+    pipeline_ci.pViewportState = &viewport_state;
+
+    VkPipelineRasterizationStateCreateInfo rasterization_state =
+        PipelineGetDefaultRasterizationState();
+    pipeline_ci.pRasterizationState = &rasterization_state;
+
+    VkPipelineMultisampleStateCreateInfo multisample_state =
+        PipelineGetDefaultMultisampleState(sample_count);
+    pipeline_ci.pMultisampleState = &multisample_state;
+
+    VkPipelineDepthStencilStateCreateInfo depth_state = PipelineGetDefaultDepthStencilState();
+    depth_state.depthWriteEnable = VK_FALSE;
+    depth_state.depthTestEnable = VK_FALSE;
+    pipeline_ci.pDepthStencilState = &depth_state;
+
+    VkPipelineColorBlendAttachmentState color_blend_attachements[2] = {0};
+    ASSERT(color_count <= ARRAY_SIZE(color_blend_attachements));
+    for(u32 i = 0; i < color_count; ++i) {
+        VkPipelineColorBlendAttachmentState *attachement = &color_blend_attachements[i];
+        attachement->blendEnable = additive ? VK_TRUE : VK_FALSE;
+        attachement->srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+        attachement->dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+        attachement->colorBlendOp = VK_BLEND_OP_ADD;
+        attachement->srcAlphaBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+        attachement->dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+        attachement->alphaBlendOp = VK_BLEND_OP_ADD;
+        attachement->colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+                                      VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    }
+    VkPipelineColorBlendStateCreateInfo color_blend_state =
+        PipelineGetDefaultColorBlendState(color_count, color_blend_attachements);
+    pipeline_ci.pColorBlendState = &color_blend_state;
+
+    pipeline_ci.pDynamicState = NULL;
+    pipeline_ci.layout = layout;
+
+    pipeline_ci.renderPass = render_pass;
+    pipeline_ci.subpass = 0;
+    pipeline_ci.basePipelineHandle = VK_NULL_HANDLE;
+    pipeline_ci.basePipelineIndex = 0;
+
     AssertVkResult(
         vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipeline_ci, NULL, pipeline));
 
@@ -214,3 +361,31 @@ void PipelineCreateDefault(VkDevice device,
     vkDestroyShaderModule(device, pipeline_ci.pStages[0].module, NULL);
     vkDestroyShaderModule(device, pipeline_ci.pStages[1].module, NULL);
 }
+
+void PipelineCreateCompute(VkDevice device,
+                           PlatformAPI *platform,
+                           const char *compute_shader,
+                           const VkSpecializationInfo *specialization,
+                           const VkPipelineLayout layout,
+                           VkPipeline *pipeline) {
+    VkComputePipelineCreateInfo pipeline_ci = {0};
+    pipeline_ci.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_ci.pNext = NULL;
+    pipeline_ci.flags = 0;
+    pipeline_ci.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_ci.stage.pNext = NULL;
+    pipeline_ci.stage.flags = 0;
+    pipeline_ci.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    CreateVkShaderModule(compute_shader, device, platform, &pipeline_ci.stage.module);
+    pipeline_ci.stage.pName = "main";
+    pipeline_ci.stage.pSpecializationInfo = specialization;
+    pipeline_ci.layout = layout;
+    pipeline_ci.basePipelineHandle = VK_NULL_HANDLE;
+    pipeline_ci.basePipelineIndex = 0;
+
+    AssertVkResult(
+        vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipeline_ci, NULL, pipeline));
+
+    vkDeviceWaitIdle(device);
+    vkDestroyShaderModule(device, pipeline_ci.stage.module, NULL);
+}
@@ -4,6 +4,7 @@
 #include "renderer/gltf.c"
 #include "renderer/vulkan/vulkan_renderer.h"
 #include "renderer/vulkan/vulkan_helper.c"
+#include "renderer/vulkan/vulkan_accel.c"
 #include "renderer/vulkan/vulkan_pipeline.c"
 
 global VkDebugUtilsMessengerEXT debug_messenger;
@@ -116,6 +117,8 @@ internal void LoadDeviceFuncPointers(VkDevice device) {
     VK_LOAD_DEVICE_FUNC(vkCmdBuildAccelerationStructuresKHR);
     VK_LOAD_DEVICE_FUNC(vkDestroyAccelerationStructureKHR);
     VK_LOAD_DEVICE_FUNC(vkGetAccelerationStructureDeviceAddressKHR);
+    VK_LOAD_DEVICE_FUNC(vkCmdWriteAccelerationStructuresPropertiesKHR);
+    VK_LOAD_DEVICE_FUNC(vkCmdCopyAccelerationStructureKHR);
 }
 
 internal void GetQueuesId(Renderer *context) {
@@ -154,6 +157,11 @@ internal void GetQueuesId(Renderer *context) {
         }
     }
     sFree(queue_properties);
+
+    if(!(set_flags & 2)) {
+        // No dedicated transfer family, transfers share the graphics queue
+        context->transfer_queue_id = context->graphics_queue_id;
+    }
 }
 
 internal void CreateVkDevice(VkPhysicalDevice physical_device,
@@ -203,9 +211,14 @@ internal void CreateVkDevice(VkPhysicalDevice physical_device,
     accel_feature.pNext = NULL;
     accel_feature.accelerationStructure = VK_TRUE;
 
+    VkPhysicalDeviceRayQueryFeaturesKHR ray_query_feature = {0};
+    ray_query_feature.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR;
+    ray_query_feature.pNext = &accel_feature;
+    ray_query_feature.rayQuery = VK_TRUE;
+
     VkPhysicalDeviceRayTracingPipelineFeaturesKHR rt_feature = {0};
     rt_feature.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR;
-    rt_feature.pNext = &accel_feature;
+    rt_feature.pNext = &ray_query_feature;
     rt_feature.rayTracingPipeline = VK_TRUE;
 
     VkPhysicalDeviceBufferDeviceAddressFeatures device_address = {0};
@@ -213,16 +226,11 @@ internal void CreateVkDevice(VkPhysicalDevice physical_device,
     device_address.pNext = &rt_feature;
     device_address.bufferDeviceAddress = VK_TRUE;
 
-    VkPhysicalDeviceRobustness2FeaturesEXT robustness = {0};
-    robustness.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ROBUSTNESS_2_FEATURES_EXT;
-    robustness.pNext = &device_address;
-    robustness.robustBufferAccess2 = VK_FALSE;
-    robustness.robustImageAccess2 = VK_FALSE;
-    robustness.nullDescriptor = VK_TRUE;
-
+    // No null descriptors, robustness2 isn't enabled : the empty TLAS is bound while the scene
+    // has no instances and freed texture slots get a fallback image
     VkPhysicalDeviceDescriptorIndexingFeatures descriptor_indexing = {0};
     descriptor_indexing.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
-    descriptor_indexing.pNext = &robustness;
+    descriptor_indexing.pNext = &device_address;
     descriptor_indexing.runtimeDescriptorArray = VK_TRUE;
     descriptor_indexing.descriptorBindingVariableDescriptorCount = VK_TRUE;
     descriptor_indexing.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
@@ -238,7 +246,7 @@ internal void CreateVkDevice(VkPhysicalDevice physical_device,
     device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
     device_create_info.pNext = &features2;
     device_create_info.flags = 0;
-    device_create_info.queueCreateInfoCount = 2;
+    device_create_info.queueCreateInfoCount = transfer_queue != graphics_queue ? 2 : 1;
     device_create_info.pQueueCreateInfos = queues_ci;
     device_create_info.enabledLayerCount = 0;
     device_create_info.ppEnabledLayerNames = 0;
@@ -450,10 +458,11 @@ internal void DestroySwapchain(const Renderer *context, Swapchain *swapchain) {
     sFree(swapchain->render_complete_semaphore);
 }
 
-internal void BeginRenderGroup(VkCommandBuffer cmd,
-                               const RenderGroup *render_group,
-                               VkFramebuffer target,
-                               const VkExtent2D extent) {
+internal void BeginRenderPass(VkCommandBuffer cmd,
+                              const RenderGroup *render_group,
+                              VkFramebuffer target,
+                              const VkExtent2D extent,
+                              const VkSubpassContents contents) {
     VkRenderPassBeginInfo renderpass_begin = {0};
     renderpass_begin.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     renderpass_begin.pNext = 0;
@@ -463,7 +472,11 @@ internal void BeginRenderGroup(VkCommandBuffer cmd,
 
     renderpass_begin.clearValueCount = render_group->clear_values_count;
     renderpass_begin.pClearValues = render_group->clear_values;
-    vkCmdBeginRenderPass(cmd, &renderpass_begin, VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdBeginRenderPass(cmd, &renderpass_begin, contents);
+}
+
+// Pipeline and descriptor sets, secondary command buffers bind them again
+internal void BindRenderGroup(VkCommandBuffer cmd, const RenderGroup *render_group) {
     vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, render_group->pipeline);
     vkCmdBindDescriptorSets(cmd,
                             VK_PIPELINE_BIND_POINT_GRAPHICS,
@@ -475,6 +488,14 @@ internal void BeginRenderGroup(VkCommandBuffer cmd,
                             NULL);
 }
 
+internal void BeginRenderGroup(VkCommandBuffer cmd,
+                               const RenderGroup *render_group,
+                               VkFramebuffer target,
+                               const VkExtent2D extent) {
+    BeginRenderPass(cmd, render_group, target, extent, VK_SUBPASS_CONTENTS_INLINE);
+    BindRenderGroup(cmd, render_group);
+}
+
 internal void DestroyRenderGroup(Renderer *context, RenderGroup *render_group) {
     vkFreeDescriptorSets(context->device,
                          context->descriptor_pool,
@@ -492,10 +513,24 @@ internal void DestroyRenderGroup(Renderer *context, RenderGroup *render_group) {
 
     vkDestroyRenderPass(context->device, render_group->render_pass, 0);
 
-    sFree(render_group->clear_values);
+    // Compute groups have no attachments to clear
+    if(render_group->clear_values) {
+        sFree(render_group->clear_values);
+    }
 }
 
-internal void CreateShadowMapRenderGroup(Renderer *renderer, RenderGroup *render_group) {
+// Depth only pass, over a layer of a shadow map or over the depth of the prepass. It waits for
+// src_stage before writing and makes the depth visible to dst_stage.
+internal void CreateShadowRenderPass(Renderer *renderer,
+                                     const VkSampleCountFlagBits samples,
+                                     const VkAttachmentLoadOp load_op,
+                                     const VkImageLayout initial_layout,
+                                     const VkImageLayout final_layout,
+                                     const VkPipelineStageFlags src_stage,
+                                     const VkAccessFlags src_access,
+                                     const VkPipelineStageFlags dst_stage,
+                                     const VkAccessFlags dst_access,
+                                     VkRenderPass *render_pass) {
     VkRenderPassCreateInfo render_pass_ci = {0};
     render_pass_ci.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
     render_pass_ci.pNext = NULL;
@@ -504,13 +539,13 @@ internal void CreateShadowMapRenderGroup(Renderer *renderer, RenderGroup *render
     VkAttachmentDescription depth_attachment = {0};
     depth_attachment.flags = 0;
     depth_attachment.format = renderer->depth_format;
-    depth_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
-    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth_attachment.samples = samples;
+    depth_attachment.loadOp = load_op;
     depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
     depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    depth_attachment.initialLayout = initial_layout;
+    depth_attachment.finalLayout = final_layout;
 
     VkAttachmentDescription attachments[] = {depth_attachment};
 
@@ -521,18 +556,19 @@ internal void CreateShadowMapRenderGroup(Renderer *renderer, RenderGroup *render
     VkSubpassDependency dependencies[2] = {0};
     dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
     dependencies[0].dstSubpass = 0;
-    dependencies[0].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    dependencies[0].srcStageMask = src_stage;
     dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-    dependencies[0].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependencies[0].srcAccessMask = src_access;
+    dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                    VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
     dependencies[0].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
 
     dependencies[1].srcSubpass = 0;
     dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
     dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
-    dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    dependencies[1].dstStageMask = dst_stage;
     dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-    dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    dependencies[1].dstAccessMask = dst_access;
     dependencies[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
 
     VkSubpassDescription subpass_desc = {0};
@@ -548,11 +584,25 @@ internal void CreateShadowMapRenderGroup(Renderer *renderer, RenderGroup *render
     subpass_desc.pPreserveAttachments = NULL;
     render_pass_ci.subpassCount = 1;
     render_pass_ci.pSubpasses = &subpass_desc;
-    render_pass_ci.dependencyCount = 2;
+    // Without stages the frame graph syncs the pass
+    render_pass_ci.dependencyCount = src_stage ? ARRAY_SIZE(dependencies) : 0;
     render_pass_ci.pDependencies = dependencies;
 
-    AssertVkResult(
-        vkCreateRenderPass(renderer->device, &render_pass_ci, NULL, &render_group->render_pass));
+    AssertVkResult(vkCreateRenderPass(renderer->device, &render_pass_ci, NULL, render_pass));
+}
+
+// Draws the dynamic casters over the copy of the static ones, see RecordShadowCascade
+internal void CreateShadowMapRenderGroup(Renderer *renderer, RenderGroup *render_group) {
+    CreateShadowRenderPass(renderer,
+                           VK_SAMPLE_COUNT_1_BIT,
+                           VK_ATTACHMENT_LOAD_OP_LOAD,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_ACCESS_TRANSFER_WRITE_BIT,
+                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                           VK_ACCESS_SHADER_READ_BIT,
+                           &render_group->render_pass);
 
     // Set Layout
     render_group->descriptor_set_count = 1;
@@ -587,8 +637,9 @@ internal void CreateShadowMapRenderGroup(Renderer *renderer, RenderGroup *render
     AssertVkResult(
         vkAllocateDescriptorSets(renderer->device, &allocate_info, render_group->descriptor_sets));
 
-    // Push constants
-    VkPushConstantRange push_constant_range = {VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstant)};
+    // Push constants, the cascade index follows the material
+    VkPushConstantRange push_constant_range = {
+        VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstant) + sizeof(u32)};
     const u32 push_constant_count = 1;
     //render_group->push_constant_size = push_constant_range.size;
 
@@ -643,15 +694,29 @@ internal void CreateShadowMapRenderGroup(Renderer *renderer, RenderGroup *render
     pipeline_ci.stageCount = 1;
     pipeline_ci.pStages = &stages_ci;
 
-    VkVertexInputBindingDescription vtx_input_binding = {
-        0, sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX};
+    VkVertexInputBindingDescription vtx_input_bindings[] = {
+        {0, sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX},
+        {1, sizeof(InstanceData), VK_VERTEX_INPUT_RATE_INSTANCE},
+    };
+    const u32 transform_offset = offsetof(InstanceData, transform);
+    const u32 normal_offset = offsetof(InstanceData, normal_matrix);
     VkVertexInputAttributeDescription vtx_descriptions[] = {
         {0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, pos)},
         {1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, normal)},
         {2, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(Vertex, uv)},
+        {3, 1, VK_FORMAT_R32G32B32A32_SFLOAT, transform_offset + 0 * sizeof(Vec4)},
+        {4, 1, VK_FORMAT_R32G32B32A32_SFLOAT, transform_offset + 1 * sizeof(Vec4)},
+        {5, 1, VK_FORMAT_R32G32B32A32_SFLOAT, transform_offset + 2 * sizeof(Vec4)},
+        {6, 1, VK_FORMAT_R32G32B32A32_SFLOAT, transform_offset + 3 * sizeof(Vec4)},
+        {7, 1, VK_FORMAT_R32G32B32_SFLOAT, normal_offset + 0 * sizeof(Vec4)},
+        {8, 1, VK_FORMAT_R32G32B32_SFLOAT, normal_offset + 1 * sizeof(Vec4)},
+        {9, 1, VK_FORMAT_R32G32B32_SFLOAT, normal_offset + 2 * sizeof(Vec4)},
     };
     VkPipelineVertexInputStateCreateInfo vertex_input =
-        PipelineGetDefaultVertexInputState(&vtx_input_binding, 3, vtx_descriptions);
+        PipelineGetDefaultVertexInputState(ARRAY_SIZE(vtx_input_bindings),
+                                           vtx_input_bindings,
+                                           ARRAY_SIZE(vtx_descriptions),
+                                           vtx_descriptions);
     pipeline_ci.pVertexInputState = &vertex_input;
 
     VkPipelineInputAssemblyStateCreateInfo input_assembly_state =
@@ -705,6 +770,189 @@ internal void CreateShadowMapRenderGroup(Renderer *renderer, RenderGroup *render
     render_group->clear_values[0].depthStencil = (VkClearDepthStencilValue){1.0f, 0};
 }
 
+// Draws to color_pass_image. With MSAA the depth is resolved into resolved_depth_image, single
+// sampled modes draw their depth straight to it. TAA also writes the motion vectors. After the
+// depth prepass the depth is loaded instead of cleared. The attachments stay in the layouts the
+// frame graph puts them in, as in the other screen passes.
+internal void CreateMainRenderPass(Renderer *renderer, VkRenderPass *render_pass) {
+    const bool multisampled = renderer->msaa_level != VK_SAMPLE_COUNT_1_BIT;
+    const bool temporal = renderer->anti_aliasing == ANTI_ALIASING_TAA;
+
+    VkAttachmentDescription2 color_attachment = {0};
+    color_attachment.sType = VK_STRUCTURE_TYPE_ATTACHMENT_DESCRIPTION_2;
+    color_attachment.pNext = NULL;
+    color_attachment.flags = 0;
+    color_attachment.format = renderer->swapchain.format;
+    color_attachment.samples = renderer->msaa_level;
+    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    color_attachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    color_attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentDescription2 depth_attachment = {0};
+    depth_attachment.sType = VK_STRUCTURE_TYPE_ATTACHMENT_DESCRIPTION_2;
+    depth_attachment.pNext = NULL;
+    depth_attachment.flags = 0;
+    depth_attachment.format = renderer->depth_format;
+    depth_attachment.samples = renderer->msaa_level;
+    depth_attachment.loadOp =
+        renderer->depth_prepass ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentDescription2 depth_resolve_attachment = {0};
+    depth_resolve_attachment.sType = VK_STRUCTURE_TYPE_ATTACHMENT_DESCRIPTION_2;
+    depth_resolve_attachment.pNext = NULL;
+    depth_resolve_attachment.flags = 0;
+    depth_resolve_attachment.format = renderer->depth_format;
+    depth_resolve_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    depth_resolve_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depth_resolve_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    depth_resolve_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depth_resolve_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_resolve_attachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth_resolve_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentDescription2 velocity_attachment = {0};
+    velocity_attachment.sType = VK_STRUCTURE_TYPE_ATTACHMENT_DESCRIPTION_2;
+    velocity_attachment.pNext = NULL;
+    velocity_attachment.flags = 0;
+    velocity_attachment.format = TAA_VELOCITY_FORMAT;
+    velocity_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    velocity_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    velocity_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    velocity_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    velocity_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    velocity_attachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    velocity_attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    // The depth resolve or the motion vectors follow the color and the depth
+    VkAttachmentDescription2 attachments[3] = {color_attachment, depth_attachment};
+    u32 attachment_count = 2;
+
+    VkAttachmentReference2 color_attachement_refs[2] = {0};
+    color_attachement_refs[0].sType = VK_STRUCTURE_TYPE_ATTACHMENT_REFERENCE_2;
+    color_attachement_refs[0].attachment = 0;
+    color_attachement_refs[0].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    color_attachement_refs[0].aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+
+    VkAttachmentReference2 depth_attachement_ref = {0};
+    depth_attachement_ref.sType = VK_STRUCTURE_TYPE_ATTACHMENT_REFERENCE_2;
+    depth_attachement_ref.attachment = 1;
+    depth_attachement_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth_attachement_ref.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+
+    VkAttachmentReference2 depth_resolve_attachement_ref = {0};
+    depth_resolve_attachement_ref.sType = VK_STRUCTURE_TYPE_ATTACHMENT_REFERENCE_2;
+    depth_resolve_attachement_ref.attachment = attachment_count;
+    depth_resolve_attachement_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth_resolve_attachement_ref.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+
+    VkSubpassDescriptionDepthStencilResolve depth_resolve = {0};
+    depth_resolve.sType = VK_STRUCTURE_TYPE_SUBPASS_DESCRIPTION_DEPTH_STENCIL_RESOLVE;
+    depth_resolve.pNext = NULL;
+    depth_resolve.depthResolveMode = VK_RESOLVE_MODE_SAMPLE_ZERO_BIT;
+    depth_resolve.stencilResolveMode = VK_RESOLVE_MODE_SAMPLE_ZERO_BIT;
+    depth_resolve.pDepthStencilResolveAttachment = &depth_resolve_attachement_ref;
+    if(multisampled) {
+        attachments[attachment_count++] = depth_resolve_attachment;
+    }
+
+    color_attachement_refs[1].sType = VK_STRUCTURE_TYPE_ATTACHMENT_REFERENCE_2;
+    color_attachement_refs[1].attachment = attachment_count;
+    color_attachement_refs[1].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    color_attachement_refs[1].aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    if(temporal) {
+        attachments[attachment_count++] = velocity_attachment;
+    }
+
+    VkSubpassDescription2 subpasses = {0};
+    subpasses.sType = VK_STRUCTURE_TYPE_SUBPASS_DESCRIPTION_2;
+    subpasses.pNext = multisampled ? &depth_resolve : NULL;
+    subpasses.flags = 0;
+    subpasses.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpasses.viewMask = 0;
+    subpasses.inputAttachmentCount = 0;
+    subpasses.pInputAttachments = NULL;
+    subpasses.colorAttachmentCount = temporal ? 2 : 1;
+    subpasses.pColorAttachments = color_attachement_refs;
+    subpasses.pResolveAttachments = NULL;
+    subpasses.pDepthStencilAttachment = &depth_attachement_ref;
+    subpasses.preserveAttachmentCount = 0;
+    subpasses.pPreserveAttachments = NULL;
+
+    VkRenderPassCreateInfo2 renderpass_ci = {0};
+    renderpass_ci.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO_2;
+    renderpass_ci.pNext = NULL;
+    renderpass_ci.flags = 0;
+    renderpass_ci.attachmentCount = attachment_count;
+    renderpass_ci.pAttachments = attachments;
+    renderpass_ci.subpassCount = 1;
+    renderpass_ci.pSubpasses = &subpasses;
+    renderpass_ci.dependencyCount = 0;
+    renderpass_ci.pDependencies = NULL;
+    renderpass_ci.correlatedViewMaskCount = 0;
+    renderpass_ci.pCorrelatedViewMasks = NULL;
+
+    AssertVkResult(vkCreateRenderPass2(renderer->device, &renderpass_ci, 0, render_pass));
+}
+
+internal void CreateMainPipeline(Renderer *renderer, RenderGroup *render_group) {
+    const VkBool32 velocity = renderer->anti_aliasing == ANTI_ALIASING_TAA;
+    const VkSpecializationMapEntry entry = {0, 0, sizeof(VkBool32)};
+    const VkSpecializationInfo info = {1, &entry, sizeof(VkBool32), &velocity};
+    PipelineCreateDefault(renderer->device,
+                          renderer->platform,
+                          "resources/shaders/general.vert.spv",
+                          "resources/shaders/general.frag.spv",
+                          &renderer->swapchain.extent,
+                          renderer->msaa_level,
+                          &info,
+                          velocity ? 2 : 1,
+                          renderer->depth_prepass,
+                          render_group->layout,
+                          render_group->render_pass,
+                          &render_group->pipeline);
+}
+
+// Lays down the depth of the opaque geometry with general.vert alone, so the main pass only
+// shades the fragments that end up visible. The pipeline shares the layout and the descriptor
+// sets of the main render group.
+internal void CreateDepthPrepass(Renderer *renderer) {
+    CreateShadowRenderPass(renderer,
+                           renderer->msaa_level,
+                           VK_ATTACHMENT_LOAD_OP_CLEAR,
+                           VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                           VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                           0,
+                           0,
+                           0,
+                           0,
+                           &renderer->depth_prepass_render_pass);
+    PipelineCreateDefault(renderer->device,
+                          renderer->platform,
+                          "resources/shaders/general.vert.spv",
+                          NULL,
+                          &renderer->swapchain.extent,
+                          renderer->msaa_level,
+                          NULL,
+                          0,
+                          false,
+                          renderer->main_render_group.layout,
+                          renderer->depth_prepass_render_pass,
+                          &renderer->depth_prepass_pipeline);
+}
+
+internal void DestroyDepthPrepass(Renderer *renderer) {
+    vkDestroyPipeline(renderer->device, renderer->depth_prepass_pipeline, NULL);
+    vkDestroyRenderPass(renderer->device, renderer->depth_prepass_render_pass, NULL);
+}
+
 internal void CreateMainRenderGroup(Renderer *renderer, RenderGroup *render_group) {
     // TODO : Séparer ca en 2. un avec la texture. et un avec le reste. Bind la texture pour chaque primitive si necessaire
 
@@ -738,6 +986,12 @@ internal void CreateMainRenderGroup(Renderer *renderer, RenderGroup *render_grou
          VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
          1,
          VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL},
+        {// TLAS
+         4,
+         VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
          NULL}};
 
     const u32 descriptor_count = sizeof(bindings) / sizeof(bindings[0]);
@@ -751,6 +1005,8 @@ internal void CreateMainRenderGroup(Renderer *renderer, RenderGroup *render_grou
     AssertVkResult(vkCreateDescriptorSetLayout(
         renderer->device, &game_set_create_info, NULL, &render_group->set_layouts[0]));
 
+    renderer->bound_textures_count = renderer->textures_count;
+
     // Descriptor Set
     VkDescriptorSetAllocateInfo allocate_info = {0};
     allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
@@ -804,160 +1060,9 @@ internal void CreateMainRenderGroup(Renderer *renderer, RenderGroup *render_grou
     static_writes[2].pTexelBufferView = NULL;
 
     vkUpdateDescriptorSets(renderer->device, static_writes_count, static_writes, 0, NULL);
+    TlasWriteDescriptor(renderer, render_group->descriptor_sets[0], 4);
 
-    { // Render pass
-        /*
-        VkRenderPassCreateInfo render_pass_ci = {};
-        render_pass_ci.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-        render_pass_ci.pNext = NULL;
-        render_pass_ci.flags = 0;
-
-        VkAttachmentDescription color_attachment = {};
-        color_attachment.flags = 0;
-        color_attachment.format = renderer->swapchain.format;
-        color_attachment.samples = renderer->msaa_level;
-        color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-        color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-        color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-        color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        color_attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-
-        VkAttachmentDescription depth_attachment = {};
-        depth_attachment.flags = 0;
-        depth_attachment.format = VK_FORMAT_D32_SFLOAT;
-        depth_attachment.samples = renderer->msaa_level;
-        depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-        depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-        depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-        depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        depth_attachment.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-
-        VkAttachmentDescription attachments[] = {color_attachment, depth_attachment};
-
-        render_pass_ci.attachmentCount = sizeof(attachments) / sizeof(attachments[0]);
-        render_pass_ci.pAttachments = attachments;
-
-        VkSubpassDescription subpass_desc = {};
-        subpass_desc.flags = 0;
-        subpass_desc.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-        subpass_desc.inputAttachmentCount = 0;
-        subpass_desc.pInputAttachments = NULL;
-
-        VkAttachmentReference color_ref = {0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
-        VkAttachmentReference depth_ref = {1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
-
-        subpass_desc.colorAttachmentCount = 1;
-        subpass_desc.pColorAttachments = &color_ref;
-        subpass_desc.pResolveAttachments = NULL;
-        subpass_desc.pDepthStencilAttachment = &depth_ref;
-        subpass_desc.preserveAttachmentCount = 0;
-        subpass_desc.pPreserveAttachments = NULL;
-
-        render_pass_ci.subpassCount = 1;
-        render_pass_ci.pSubpasses = &subpass_desc;
-        render_pass_ci.dependencyCount = 0;
-        render_pass_ci.pDependencies = NULL;
-*/
-        VkAttachmentDescription2 color_attachment = {0};
-        color_attachment.sType = VK_STRUCTURE_TYPE_ATTACHMENT_DESCRIPTION_2;
-        color_attachment.pNext = NULL;
-        color_attachment.flags = 0;
-        color_attachment.format = renderer->swapchain.format;
-        color_attachment.samples = renderer->msaa_level;
-        color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-        color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-        color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-        color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        color_attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-
-        VkAttachmentDescription2 depth_attachment = {0};
-        depth_attachment.sType = VK_STRUCTURE_TYPE_ATTACHMENT_DESCRIPTION_2;
-        depth_attachment.pNext = NULL;
-        depth_attachment.flags = 0;
-        depth_attachment.format = renderer->depth_format;
-        depth_attachment.samples = renderer->msaa_level;
-        depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-        depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-        depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-        depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-
-        VkAttachmentDescription2 depth_resolve_attachment = {0};
-        depth_resolve_attachment.sType = VK_STRUCTURE_TYPE_ATTACHMENT_DESCRIPTION_2;
-        depth_resolve_attachment.pNext = NULL;
-        depth_resolve_attachment.flags = 0;
-        depth_resolve_attachment.format = renderer->depth_format;
-        depth_resolve_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
-        depth_resolve_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-        depth_resolve_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-        depth_resolve_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-        depth_resolve_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        depth_resolve_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        depth_resolve_attachment.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-        VkAttachmentDescription2 attachments[] = {
-            color_attachment, depth_attachment, depth_resolve_attachment};
-
-        VkAttachmentReference2 color_attachement_ref = {0};
-        color_attachement_ref.sType = VK_STRUCTURE_TYPE_ATTACHMENT_REFERENCE_2;
-        color_attachement_ref.attachment = 0;
-        color_attachement_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-        color_attachement_ref.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-
-        VkAttachmentReference2 depth_attachement_ref = {0};
-        depth_attachement_ref.sType = VK_STRUCTURE_TYPE_ATTACHMENT_REFERENCE_2;
-        depth_attachement_ref.attachment = 1;
-        depth_attachement_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-        depth_attachement_ref.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-
-        VkAttachmentReference2 depth_resolve_attachement_ref = {0};
-        depth_resolve_attachement_ref.sType = VK_STRUCTURE_TYPE_ATTACHMENT_REFERENCE_2;
-        depth_resolve_attachement_ref.attachment = 2;
-        depth_resolve_attachement_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-        depth_resolve_attachement_ref.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-
-        VkSubpassDescriptionDepthStencilResolve depth_resolve = {0};
-        depth_resolve.sType = VK_STRUCTURE_TYPE_SUBPASS_DESCRIPTION_DEPTH_STENCIL_RESOLVE;
-        depth_resolve.pNext = NULL;
-        depth_resolve.depthResolveMode = VK_RESOLVE_MODE_SAMPLE_ZERO_BIT;
-        depth_resolve.stencilResolveMode = VK_RESOLVE_MODE_SAMPLE_ZERO_BIT;
-        depth_resolve.pDepthStencilResolveAttachment = &depth_resolve_attachement_ref;
-
-        VkSubpassDescription2 subpasses = {0};
-        subpasses.sType = VK_STRUCTURE_TYPE_SUBPASS_DESCRIPTION_2;
-        subpasses.pNext = &depth_resolve;
-        subpasses.flags = 0;
-        subpasses.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-        subpasses.viewMask = 0;
-        subpasses.inputAttachmentCount = 0;
-        subpasses.pInputAttachments = NULL;
-        subpasses.colorAttachmentCount = 1;
-        subpasses.pColorAttachments = &color_attachement_ref;
-        subpasses.pResolveAttachments = NULL;
-        subpasses.pDepthStencilAttachment = &depth_attachement_ref;
-        subpasses.preserveAttachmentCount = 0;
-        subpasses.pPreserveAttachments = NULL;
-
-        VkRenderPassCreateInfo2 renderpass_ci = {0};
-        renderpass_ci.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO_2;
-        renderpass_ci.pNext = NULL;
-        renderpass_ci.flags = 0;
-        renderpass_ci.attachmentCount = ARRAY_SIZE(attachments);
-        renderpass_ci.pAttachments = attachments;
-        renderpass_ci.subpassCount = 1;
-        renderpass_ci.pSubpasses = &subpasses;
-        renderpass_ci.dependencyCount = 0;
-        renderpass_ci.pDependencies = NULL;
-        renderpass_ci.correlatedViewMaskCount = 0;
-        renderpass_ci.pCorrelatedViewMasks = NULL;
-
-        AssertVkResult(
-            vkCreateRenderPass2(renderer->device, &renderpass_ci, 0, &render_group->render_pass));
-    }
+    CreateMainRenderPass(renderer, &render_group->render_pass);
     { // Build layout
         // Push constants
         VkPushConstantRange push_constant_range = {
@@ -977,398 +1082,1581 @@ internal void CreateMainRenderGroup(Renderer *renderer, RenderGroup *render_grou
         AssertVkResult(
             vkCreatePipelineLayout(renderer->device, &create_info, NULL, &render_group->layout));
     }
-    PipelineCreateDefault(renderer->device,
-                          renderer->platform,
-                          "resources/shaders/general.vert.spv",
-                          "resources/shaders/general.frag.spv",
-                          &renderer->swapchain.extent,
-                          renderer->msaa_level,
-                          render_group->layout,
-                          render_group->render_pass,
-                          &render_group->pipeline);
+    CreateMainPipeline(renderer, render_group);
 
-    render_group->clear_values_count = 2;
+    render_group->clear_values_count = 3;
     render_group->clear_values =
         (VkClearValue *)sCalloc(render_group->clear_values_count, sizeof(VkClearValue));
 
     render_group->clear_values[0].color = (VkClearColorValue){{0.43f, 0.77f, 0.91f, 0.0f}};
     render_group->clear_values[1].depthStencil = (VkClearDepthStencilValue){1.0f, 0};
+    render_group->clear_values[2].color = (VkClearColorValue){{0.0f, 0.0f, 0.0f, 0.0f}};
 }
 
-internal void CreateVolumetricRenderGroup(Renderer *renderer, RenderGroup *render_group) {
-    { // Descriptors
-        render_group->descriptor_set_count = 1;
-        render_group->set_layouts = (VkDescriptorSetLayout *)sCalloc(
-            render_group->descriptor_set_count, sizeof(VkDescriptorSetLayout));
-        render_group->descriptor_sets =
-            (VkDescriptorSet *)sCalloc(render_group->descriptor_set_count, sizeof(VkDescriptorSet));
-
-        const VkDescriptorSetLayoutBinding bindings[] = {{// CAMERA MATRICES
-                                                          0,
-                                                          VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-                                                          1,
-                                                          VK_SHADER_STAGE_FRAGMENT_BIT,
-                                                          NULL},
-                                                         {// DEPTH TEXTURE
-                                                          1,
-                                                          VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-                                                          1,
-                                                          VK_SHADER_STAGE_FRAGMENT_BIT,
-                                                          NULL},
-                                                         {// SHADOWMAP READ
-                                                          2,
-                                                          VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-                                                          1,
-                                                          VK_SHADER_STAGE_FRAGMENT_BIT,
-                                                          NULL}};
-        const u32 descriptor_count = sizeof(bindings) / sizeof(bindings[0]);
-
-        VkDescriptorSetLayoutCreateInfo game_set_create_info = {0};
-        game_set_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-        game_set_create_info.pNext = NULL;
-        game_set_create_info.flags = 0;
-        game_set_create_info.bindingCount = descriptor_count;
-        game_set_create_info.pBindings = bindings;
-        AssertVkResult(vkCreateDescriptorSetLayout(
-            renderer->device, &game_set_create_info, NULL, &render_group->set_layouts[0]));
-        DEBUGNameObject(renderer->device,
-                        (u64)render_group->set_layouts[0],
-                        VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT,
-                        "Volumetric descriptor set layout");
-
-        // Descriptor Set
-        VkDescriptorSetAllocateInfo allocate_info = {0};
-        allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-        allocate_info.pNext = NULL;
-        allocate_info.descriptorPool = renderer->descriptor_pool;
-        allocate_info.descriptorSetCount = render_group->descriptor_set_count;
-        allocate_info.pSetLayouts = render_group->set_layouts;
-        AssertVkResult(vkAllocateDescriptorSets(
-            renderer->device, &allocate_info, render_group->descriptor_sets));
-        for(u32 i = 0; i < render_group->descriptor_set_count; ++i) {
-            DEBUGNameObject(renderer->device,
-                            (u64)render_group->descriptor_sets[i],
-                            VK_OBJECT_TYPE_DESCRIPTOR_SET,
-                            "Volumetric descriptor set");
-        }
-    }
-    { // Writes
-        const u32 static_writes_count = 3;
-        VkWriteDescriptorSet static_writes[static_writes_count];
-
-        VkDescriptorBufferInfo bi_cam = {renderer->camera_info_buffer.buffer, 0, VK_WHOLE_SIZE};
-        static_writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        static_writes[0].pNext = NULL;
-        static_writes[0].dstSet = render_group->descriptor_sets[0];
-        static_writes[0].dstBinding = 0;
-        static_writes[0].dstArrayElement = 0;
-        static_writes[0].descriptorCount = 1;
-        static_writes[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        static_writes[0].pImageInfo = NULL;
-        static_writes[0].pBufferInfo = &bi_cam;
-        static_writes[0].pTexelBufferView = NULL;
-
-        VkDescriptorImageInfo depth_image_info = {renderer->depth_sampler,
-                                                  renderer->resolved_depth_image.image_view,
-                                                  VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
-        static_writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        static_writes[1].pNext = NULL;
-        static_writes[1].dstSet = render_group->descriptor_sets[0];
-        static_writes[1].dstBinding = 1;
-        static_writes[1].dstArrayElement = 0;
-        static_writes[1].descriptorCount = 1;
-        static_writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-        static_writes[1].pImageInfo = &depth_image_info;
-        static_writes[1].pBufferInfo = NULL;
-        static_writes[1].pTexelBufferView = NULL;
-
-        VkDescriptorImageInfo image_info = {renderer->shadowmap_sampler,
-                                            renderer->shadowmap.image_view,
-                                            VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL};
-        static_writes[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        static_writes[2].pNext = NULL;
-        static_writes[2].dstSet = render_group->descriptor_sets[0];
-        static_writes[2].dstBinding = 2;
-        static_writes[2].dstArrayElement = 0;
-        static_writes[2].descriptorCount = 1;
-        static_writes[2].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-        static_writes[2].pImageInfo = &image_info;
-        static_writes[2].pBufferInfo = NULL;
-        static_writes[2].pTexelBufferView = NULL;
-
-        vkUpdateDescriptorSets(renderer->device, static_writes_count, static_writes, 0, NULL);
-    }
-    { // Render pass
-
-        VkAttachmentDescription previous_attachment = {0};
-        previous_attachment.flags = 0;
-        previous_attachment.format = renderer->swapchain.format;
-        previous_attachment.samples = renderer->msaa_level;
-        previous_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
-        previous_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-        previous_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-        previous_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        previous_attachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-        previous_attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-
-        VkAttachmentDescription resolve_attachment = {0};
-        resolve_attachment.flags = 0;
-        resolve_attachment.format = renderer->swapchain.format;
-        resolve_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
-        resolve_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-        resolve_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-        resolve_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-        resolve_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_STORE;
-        resolve_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        resolve_attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-
-        VkAttachmentDescription attachments[] = {previous_attachment, resolve_attachment};
-
-        VkAttachmentReference color_ref[] = {
-            {0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
-        };
-
-        VkAttachmentReference resolve_ref = {1, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
-
-        VkSubpassDescription subpass_desc = {0};
-        subpass_desc.flags = 0;
-        subpass_desc.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-        subpass_desc.inputAttachmentCount = 0;
-        subpass_desc.pInputAttachments = NULL;
-        subpass_desc.colorAttachmentCount = ARRAY_SIZE(color_ref);
-        subpass_desc.pColorAttachments = color_ref;
-        subpass_desc.pResolveAttachments = &resolve_ref;
-        subpass_desc.pDepthStencilAttachment = NULL;
-        subpass_desc.preserveAttachmentCount = 0;
-        subpass_desc.pPreserveAttachments = NULL;
-
-        VkRenderPassCreateInfo render_pass_ci = {0};
-        render_pass_ci.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-        render_pass_ci.pNext = NULL;
-        render_pass_ci.flags = 0;
-        render_pass_ci.attachmentCount = ARRAY_SIZE(attachments);
-        render_pass_ci.pAttachments = attachments;
-        render_pass_ci.subpassCount = 1;
-        render_pass_ci.pSubpasses = &subpass_desc;
-        render_pass_ci.dependencyCount = 0;
-        render_pass_ci.pDependencies = NULL;
-
-        AssertVkResult(vkCreateRenderPass(
-            renderer->device, &render_pass_ci, NULL, &render_group->render_pass));
-    }
-    { // Pipeline layout
-        VkPipelineLayoutCreateInfo create_info = {0};
-        create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-        create_info.pNext = NULL;
-        create_info.flags = 0;
-        create_info.setLayoutCount = render_group->descriptor_set_count;
-        create_info.pSetLayouts = render_group->set_layouts;
-        create_info.pushConstantRangeCount = 0;
-        create_info.pPushConstantRanges = NULL;
+// Adds the fog to the color image and resolves it into the swapchain image. Single sampled, the
+// color image is left for the resolve pass to read.
+internal void CreateFogCompositeRenderPass(Renderer *renderer, VkRenderPass *render_pass) {
+    const bool multisampled = renderer->msaa_level != VK_SAMPLE_COUNT_1_BIT;
+    VkAttachmentDescription previous_attachment = {0};
+    previous_attachment.flags = 0;
+    previous_attachment.format = renderer->swapchain.format;
+    previous_attachment.samples = renderer->msaa_level;
+    previous_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    previous_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    previous_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    previous_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    previous_attachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    previous_attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentDescription resolve_attachment = {0};
+    resolve_attachment.flags = 0;
+    resolve_attachment.format = renderer->swapchain.format;
+    resolve_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    resolve_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    resolve_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    resolve_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    resolve_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_STORE;
+    resolve_attachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    resolve_attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentDescription attachments[] = {previous_attachment, resolve_attachment};
+
+    VkAttachmentReference color_ref[] = {
+        {0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
+    };
 
-        AssertVkResult(
-            vkCreatePipelineLayout(renderer->device, &create_info, NULL, &render_group->layout));
-    }
-    { // Pipeline
+    VkAttachmentReference resolve_ref = {1, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
 
-        VkGraphicsPipelineCreateInfo pipeline_ci;
-        pipeline_ci.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-        pipeline_ci.pNext = NULL;
-        pipeline_ci.flags = 0;
+    VkSubpassDescription subpass_desc = {0};
+    subpass_desc.flags = 0;
+    subpass_desc.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass_desc.inputAttachmentCount = 0;
+    subpass_desc.pInputAttachments = NULL;
+    subpass_desc.colorAttachmentCount = ARRAY_SIZE(color_ref);
+    subpass_desc.pColorAttachments = color_ref;
+    subpass_desc.pResolveAttachments = multisampled ? &resolve_ref : NULL;
+    subpass_desc.pDepthStencilAttachment = NULL;
+    subpass_desc.preserveAttachmentCount = 0;
+    subpass_desc.pPreserveAttachments = NULL;
 
-        VkPipelineShaderStageCreateInfo stages_ci[2];
-        stages_ci[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-        stages_ci[0].pNext = NULL;
-        stages_ci[0].flags = 0;
-        stages_ci[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
-        CreateVkShaderModule("resources/shaders/volumetric.vert.spv",
-                             renderer->device,
-                             renderer->platform,
-                             &stages_ci[0].module);
-        stages_ci[0].pName = "main";
-        stages_ci[0].pSpecializationInfo = NULL;
-
-        stages_ci[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-        stages_ci[1].pNext = NULL;
-        stages_ci[1].flags = 0;
-        stages_ci[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-        CreateVkShaderModule("resources/shaders/volumetric.frag.spv",
-                             renderer->device,
-                             renderer->platform,
-                             &stages_ci[1].module);
-        stages_ci[1].pName = "main";
-        stages_ci[1].pSpecializationInfo = NULL;
-        pipeline_ci.stageCount = 2;
-
-        pipeline_ci.pStages = stages_ci;
-
-        VkPipelineVertexInputStateCreateInfo vertex_input =
-            PipelineGetDefaultVertexInputState(NULL, 0, NULL);
-        vertex_input.vertexBindingDescriptionCount = 0;
-        vertex_input.vertexAttributeDescriptionCount = 0;
-        pipeline_ci.pVertexInputState = &vertex_input;
-
-        VkPipelineInputAssemblyStateCreateInfo input_assembly_state =
-            PipelineGetDefaultInputAssemblyState();
-        pipeline_ci.pInputAssemblyState = &input_assembly_state;
-
-        VkViewport viewport;
-        viewport.x = 0.f;
-        viewport.y = 0.f;
-        viewport.width = renderer->swapchain.extent.width;
-        viewport.height = renderer->swapchain.extent.height;
-        viewport.minDepth = 0.f;
-        viewport.maxDepth = 1.f;
-
-        VkRect2D scissor;
-        scissor.offset = (VkOffset2D){0, 0};
-        scissor.extent = renderer->swapchain.extent;
-        VkPipelineViewportStateCreateInfo viewport_state =
-            PipelineGetDefaultViewportState(1, &viewport, 1, &scissor);
-        pipeline_ci.pViewportState = &viewport_state;
-
-        VkPipelineRasterizationStateCreateInfo rasterization_state =
-            PipelineGetDefaultRasterizationState();
-        pipeline_ci.pRasterizationState = &rasterization_state;
-
-        VkPipelineMultisampleStateCreateInfo multisample_state =
-            PipelineGetDefaultMultisampleState(renderer->msaa_level);
-        pipeline_ci.pMultisampleState = &multisample_state;
-
-        VkPipelineDepthStencilStateCreateInfo depth_state = PipelineGetDefaultDepthStencilState();
-        depth_state.depthWriteEnable = VK_FALSE;
-        depth_state.depthTestEnable = VK_FALSE;
-        pipeline_ci.pDepthStencilState = &depth_state;
-
-        VkPipelineColorBlendAttachmentState color_blend_attachement = {0};
-        color_blend_attachement.blendEnable = VK_TRUE;
-        color_blend_attachement.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
-        color_blend_attachement.dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
-        color_blend_attachement.colorBlendOp = VK_BLEND_OP_ADD;
-        color_blend_attachement.srcAlphaBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
-        color_blend_attachement.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-        color_blend_attachement.alphaBlendOp = VK_BLEND_OP_ADD;
-        color_blend_attachement.colorWriteMask =
-            VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT |
-            VK_COLOR_COMPONENT_A_BIT;
-        VkPipelineColorBlendStateCreateInfo color_blend_state =
-            PipelineGetDefaultColorBlendState(1, &color_blend_attachement);
-        pipeline_ci.pColorBlendState = &color_blend_state;
-
-        pipeline_ci.pDynamicState = NULL; // TODO: look at this
-        pipeline_ci.layout = render_group->layout;
-
-        pipeline_ci.renderPass = render_group->render_pass;
-        pipeline_ci.subpass = 0;
-        pipeline_ci.basePipelineHandle = VK_NULL_HANDLE;
-        pipeline_ci.basePipelineIndex = 0;
-
-        // TODO: handle pipeline caching
-        AssertVkResult(vkCreateGraphicsPipelines(
-            renderer->device, VK_NULL_HANDLE, 1, &pipeline_ci, NULL, &render_group->pipeline));
-
-        vkDeviceWaitIdle(renderer->device);
-        vkDestroyShaderModule(renderer->device, pipeline_ci.pStages[0].module, NULL);
-        vkDestroyShaderModule(renderer->device, pipeline_ci.pStages[1].module, NULL);
-    }
-    render_group->clear_values_count = 1;
-    render_group->clear_values =
-        (VkClearValue *)sCalloc(render_group->clear_values_count, sizeof(VkClearValue));
+    VkRenderPassCreateInfo render_pass_ci = {0};
+    render_pass_ci.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    render_pass_ci.pNext = NULL;
+    render_pass_ci.flags = 0;
+    render_pass_ci.attachmentCount = multisampled ? ARRAY_SIZE(attachments) : 1;
+    render_pass_ci.pAttachments = attachments;
+    render_pass_ci.subpassCount = 1;
+    render_pass_ci.pSubpasses = &subpass_desc;
+    render_pass_ci.dependencyCount = 0;
+    render_pass_ci.pDependencies = NULL;
 
-    render_group->clear_values[0].color = (VkClearColorValue){{0.f, 0.0f, 0.0f, 0.0f}};
+    AssertVkResult(vkCreateRenderPass(renderer->device, &render_pass_ci, NULL, render_pass));
 }
 
-DLL_EXPORT Renderer *VulkanCreateRenderer(PlatformWindow *window, PlatformAPI *platform_api) {
-    Renderer *renderer = (Renderer *)sMalloc(sizeof(Renderer));
+// Single sampled target of the reduced fog passes, read by the fragment shader of the next one
+internal void
+CreateFogTargetRenderPass(Renderer *renderer, const VkFormat format, VkRenderPass *render_pass) {
+    VkAttachmentDescription attachment = {0};
+    attachment.flags = 0;
+    attachment.format = format;
+    attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE; // Every texel is written
+    attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentReference color_ref = {0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
 
-    renderer->platform = platform_api;
+    VkSubpassDescription subpass_desc = {0};
+    subpass_desc.flags = 0;
+    subpass_desc.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass_desc.inputAttachmentCount = 0;
+    subpass_desc.pInputAttachments = NULL;
+    subpass_desc.colorAttachmentCount = 1;
+    subpass_desc.pColorAttachments = &color_ref;
+    subpass_desc.pResolveAttachments = NULL;
+    subpass_desc.pDepthStencilAttachment = NULL;
+    subpass_desc.preserveAttachmentCount = 0;
+    subpass_desc.pPreserveAttachments = NULL;
 
-    CreateVkInstance(&renderer->instance, platform_api);
-    platform_api->CreateVkSurface(renderer->instance, window, &renderer->surface);
-    CreateVkPhysicalDevice(renderer->instance, &renderer->physical_device);
+    VkRenderPassCreateInfo render_pass_ci = {0};
+    render_pass_ci.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    render_pass_ci.pNext = NULL;
+    render_pass_ci.flags = 0;
+    render_pass_ci.attachmentCount = 1;
+    render_pass_ci.pAttachments = &attachment;
+    render_pass_ci.subpassCount = 1;
+    render_pass_ci.pSubpasses = &subpass_desc;
+    render_pass_ci.dependencyCount = 0;
+    render_pass_ci.pDependencies = NULL;
 
-    // Get device properties
-    vkGetPhysicalDeviceMemoryProperties(renderer->physical_device, &renderer->memory_properties);
-    vkGetPhysicalDeviceProperties(renderer->physical_device, &renderer->physical_device_properties);
+    AssertVkResult(vkCreateRenderPass(renderer->device, &render_pass_ci, NULL, render_pass));
+}
 
-    // MSAA
-    VkSampleCountFlags msaa_levels =
-        renderer->physical_device_properties.limits.framebufferColorSampleCounts &
-        renderer->physical_device_properties.limits.framebufferDepthSampleCounts;
-    if(msaa_levels & VK_SAMPLE_COUNT_8_BIT) {
-        renderer->msaa_level = VK_SAMPLE_COUNT_8_BIT;
-        sLog("VK_SAMPLE_COUNT_8_BIT");
-    } else if(msaa_levels & VK_SAMPLE_COUNT_4_BIT) {
-        renderer->msaa_level = VK_SAMPLE_COUNT_4_BIT;
-        sLog("VK_SAMPLE_COUNT_4_BIT");
-    } else if(msaa_levels & VK_SAMPLE_COUNT_2_BIT) {
-        renderer->msaa_level = VK_SAMPLE_COUNT_2_BIT;
-        sLog("VK_SAMPLE_COUNT_2_BIT");
-    } else {
-        renderer->msaa_level = VK_SAMPLE_COUNT_1_BIT;
-        sLog("VK_SAMPLE_COUNT_1_BIT");
-    }
+// A single descriptor set over the bindings and the pipeline layout using it
+internal void CreatePassDescriptors(Renderer *renderer,
+                                    const VkDescriptorSetLayoutBinding *bindings,
+                                    const u32 binding_count,
+                                    const char *name,
+                                    RenderGroup *render_group) {
+    render_group->descriptor_set_count = 1;
+    render_group->set_layouts = (VkDescriptorSetLayout *)sCalloc(
+        render_group->descriptor_set_count, sizeof(VkDescriptorSetLayout));
+    render_group->descriptor_sets =
+        (VkDescriptorSet *)sCalloc(render_group->descriptor_set_count, sizeof(VkDescriptorSet));
 
-    GetQueuesId(renderer);
-    CreateVkDevice(renderer->physical_device,
-                   renderer->graphics_queue_id,
-                   renderer->transfer_queue_id,
-                   renderer->present_queue_id,
-                   &renderer->device);
+    VkDescriptorSetLayoutCreateInfo set_create_info = {0};
+    set_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    set_create_info.pNext = NULL;
+    set_create_info.flags = 0;
+    set_create_info.bindingCount = binding_count;
+    set_create_info.pBindings = bindings;
+    AssertVkResult(vkCreateDescriptorSetLayout(
+        renderer->device, &set_create_info, NULL, &render_group->set_layouts[0]));
+    DEBUGNameObject(renderer->device,
+                    (u64)render_group->set_layouts[0],
+                    VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT,
+                    name);
 
-    LoadDeviceFuncPointers(renderer->device);
+    VkDescriptorSetAllocateInfo allocate_info = {0};
+    allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocate_info.pNext = NULL;
+    allocate_info.descriptorPool = renderer->descriptor_pool;
+    allocate_info.descriptorSetCount = render_group->descriptor_set_count;
+    allocate_info.pSetLayouts = render_group->set_layouts;
+    AssertVkResult(
+        vkAllocateDescriptorSets(renderer->device, &allocate_info, render_group->descriptor_sets));
+    DEBUGNameObject(renderer->device,
+                    (u64)render_group->descriptor_sets[0],
+                    VK_OBJECT_TYPE_DESCRIPTOR_SET,
+                    name);
 
-    vkGetDeviceQueue(renderer->device, renderer->graphics_queue_id, 0, &renderer->graphics_queue);
-    vkGetDeviceQueue(renderer->device, renderer->present_queue_id, 0, &renderer->present_queue);
-    vkGetDeviceQueue(renderer->device, renderer->transfer_queue_id, 0, &renderer->transfer_queue);
+    VkPipelineLayoutCreateInfo create_info = {0};
+    create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    create_info.pNext = NULL;
+    create_info.flags = 0;
+    create_info.setLayoutCount = render_group->descriptor_set_count;
+    create_info.pSetLayouts = render_group->set_layouts;
+    create_info.pushConstantRangeCount = 0;
+    create_info.pPushConstantRanges = NULL;
+    AssertVkResult(
+        vkCreatePipelineLayout(renderer->device, &create_info, NULL, &render_group->layout));
+}
 
-    // Graphics Command Pool
-    VkCommandPoolCreateInfo pool_create_info = {0};
-    pool_create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    pool_create_info.pNext = NULL;
-    pool_create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-    pool_create_info.queueFamilyIndex = renderer->graphics_queue_id;
-    VkResult result = vkCreateCommandPool(
-        renderer->device, &pool_create_info, NULL, &renderer->graphics_command_pool);
-    AssertVkResult(result);
+internal void WriteImageDescriptor(Renderer *renderer,
+                                   VkDescriptorSet set,
+                                   const u32 binding,
+                                   const VkDescriptorType type,
+                                   VkSampler sampler,
+                                   VkImageView image_view,
+                                   const VkImageLayout layout) {
+    VkDescriptorImageInfo image_info = {sampler, image_view, layout};
+    VkWriteDescriptorSet write = {0};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.pNext = NULL;
+    write.dstSet = set;
+    write.dstBinding = binding;
+    write.dstArrayElement = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = type;
+    write.pImageInfo = &image_info;
+    write.pBufferInfo = NULL;
+    write.pTexelBufferView = NULL;
+    vkUpdateDescriptorSets(renderer->device, 1, &write, 0, NULL);
+}
 
-    // Descriptor Pool
-    VkDescriptorPoolSize pool_sizes[] = {
-        {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 100},
-        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 100},
-        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1},
-        //{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 100},
-        {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 100},
+internal void WriteCameraDescriptor(Renderer *renderer, VkDescriptorSet set, const u32 binding) {
+    VkDescriptorBufferInfo bi_cam = {renderer->camera_info_buffer.buffer, 0, VK_WHOLE_SIZE};
+    VkWriteDescriptorSet write = {0};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.pNext = NULL;
+    write.dstSet = set;
+    write.dstBinding = binding;
+    write.dstArrayElement = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    write.pImageInfo = NULL;
+    write.pBufferInfo = &bi_cam;
+    write.pTexelBufferView = NULL;
+    vkUpdateDescriptorSets(renderer->device, 1, &write, 0, NULL);
+}
+
+// The fog is marched to its own targets when it is reduced or accumulated over frames, at full
+// resolution without history it goes straight to the color image
+internal bool FogUsesTargets(const Renderer *renderer) {
+    return renderer->fog_resolution != FOG_RESOLUTION_FULL || renderer->fog_temporal;
+}
+
+// Raymarches the fog. Straight to the color image it is added to it, otherwise it is written to
+// fog_color and marched up to the depth of fog_depth.
+internal void CreateVolumetricRenderGroup(Renderer *renderer, RenderGroup *render_group) {
+    const VkDescriptorSetLayoutBinding bindings[] = {
+        {// CAMERA MATRICES
+         0,
+         VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL},
+        {// DEPTH TEXTURE
+         1,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL},
+        {// SHADOWMAP READ
+         2,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL},
+        {// TLAS
+         3,
+         VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL}};
+    CreatePassDescriptors(
+        renderer, bindings, ARRAY_SIZE(bindings), "Volumetric descriptor set", render_group);
+
+    VkDescriptorSet set = render_group->descriptor_sets[0];
+    WriteCameraDescriptor(renderer, set, 0);
+    if(FogUsesTargets(renderer)) {
+        WriteImageDescriptor(renderer,
+                             set,
+                             1,
+                             VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                             renderer->fog_sampler,
+                             renderer->fog_depth.image_view,
+                             VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    } else {
+        WriteImageDescriptor(renderer,
+                             set,
+                             1,
+                             VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                             renderer->depth_sampler,
+                             renderer->resolved_depth_image.image_view,
+                             VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    }
+    WriteImageDescriptor(renderer,
+                         set,
+                         2,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->shadowmap_sampler,
+                         renderer->shadowmap.image_view,
+                         VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+    TlasWriteDescriptor(renderer, set, 3);
+
+    const VkSpecializationMapEntry march_entries[] = {
+        {0, offsetof(FogMarch, max_steps), sizeof(u32)},
+        {1, offsetof(FogMarch, min_step), sizeof(f32)},
+        {2, offsetof(FogMarch, step_growth), sizeof(f32)},
+        {3, offsetof(FogMarch, min_transmittance), sizeof(f32)},
+        {4, offsetof(FogMarch, max_distance), sizeof(f32)},
     };
-    const u32 pool_sizes_count = sizeof(pool_sizes) / sizeof(pool_sizes[0]);
+    const VkSpecializationInfo march_info = {
+        ARRAY_SIZE(march_entries), march_entries, sizeof(FogMarch), &renderer->fog_march};
+
+    if(FogUsesTargets(renderer)) {
+        CreateFogTargetRenderPass(renderer, FOG_COLOR_FORMAT, &render_group->render_pass);
+        PipelineCreateFullscreen(renderer->device,
+                                 renderer->platform,
+                                 "resources/shaders/volumetric.frag.spv",
+                                 &march_info,
+                                 &renderer->fog_extent,
+                                 VK_SAMPLE_COUNT_1_BIT,
+                                 false,
+                                 1,
+                                 render_group->layout,
+                                 render_group->render_pass,
+                                 &render_group->pipeline);
+    } else {
+        CreateFogCompositeRenderPass(renderer, &render_group->render_pass);
+        PipelineCreateFullscreen(renderer->device,
+                                 renderer->platform,
+                                 "resources/shaders/volumetric.frag.spv",
+                                 &march_info,
+                                 &renderer->swapchain.extent,
+                                 renderer->msaa_level,
+                                 true,
+                                 1,
+                                 render_group->layout,
+                                 render_group->render_pass,
+                                 &render_group->pipeline);
+    }
 
-    VkDescriptorPoolCreateInfo pool_ci = {0};
-    pool_ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    pool_ci.pNext = NULL;
-    pool_ci.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
-    pool_ci.maxSets = 10;
-    pool_ci.poolSizeCount = pool_sizes_count;
-    pool_ci.pPoolSizes = pool_sizes;
-    AssertVkResult(
-        vkCreateDescriptorPool(renderer->device, &pool_ci, NULL, &renderer->descriptor_pool));
+    render_group->clear_values_count = 1;
+    render_group->clear_values =
+        (VkClearValue *)sCalloc(render_group->clear_values_count, sizeof(VkClearValue));
 
-    // Swapchain
-    renderer->swapchain.swapchain = VK_NULL_HANDLE;
-    CreateSwapchain(renderer, &renderer->swapchain);
+    render_group->clear_values[0].color = (VkClearColorValue){{0.f, 0.0f, 0.0f, 0.0f}};
+}
 
-    // TODO : pick that don't hard code it
-    renderer->depth_format = VK_FORMAT_D32_SFLOAT;
+// Keeps the nearest or the farthest depth of each block of pixels covered by a fog texel, in a
+// checkerboard so both sides of an edge have texels marched to them
+internal void CreateFogDepthRenderGroup(Renderer *renderer, RenderGroup *render_group) {
+    const VkDescriptorSetLayoutBinding bindings[] = {
+        {// DEPTH TEXTURE
+         0,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL}};
+    CreatePassDescriptors(
+        renderer, bindings, ARRAY_SIZE(bindings), "Fog depth descriptor set", render_group);
+    WriteImageDescriptor(renderer,
+                         render_group->descriptor_sets[0],
+                         0,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->fog_sampler,
+                         renderer->resolved_depth_image.image_view,
+                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    const u32 downscale = renderer->fog_resolution;
+    const VkSpecializationMapEntry entry = {0, 0, sizeof(u32)};
+    const VkSpecializationInfo info = {1, &entry, sizeof(u32), &downscale};
+    CreateFogTargetRenderPass(renderer, FOG_DEPTH_FORMAT, &render_group->render_pass);
+    PipelineCreateFullscreen(renderer->device,
+                             renderer->platform,
+                             "resources/shaders/fog_depth.frag.spv",
+                             &info,
+                             &renderer->fog_extent,
+                             VK_SAMPLE_COUNT_1_BIT,
+                             false,
+                             1,
+                             render_group->layout,
+                             render_group->render_pass,
+                             &render_group->pipeline);
 
-    // Texture Sampler
-    {
-        VkSamplerCreateInfo sampler_ci = {0};
-        sampler_ci.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-        sampler_ci.pNext = NULL;
-        sampler_ci.flags = 0;
-        sampler_ci.magFilter = VK_FILTER_NEAREST;
-        sampler_ci.minFilter = VK_FILTER_NEAREST;
-        sampler_ci.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
-        sampler_ci.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    render_group->clear_values_count = 1;
+    render_group->clear_values =
+        (VkClearValue *)sCalloc(render_group->clear_values_count, sizeof(VkClearValue));
+    render_group->clear_values[0].color = (VkClearColorValue){{0.f, 0.0f, 0.0f, 0.0f}};
+}
+
+// Brings fog_color back to full resolution, weighting the 4 nearest fog texels by how close their
+// depth is to the one of the pixel, and adds it to the color image like the full resolution fog
+internal void CreateFogUpsampleRenderGroup(Renderer *renderer, RenderGroup *render_group) {
+    const VkDescriptorSetLayoutBinding bindings[] = {
+        {// CAMERA MATRICES
+         0,
+         VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL},
+        {// DEPTH TEXTURE
+         1,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL},
+        {// FOG DEPTH
+         2,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL},
+        {// FOG COLOR
+         3,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL}};
+    CreatePassDescriptors(
+        renderer, bindings, ARRAY_SIZE(bindings), "Fog upsample descriptor set", render_group);
+
+    VkDescriptorSet set = render_group->descriptor_sets[0];
+    WriteCameraDescriptor(renderer, set, 0);
+    WriteImageDescriptor(renderer,
+                         set,
+                         1,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->fog_sampler,
+                         renderer->resolved_depth_image.image_view,
+                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    WriteImageDescriptor(renderer,
+                         set,
+                         2,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->fog_sampler,
+                         renderer->fog_depth.image_view,
+                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    WriteImageDescriptor(renderer,
+                         set,
+                         3,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->fog_sampler,
+                         renderer->fog_color.image_view,
+                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    CreateFogCompositeRenderPass(renderer, &render_group->render_pass);
+    PipelineCreateFullscreen(renderer->device,
+                             renderer->platform,
+                             "resources/shaders/fog_upsample.frag.spv",
+                             NULL,
+                             &renderer->swapchain.extent,
+                             renderer->msaa_level,
+                             true,
+                             1,
+                             render_group->layout,
+                             render_group->render_pass,
+                             &render_group->pipeline);
+
+    render_group->clear_values_count = 1;
+    render_group->clear_values =
+        (VkClearValue *)sCalloc(render_group->clear_values_count, sizeof(VkClearValue));
+    render_group->clear_values[0].color = (VkClearColorValue){{0.f, 0.0f, 0.0f, 0.0f}};
+}
+
+// Blends the marched fog into the history reprojected from the last frame. The history it reads
+// and the one it writes swap every frame, see UpdateFogHistoryDescriptors.
+internal void CreateFogTemporalRenderGroup(Renderer *renderer, RenderGroup *render_group) {
+    const VkDescriptorSetLayoutBinding bindings[] = {
+        {// CAMERA MATRICES
+         0,
+         VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL},
+        {// FOG DEPTH
+         1,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL},
+        {// FOG COLOR
+         2,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL},
+        {// HISTORY
+         3,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL}};
+    CreatePassDescriptors(
+        renderer, bindings, ARRAY_SIZE(bindings), "Fog temporal descriptor set", render_group);
+
+    VkDescriptorSet set = render_group->descriptor_sets[0];
+    WriteCameraDescriptor(renderer, set, 0);
+    WriteImageDescriptor(renderer,
+                         set,
+                         1,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->fog_sampler,
+                         renderer->fog_depth.image_view,
+                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    WriteImageDescriptor(renderer,
+                         set,
+                         2,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->fog_sampler,
+                         renderer->fog_color.image_view,
+                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    CreateFogTargetRenderPass(renderer, FOG_COLOR_FORMAT, &render_group->render_pass);
+    PipelineCreateFullscreen(renderer->device,
+                             renderer->platform,
+                             "resources/shaders/fog_temporal.frag.spv",
+                             NULL,
+                             &renderer->fog_extent,
+                             VK_SAMPLE_COUNT_1_BIT,
+                             false,
+                             1,
+                             render_group->layout,
+                             render_group->render_pass,
+                             &render_group->pipeline);
+
+    render_group->clear_values_count = 1;
+    render_group->clear_values =
+        (VkClearValue *)sCalloc(render_group->clear_values_count, sizeof(VkClearValue));
+    render_group->clear_values[0].color = (VkClearColorValue){{0.f, 0.0f, 0.0f, 0.0f}};
+}
+
+// A cleared history has 0 in alpha, fog_temporal.frag and resolve.frag don't blend it in
+internal void ClearHistory(Renderer *renderer, Image history[2]) {
+    VkImageMemoryBarrier barriers[2] = {0};
+    for(u32 i = 0; i < ARRAY_SIZE(barriers); ++i) {
+        barriers[i].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barriers[i].pNext = NULL;
+        barriers[i].srcAccessMask = 0;
+        barriers[i].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barriers[i].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barriers[i].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barriers[i].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barriers[i].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barriers[i].image = history[i].image;
+        barriers[i].subresourceRange =
+            (VkImageSubresourceRange){VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    }
+
+    VkCommandBuffer cmd;
+    AllocateAndBeginCommandBuffer(renderer->device, renderer->graphics_command_pool, &cmd);
+    vkCmdPipelineBarrier(cmd,
+                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0,
+                         0,
+                         NULL,
+                         0,
+                         NULL,
+                         ARRAY_SIZE(barriers),
+                         barriers);
+    const VkClearColorValue clear = {{0.0f, 0.0f, 0.0f, 0.0f}};
+    const VkImageSubresourceRange range = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    for(u32 i = 0; i < ARRAY_SIZE(barriers); ++i) {
+        vkCmdClearColorImage(cmd,
+                             history[i].image,
+                             VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                             &clear,
+                             1,
+                             &range);
+        barriers[i].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barriers[i].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        barriers[i].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barriers[i].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    }
+    vkCmdPipelineBarrier(cmd,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                         0,
+                         0,
+                         NULL,
+                         0,
+                         NULL,
+                         ARRAY_SIZE(barriers),
+                         barriers);
+    EndAndExecuteCommandBuffer(
+        renderer->device, renderer->graphics_queue, renderer->graphics_command_pool, cmd);
+}
+
+// Scattered light at the center of each froxel
+internal void CreateFroxelInjectGroup(Renderer *renderer, RenderGroup *render_group) {
+    *render_group = (RenderGroup){0};
+    const VkDescriptorSetLayoutBinding bindings[] = {
+        {// CAMERA MATRICES
+         0,
+         VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+         1,
+         VK_SHADER_STAGE_COMPUTE_BIT,
+         NULL},
+        {// SHADOWMAP READ
+         1,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         1,
+         VK_SHADER_STAGE_COMPUTE_BIT,
+         NULL},
+        {// TLAS
+         2,
+         VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR,
+         1,
+         VK_SHADER_STAGE_COMPUTE_BIT,
+         NULL},
+        {// SCATTERING WRITE
+         3,
+         VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+         1,
+         VK_SHADER_STAGE_COMPUTE_BIT,
+         NULL}};
+    CreatePassDescriptors(
+        renderer, bindings, ARRAY_SIZE(bindings), "Froxel inject descriptor set", render_group);
+
+    VkDescriptorSet set = render_group->descriptor_sets[0];
+    WriteCameraDescriptor(renderer, set, 0);
+    WriteImageDescriptor(renderer,
+                         set,
+                         1,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->shadowmap_sampler,
+                         renderer->shadowmap.image_view,
+                         VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+    TlasWriteDescriptor(renderer, set, 2);
+    WriteImageDescriptor(renderer,
+                         set,
+                         3,
+                         VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                         VK_NULL_HANDLE,
+                         renderer->froxel_scattering.image_view,
+                         VK_IMAGE_LAYOUT_GENERAL);
+
+    const VkSpecializationMapEntry entry = {0, offsetof(FogMarch, max_distance), sizeof(f32)};
+    const VkSpecializationInfo info = {1, &entry, sizeof(FogMarch), &renderer->fog_march};
+    PipelineCreateCompute(renderer->device,
+                          renderer->platform,
+                          "resources/shaders/froxel_inject.comp.spv",
+                          &info,
+                          render_group->layout,
+                          &render_group->pipeline);
+}
+
+// Gathers the scattered light front to back along each column of froxels
+internal void CreateFroxelIntegrateGroup(Renderer *renderer, RenderGroup *render_group) {
+    *render_group = (RenderGroup){0};
+    const VkDescriptorSetLayoutBinding bindings[] = {
+        {// SCATTERING READ
+         0,
+         VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+         1,
+         VK_SHADER_STAGE_COMPUTE_BIT,
+         NULL},
+        {// INTEGRATED WRITE
+         1,
+         VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+         1,
+         VK_SHADER_STAGE_COMPUTE_BIT,
+         NULL}};
+    CreatePassDescriptors(
+        renderer, bindings, ARRAY_SIZE(bindings), "Froxel integrate descriptor set", render_group);
+
+    VkDescriptorSet set = render_group->descriptor_sets[0];
+    WriteImageDescriptor(renderer,
+                         set,
+                         0,
+                         VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                         VK_NULL_HANDLE,
+                         renderer->froxel_scattering.image_view,
+                         VK_IMAGE_LAYOUT_GENERAL);
+    WriteImageDescriptor(renderer,
+                         set,
+                         1,
+                         VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                         VK_NULL_HANDLE,
+                         renderer->froxel_integrated.image_view,
+                         VK_IMAGE_LAYOUT_GENERAL);
+
+    const VkSpecializationMapEntry entry = {0, offsetof(FogMarch, max_distance), sizeof(f32)};
+    const VkSpecializationInfo info = {1, &entry, sizeof(FogMarch), &renderer->fog_march};
+    PipelineCreateCompute(renderer->device,
+                          renderer->platform,
+                          "resources/shaders/froxel_integrate.comp.spv",
+                          &info,
+                          render_group->layout,
+                          &render_group->pipeline);
+}
+
+// Reads the froxels at the distance of each pixel and adds them to the color image
+internal void CreateFroxelCompositeGroup(Renderer *renderer, RenderGroup *render_group) {
+    const VkDescriptorSetLayoutBinding bindings[] = {
+        {// CAMERA MATRICES
+         0,
+         VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL},
+        {// DEPTH TEXTURE
+         1,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL},
+        {// INTEGRATED FROXELS
+         2,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL}};
+    CreatePassDescriptors(
+        renderer, bindings, ARRAY_SIZE(bindings), "Froxel composite descriptor set", render_group);
+
+    VkDescriptorSet set = render_group->descriptor_sets[0];
+    WriteCameraDescriptor(renderer, set, 0);
+    WriteImageDescriptor(renderer,
+                         set,
+                         1,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->fog_sampler,
+                         renderer->resolved_depth_image.image_view,
+                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    WriteImageDescriptor(renderer,
+                         set,
+                         2,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->fog_linear_sampler,
+                         renderer->froxel_integrated.image_view,
+                         VK_IMAGE_LAYOUT_GENERAL);
+
+    const VkSpecializationMapEntry entry = {0, offsetof(FogMarch, max_distance), sizeof(f32)};
+    const VkSpecializationInfo info = {1, &entry, sizeof(FogMarch), &renderer->fog_march};
+    CreateFogCompositeRenderPass(renderer, &render_group->render_pass);
+    PipelineCreateFullscreen(renderer->device,
+                             renderer->platform,
+                             "resources/shaders/froxel_composite.frag.spv",
+                             &info,
+                             &renderer->swapchain.extent,
+                             renderer->msaa_level,
+                             true,
+                             1,
+                             render_group->layout,
+                             render_group->render_pass,
+                             &render_group->pipeline);
+
+    render_group->clear_values_count = 1;
+    render_group->clear_values =
+        (VkClearValue *)sCalloc(render_group->clear_values_count, sizeof(VkClearValue));
+    render_group->clear_values[0].color = (VkClearColorValue){{0.f, 0.0f, 0.0f, 0.0f}};
+}
+
+// The froxel volumes and the compute passes filling them don't depend on the screen or on the
+// fog settings, they are only created again with the shaders. The volumes stay in the general
+// layout, written as storage and read by the samplers.
+internal void CreateFroxelPasses(Renderer *renderer) {
+    const VkExtent3D extent = {FROXEL_WIDTH, FROXEL_HEIGHT, FROXEL_DEPTH};
+    const VkImageUsageFlags usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    CreateImage3D(renderer->device,
+                  &renderer->memory_properties,
+                  FROXEL_FORMAT,
+                  extent,
+                  usage,
+                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                  &renderer->froxel_scattering);
+    DEBUGNameImage(renderer->device, &renderer->froxel_scattering, "FROXEL SCATTERING");
+    CreateImage3D(renderer->device,
+                  &renderer->memory_properties,
+                  FROXEL_FORMAT,
+                  extent,
+                  usage,
+                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                  &renderer->froxel_integrated);
+    DEBUGNameImage(renderer->device, &renderer->froxel_integrated, "FROXEL INTEGRATED");
+
+    VkImageMemoryBarrier barriers[2] = {0};
+    const VkImage images[] = {renderer->froxel_scattering.image, renderer->froxel_integrated.image};
+    for(u32 i = 0; i < ARRAY_SIZE(barriers); ++i) {
+        barriers[i].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barriers[i].pNext = NULL;
+        barriers[i].srcAccessMask = 0;
+        barriers[i].dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        barriers[i].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barriers[i].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        barriers[i].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barriers[i].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barriers[i].image = images[i];
+        barriers[i].subresourceRange =
+            (VkImageSubresourceRange){VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    }
+    VkCommandBuffer cmd;
+    AllocateAndBeginCommandBuffer(renderer->device, renderer->graphics_command_pool, &cmd);
+    vkCmdPipelineBarrier(cmd,
+                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0,
+                         0,
+                         NULL,
+                         0,
+                         NULL,
+                         ARRAY_SIZE(barriers),
+                         barriers);
+    EndAndExecuteCommandBuffer(
+        renderer->device, renderer->graphics_queue, renderer->graphics_command_pool, cmd);
+
+    CreateFroxelInjectGroup(renderer, &renderer->froxel_inject_group);
+    CreateFroxelIntegrateGroup(renderer, &renderer->froxel_integrate_group);
+}
+
+internal void DestroyFroxelPasses(Renderer *renderer) {
+    DestroyRenderGroup(renderer, &renderer->froxel_inject_group);
+    DestroyRenderGroup(renderer, &renderer->froxel_integrate_group);
+    DestroyImage(renderer->device, &renderer->froxel_scattering);
+    DestroyImage(renderer->device, &renderer->froxel_integrated);
+}
+
+internal void CreateFogFramebuffer(Renderer *renderer,
+                                   VkRenderPass render_pass,
+                                   Image *image,
+                                   VkFramebuffer *framebuffer) {
+    VkFramebufferCreateInfo create_info = {0};
+    create_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    create_info.pNext = NULL;
+    create_info.flags = 0;
+    create_info.renderPass = render_pass;
+    create_info.attachmentCount = 1;
+    create_info.pAttachments = &image->image_view;
+    create_info.width = renderer->fog_extent.width;
+    create_info.height = renderer->fog_extent.height;
+    create_info.layers = 1;
+    AssertVkResult(vkCreateFramebuffer(renderer->device, &create_info, NULL, framebuffer));
+}
+
+// Render groups, histories and framebuffers of the raymarched fog at renderer->fog_extent and the
+// froxel composite. fog_depth and fog_color are transient targets, created before.
+internal void CreateFogPasses(Renderer *renderer) {
+    if(FogUsesTargets(renderer)) {
+        CreateFogDepthRenderGroup(renderer, &renderer->fog_depth_render_group);
+        CreateFogUpsampleRenderGroup(renderer, &renderer->fog_upsample_render_group);
+    }
+    if(renderer->fog_temporal) {
+        for(u32 i = 0; i < ARRAY_SIZE(renderer->fog_history); ++i) {
+            CreateImage(renderer->device,
+                        &renderer->memory_properties,
+                        FOG_COLOR_FORMAT,
+                        renderer->fog_extent,
+                        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
+                            VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                        &renderer->fog_history[i]);
+            DEBUGNameImage(renderer->device, &renderer->fog_history[i], "FOG HISTORY");
+        }
+        ClearHistory(renderer, renderer->fog_history);
+        renderer->fog_history_id = 0;
+        CreateFogTemporalRenderGroup(renderer, &renderer->fog_temporal_render_group);
+    }
+    CreateVolumetricRenderGroup(renderer, &renderer->volumetric_render_group);
+    CreateFroxelCompositeGroup(renderer, &renderer->froxel_composite_group);
+
+    if(FogUsesTargets(renderer)) {
+        CreateFogFramebuffer(renderer,
+                             renderer->fog_depth_render_group.render_pass,
+                             &renderer->fog_depth,
+                             &renderer->fog_depth_framebuffer);
+        CreateFogFramebuffer(renderer,
+                             renderer->volumetric_render_group.render_pass,
+                             &renderer->fog_color,
+                             &renderer->fog_color_framebuffer);
+    }
+    if(renderer->fog_temporal) {
+        for(u32 i = 0; i < ARRAY_SIZE(renderer->fog_history); ++i) {
+            CreateFogFramebuffer(renderer,
+                                 renderer->fog_temporal_render_group.render_pass,
+                                 &renderer->fog_history[i],
+                                 &renderer->fog_history_framebuffers[i]);
+        }
+    }
+
+    // The full resolution fog, the upsample and the froxel composite have the same render pass
+    const VkRenderPass composite_pass = FogUsesTargets(renderer)
+                                            ? renderer->fog_upsample_render_group.render_pass
+                                            : renderer->volumetric_render_group.render_pass;
+    renderer->framebuffers =
+        (VkFramebuffer *)sCalloc(renderer->swapchain.image_count, sizeof(VkFramebuffer));
+    for(u32 i = 0; i < renderer->swapchain.image_count; ++i) {
+        VkFramebufferCreateInfo create_info = {0};
+        create_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        create_info.pNext = NULL;
+        create_info.flags = 0;
+        create_info.renderPass = composite_pass;
+
+        VkImageView attachments[] = {renderer->color_pass_image.image_view,
+                                     renderer->swapchain.image_views[i]};
+
+        // Without a resolve the swapchain image is written by the resolve pass
+        create_info.attachmentCount =
+            renderer->msaa_level != VK_SAMPLE_COUNT_1_BIT ? ARRAY_SIZE(attachments) : 1;
+        create_info.pAttachments = attachments;
+        create_info.width = renderer->swapchain.extent.width;
+        create_info.height = renderer->swapchain.extent.height;
+        create_info.layers = 1;
+        AssertVkResult(
+            vkCreateFramebuffer(renderer->device, &create_info, NULL, &renderer->framebuffers[i]));
+    }
+}
+
+internal void DestroyFogPasses(Renderer *renderer) {
+    for(u32 i = 0; i < renderer->swapchain.image_count; ++i) {
+        vkDestroyFramebuffer(renderer->device, renderer->framebuffers[i], NULL);
+    }
+    sFree(renderer->framebuffers);
+    renderer->framebuffers = NULL;
+    DestroyRenderGroup(renderer, &renderer->volumetric_render_group);
+    DestroyRenderGroup(renderer, &renderer->froxel_composite_group);
+    if(FogUsesTargets(renderer)) {
+        vkDestroyFramebuffer(renderer->device, renderer->fog_depth_framebuffer, NULL);
+        vkDestroyFramebuffer(renderer->device, renderer->fog_color_framebuffer, NULL);
+        DestroyRenderGroup(renderer, &renderer->fog_depth_render_group);
+        DestroyRenderGroup(renderer, &renderer->fog_upsample_render_group);
+    }
+    if(renderer->fog_temporal) {
+        for(u32 i = 0; i < ARRAY_SIZE(renderer->fog_history); ++i) {
+            vkDestroyFramebuffer(renderer->device, renderer->fog_history_framebuffers[i], NULL);
+            DestroyImage(renderer->device, &renderer->fog_history[i]);
+        }
+        DestroyRenderGroup(renderer, &renderer->fog_temporal_render_group);
+    }
+}
+
+internal VkSampleCountFlagBits AntiAliasingSamples(const AntiAliasing mode) {
+    return mode == ANTI_ALIASING_TAA ? VK_SAMPLE_COUNT_1_BIT : (VkSampleCountFlagBits)mode;
+}
+
+// Writes the swapchain image, and in TAA the history the next frame reads
+internal void CreateResolveRenderPass(Renderer *renderer, VkRenderPass *render_pass) {
+    const bool temporal = renderer->anti_aliasing == ANTI_ALIASING_TAA;
+
+    VkAttachmentDescription attachments[2] = {0};
+    attachments[0].flags = 0;
+    attachments[0].format = renderer->swapchain.format;
+    attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
+    attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE; // Every pixel is written
+    attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[0].initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attachments[0].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    attachments[1] = attachments[0];
+    attachments[1].format = TAA_HISTORY_FORMAT;
+
+    VkAttachmentReference color_refs[] = {
+        {0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
+        {1, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
+    };
+
+    VkSubpassDescription subpass_desc = {0};
+    subpass_desc.flags = 0;
+    subpass_desc.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass_desc.inputAttachmentCount = 0;
+    subpass_desc.pInputAttachments = NULL;
+    subpass_desc.colorAttachmentCount = temporal ? 2 : 1;
+    subpass_desc.pColorAttachments = color_refs;
+    subpass_desc.pResolveAttachments = NULL;
+    subpass_desc.pDepthStencilAttachment = NULL;
+    subpass_desc.preserveAttachmentCount = 0;
+    subpass_desc.pPreserveAttachments = NULL;
+
+    VkRenderPassCreateInfo render_pass_ci = {0};
+    render_pass_ci.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    render_pass_ci.pNext = NULL;
+    render_pass_ci.flags = 0;
+    render_pass_ci.attachmentCount = temporal ? 2 : 1;
+    render_pass_ci.pAttachments = attachments;
+    render_pass_ci.subpassCount = 1;
+    render_pass_ci.pSubpasses = &subpass_desc;
+    render_pass_ci.dependencyCount = 0;
+    render_pass_ci.pDependencies = NULL;
+
+    AssertVkResult(vkCreateRenderPass(renderer->device, &render_pass_ci, NULL, render_pass));
+}
+
+// Copies the color image to the swapchain image, or in TAA blends it into the history
+// reprojected with the motion vectors. The history it reads and the one it writes swap every
+// frame, see UpdateTaaHistoryDescriptors.
+internal void CreateResolveRenderGroup(Renderer *renderer, RenderGroup *render_group) {
+    const VkDescriptorSetLayoutBinding bindings[] = {
+        {// COLOR
+         0,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL},
+        {// VELOCITY
+         1,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL},
+        {// HISTORY
+         2,
+         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+         1,
+         VK_SHADER_STAGE_FRAGMENT_BIT,
+         NULL}};
+    CreatePassDescriptors(
+        renderer, bindings, ARRAY_SIZE(bindings), "Resolve descriptor set", render_group);
+
+    // Without TAA only the color is read, the other bindings see it too
+    const VkBool32 temporal = renderer->anti_aliasing == ANTI_ALIASING_TAA;
+    VkDescriptorSet set = render_group->descriptor_sets[0];
+    WriteImageDescriptor(renderer,
+                         set,
+                         0,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->fog_sampler,
+                         renderer->color_pass_image.image_view,
+                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    WriteImageDescriptor(renderer,
+                         set,
+                         1,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->fog_sampler,
+                         temporal ? renderer->velocity_image.image_view
+                                  : renderer->color_pass_image.image_view,
+                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    WriteImageDescriptor(renderer,
+                         set,
+                         2,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->fog_linear_sampler,
+                         temporal ? renderer->taa_history[0].image_view
+                                  : renderer->color_pass_image.image_view,
+                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    const VkSpecializationMapEntry entry = {0, 0, sizeof(VkBool32)};
+    const VkSpecializationInfo info = {1, &entry, sizeof(VkBool32), &temporal};
+    CreateResolveRenderPass(renderer, &render_group->render_pass);
+    PipelineCreateFullscreen(renderer->device,
+                             renderer->platform,
+                             "resources/shaders/resolve.frag.spv",
+                             &info,
+                             &renderer->swapchain.extent,
+                             VK_SAMPLE_COUNT_1_BIT,
+                             false,
+                             temporal ? 2 : 1,
+                             render_group->layout,
+                             render_group->render_pass,
+                             &render_group->pipeline);
+
+    render_group->clear_values_count = 1;
+    render_group->clear_values =
+        (VkClearValue *)sCalloc(render_group->clear_values_count, sizeof(VkClearValue));
+    render_group->clear_values[0].color = (VkClearColorValue){{0.f, 0.0f, 0.0f, 0.0f}};
+}
+
+// A screen target that doesn't outlive the frame, image is NULL in the modes without it
+typedef struct TransientTarget {
+    Image *image;
+    VkFormat format;
+    VkExtent2D extent;
+    VkSampleCountFlagBits samples;
+    VkImageUsageFlags usage;
+    const char *name;
+} TransientTarget;
+
+internal TransientTarget GetTransientTarget(Renderer *renderer, const FrameResource resource) {
+    const bool multisampled = renderer->msaa_level != VK_SAMPLE_COUNT_1_BIT;
+    const bool temporal = renderer->anti_aliasing == ANTI_ALIASING_TAA;
+    const VkExtent2D extent = renderer->swapchain.extent;
+    const VkImageUsageFlags fog_usage =
+        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    TransientTarget target = {0};
+    switch(resource) {
+    case FRAME_RESOURCE_DEPTH:
+        if(multisampled) {
+            target = (TransientTarget){&renderer->depth_image,
+                                       renderer->depth_format,
+                                       extent,
+                                       renderer->msaa_level,
+                                       VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+                                       "DEPTH IMAGE"};
+        }
+        break;
+    case FRAME_RESOURCE_RESOLVED_DEPTH:
+        target = (TransientTarget){&renderer->resolved_depth_image,
+                                   renderer->depth_format,
+                                   extent,
+                                   VK_SAMPLE_COUNT_1_BIT,
+                                   VK_IMAGE_USAGE_SAMPLED_BIT |
+                                       VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+                                   "RESOLVED DEPTH IMAGE"};
+        break;
+    case FRAME_RESOURCE_COLOR:
+        target = (TransientTarget){&renderer->color_pass_image,
+                                   renderer->swapchain.format,
+                                   extent,
+                                   renderer->msaa_level,
+                                   multisampled ? VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+                                                : VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                                                      VK_IMAGE_USAGE_SAMPLED_BIT,
+                                   "COLOR PASS IMAGE"};
+        break;
+    case FRAME_RESOURCE_VELOCITY:
+        if(temporal) {
+            target = (TransientTarget){&renderer->velocity_image,
+                                       TAA_VELOCITY_FORMAT,
+                                       extent,
+                                       VK_SAMPLE_COUNT_1_BIT,
+                                       VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                                           VK_IMAGE_USAGE_SAMPLED_BIT,
+                                       "VELOCITY"};
+        }
+        break;
+    case FRAME_RESOURCE_FOG_DEPTH:
+        if(FogUsesTargets(renderer)) {
+            target = (TransientTarget){&renderer->fog_depth,
+                                       FOG_DEPTH_FORMAT,
+                                       renderer->fog_extent,
+                                       VK_SAMPLE_COUNT_1_BIT,
+                                       fog_usage,
+                                       "FOG DEPTH"};
+        }
+        break;
+    case FRAME_RESOURCE_FOG_COLOR:
+        if(FogUsesTargets(renderer)) {
+            target = (TransientTarget){&renderer->fog_color,
+                                       FOG_COLOR_FORMAT,
+                                       renderer->fog_extent,
+                                       VK_SAMPLE_COUNT_1_BIT,
+                                       fog_usage,
+                                       "FOG COLOR"};
+        }
+        break;
+    default: break;
+    }
+    return target;
+}
+
+// The screen passes of a frame in the order they are recorded, with the resources they use. With
+// every_path it also declares the passes the settings can switch to between two frames, the
+// transient targets are placed with the lifetimes of this one.
+internal void DeclareFrameGraph(Renderer *renderer, FrameGraph *graph, const bool every_path) {
+    const bool multisampled = renderer->msaa_level != VK_SAMPLE_COUNT_1_BIT;
+    const bool temporal = renderer->anti_aliasing == ANTI_ALIASING_TAA;
+    const bool prepass = every_path || renderer->depth_prepass;
+    const bool froxels = every_path || renderer->fog_technique == FOG_TECHNIQUE_FROXELS;
+    const bool raymarch = every_path || renderer->fog_technique != FOG_TECHNIQUE_FROXELS;
+    // Single sampled modes draw their depth straight to the resolved one
+    const u32 depth = multisampled ? FRAME_RESOURCE_DEPTH : FRAME_RESOURCE_RESOLVED_DEPTH;
+
+    FrameGraphClear(graph);
+    for(u32 r = 0; r < FRAME_TRANSIENT_COUNT; ++r) {
+        if(GetTransientTarget(renderer, r).image) {
+            const VkMemoryRequirements *requirements = &renderer->transient_requirements[r];
+            FrameGraphTransient(graph,
+                                r,
+                                requirements->size,
+                                requirements->alignment,
+                                renderer->transient_offsets[r]);
+        }
+    }
+    // The histories are read by the next frame, the swapchain image by the presentation
+    if(renderer->fog_temporal) {
+        for(u32 i = 0; i < ARRAY_SIZE(renderer->fog_history); ++i) {
+            FrameGraphImport(graph,
+                             FRAME_RESOURCE_FOG_HISTORY + i,
+                             GRAPH_USE_SAMPLED,
+                             GRAPH_USE_SAMPLED,
+                             GRAPH_RESOURCE_OUTPUT);
+        }
+    }
+    if(temporal) {
+        for(u32 i = 0; i < ARRAY_SIZE(renderer->taa_history); ++i) {
+            FrameGraphImport(graph,
+                             FRAME_RESOURCE_TAA_HISTORY + i,
+                             GRAPH_USE_SAMPLED,
+                             GRAPH_USE_SAMPLED,
+                             GRAPH_RESOURCE_OUTPUT);
+        }
+    }
+    FrameGraphImport(graph,
+                     FRAME_RESOURCE_FROXEL_SCATTERING,
+                     GRAPH_USE_STORAGE_READ,
+                     GRAPH_USE_STORAGE_READ,
+                     0);
+    FrameGraphImport(graph,
+                     FRAME_RESOURCE_FROXEL_INTEGRATED,
+                     GRAPH_USE_STORAGE_READ,
+                     GRAPH_USE_STORAGE_READ,
+                     0);
+    FrameGraphImport(graph,
+                     FRAME_RESOURCE_SWAPCHAIN,
+                     GRAPH_USE_PRESENT,
+                     GRAPH_USE_PRESENT,
+                     GRAPH_RESOURCE_OUTPUT);
+
+    // Culled when the froxels aren't composited
+    FrameGraphAddPass(graph, FRAME_PASS_FROXEL_INJECT, "FROXEL INJECT");
+    FrameGraphUse(graph, FRAME_RESOURCE_FROXEL_SCATTERING, GRAPH_USE_STORAGE_WRITE);
+    FrameGraphAddPass(graph, FRAME_PASS_FROXEL_INTEGRATE, "FROXEL INTEGRATE");
+    FrameGraphUse(graph, FRAME_RESOURCE_FROXEL_SCATTERING, GRAPH_USE_STORAGE_READ);
+    FrameGraphUse(graph, FRAME_RESOURCE_FROXEL_INTEGRATED, GRAPH_USE_STORAGE_WRITE);
+
+    if(prepass) {
+        FrameGraphAddPass(graph, FRAME_PASS_DEPTH_PREPASS, "DEPTH PREPASS");
+        FrameGraphUse(graph, depth, GRAPH_USE_DEPTH_WRITE);
+    }
+    FrameGraphAddPass(graph, FRAME_PASS_COLOR, "COLOR");
+    FrameGraphUse(graph, FRAME_RESOURCE_COLOR, GRAPH_USE_COLOR_WRITE);
+    FrameGraphUse(graph, depth, prepass ? GRAPH_USE_DEPTH_TEST : GRAPH_USE_DEPTH_WRITE);
+    if(multisampled) {
+        FrameGraphUse(graph, FRAME_RESOURCE_RESOLVED_DEPTH, GRAPH_USE_DEPTH_RESOLVE);
+    }
+    if(temporal) {
+        FrameGraphUse(graph, FRAME_RESOURCE_VELOCITY, GRAPH_USE_COLOR_WRITE);
+    }
+
+    // With MSAA the passes adding the fog to the color image resolve it into the swapchain image
+    if(froxels) {
+        FrameGraphAddPass(graph, FRAME_PASS_FROXEL_COMPOSITE, "FROXEL COMPOSITE");
+        FrameGraphUse(graph, FRAME_RESOURCE_FROXEL_INTEGRATED, GRAPH_USE_STORAGE_READ);
+        FrameGraphUse(graph, FRAME_RESOURCE_RESOLVED_DEPTH, GRAPH_USE_SAMPLED);
+        FrameGraphUse(graph, FRAME_RESOURCE_COLOR, GRAPH_USE_COLOR_BLEND);
+        if(multisampled) {
+            FrameGraphUse(graph, FRAME_RESOURCE_SWAPCHAIN, GRAPH_USE_COLOR_WRITE);
+        }
+    }
+    if(raymarch && FogUsesTargets(renderer)) {
+        const u32 history = FRAME_RESOURCE_FOG_HISTORY + renderer->fog_history_id;
+        const u32 last_history = FRAME_RESOURCE_FOG_HISTORY + (renderer->fog_history_id ^ 1);
+        FrameGraphAddPass(graph, FRAME_PASS_FOG_DEPTH, "FOG DEPTH");
+        FrameGraphUse(graph, FRAME_RESOURCE_RESOLVED_DEPTH, GRAPH_USE_SAMPLED);
+        FrameGraphUse(graph, FRAME_RESOURCE_FOG_DEPTH, GRAPH_USE_COLOR_WRITE);
+        FrameGraphAddPass(graph, FRAME_PASS_FOG_MARCH, "FOG MARCH");
+        FrameGraphUse(graph, FRAME_RESOURCE_FOG_DEPTH, GRAPH_USE_SAMPLED);
+        FrameGraphUse(graph, FRAME_RESOURCE_FOG_COLOR, GRAPH_USE_COLOR_WRITE);
+        if(renderer->fog_temporal) {
+            FrameGraphAddPass(graph, FRAME_PASS_FOG_TEMPORAL, "FOG TEMPORAL");
+            FrameGraphUse(graph, FRAME_RESOURCE_FOG_DEPTH, GRAPH_USE_SAMPLED);
+            FrameGraphUse(graph, FRAME_RESOURCE_FOG_COLOR, GRAPH_USE_SAMPLED);
+            FrameGraphUse(graph, last_history, GRAPH_USE_SAMPLED);
+            FrameGraphUse(graph, history, GRAPH_USE_COLOR_WRITE);
+        }
+        FrameGraphAddPass(graph, FRAME_PASS_FOG_UPSAMPLE, "FOG UPSAMPLE");
+        FrameGraphUse(graph, FRAME_RESOURCE_RESOLVED_DEPTH, GRAPH_USE_SAMPLED);
+        FrameGraphUse(graph, FRAME_RESOURCE_FOG_DEPTH, GRAPH_USE_SAMPLED);
+        FrameGraphUse(graph,
+                      renderer->fog_temporal ? history : FRAME_RESOURCE_FOG_COLOR,
+                      GRAPH_USE_SAMPLED);
+        FrameGraphUse(graph, FRAME_RESOURCE_COLOR, GRAPH_USE_COLOR_BLEND);
+        if(multisampled) {
+            FrameGraphUse(graph, FRAME_RESOURCE_SWAPCHAIN, GRAPH_USE_COLOR_WRITE);
+        }
+    } else if(raymarch) {
+        FrameGraphAddPass(graph, FRAME_PASS_FOG_MARCH, "FOG MARCH");
+        FrameGraphUse(graph, FRAME_RESOURCE_RESOLVED_DEPTH, GRAPH_USE_SAMPLED);
+        FrameGraphUse(graph, FRAME_RESOURCE_COLOR, GRAPH_USE_COLOR_BLEND);
+        if(multisampled) {
+            FrameGraphUse(graph, FRAME_RESOURCE_SWAPCHAIN, GRAPH_USE_COLOR_WRITE);
+        }
+    }
+
+    if(!multisampled) {
+        FrameGraphAddPass(graph, FRAME_PASS_RESOLVE, "RESOLVE");
+        FrameGraphUse(graph, FRAME_RESOURCE_COLOR, GRAPH_USE_SAMPLED);
+        if(temporal) {
+            const u32 history = FRAME_RESOURCE_TAA_HISTORY + renderer->taa_history_id;
+            const u32 last_history = FRAME_RESOURCE_TAA_HISTORY + (renderer->taa_history_id ^ 1);
+            FrameGraphUse(graph, FRAME_RESOURCE_VELOCITY, GRAPH_USE_SAMPLED);
+            FrameGraphUse(graph, last_history, GRAPH_USE_SAMPLED);
+            FrameGraphUse(graph, history, GRAPH_USE_COLOR_WRITE);
+        }
+        FrameGraphUse(graph, FRAME_RESOURCE_SWAPCHAIN, GRAPH_USE_COLOR_WRITE);
+    }
+}
+
+// Creates the transient targets of the current modes and places them in transient_memory, over
+// each other when no frame uses them at the same time
+internal void CreateTransientTargets(Renderer *renderer) {
+    const u32 downscale = renderer->fog_resolution;
+    const VkExtent2D extent = renderer->swapchain.extent;
+    renderer->fog_extent = (VkExtent2D){(extent.width + downscale - 1) / downscale,
+                                        (extent.height + downscale - 1) / downscale};
+
+    u32 memory_types = UINT_MAX;
+    u64 separate_size = 0;
+    for(u32 r = 0; r < FRAME_TRANSIENT_COUNT; ++r) {
+        const TransientTarget target = GetTransientTarget(renderer, r);
+        renderer->transient_offsets[r] = 0;
+        if(!target.image) {
+            continue;
+        }
+        VkMemoryRequirements *requirements = &renderer->transient_requirements[r];
+        CreateUnboundImage(renderer->device,
+                           target.format,
+                           target.extent,
+                           target.usage,
+                           target.samples,
+                           target.image,
+                           requirements);
+        memory_types &= requirements->memoryTypeBits;
+        separate_size += requirements->size;
+    }
+    ASSERT(memory_types != 0);
+
+    FrameGraph *graph = &renderer->frame_graph;
+    DeclareFrameGraph(renderer, graph, true);
+    FrameGraphCompile(graph);
+    const u64 size = FrameGraphAlias(graph);
+
+    VkMemoryAllocateInfo alloc_info = {0};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.pNext = NULL;
+    alloc_info.allocationSize = size;
+    alloc_info.memoryTypeIndex = FindMemoryType(
+        &renderer->memory_properties, memory_types, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    AssertVkResult(
+        vkAllocateMemory(renderer->device, &alloc_info, NULL, &renderer->transient_memory));
+    DEBUGNameObject(renderer->device,
+                    (u64)renderer->transient_memory,
+                    VK_OBJECT_TYPE_DEVICE_MEMORY,
+                    "TRANSIENT TARGETS");
+
+    for(u32 r = 0; r < FRAME_TRANSIENT_COUNT; ++r) {
+        const TransientTarget target = GetTransientTarget(renderer, r);
+        if(!target.image) {
+            continue;
+        }
+        renderer->transient_offsets[r] = graph->resources[r].offset;
+        BindImage(renderer->device,
+                  renderer->transient_memory,
+                  renderer->transient_offsets[r],
+                  target.format,
+                  target.usage,
+                  target.image);
+        DEBUGNameImage(renderer->device, target.image, target.name);
+    }
+    sLog("Transient targets : %llu KB aliased to %llu KB", separate_size / 1024, size / 1024);
+}
+
+// Before the modes they were created with change
+internal void DestroyTransientTargets(Renderer *renderer) {
+    for(u32 r = 0; r < FRAME_TRANSIENT_COUNT; ++r) {
+        const TransientTarget target = GetTransientTarget(renderer, r);
+        if(target.image) {
+            DestroyImage(renderer->device, target.image);
+        }
+    }
+    vkFreeMemory(renderer->device, renderer->transient_memory, NULL);
+}
+
+// TAA histories and the framebuffers of the passes drawing to the screen sized images of
+// renderer->anti_aliasing, created after the transient targets. The main render group has to be
+// created with the same mode.
+internal void CreateSceneTargets(Renderer *renderer) {
+    const bool multisampled = renderer->msaa_level != VK_SAMPLE_COUNT_1_BIT;
+    const bool temporal = renderer->anti_aliasing == ANTI_ALIASING_TAA;
+    const VkExtent2D extent = renderer->swapchain.extent;
+
+    if(temporal) {
+        for(u32 i = 0; i < ARRAY_SIZE(renderer->taa_history); ++i) {
+            CreateImage(renderer->device,
+                        &renderer->memory_properties,
+                        TAA_HISTORY_FORMAT,
+                        extent,
+                        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
+                            VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                        &renderer->taa_history[i]);
+            DEBUGNameImage(renderer->device, &renderer->taa_history[i], "TAA HISTORY");
+        }
+        ClearHistory(renderer, renderer->taa_history);
+        renderer->taa_history_id = 0;
+    }
+
+    VkFramebufferCreateInfo ci = {0};
+    ci.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    ci.pNext = NULL;
+    ci.flags = 0;
+    ci.renderPass = renderer->main_render_group.render_pass;
+
+    // Same order as the attachments of CreateMainRenderPass
+    VkImageView attachments[3] = {renderer->color_pass_image.image_view};
+    u32 attachment_count = 1;
+    if(multisampled) {
+        attachments[attachment_count++] = renderer->depth_image.image_view;
+    }
+    attachments[attachment_count++] = renderer->resolved_depth_image.image_view;
+    if(temporal) {
+        attachments[attachment_count++] = renderer->velocity_image.image_view;
+    }
+
+    ci.attachmentCount = attachment_count;
+    ci.pAttachments = attachments;
+    ci.width = extent.width;
+    ci.height = extent.height;
+    ci.layers = 1;
+    AssertVkResult(
+        vkCreateFramebuffer(renderer->device, &ci, NULL, &renderer->color_pass_framebuffer));
+
+    // The depth attachment of the main pass
+    ci.renderPass = renderer->depth_prepass_render_pass;
+    ci.attachmentCount = 1;
+    ci.pAttachments = &attachments[1];
+    AssertVkResult(
+        vkCreateFramebuffer(renderer->device, &ci, NULL, &renderer->depth_prepass_framebuffer));
+
+    if(multisampled) {
+        return;
+    }
+    CreateResolveRenderGroup(renderer, &renderer->resolve_render_group);
+    // In TAA framebuffer image * 2 + h writes taa_history[h]
+    const u32 history_count = temporal ? ARRAY_SIZE(renderer->taa_history) : 1;
+    renderer->resolve_framebuffers = (VkFramebuffer *)sCalloc(
+        renderer->swapchain.image_count * history_count, sizeof(VkFramebuffer));
+    for(u32 i = 0; i < renderer->swapchain.image_count; ++i) {
+        for(u32 h = 0; h < history_count; ++h) {
+            VkImageView resolve_attachments[] = {renderer->swapchain.image_views[i],
+                                                 renderer->taa_history[h].image_view};
+            ci.renderPass = renderer->resolve_render_group.render_pass;
+            ci.attachmentCount = temporal ? 2 : 1;
+            ci.pAttachments = resolve_attachments;
+            VkFramebuffer *framebuffer = &renderer->resolve_framebuffers[i * history_count + h];
+            AssertVkResult(vkCreateFramebuffer(renderer->device, &ci, NULL, framebuffer));
+        }
+    }
+}
+
+internal void DestroySceneTargets(Renderer *renderer) {
+    const bool multisampled = renderer->msaa_level != VK_SAMPLE_COUNT_1_BIT;
+    const bool temporal = renderer->anti_aliasing == ANTI_ALIASING_TAA;
+    if(!multisampled) {
+        const u32 history_count = temporal ? ARRAY_SIZE(renderer->taa_history) : 1;
+        for(u32 i = 0; i < renderer->swapchain.image_count * history_count; ++i) {
+            vkDestroyFramebuffer(renderer->device, renderer->resolve_framebuffers[i], NULL);
+        }
+        sFree(renderer->resolve_framebuffers);
+        renderer->resolve_framebuffers = NULL;
+        DestroyRenderGroup(renderer, &renderer->resolve_render_group);
+    }
+    vkDestroyFramebuffer(renderer->device, renderer->color_pass_framebuffer, NULL);
+    vkDestroyFramebuffer(renderer->device, renderer->depth_prepass_framebuffer, NULL);
+    if(temporal) {
+        for(u32 i = 0; i < ARRAY_SIZE(renderer->taa_history); ++i) {
+            DestroyImage(renderer->device, &renderer->taa_history[i]);
+        }
+    }
+}
+
+internal const char *AntiAliasingName(const AntiAliasing mode) {
+    switch(mode) {
+    case ANTI_ALIASING_MSAA_1: return "No anti aliasing";
+    case ANTI_ALIASING_MSAA_2: return "MSAA 2x";
+    case ANTI_ALIASING_MSAA_4: return "MSAA 4x";
+    case ANTI_ALIASING_MSAA_8: return "MSAA 8x";
+    case ANTI_ALIASING_TAA: return "TAA";
+    }
+    return "Unknown anti aliasing";
+}
+
+// Computed from the formats rather than the allocations, which can be a bit larger with their
+// alignment. The swapchain formats picked have 32 bits texels. The swapchain and the fog targets
+// are the same in every mode and aren't counted.
+internal u64 VulkanGetAntiAliasingMemory(Renderer *renderer, const AntiAliasing mode) {
+    const VkSampleCountFlagBits samples = AntiAliasingSamples(mode);
+    if(samples > renderer->msaa_max) {
+        return 0;
+    }
+    const u64 pixels = (u64)renderer->swapchain.extent.width * renderer->swapchain.extent.height;
+    const u64 color_size = 4;
+    const u64 depth_size = 4; // D32
+    u64 size = pixels * (color_size + depth_size) * samples;
+    if(samples > VK_SAMPLE_COUNT_1_BIT) {
+        size += pixels * depth_size; // Resolved depth
+    }
+    if(mode == ANTI_ALIASING_TAA) {
+        const u64 velocity_size = 4;  // R16G16
+        const u64 history_size = 8;   // R16G16B16A16
+        size += pixels * (velocity_size + ARRAY_SIZE(renderer->taa_history) * history_size);
+    }
+    return size;
+}
+
+DLL_EXPORT Renderer *VulkanCreateRenderer(PlatformWindow *window, PlatformAPI *platform_api) {
+    Renderer *renderer = (Renderer *)sMalloc(sizeof(Renderer));
+
+    renderer->platform = platform_api;
+
+    CreateVkInstance(&renderer->instance, platform_api);
+    platform_api->CreateVkSurface(renderer->instance, window, &renderer->surface);
+    CreateVkPhysicalDevice(renderer->instance, &renderer->physical_device);
+
+    // Get device properties
+    vkGetPhysicalDeviceMemoryProperties(renderer->physical_device, &renderer->memory_properties);
+    vkGetPhysicalDeviceProperties(renderer->physical_device, &renderer->physical_device_properties);
+    {
+        VkPhysicalDeviceAccelerationStructurePropertiesKHR accel_properties = {0};
+        accel_properties.sType =
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR;
+        VkPhysicalDeviceProperties2 properties = {0};
+        properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        properties.pNext = &accel_properties;
+        vkGetPhysicalDeviceProperties2(renderer->physical_device, &properties);
+        renderer->accel_scratch_alignment =
+            accel_properties.minAccelerationStructureScratchOffsetAlignment;
+    }
+
+    // MSAA
+    VkSampleCountFlags msaa_levels =
+        renderer->physical_device_properties.limits.framebufferColorSampleCounts &
+        renderer->physical_device_properties.limits.framebufferDepthSampleCounts;
+    if(msaa_levels & VK_SAMPLE_COUNT_8_BIT) {
+        renderer->msaa_max = VK_SAMPLE_COUNT_8_BIT;
+        sLog("VK_SAMPLE_COUNT_8_BIT");
+    } else if(msaa_levels & VK_SAMPLE_COUNT_4_BIT) {
+        renderer->msaa_max = VK_SAMPLE_COUNT_4_BIT;
+        sLog("VK_SAMPLE_COUNT_4_BIT");
+    } else if(msaa_levels & VK_SAMPLE_COUNT_2_BIT) {
+        renderer->msaa_max = VK_SAMPLE_COUNT_2_BIT;
+        sLog("VK_SAMPLE_COUNT_2_BIT");
+    } else {
+        renderer->msaa_max = VK_SAMPLE_COUNT_1_BIT;
+        sLog("VK_SAMPLE_COUNT_1_BIT");
+    }
+    renderer->anti_aliasing = (AntiAliasing)renderer->msaa_max;
+    renderer->msaa_level = renderer->msaa_max;
+
+    GetQueuesId(renderer);
+    CreateVkDevice(renderer->physical_device,
+                   renderer->graphics_queue_id,
+                   renderer->transfer_queue_id,
+                   renderer->present_queue_id,
+                   &renderer->device);
+
+    LoadDeviceFuncPointers(renderer->device);
+
+    vkGetDeviceQueue(renderer->device, renderer->graphics_queue_id, 0, &renderer->graphics_queue);
+    vkGetDeviceQueue(renderer->device, renderer->present_queue_id, 0, &renderer->present_queue);
+    vkGetDeviceQueue(renderer->device, renderer->transfer_queue_id, 0, &renderer->transfer_queue);
+
+    // Graphics Command Pool
+    VkCommandPoolCreateInfo pool_create_info = {0};
+    pool_create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_create_info.pNext = NULL;
+    pool_create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    pool_create_info.queueFamilyIndex = renderer->graphics_queue_id;
+    VkResult result = vkCreateCommandPool(
+        renderer->device, &pool_create_info, NULL, &renderer->graphics_command_pool);
+    AssertVkResult(result);
+
+    // Transfer Command Pool
+    pool_create_info.queueFamilyIndex = renderer->transfer_queue_id;
+    result = vkCreateCommandPool(
+        renderer->device, &pool_create_info, NULL, &renderer->transfer_command_pool);
+    AssertVkResult(result);
+
+    // Recording Command Pools, reset as a whole every frame
+    // One context per worker and one for the main thread
+    const u32 worker_count = renderer->platform->worker_count;
+    renderer->record_job_count =
+        worker_count < RECORD_MAX_CONTEXTS - 1 ? worker_count : RECORD_MAX_CONTEXTS - 1;
+    pool_create_info.flags = 0;
+    pool_create_info.queueFamilyIndex = renderer->graphics_queue_id;
+    for(u32 i = 0; i < RECORD_MAX_CONTEXTS; ++i) {
+        RecordContext *context = &renderer->record_contexts[i];
+        *context = (RecordContext){0};
+        AssertVkResult(
+            vkCreateCommandPool(renderer->device, &pool_create_info, NULL, &context->pool));
+    }
+    renderer->record_chunk_capacity = 0;
+    renderer->record_chunks = NULL;
+
+    // Descriptor Pool
+    VkDescriptorPoolSize pool_sizes[] = {
+        {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 100},
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 100},
+        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 64},
+        {VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 10},
+        {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 100},
+    };
+    const u32 pool_sizes_count = sizeof(pool_sizes) / sizeof(pool_sizes[0]);
+
+    VkDescriptorPoolCreateInfo pool_ci = {0};
+    pool_ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_ci.pNext = NULL;
+    pool_ci.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+    pool_ci.maxSets = 32;
+    pool_ci.poolSizeCount = pool_sizes_count;
+    pool_ci.pPoolSizes = pool_sizes;
+    AssertVkResult(
+        vkCreateDescriptorPool(renderer->device, &pool_ci, NULL, &renderer->descriptor_pool));
+
+    // Swapchain
+    renderer->swapchain.swapchain = VK_NULL_HANDLE;
+    CreateSwapchain(renderer, &renderer->swapchain);
+
+    // TODO : pick that don't hard code it
+    renderer->depth_format = VK_FORMAT_D32_SFLOAT;
+
+    // Texture Sampler
+    {
+        VkSamplerCreateInfo sampler_ci = {0};
+        sampler_ci.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        sampler_ci.pNext = NULL;
+        sampler_ci.flags = 0;
+        sampler_ci.magFilter = VK_FILTER_NEAREST;
+        sampler_ci.minFilter = VK_FILTER_NEAREST;
+        sampler_ci.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+        sampler_ci.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
         sampler_ci.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
         sampler_ci.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
         sampler_ci.mipLodBias = 0.0f;
@@ -1384,28 +2672,7 @@ DLL_EXPORT Renderer *VulkanCreateRenderer(PlatformWindow *window, PlatformAPI *p
             vkCreateSampler(renderer->device, &sampler_ci, NULL, &renderer->texture_sampler));
     }
 
-    { // Depth image
-        CreateMultiSampledImage(renderer->device,
-                                &renderer->memory_properties,
-                                renderer->depth_format,
-                                renderer->swapchain.extent,
-                                VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
-                                    VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                renderer->msaa_level,
-                                &renderer->depth_image);
-        DEBUGNameImage(renderer->device, &renderer->depth_image, "DEPTH IMAGE");
-
-        CreateImage(renderer->device,
-                    &renderer->memory_properties,
-                    renderer->depth_format,
-                    renderer->swapchain.extent,
-                    VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
-                        VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                    &renderer->resolved_depth_image);
-        DEBUGNameImage(renderer->device, &renderer->resolved_depth_image, "RESOLVED DEPTH IMAGE");
-
+    { // Depth sampler, the images are created with the other scene targets
         VkSamplerCreateInfo sampler_ci = {0};
         sampler_ci.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
         sampler_ci.pNext = NULL;
@@ -1427,17 +2694,6 @@ DLL_EXPORT Renderer *VulkanCreateRenderer(PlatformWindow *window, PlatformAPI *p
         sampler_ci.unnormalizedCoordinates = VK_FALSE;
         AssertVkResult(
             vkCreateSampler(renderer->device, &sampler_ci, NULL, &renderer->depth_sampler));
-        // MSAA Image
-        CreateMultiSampledImage(renderer->device,
-                                &renderer->memory_properties,
-                                renderer->swapchain.format,
-                                renderer->swapchain.extent,
-                                VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |
-                                    VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                renderer->msaa_level,
-                                &renderer->msaa_image);
-        DEBUGNameImage(renderer->device, &renderer->msaa_image, "MSAA RENDER TGT");
     }
     {
         // Camera info
@@ -1450,52 +2706,228 @@ DLL_EXPORT Renderer *VulkanCreateRenderer(PlatformWindow *window, PlatformAPI *p
         DEBUGNameBuffer(renderer->device, &renderer->camera_info_buffer, "Camera Info");
         renderer->camera_info.proj = mat4_perspective(90.0f, 1280.0f / 720.0f, 0.1f, 1000.0f);
         mat4_inverse(&renderer->camera_info.proj, &renderer->camera_info.proj_inverse);
+        renderer->camera_info.shadow_mode = SHADOW_MODE_MAP;
+        renderer->camera_info.previous_proj = renderer->camera_info.proj;
+        renderer->camera_info.previous_view = mat4_identity();
+        renderer->camera_info.fog_frame = 0;
 
         // Scene info
         // Materials
-        renderer->materials_count = 0;
+        renderer->materials_capacity = 128;
+        renderer->materials = (Material *)sCalloc(renderer->materials_capacity, sizeof(Material));
         CreateBuffer(renderer->device,
                      &renderer->memory_properties,
-                     128 * sizeof(Material),
-                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     renderer->materials_capacity * sizeof(Material),
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                         VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
                      &renderer->mat_buffer);
         DEBUGNameBuffer(renderer->device, &renderer->mat_buffer, "SCENE MATS");
 
+        // Default material, used by primitives that don't have one
+        Material *default_material = &renderer->materials[0];
+        default_material->base_color = (Vec3){1.0f, 1.0f, 1.0f};
+        default_material->base_color_texture = UINT_MAX;
+        default_material->metallic_roughness_texture = UINT_MAX;
+        default_material->metallic_factor = 0.0f;
+        default_material->roughness_factor = 1.0f;
+        default_material->normal_texture = UINT_MAX;
+        default_material->ao_texture = UINT_MAX;
+        default_material->emissive_texture = UINT_MAX;
+        default_material->base_color_uv = (Vec4){1.0f, 1.0f, 0.0f, 0.0f};
+        renderer->materials_count = 1;
+        UploadToDeviceBuffer(renderer->device,
+                             &renderer->memory_properties,
+                             renderer->graphics_command_pool,
+                             renderer->graphics_queue,
+                             &renderer->mat_buffer,
+                             0,
+                             default_material,
+                             sizeof(Material));
+
         // Textures
         renderer->textures_capacity = 1;
         renderer->textures = (Image *)sCalloc(renderer->textures_capacity, sizeof(Image));
+        renderer->texture_entries =
+            (TextureEntry *)sCalloc(renderer->textures_capacity, sizeof(TextureEntry));
         renderer->textures_count = 0;
+        renderer->texture_pixel_dedup = true;
 
-        // TEMP: switch to dyn arrays
-        renderer->meshes = (Mesh **)sCalloc(1, sizeof(Mesh *));
+        // White, in the descriptors of the freed slots
+        const VkExtent2D fallback_extent = {1, 1};
+        u32 white = 0xFFFFFFFF;
+        CreateImage(renderer->device,
+                    &renderer->memory_properties,
+                    VK_FORMAT_R8G8B8A8_UNORM,
+                    fallback_extent,
+                    VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    &renderer->fallback_texture);
+        DEBUGNameImage(renderer->device, &renderer->fallback_texture, "FALLBACK TEXTURE");
+        Buffer staging;
+        CreateBuffer(renderer->device,
+                     &renderer->memory_properties,
+                     sizeof(white),
+                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &staging);
+        UploadToBuffer(renderer->device, &staging, &white, sizeof(white));
+        VkCommandBuffer cmd;
+        AllocateAndBeginCommandBuffer(renderer->device, renderer->graphics_command_pool, &cmd);
+        CopyBufferToImage(cmd, fallback_extent, &staging, &renderer->fallback_texture);
+        EndAndExecuteCommandBuffer(
+            renderer->device, renderer->graphics_queue, renderer->graphics_command_pool, cmd);
+        DestroyBuffer(renderer->device, &staging);
+
+        renderer->texture_atlas_enabled = true;
+        renderer->atlas_page_capacity = 1;
+        renderer->atlas_pages =
+            (AtlasPage *)sCalloc(renderer->atlas_page_capacity, sizeof(AtlasPage));
+        renderer->atlas_region_capacity = 16;
+        renderer->atlas_regions =
+            (AtlasRegion *)sCalloc(renderer->atlas_region_capacity, sizeof(AtlasRegion));
+
+        renderer->mesh_capacity = 4;
+        renderer->meshes = (Mesh *)sCalloc(renderer->mesh_capacity, sizeof(Mesh));
         renderer->mesh_count = 0;
+        HandleMapInit(&renderer->mesh_handles, renderer->mesh_capacity);
+
+        renderer->mesh_load_capacity = 4;
+        renderer->mesh_loads =
+            (MeshLoad **)sCalloc(renderer->mesh_load_capacity, sizeof(MeshLoad *));
+
+        Mat4BatchInit();
+        renderer->instance_scratch_capacity = 0;
+        renderer->instance_scratch = NULL;
+
+        CullInit();
+        renderer->cull_unit_count = 0;
+        renderer->cull_unit_capacity = 64;
+        renderer->cull_units = (CullUnit *)sCalloc(renderer->cull_unit_capacity, sizeof(CullUnit));
+        atomic_init(&renderer->cull_next_unit, 0);
+        atomic_init(&renderer->cull_running_jobs, 0);
+        renderer->cull_job_count = renderer->platform->worker_count;
+        renderer->cull_stats = (CullStats){0};
+        renderer->render_queue = (RenderQueue){0};
+        renderer->draw_stats = (DrawStats){0};
+
+        BvhInit(&renderer->scene_tree, 64);
+        renderer->trace_job_count = renderer->platform->worker_count;
+
+        renderer->accel_scratch = (Buffer){0};
+        renderer->blas_memory = 0;
+        renderer->blas_memory_saved = 0;
+        renderer->tlas = (Tlas){0};
+        renderer->tlas.layout_dirty = true;
+        TlasCreateEmpty(renderer, &renderer->empty_tlas);
+        renderer->tlas_bound = VK_NULL_HANDLE;
+        renderer->tlas_bound_generation = 0;
     }
     { // ShadowMap group
-        renderer->shadowmap_extent = (VkExtent2D){4096, 4096};
+        renderer->shadowmap_extent = (VkExtent2D){2048, 2048};
+        renderer->camera_info.cascade_count = SHADOW_CASCADE_COUNT;
+        ASSERT(SHADOW_CASCADE_COUNT >= 2 && SHADOW_CASCADE_COUNT <= SHADOW_MAX_CASCADES);
         CreateShadowMapRenderGroup(renderer, &renderer->shadowmap_render_group);
 
-        CreateImage(renderer->device,
-                    &renderer->memory_properties,
-                    renderer->depth_format,
-                    renderer->shadowmap_extent,
-                    VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                    &renderer->shadowmap);
+        CreateImageArray(renderer->device,
+                         &renderer->memory_properties,
+                         renderer->depth_format,
+                         renderer->shadowmap_extent,
+                         SHADOW_CASCADE_COUNT,
+                         VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                             VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                         &renderer->shadowmap);
         DEBUGNameImage(renderer->device, &renderer->shadowmap, "SHADOW MAP");
 
-        VkFramebufferCreateInfo framebuffer_create_info = {0};
-        framebuffer_create_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        framebuffer_create_info.pNext = NULL;
-        framebuffer_create_info.flags = 0;
-        framebuffer_create_info.renderPass = renderer->shadowmap_render_group.render_pass;
-        framebuffer_create_info.attachmentCount = 1;
-        framebuffer_create_info.pAttachments = &renderer->shadowmap.image_view;
-        framebuffer_create_info.width = renderer->shadowmap_extent.width;
-        framebuffer_create_info.height = renderer->shadowmap_extent.height;
-        framebuffer_create_info.layers = 1;
-        AssertVkResult(vkCreateFramebuffer(
-            renderer->device, &framebuffer_create_info, NULL, &renderer->shadowmap_framebuffer));
+        CreateShadowRenderPass(renderer,
+                               VK_SAMPLE_COUNT_1_BIT,
+                               VK_ATTACHMENT_LOAD_OP_CLEAR,
+                               VK_IMAGE_LAYOUT_UNDEFINED,
+                               VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                               VK_PIPELINE_STAGE_TRANSFER_BIT,
+                               0,
+                               VK_PIPELINE_STAGE_TRANSFER_BIT,
+                               VK_ACCESS_TRANSFER_READ_BIT,
+                               &renderer->shadowmap_static_render_pass);
+        CreateImageArray(renderer->device,
+                         &renderer->memory_properties,
+                         renderer->depth_format,
+                         renderer->shadowmap_extent,
+                         SHADOW_CASCADE_COUNT,
+                         VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                             VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                         &renderer->shadowmap_static);
+        DEBUGNameImage(renderer->device, &renderer->shadowmap_static, "STATIC SHADOW MAP");
+        renderer->shadow_static_dirty = true;
+        renderer->shadow_dynamic_count = 0;
+
+        // The color and fog passes sample it even when the shadow pass is skipped
+        VkImageMemoryBarrier barrier = {0};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.pNext = NULL;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = renderer->shadowmap.image;
+        barrier.subresourceRange =
+            (VkImageSubresourceRange){VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, SHADOW_CASCADE_COUNT};
+        VkCommandBuffer cmd;
+        AllocateAndBeginCommandBuffer(renderer->device, renderer->graphics_command_pool, &cmd);
+        vkCmdPipelineBarrier(cmd,
+                             VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                             0,
+                             0,
+                             NULL,
+                             0,
+                             NULL,
+                             1,
+                             &barrier);
+        EndAndExecuteCommandBuffer(
+            renderer->device, renderer->graphics_queue, renderer->graphics_command_pool, cmd);
+
+        for(u32 c = 0; c < SHADOW_CASCADE_COUNT; ++c) {
+            CreateImageLayerView(renderer->device,
+                                 &renderer->shadowmap,
+                                 renderer->depth_format,
+                                 VK_IMAGE_ASPECT_DEPTH_BIT,
+                                 c,
+                                 &renderer->shadowmap_layer_views[c]);
+
+            VkFramebufferCreateInfo framebuffer_create_info = {0};
+            framebuffer_create_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+            framebuffer_create_info.pNext = NULL;
+            framebuffer_create_info.flags = 0;
+            framebuffer_create_info.renderPass = renderer->shadowmap_render_group.render_pass;
+            framebuffer_create_info.attachmentCount = 1;
+            framebuffer_create_info.pAttachments = &renderer->shadowmap_layer_views[c];
+            framebuffer_create_info.width = renderer->shadowmap_extent.width;
+            framebuffer_create_info.height = renderer->shadowmap_extent.height;
+            framebuffer_create_info.layers = 1;
+            AssertVkResult(vkCreateFramebuffer(renderer->device,
+                                               &framebuffer_create_info,
+                                               NULL,
+                                               &renderer->shadowmap_framebuffers[c]));
+
+            CreateImageLayerView(renderer->device,
+                                 &renderer->shadowmap_static,
+                                 renderer->depth_format,
+                                 VK_IMAGE_ASPECT_DEPTH_BIT,
+                                 c,
+                                 &renderer->shadowmap_static_layer_views[c]);
+            framebuffer_create_info.renderPass = renderer->shadowmap_static_render_pass;
+            framebuffer_create_info.pAttachments = &renderer->shadowmap_static_layer_views[c];
+            AssertVkResult(vkCreateFramebuffer(renderer->device,
+                                               &framebuffer_create_info,
+                                               NULL,
+                                               &renderer->shadowmap_static_framebuffers[c]));
+            renderer->shadowmap_layer_clean[c] = false;
+        }
 
         VkSamplerCreateInfo shdw_sampler_ci = {0};
         shdw_sampler_ci.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
@@ -1521,55 +2953,62 @@ DLL_EXPORT Renderer *VulkanCreateRenderer(PlatformWindow *window, PlatformAPI *p
     }
 
     { // Main
+        renderer->depth_prepass = false;
         CreateMainRenderGroup(renderer, &renderer->main_render_group);
-        CreateMultiSampledImage(renderer->device,
-                                &renderer->memory_properties,
-                                renderer->swapchain.format,
-                                renderer->swapchain.extent,
-                                VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                renderer->msaa_level,
-                                &renderer->color_pass_image);
-        VkFramebufferCreateInfo ci = {0};
-        ci.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        ci.pNext = NULL;
-        ci.flags = 0;
-        ci.renderPass = renderer->main_render_group.render_pass;
-
-        VkImageView attachments[] = {renderer->color_pass_image.image_view,
-                                     renderer->depth_image.image_view,
-                                     renderer->resolved_depth_image.image_view};
-
-        ci.attachmentCount = ARRAY_SIZE(attachments);
-        ci.pAttachments = attachments;
-        ci.width = renderer->swapchain.extent.width;
-        ci.height = renderer->swapchain.extent.height;
-        ci.layers = 1;
-        AssertVkResult(
-            vkCreateFramebuffer(renderer->device, &ci, NULL, &renderer->color_pass_framebuffer));
+        CreateDepthPrepass(renderer);
     }
     { // Volumetric
-        CreateVolumetricRenderGroup(renderer, &renderer->volumetric_render_group);
-        renderer->framebuffers =
-            (VkFramebuffer *)sCalloc(renderer->swapchain.image_count, sizeof(VkFramebuffer));
-
-        for(u32 i = 0; i < renderer->swapchain.image_count; ++i) {
-            VkFramebufferCreateInfo create_info = {0};
-            create_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-            create_info.pNext = NULL;
-            create_info.flags = 0;
-            create_info.renderPass = renderer->volumetric_render_group.render_pass;
-
-            VkImageView attachments[] = {renderer->color_pass_image.image_view,
-                                         renderer->swapchain.image_views[i]};
-
-            create_info.attachmentCount = ARRAY_SIZE(attachments);
-            create_info.pAttachments = attachments;
-            create_info.width = renderer->swapchain.extent.width;
-            create_info.height = renderer->swapchain.extent.height;
-            create_info.layers = 1;
-            AssertVkResult(vkCreateFramebuffer(
-                renderer->device, &create_info, NULL, &renderer->framebuffers[i]));
+        VkSamplerCreateInfo sampler_ci = {0};
+        sampler_ci.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        sampler_ci.pNext = NULL;
+        sampler_ci.flags = 0;
+        sampler_ci.magFilter = VK_FILTER_NEAREST;
+        sampler_ci.minFilter = VK_FILTER_NEAREST;
+        sampler_ci.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+        sampler_ci.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        sampler_ci.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        sampler_ci.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        sampler_ci.mipLodBias = 0.0f;
+        sampler_ci.anisotropyEnable = VK_FALSE;
+        sampler_ci.maxAnisotropy = 1.0f;
+        sampler_ci.compareEnable = VK_FALSE;
+        sampler_ci.compareOp = VK_COMPARE_OP_ALWAYS;
+        sampler_ci.minLod = 0.0f;
+        sampler_ci.maxLod = 0.0f;
+        sampler_ci.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+        sampler_ci.unnormalizedCoordinates = VK_FALSE;
+        AssertVkResult(
+            vkCreateSampler(renderer->device, &sampler_ci, NULL, &renderer->fog_sampler));
+        sampler_ci.magFilter = VK_FILTER_LINEAR;
+        sampler_ci.minFilter = VK_FILTER_LINEAR;
+        AssertVkResult(
+            vkCreateSampler(renderer->device, &sampler_ci, NULL, &renderer->fog_linear_sampler));
+
+        renderer->fog_march = FOG_MARCH_DEFAULT;
+        renderer->fog_resolution = FOG_RESOLUTION_FULL;
+        renderer->fog_technique = FOG_TECHNIQUE_RAYMARCH;
+        renderer->fog_temporal = false;
+        CreateFroxelPasses(renderer);
+    }
+    { // Targets of the anti aliasing and the fog passes over them
+        renderer->taa_frame = 0;
+        renderer->camera_info.jitter = (Vec2){0.0f, 0.0f};
+        // The frame graph names the histories before the modes using them reset their ids
+        renderer->taa_history_id = 0;
+        renderer->fog_history_id = 0;
+        CreateTransientTargets(renderer);
+        CreateSceneTargets(renderer);
+        CreateFogPasses(renderer);
+        const AntiAliasing modes[] = {ANTI_ALIASING_MSAA_1,
+                                      ANTI_ALIASING_MSAA_2,
+                                      ANTI_ALIASING_MSAA_4,
+                                      ANTI_ALIASING_MSAA_8,
+                                      ANTI_ALIASING_TAA};
+        for(u32 i = 0; i < ARRAY_SIZE(modes); ++i) {
+            const u64 size = VulkanGetAntiAliasingMemory(renderer, modes[i]);
+            if(size > 0) {
+                sLog("%s : %llu KB of scene targets", AntiAliasingName(modes[i]), size / 1024);
+            }
         }
     }
 
@@ -1577,41 +3016,69 @@ DLL_EXPORT Renderer *VulkanCreateRenderer(PlatformWindow *window, PlatformAPI *p
 }
 
 DLL_EXPORT void VulkanDestroyRenderer(Renderer *context) {
+    // Let the pending loads finish so that their resources belong to a mesh
+    for(u32 i = 0; i < context->mesh_load_capacity; ++i) {
+        if(context->mesh_loads[i]) {
+            RendererWaitMesh(context, i);
+        }
+    }
+    sFree(context->mesh_loads);
+
     vkDeviceWaitIdle(context->device);
 
+    // Meshes release their textures
+    while(context->mesh_count > 0) {
+        RendererDestroyMesh(context, HandleMapHandleOf(&context->mesh_handles, 0));
+    }
+    sFree(context->meshes);
+    HandleMapFree(&context->mesh_handles);
+    sFree(context->instance_scratch);
+    sFree(context->cull_units);
+    BvhFree(&context->scene_tree);
+    if(context->accel_scratch.size > 0) {
+        DestroyBuffer(context->device, &context->accel_scratch);
+    }
+    TlasFree(context, &context->tlas);
+    TlasFree(context, &context->empty_tlas);
+
     for(u32 i = 0; i < context->textures_count; ++i) {
-        DestroyImage(context->device, &context->textures[i]);
+        if(context->texture_entries[i].ref_count > 0) {
+            DestroyImage(context->device, &context->textures[i]);
+        }
     }
+    DestroyImage(context->device, &context->fallback_texture);
     sFree(context->textures);
+    sFree(context->texture_entries);
+    sFree(context->atlas_pages);
+    sFree(context->atlas_regions);
 
     DestroyBuffer(context->device, &context->mat_buffer);
-
-    for(u32 i = 0; i < context->mesh_count; ++i) {
-        RendererDestroyMesh(context, i);
-    }
-    sFree(context->meshes);
+    sFree(context->materials);
 
     // Volumetric render group
-    DestroyRenderGroup(context, &context->volumetric_render_group);
-    for(u32 i = 0; i < context->swapchain.image_count; ++i) {
-        vkDestroyFramebuffer(context->device, context->framebuffers[i], NULL);
-    }
+    DestroyFogPasses(context);
+    DestroyFroxelPasses(context);
+    vkDestroySampler(context->device, context->fog_sampler, NULL);
+    vkDestroySampler(context->device, context->fog_linear_sampler, NULL);
     // Shadowmap render group
     DestroyImage(context->device, &context->shadowmap);
     vkDestroySampler(context->device, context->shadowmap_sampler, NULL);
-    vkDestroyFramebuffer(context->device, context->shadowmap_framebuffer, NULL);
+    for(u32 c = 0; c < context->camera_info.cascade_count; ++c) {
+        vkDestroyFramebuffer(context->device, context->shadowmap_framebuffers[c], NULL);
+        vkDestroyImageView(context->device, context->shadowmap_layer_views[c], NULL);
+        vkDestroyFramebuffer(context->device, context->shadowmap_static_framebuffers[c], NULL);
+        vkDestroyImageView(context->device, context->shadowmap_static_layer_views[c], NULL);
+    }
+    DestroyImage(context->device, &context->shadowmap_static);
+    vkDestroyRenderPass(context->device, context->shadowmap_static_render_pass, NULL);
     DestroyRenderGroup(context, &context->shadowmap_render_group);
 
     // Main render group
+    DestroySceneTargets(context);
+    DestroyTransientTargets(context);
+    DestroyDepthPrepass(context);
     DestroyRenderGroup(context, &context->main_render_group);
-    vkDestroyFramebuffer(context->device, context->color_pass_framebuffer, NULL);
-
-    sFree(context->framebuffers);
-
-    DestroyImage(context->device, &context->resolved_depth_image);
-    DestroyImage(context->device, &context->color_pass_image);
-    DestroyImage(context->device, &context->depth_image);
-    DestroyImage(context->device, &context->msaa_image);
+    RenderQueueFree(&context->render_queue);
 
     vkDestroySampler(context->device, context->texture_sampler, NULL);
     vkDestroySampler(context->device, context->depth_sampler, NULL);
@@ -1624,6 +3091,12 @@ DLL_EXPORT void VulkanDestroyRenderer(Renderer *context) {
 
     vkDestroyDescriptorPool(context->device, context->descriptor_pool, NULL);
     vkDestroyCommandPool(context->device, context->graphics_command_pool, NULL);
+    vkDestroyCommandPool(context->device, context->transfer_command_pool, NULL);
+    for(u32 i = 0; i < RECORD_MAX_CONTEXTS; ++i) {
+        vkDestroyCommandPool(context->device, context->record_contexts[i].pool, NULL);
+        sFree(context->record_contexts[i].buffers);
+    }
+    sFree(context->record_chunks);
 
     vkDestroyDevice(context->device, NULL);
     pfn_vkDestroyDebugUtilsMessengerEXT(context->instance, debug_messenger, NULL);
@@ -1636,22 +3109,95 @@ DLL_EXPORT void VulkanDestroyRenderer(Renderer *context) {
 
 DLL_EXPORT void VulkanReloadShaders(Renderer *renderer) {
     vkDestroyPipeline(renderer->device, renderer->main_render_group.pipeline, NULL);
-
-    PipelineCreateDefault(renderer->device,
-                          renderer->platform,
-                          "resources/shaders/general.vert.spv",
-                          "resources/shaders/general.frag.spv",
-                          &renderer->swapchain.extent,
-                          renderer->msaa_level,
-                          renderer->main_render_group.layout,
-                          renderer->main_render_group.render_pass,
-                          &renderer->main_render_group.pipeline);
+    CreateMainPipeline(renderer, &renderer->main_render_group);
 
     DestroyRenderGroup(renderer, &renderer->shadowmap_render_group);
     CreateShadowMapRenderGroup(renderer, &renderer->shadowmap_render_group);
+    renderer->shadow_static_dirty = true;
+
+    DestroyFogPasses(renderer);
+    DestroyFroxelPasses(renderer);
+    DestroySceneTargets(renderer);
+    DestroyDepthPrepass(renderer);
+    CreateDepthPrepass(renderer);
+    CreateSceneTargets(renderer);
+    CreateFroxelPasses(renderer);
+    CreateFogPasses(renderer);
+}
 
-    DestroyRenderGroup(renderer, &renderer->volumetric_render_group);
-    CreateVolumetricRenderGroup(renderer, &renderer->volumetric_render_group);
+// The targets are sized anew and placed again with the others, it waits for the last frame
+internal void VulkanSetFogResolution(Renderer *renderer, const FogResolution resolution) {
+    if(resolution == renderer->fog_resolution) {
+        return;
+    }
+    vkQueueWaitIdle(renderer->graphics_queue);
+    DestroyFogPasses(renderer);
+    DestroySceneTargets(renderer);
+    DestroyTransientTargets(renderer);
+    renderer->fog_resolution = resolution;
+    CreateTransientTargets(renderer);
+    CreateSceneTargets(renderer);
+    CreateFogPasses(renderer);
+}
+
+// The history carries the samples of the last frames so the march takes fewer steps with it.
+// The fog targets come and go with it, the transient targets are placed again.
+internal void VulkanSetFogTemporal(Renderer *renderer, const bool enabled) {
+    if(enabled == renderer->fog_temporal) {
+        return;
+    }
+    vkQueueWaitIdle(renderer->graphics_queue);
+    DestroyFogPasses(renderer);
+    DestroySceneTargets(renderer);
+    DestroyTransientTargets(renderer);
+    renderer->fog_temporal = enabled;
+    renderer->fog_march = enabled ? FOG_MARCH_TEMPORAL : FOG_MARCH_DEFAULT;
+    CreateTransientTargets(renderer);
+    CreateSceneTargets(renderer);
+    CreateFogPasses(renderer);
+}
+
+// Every screen sized target and the passes drawing to them are created again for the new sample
+// count, it waits for the last frame
+internal void VulkanSetAntiAliasing(Renderer *renderer, AntiAliasing mode) {
+    while(AntiAliasingSamples(mode) > renderer->msaa_max) {
+        mode = (AntiAliasing)(mode / 2);
+    }
+    if(mode == renderer->anti_aliasing) {
+        return;
+    }
+    vkQueueWaitIdle(renderer->graphics_queue);
+    DestroyFogPasses(renderer);
+    DestroySceneTargets(renderer);
+    DestroyTransientTargets(renderer);
+    DestroyDepthPrepass(renderer);
+    vkDestroyPipeline(renderer->device, renderer->main_render_group.pipeline, NULL);
+    vkDestroyRenderPass(renderer->device, renderer->main_render_group.render_pass, NULL);
+
+    renderer->anti_aliasing = mode;
+    renderer->msaa_level = AntiAliasingSamples(mode);
+    renderer->camera_info.jitter = (Vec2){0.0f, 0.0f};
+
+    CreateMainRenderPass(renderer, &renderer->main_render_group.render_pass);
+    CreateMainPipeline(renderer, &renderer->main_render_group);
+    CreateDepthPrepass(renderer);
+    CreateTransientTargets(renderer);
+    CreateSceneTargets(renderer);
+    CreateFogPasses(renderer);
+}
+
+// The main pass loads the depth of the prepass and tests it for equality instead of clearing
+// it, its framebuffer stays compatible
+internal void VulkanSetDepthPrepass(Renderer *renderer, const bool enabled) {
+    if(enabled == renderer->depth_prepass) {
+        return;
+    }
+    vkQueueWaitIdle(renderer->graphics_queue);
+    vkDestroyPipeline(renderer->device, renderer->main_render_group.pipeline, NULL);
+    vkDestroyRenderPass(renderer->device, renderer->main_render_group.render_pass, NULL);
+    renderer->depth_prepass = enabled;
+    CreateMainRenderPass(renderer, &renderer->main_render_group.render_pass);
+    CreateMainPipeline(renderer, &renderer->main_render_group);
 }
 
 // ================
@@ -1660,11 +3206,606 @@ DLL_EXPORT void VulkanReloadShaders(Renderer *renderer) {
 //
 // ================
 
+// The secondary buffers recorded last frame are done, the frame waits for the queue
+internal void ResetRecordContexts(Renderer *renderer) {
+    for(u32 i = 0; i < RECORD_MAX_CONTEXTS; ++i) {
+        RecordContext *context = &renderer->record_contexts[i];
+        if(context->used > 0) {
+            AssertVkResult(vkResetCommandPool(renderer->device, context->pool, 0));
+            context->used = 0;
+        }
+    }
+}
+
+// Enough buffers for the context to record count more chunks. Allocated on the main thread
+// before the workers start, they only take them from their own context.
+internal void ReserveRecordContext(Renderer *renderer, RecordContext *context, const u32 count) {
+    const u32 needed = context->used + count;
+    if(needed <= context->buffer_count) {
+        return;
+    }
+    context->buffers =
+        (VkCommandBuffer *)sRealloc(context->buffers, needed * sizeof(VkCommandBuffer));
+    VkCommandBufferAllocateInfo allocate_info = {0};
+    allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocate_info.pNext = NULL;
+    allocate_info.commandPool = context->pool;
+    allocate_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+    allocate_info.commandBufferCount = needed - context->buffer_count;
+    AssertVkResult(vkAllocateCommandBuffers(
+        renderer->device, &allocate_info, &context->buffers[context->buffer_count]));
+    context->buffer_count = needed;
+}
+
+// A pass split in chunks of RECORD_CHUNK_SIZE draws, shared by the threads recording it
+typedef struct PassRecording {
+    Renderer *renderer;
+    const RenderGroup *render_group;
+    VkFramebuffer framebuffer;
+    Frame frame; // Each chunk records with its own buffer and counts
+    DrawPass pass;
+    u32 cascade; // Pushed after the material in the shadow passes
+    u32 first;   // Draws of the pass in the render queue
+    u32 end;
+    u32 chunk_count;
+    _Atomic u32 next_chunk;
+    _Atomic u32 next_context;
+    _Atomic u32 running_jobs;
+} PassRecording;
+
+internal void RecordPassState(const PassRecording *recording, VkCommandBuffer cmd) {
+    if(recording->pass == DRAW_PASS_SHADOW) {
+        vkCmdPushConstants(cmd,
+                           recording->render_group->layout,
+                           VK_SHADER_STAGE_VERTEX_BIT,
+                           sizeof(PushConstant),
+                           sizeof(u32),
+                           &recording->cascade);
+    }
+}
+
+internal void RecordChunks(PassRecording *recording) {
+    Renderer *renderer = recording->renderer;
+    const u32 context_id = atomic_fetch_add(&recording->next_context, 1);
+    RecordContext *context = &renderer->record_contexts[context_id];
+    for(;;) {
+        const u32 c = atomic_fetch_add(&recording->next_chunk, 1);
+        if(c >= recording->chunk_count) {
+            break;
+        }
+        RecordChunk *chunk = &renderer->record_chunks[c];
+        VkCommandBuffer cmd = context->buffers[context->used++];
+
+        VkCommandBufferInheritanceInfo inheritance = {0};
+        inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        inheritance.pNext = NULL;
+        inheritance.renderPass = recording->render_group->render_pass;
+        inheritance.subpass = 0;
+        inheritance.framebuffer = recording->framebuffer;
+        const VkCommandBufferBeginInfo begin_info = {
+            VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            NULL,
+            VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+            &inheritance};
+        AssertVkResult(vkBeginCommandBuffer(cmd, &begin_info));
+        BindRenderGroup(cmd, recording->render_group);
+        RecordPassState(recording, cmd);
+
+        Frame frame = recording->frame;
+        frame.cmd = cmd;
+        frame.visible_count = 0;
+        frame.draw_count = 0;
+        chunk->stats = (DrawPassStats){0};
+        const u32 first = recording->first + c * RECORD_CHUNK_SIZE;
+        const u32 end = first + RECORD_CHUNK_SIZE < recording->end ? first + RECORD_CHUNK_SIZE
+                                                                   : recording->end;
+        RendererRecordDraws(renderer, &frame, recording->pass, first, end, &chunk->stats);
+        AssertVkResult(vkEndCommandBuffer(cmd));
+
+        chunk->cmd = cmd;
+        chunk->visible_count = frame.visible_count;
+        chunk->draw_count = frame.draw_count;
+    }
+}
+
+// Worker thread
+internal void RecordJob(void *data) {
+    PassRecording *recording = (PassRecording *)data;
+    RecordChunks(recording);
+    atomic_fetch_sub(&recording->running_jobs, 1);
+}
+
+// Records a render pass with the draws of pass from the sorted render queue. Passes with enough
+// draws are recorded in chunks by the workers and the main thread into secondary command
+// buffers, executed in the order of the queue.
+internal void RecordDrawPass(Renderer *renderer,
+                             VkCommandBuffer cmd,
+                             const RenderGroup *render_group,
+                             VkFramebuffer framebuffer,
+                             const VkExtent2D extent,
+                             Frame *frame,
+                             const DrawPass pass,
+                             const u32 cascade) {
+    PassRecording recording = {0};
+    recording.renderer = renderer;
+    recording.render_group = render_group;
+    recording.framebuffer = framebuffer;
+    recording.frame = *frame;
+    recording.pass = pass;
+    recording.cascade = cascade;
+    RenderQueueRange(&renderer->render_queue, pass, &recording.first, &recording.end);
+    DrawPassStats *stats = &renderer->draw_stats.passes[pass];
+
+    const u32 count = recording.end - recording.first;
+    // Small passes aren't worth the secondary buffers, and loads keep the workers busy
+    if(count < RECORD_PARALLEL_THRESHOLD || renderer->record_job_count == 0 ||
+       RendererIsLoading(renderer)) {
+        BeginRenderGroup(cmd, render_group, framebuffer, extent);
+        RecordPassState(&recording, cmd);
+        RendererRecordDraws(renderer, frame, pass, recording.first, recording.end, stats);
+        vkCmdEndRenderPass(cmd);
+        return;
+    }
+
+    recording.chunk_count = (count + RECORD_CHUNK_SIZE - 1) / RECORD_CHUNK_SIZE;
+    if(recording.chunk_count > renderer->record_chunk_capacity) {
+        renderer->record_chunk_capacity = recording.chunk_count;
+        renderer->record_chunks = (RecordChunk *)sRealloc(
+            renderer->record_chunks, recording.chunk_count * sizeof(RecordChunk));
+    }
+    const u32 job_count = renderer->record_job_count;
+    for(u32 i = 0; i < job_count + 1; ++i) {
+        ReserveRecordContext(renderer, &renderer->record_contexts[i], recording.chunk_count);
+    }
+    atomic_store(&recording.next_chunk, 0);
+    atomic_store(&recording.next_context, 0);
+    atomic_store(&recording.running_jobs, job_count);
+    for(u32 i = 0; i < job_count; ++i) {
+        renderer->platform->PushJob(&RecordJob, &recording);
+    }
+    RecordChunks(&recording);
+    // Late jobs find no chunk left and return right away
+    RendererWaitJobs(renderer, &recording.running_jobs);
+
+    BeginRenderPass(
+        cmd, render_group, framebuffer, extent, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+    for(u32 c = 0; c < recording.chunk_count; ++c) {
+        const RecordChunk *chunk = &renderer->record_chunks[c];
+        vkCmdExecuteCommands(cmd, 1, &chunk->cmd);
+        frame->visible_count += chunk->visible_count;
+        frame->draw_count += chunk->draw_count;
+        stats->primitives += chunk->stats.primitives;
+        stats->binds += chunk->stats.binds;
+        stats->pushes += chunk->stats.pushes;
+        stats->draws += chunk->stats.draws;
+    }
+    vkCmdEndRenderPass(cmd);
+}
+
+// Draws the casters of a cascade that pass the filter into one of its layers
+internal void DrawShadowCascade(Renderer *renderer,
+                                VkCommandBuffer cmd,
+                                const RenderGroup *render_group,
+                                VkFramebuffer framebuffer,
+                                const u32 cascade,
+                                const DrawFilter filter) {
+    Frame frame = {cmd, render_group->layout, CULL_VISIBLE_SHADOW(cascade), filter};
+    // Mesh order, the shadow passes neither shade nor read the material
+    RenderQueueClear(&renderer->render_queue);
+    RendererQueuePass(renderer, &frame, DRAW_PASS_SHADOW, 0);
+    RenderQueueSort(&renderer->render_queue);
+    RecordDrawPass(renderer,
+                   cmd,
+                   render_group,
+                   framebuffer,
+                   renderer->shadowmap_extent,
+                   &frame,
+                   DRAW_PASS_SHADOW,
+                   cascade);
+    renderer->cull_stats.shadow_visible += frame.visible_count;
+    renderer->cull_stats.shadow_draws += frame.draw_count;
+}
+
+// The static casters are drawn again only when the cascade moved or the static instances
+// changed. The layer that is sampled is a copy of them with the dynamic casters on top, it is
+// left alone while there is nothing dynamic to add.
+internal void RecordShadowCascade(Renderer *renderer, VkCommandBuffer cmd, const u32 cascade) {
+    const Mat4 *vp = &renderer->camera_info.shadow_vp[cascade];
+    if(renderer->shadow_static_dirty ||
+       memcmp(&renderer->shadowmap_static_vp[cascade], vp, sizeof(Mat4)) != 0) {
+        // Same pipeline, the static pass is compatible with the one of the group
+        RenderGroup static_group = renderer->shadowmap_render_group;
+        static_group.render_pass = renderer->shadowmap_static_render_pass;
+        DrawShadowCascade(renderer,
+                          cmd,
+                          &static_group,
+                          renderer->shadowmap_static_framebuffers[cascade],
+                          cascade,
+                          DRAW_STATIC);
+        renderer->shadowmap_static_vp[cascade] = *vp;
+        renderer->shadowmap_layer_clean[cascade] = false;
+        ++renderer->cull_stats.shadow_baked_cascades;
+    }
+    if(renderer->shadowmap_layer_clean[cascade] && renderer->shadow_dynamic_count == 0) {
+        return;
+    }
+
+    VkImageMemoryBarrier barrier = {0};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.pNext = NULL;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = renderer->shadowmap.image;
+    barrier.subresourceRange =
+        (VkImageSubresourceRange){VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, cascade, 1};
+    vkCmdPipelineBarrier(cmd,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0,
+                         0,
+                         NULL,
+                         0,
+                         NULL,
+                         1,
+                         &barrier);
+
+    VkImageCopy region = {0};
+    region.srcSubresource = (VkImageSubresourceLayers){VK_IMAGE_ASPECT_DEPTH_BIT, 0, cascade, 1};
+    region.srcOffset = (VkOffset3D){0, 0, 0};
+    region.dstSubresource = region.srcSubresource;
+    region.dstOffset = (VkOffset3D){0, 0, 0};
+    region.extent =
+        (VkExtent3D){renderer->shadowmap_extent.width, renderer->shadowmap_extent.height, 1};
+    vkCmdCopyImage(cmd,
+                   renderer->shadowmap_static.image,
+                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                   renderer->shadowmap.image,
+                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                   1,
+                   &region);
+
+    DrawShadowCascade(renderer,
+                      cmd,
+                      &renderer->shadowmap_render_group,
+                      renderer->shadowmap_framebuffers[cascade],
+                      cascade,
+                      DRAW_DYNAMIC);
+    renderer->shadowmap_layer_clean[cascade] = renderer->shadow_dynamic_count == 0;
+}
+
+internal void RecordComputeBarrier(VkCommandBuffer cmd,
+                                   const VkPipelineStageFlags src_stage,
+                                   const VkAccessFlags src_access,
+                                   const VkPipelineStageFlags dst_stage) {
+    const VkMemoryBarrier barrier = {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER, NULL, src_access, VK_ACCESS_SHADER_READ_BIT};
+    vkCmdPipelineBarrier(cmd, src_stage, dst_stage, 0, 1, &barrier, 0, NULL, 0, NULL);
+}
+
+// The froxel volumes are 8x8 columns per group
+internal void DispatchFroxels(VkCommandBuffer cmd, const RenderGroup *group, const u32 depth) {
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, group->pipeline);
+    vkCmdBindDescriptorSets(cmd,
+                            VK_PIPELINE_BIND_POINT_COMPUTE,
+                            group->layout,
+                            0,
+                            group->descriptor_set_count,
+                            group->descriptor_sets,
+                            0,
+                            NULL);
+    vkCmdDispatch(cmd, (FROXEL_WIDTH + 7) / 8, (FROXEL_HEIGHT + 7) / 8, depth);
+}
+
+internal void DrawFullscreen(VkCommandBuffer cmd,
+                             const RenderGroup *render_group,
+                             VkFramebuffer target,
+                             const VkExtent2D extent) {
+    BeginRenderGroup(cmd, render_group, target, extent);
+    vkCmdDraw(cmd, 6, 1, 0, 0);
+    vkCmdEndRenderPass(cmd);
+}
+
+typedef struct GraphUseState {
+    VkImageLayout layout;
+    VkPipelineStageFlags stages;
+    VkAccessFlags access;
+} GraphUseState;
+
+internal GraphUseState GetGraphUseState(const GraphUse use) {
+    const VkPipelineStageFlags depth_stages =
+        VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    const VkAccessFlags depth_access = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                       VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    switch(use) {
+    case GRAPH_USE_NONE:
+        return (GraphUseState){VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0};
+    case GRAPH_USE_COLOR_WRITE:
+        return (GraphUseState){VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                               VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                               VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT};
+    case GRAPH_USE_COLOR_BLEND:
+        return (GraphUseState){VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                               VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                               VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+                                   VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT};
+    case GRAPH_USE_DEPTH_WRITE:
+    case GRAPH_USE_DEPTH_TEST:
+        return (GraphUseState){
+            VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, depth_stages, depth_access};
+    case GRAPH_USE_DEPTH_RESOLVE:
+        // Resolves happen in the color attachment output stage, depth ones included
+        return (GraphUseState){VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                               VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                                   VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                               VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                   VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT};
+    case GRAPH_USE_SAMPLED:
+        return (GraphUseState){VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                               VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                               VK_ACCESS_SHADER_READ_BIT};
+    case GRAPH_USE_STORAGE_WRITE:
+        return (GraphUseState){VK_IMAGE_LAYOUT_GENERAL,
+                               VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                               VK_ACCESS_SHADER_WRITE_BIT};
+    case GRAPH_USE_STORAGE_READ:
+        return (GraphUseState){VK_IMAGE_LAYOUT_GENERAL,
+                               VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                                   VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                               VK_ACCESS_SHADER_READ_BIT};
+    case GRAPH_USE_PRESENT:
+        // Same stage as the wait on the acquire semaphore, the first write of the image waits
+        // for it
+        return (GraphUseState){VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+                               VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                               0};
+    case GRAPH_USE_COUNT: break;
+    }
+    ASSERT(0);
+    return (GraphUseState){VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0};
+}
+
+internal VkImage FrameResourceImage(Renderer *renderer, const u32 resource, const u32 image_id) {
+    if(resource < FRAME_TRANSIENT_COUNT) {
+        return GetTransientTarget(renderer, resource).image->image;
+    }
+    if(resource < FRAME_RESOURCE_TAA_HISTORY) {
+        return renderer->fog_history[resource - FRAME_RESOURCE_FOG_HISTORY].image;
+    }
+    if(resource < FRAME_RESOURCE_FROXEL_SCATTERING) {
+        return renderer->taa_history[resource - FRAME_RESOURCE_TAA_HISTORY].image;
+    }
+    switch(resource) {
+    case FRAME_RESOURCE_FROXEL_SCATTERING: return renderer->froxel_scattering.image;
+    case FRAME_RESOURCE_FROXEL_INTEGRATED: return renderer->froxel_integrated.image;
+    case FRAME_RESOURCE_SWAPCHAIN: return renderer->swapchain.images[image_id];
+    }
+    ASSERT(0);
+    return VK_NULL_HANDLE;
+}
+
+// Barriers [first, first + count) of the compiled frame graph in a single call, waiting for the
+// stages of every barrier
+internal void RecordGraphBarriers(Renderer *renderer,
+                                  VkCommandBuffer cmd,
+                                  const u32 image_id,
+                                  const u32 first,
+                                  const u32 count) {
+    if(count == 0) {
+        return;
+    }
+    const FrameGraph *graph = &renderer->frame_graph;
+    VkImageMemoryBarrier barriers[GRAPH_MAX_BARRIERS];
+    VkPipelineStageFlags src_stages = 0;
+    VkPipelineStageFlags dst_stages = 0;
+    for(u32 i = 0; i < count; ++i) {
+        const GraphBarrier *barrier = &graph->barriers[first + i];
+        VkAccessFlags src_access = 0;
+        for(u32 use = 0; use < GRAPH_USE_COUNT; ++use) {
+            if(barrier->src_uses & (1u << use)) {
+                const GraphUseState state = GetGraphUseState((GraphUse)use);
+                src_stages |= state.stages;
+                src_access |= state.access;
+            }
+        }
+        const GraphUseState old_state = GetGraphUseState(barrier->old_use);
+        const GraphUseState new_state = GetGraphUseState(barrier->new_use);
+        dst_stages |= new_state.stages;
+        const bool depth = barrier->resource == FRAME_RESOURCE_DEPTH ||
+                           barrier->resource == FRAME_RESOURCE_RESOLVED_DEPTH;
+
+        barriers[i].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barriers[i].pNext = NULL;
+        barriers[i].srcAccessMask = src_access;
+        barriers[i].dstAccessMask = new_state.access;
+        barriers[i].oldLayout = old_state.layout;
+        barriers[i].newLayout = new_state.layout;
+        barriers[i].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barriers[i].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barriers[i].image = FrameResourceImage(renderer, barrier->resource, image_id);
+        barriers[i].subresourceRange = (VkImageSubresourceRange){
+            depth ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    }
+    vkCmdPipelineBarrier(cmd, src_stages, dst_stages, 0, 0, NULL, 0, NULL, count, barriers);
+}
+
+// A kept pass of the frame graph, its barriers are recorded before it
+internal void RecordFramePass(Renderer *renderer,
+                              VkCommandBuffer cmd,
+                              const FramePass pass,
+                              const u32 image_id) {
+    const VkExtent2D extent = renderer->swapchain.extent;
+    switch(pass) {
+    case FRAME_PASS_FROXEL_INJECT: {
+        // The shadow map is drawn or copied from the static casters just before, outside the graph
+        const VkPipelineStageFlags shadow_stages =
+            VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+        const VkAccessFlags shadow_access =
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+        RecordComputeBarrier(
+            cmd, shadow_stages, shadow_access, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+        DispatchFroxels(cmd, &renderer->froxel_inject_group, FROXEL_DEPTH);
+    } break;
+    case FRAME_PASS_FROXEL_INTEGRATE: {
+        DispatchFroxels(cmd, &renderer->froxel_integrate_group, 1);
+    } break;
+    case FRAME_PASS_DEPTH_PREPASS: {
+        // Same layout and sets, the depth is the only attachment
+        RenderGroup prepass_group = renderer->main_render_group;
+        prepass_group.render_pass = renderer->depth_prepass_render_pass;
+        prepass_group.pipeline = renderer->depth_prepass_pipeline;
+        prepass_group.clear_values_count = 1;
+        prepass_group.clear_values = &renderer->main_render_group.clear_values[1];
+        Frame frame = {cmd, prepass_group.layout, CULL_VISIBLE_COLOR};
+        RecordDrawPass(renderer,
+                       cmd,
+                       &prepass_group,
+                       renderer->depth_prepass_framebuffer,
+                       extent,
+                       &frame,
+                       DRAW_PASS_DEPTH_PREPASS,
+                       0);
+    } break;
+    case FRAME_PASS_COLOR: {
+        Frame frame = {cmd, renderer->main_render_group.layout, CULL_VISIBLE_COLOR};
+        RecordDrawPass(renderer,
+                       cmd,
+                       &renderer->main_render_group,
+                       renderer->color_pass_framebuffer,
+                       extent,
+                       &frame,
+                       DRAW_PASS_COLOR,
+                       0);
+        renderer->cull_stats.color_visible = frame.visible_count;
+        renderer->cull_stats.color_draws = frame.draw_count;
+    } break;
+    case FRAME_PASS_FROXEL_COMPOSITE: {
+        DrawFullscreen(
+            cmd, &renderer->froxel_composite_group, renderer->framebuffers[image_id], extent);
+    } break;
+    case FRAME_PASS_FOG_DEPTH: {
+        DrawFullscreen(cmd,
+                       &renderer->fog_depth_render_group,
+                       renderer->fog_depth_framebuffer,
+                       renderer->fog_extent);
+    } break;
+    case FRAME_PASS_FOG_MARCH: {
+        // TODO: maybe this doesnt need to be in a separate render group
+        if(FogUsesTargets(renderer)) {
+            DrawFullscreen(cmd,
+                           &renderer->volumetric_render_group,
+                           renderer->fog_color_framebuffer,
+                           renderer->fog_extent);
+        } else {
+            DrawFullscreen(
+                cmd, &renderer->volumetric_render_group, renderer->framebuffers[image_id], extent);
+        }
+    } break;
+    case FRAME_PASS_FOG_TEMPORAL: {
+        DrawFullscreen(cmd,
+                       &renderer->fog_temporal_render_group,
+                       renderer->fog_history_framebuffers[renderer->fog_history_id],
+                       renderer->fog_extent);
+    } break;
+    case FRAME_PASS_FOG_UPSAMPLE: {
+        DrawFullscreen(
+            cmd, &renderer->fog_upsample_render_group, renderer->framebuffers[image_id], extent);
+    } break;
+    case FRAME_PASS_RESOLVE: {
+        const u32 framebuffer = renderer->anti_aliasing == ANTI_ALIASING_TAA
+                                    ? image_id * 2 + renderer->taa_history_id
+                                    : image_id;
+        DrawFullscreen(cmd,
+                       &renderer->resolve_render_group,
+                       renderer->resolve_framebuffers[framebuffer],
+                       extent);
+    } break;
+    }
+}
+
+// Points the descriptor sets at the TLAS again when it was created anew or emptied
+internal void UpdateTlasDescriptors(Renderer *renderer) {
+    if(TlasShaderStructure(renderer) == renderer->tlas_bound &&
+       renderer->tlas.generation == renderer->tlas_bound_generation) {
+        return;
+    }
+    TlasWriteDescriptor(renderer, renderer->main_render_group.descriptor_sets[0], 4);
+    TlasWriteDescriptor(renderer, renderer->volumetric_render_group.descriptor_sets[0], 3);
+    TlasWriteDescriptor(renderer, renderer->froxel_inject_group.descriptor_sets[0], 2);
+}
+
+// The temporal pass reads the history written last frame and writes the other one, which the
+// upsample then reads
+internal void UpdateFogHistoryDescriptors(Renderer *renderer) {
+    const Image *written = &renderer->fog_history[renderer->fog_history_id];
+    const Image *read = &renderer->fog_history[renderer->fog_history_id ^ 1];
+    WriteImageDescriptor(renderer,
+                         renderer->fog_temporal_render_group.descriptor_sets[0],
+                         3,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->fog_linear_sampler,
+                         read->image_view,
+                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    WriteImageDescriptor(renderer,
+                         renderer->fog_upsample_render_group.descriptor_sets[0],
+                         3,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->fog_sampler,
+                         written->image_view,
+                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+}
+
+// The resolve pass reads the history written last frame and writes the other one
+internal void UpdateTaaHistoryDescriptors(Renderer *renderer) {
+    WriteImageDescriptor(renderer,
+                         renderer->resolve_render_group.descriptor_sets[0],
+                         2,
+                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                         renderer->fog_linear_sampler,
+                         renderer->taa_history[renderer->taa_history_id ^ 1].image_view,
+                         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+}
+
+// Element index of the Halton sequence in base, in [0, 1)
+internal f32 Halton(u32 index, const u32 base) {
+    f32 result = 0.0f;
+    f32 fraction = 1.0f;
+    while(index > 0) {
+        fraction /= (f32)base;
+        result += fraction * (f32)(index % base);
+        index /= base;
+    }
+    return result;
+}
+
 DLL_EXPORT void VulkanDrawFrame(Renderer *renderer) {
+    RendererUpdateMeshLoads(renderer);
+    RendererUpdateInstances(renderer);
+    RendererUpdateTlas(renderer);
+    RendererUpdateShadowCascades(renderer);
+    RendererCullInstances(renderer);
+
+    if(renderer->anti_aliasing == ANTI_ALIASING_TAA) {
+        // A different sub pixel offset every frame, spread over the pixel by the Halton sequence
+        const u32 phase = renderer->taa_frame++ % TAA_JITTER_PHASES + 1;
+        const VkExtent2D extent = renderer->swapchain.extent;
+        renderer->camera_info.jitter = (Vec2){(Halton(phase, 2) - 0.5f) * 2.0f / extent.width,
+                                              (Halton(phase, 3) - 0.5f) * 2.0f / extent.height};
+    }
     UploadToBuffer(renderer->device,
                    &renderer->camera_info_buffer,
                    &renderer->camera_info,
                    sizeof(renderer->camera_info));
+    // The next frame reprojects the fog history and the motion vectors with this camera
+    renderer->camera_info.previous_proj = renderer->camera_info.proj;
+    renderer->camera_info.previous_view = renderer->camera_info.view;
+    if(renderer->fog_temporal) {
+        ++renderer->camera_info.fog_frame;
+    }
 
     u32 image_id;
     Swapchain *swapchain = &renderer->swapchain;
@@ -1689,54 +3830,68 @@ DLL_EXPORT void VulkanDrawFrame(Renderer *renderer) {
     const VkCommandBufferBeginInfo begin_info = {
         VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, NULL, 0, NULL};
     AssertVkResult(vkBeginCommandBuffer(cmd, &begin_info));
+    renderer->draw_stats = (DrawStats){0};
+    ResetRecordContexts(renderer);
+
+    TlasRecordBuild(renderer, &renderer->tlas, cmd);
+    // Nothing is bound yet in this command buffer and the last frame is done
+    UpdateTlasDescriptors(renderer);
+    if(renderer->fog_temporal) {
+        UpdateFogHistoryDescriptors(renderer);
+    }
+    if(renderer->anti_aliasing == ANTI_ALIASING_TAA) {
+        UpdateTaaHistoryDescriptors(renderer);
+    }
 
-    { // Shadow map
+    // Ray queries don't read the shadow map, it keeps its last contents
+    if(renderer->camera_info.shadow_mode == SHADOW_MODE_MAP) { // Shadow map
         VkDebugUtilsLabelEXT marker = {
             VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT, NULL, "SHADOW MAP", {0.0, 0.0, 0.0, 0.0}};
         pfn_vkCmdBeginDebugUtilsLabelEXT(cmd, &marker);
-        BeginRenderGroup(cmd,
-                         &renderer->shadowmap_render_group,
-                         renderer->shadowmap_framebuffer,
-                         renderer->shadowmap_extent);
-        Frame frame = {cmd, renderer->shadowmap_render_group.layout};
-        for(u32 i = 0; i < renderer->mesh_count; ++i) {
-            Mesh *mesh = renderer->meshes[i];
-            RendererDrawMesh(&frame, mesh, mesh->instance_count, mesh->instance_transforms);
+        for(u32 c = 0; c < renderer->camera_info.cascade_count; ++c) {
+            RecordShadowCascade(renderer, cmd, c);
         }
-        vkCmdEndRenderPass(cmd);
+        renderer->shadow_static_dirty = false;
         pfn_vkCmdEndDebugUtilsLabelEXT(cmd);
     }
 
-    { // Color
-        VkDebugUtilsLabelEXT marker = {
-            VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT, NULL, "COLOR", {0.0, 0.0, 0.0, 0.0}};
-        pfn_vkCmdBeginDebugUtilsLabelEXT(cmd, &marker);
-        BeginRenderGroup(
-            cmd, &renderer->main_render_group, renderer->color_pass_framebuffer, swapchain->extent);
-        Frame frame = {cmd, renderer->main_render_group.layout};
-        for(u32 i = 0; i < renderer->mesh_count; ++i) {
-            Mesh *mesh = renderer->meshes[i];
-            RendererDrawMesh(&frame, mesh, mesh->instance_count, mesh->instance_transforms);
+    { // Draws of the view passes, sorted together
+        const Frame view = {cmd, renderer->main_render_group.layout, CULL_VISIBLE_COLOR};
+        RenderQueueClear(&renderer->render_queue);
+        if(renderer->depth_prepass) {
+            // The prepass fills the depth front to back, then the color pass shades each fragment
+            // once whatever the order and is grouped by material and mesh
+            RendererQueuePass(renderer, &view, DRAW_PASS_DEPTH_PREPASS, RENDER_SORT_DEPTH);
+            RendererQueuePass(renderer, &view, DRAW_PASS_COLOR, RENDER_SORT_MATERIAL);
+        } else {
+            RendererQueuePass(renderer, &view, DRAW_PASS_COLOR, RENDER_SORT_DEPTH);
         }
-        vkCmdEndRenderPass(cmd);
-        pfn_vkCmdEndDebugUtilsLabelEXT(cmd);
+        RenderQueueSort(&renderer->render_queue);
     }
 
-    { // Fog
-        // TODO: maybe this doesnt need to be in a separate render group
-        VkDebugUtilsLabelEXT marker = {
-            VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT, NULL, "FOG", {0.0, 0.0, 0.0, 0.0}};
-        pfn_vkCmdBeginDebugUtilsLabelEXT(cmd, &marker);
-        BeginRenderGroup(cmd,
-                         &renderer->volumetric_render_group,
-                         renderer->framebuffers[image_id],
-                         swapchain->extent);
-        vkCmdDraw(cmd, 6, 1, 0, 0);
-        vkCmdEndRenderPass(cmd);
-        pfn_vkCmdEndDebugUtilsLabelEXT(cmd);
+    { // Screen passes, in the order of the graph with the barriers it computed
+        FrameGraph *graph = &renderer->frame_graph;
+        DeclareFrameGraph(renderer, graph, false);
+        FrameGraphCompile(graph);
+        for(u32 p = 0; p < graph->pass_count; ++p) {
+            const GraphPass *pass = &graph->passes[p];
+            if(pass->culled) {
+                continue;
+            }
+            VkDebugUtilsLabelEXT marker = {
+                VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT, NULL, pass->name, {0.0, 0.0, 0.0, 0.0}};
+            pfn_vkCmdBeginDebugUtilsLabelEXT(cmd, &marker);
+            RecordGraphBarriers(renderer, cmd, image_id, pass->barrier_first, pass->barrier_count);
+            RecordFramePass(renderer, cmd, (FramePass)pass->id, image_id);
+            pfn_vkCmdEndDebugUtilsLabelEXT(cmd);
+        }
+        RecordGraphBarriers(
+            renderer, cmd, image_id, graph->final_barrier_first, graph->final_barrier_count);
     }
 
     AssertVkResult(vkEndCommandBuffer(cmd));
+    renderer->fog_history_id ^= 1;
+    renderer->taa_history_id ^= 1;
 
     const VkPipelineStageFlags stage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
     VkSubmitInfo submit_info = {0};
@@ -1768,5 +3923,7 @@ DLL_EXPORT void VulkanDrawFrame(Renderer *renderer) {
 
     swapchain->semaphore_id = (swapchain->semaphore_id + 1) % swapchain->image_count;
 
-    vkDeviceWaitIdle(renderer->device);
+    // Not the whole device, uploads on the transfer queue keep running across frames
+    vkQueueWaitIdle(renderer->graphics_queue);
+    vkQueueWaitIdle(renderer->present_queue);
 }
@@ -1,8 +1,26 @@
 #ifndef VULKAN_RENDERER_H
 #define VULKAN_RENDERER_H
 
+#include <stdatomic.h>
+
 #include <vulkan/vulkan.h>
 #include <sl3dge-utils/sl3dge.h>
+#include <cgltf/cgltf.h>
+
+#include "renderer/fog_march.h"
+
+#define FOG_DEPTH_FORMAT VK_FORMAT_R32_SFLOAT
+#define FOG_COLOR_FORMAT VK_FORMAT_R16G16B16A16_SFLOAT
+
+// Froxels are cells of a grid aligned with the view, with slices getting thicker farther away
+#define FROXEL_WIDTH 160
+#define FROXEL_HEIGHT 90
+#define FROXEL_DEPTH 64
+#define FROXEL_FORMAT VK_FORMAT_R16G16B16A16_SFLOAT
+
+#define TAA_VELOCITY_FORMAT VK_FORMAT_R16G16_SFLOAT
+#define TAA_HISTORY_FORMAT VK_FORMAT_R16G16B16A16_SFLOAT
+#define TAA_JITTER_PHASES 8 // Length of the Halton sequence the jitter cycles through
 
 #define VK_DECL_FUNC(name) static PFN_##name pfn_##name
 #define VK_LOAD_INSTANCE_FUNC(instance, name)                                                      \
@@ -23,6 +41,8 @@ VK_DECL_FUNC(vkGetAccelerationStructureBuildSizesKHR);
 VK_DECL_FUNC(vkCmdBuildAccelerationStructuresKHR);
 VK_DECL_FUNC(vkDestroyAccelerationStructureKHR);
 VK_DECL_FUNC(vkGetAccelerationStructureDeviceAddressKHR);
+VK_DECL_FUNC(vkCmdWriteAccelerationStructuresPropertiesKHR);
+VK_DECL_FUNC(vkCmdCopyAccelerationStructureKHR);
 
 typedef struct Buffer {
     VkBuffer buffer;
@@ -37,6 +57,150 @@ typedef struct Image {
     VkImageView image_view;
 } Image;
 
+// A texture slot in the bindless array.
+// Slots are shared between meshes that reference the same image, keyed by the hash of the file
+// contents and, once decoded, of the pixels themselves. The hash of the resolved path spares
+// hashing the file again when the same path is loaded later.
+typedef struct TextureEntry {
+    u64 path_hash;
+    u64 file_hash;
+    u64 pixel_hash;
+    VkFormat format;
+    VkExtent2D extent;
+    u32 ref_count;
+    bool is_atlas; // Page of the atlas, ref_count counts the regions references
+    const struct MeshLoad *pending_load; // Not shared until the copies of this load are done
+} TextureEntry;
+
+// Atlas pages are filled with shelves : textures are placed left to right on the current shelf,
+// a new shelf is opened above when the row is full.
+typedef struct AtlasPage {
+    u32 slot;
+    VkFormat format;
+    u32 shelf_x;
+    u32 shelf_y;
+    u32 shelf_height;
+    u64 used_pixels;
+    u32 region_count;
+    bool written; // Has been transitioned to SHADER_READ_ONLY at least once
+} AtlasPage;
+
+// A small texture packed into an atlas page
+typedef struct AtlasRegion {
+    u64 path_hash;
+    u64 file_hash;
+    u64 pixel_hash;
+    VkFormat format;
+    VkExtent2D extent;
+    u32 slot;     // Slot of the page
+    Vec4 uv_rect; // xy : scale, zw : offset
+    const struct MeshLoad *pending_load; // Not shared until the copies of this load are done
+} AtlasRegion;
+
+// A loaded texture and its source file. The decoding neither hashes nor decodes the files it
+// already knows.
+typedef struct TextureFile {
+    u64 path_hash;
+    u64 file_hash;
+    VkFormat format;
+    VkExtent2D extent;
+    bool in_atlas;
+} TextureFile;
+
+// A gltf texture decoded by a worker, uploaded or shared by the main thread
+typedef struct DecodedTexture {
+    VkFormat format;
+    VkExtent2D extent;
+    bool use_atlas;
+    u64 path_hash;
+    u64 file_hash;
+    u64 pixel_hash;
+    u32 *pixels; // NULL if the image couldn't be loaded or is known
+    bool known;  // Same file and format as a loaded texture, shared without being decoded
+} DecodedTexture;
+
+// Bottom level acceleration structures of a mesh, one per primitive, in a single buffer
+typedef struct BlasSet {
+    u32 count;
+    Buffer buffer;
+    VkAccelerationStructureKHR *structures;
+    VkDeviceAddress *addresses;
+} BlasSet;
+
+// The uncompacted structures of a mesh, built together and then compacted into a BlasSet
+typedef struct BlasBatch {
+    u32 count;
+    VkAccelerationStructureGeometryKHR *geometries;
+    VkAccelerationStructureBuildGeometryInfoKHR *infos;
+    VkAccelerationStructureBuildRangeInfoKHR *ranges;
+    VkDeviceSize *offsets;         // In buffer
+    VkDeviceSize *scratch_offsets; // From the aligned start of the scratch buffer
+    VkDeviceSize scratch_alignment;
+    VkDeviceSize *sizes;
+    VkDeviceSize build_size;     // Size of buffer
+    VkDeviceSize compacted_size; // Size of the BlasSet buffer, known once the queries are read
+    Buffer buffer;
+    VkAccelerationStructureKHR *structures;
+    VkQueryPool query_pool; // Compacted size of each structure
+} BlasBatch;
+
+// Top level acceleration structure. Records are packed mesh by mesh, then primitive major with a
+// stride of the instance count of the mesh.
+typedef struct Tlas {
+    u32 count;
+    u32 capacity;
+    Buffer instances;
+    VkAccelerationStructureInstanceKHR *instance_data; // Persistently mapped, write only
+    Vec3 *centers;       // Bounds center of each record
+    Vec3 *build_centers; // Same at the last full build
+    bool *drifted;       // Moved too far from its build center, refits lose quality
+    u32 drifted_count;
+
+    Buffer buffer;
+    VkAccelerationStructureKHR structure;
+    u32 generation; // Incremented when structure is created again
+    Buffer scratch;
+
+    bool layout_dirty;     // Records were added or removed, every record has to be written
+    bool transforms_dirty; // Records were written since the last build
+    u32 update_count;      // Refits since the last full build
+    u32 build_count;
+} Tlas;
+
+// An asynchronous mesh load. The worker owns it while the state is MESH_LOAD_DECODING, then
+// the main thread records the uploads and publishes the mesh once the fence is signaled.
+typedef struct MeshLoad {
+    _Atomic u32 state; // MeshLoadState
+    Renderer *renderer;
+    char path[256];
+    char directory[256];
+
+    cgltf_data *data;
+    Mesh *mesh;
+
+    u32 primitive_count;
+    Primitive *primitives;
+    u32 vertex_count;
+    u32 index_count;
+    u32 geometry_size;
+    void *geometry; // Vertices followed by the indices
+    DecodedTexture *textures;
+    u32 known_file_count;
+    TextureFile *known_files; // Files loaded when the load was queued, read by the load job
+    RtBuild trace_build; // Filled by the load job, built by jobs pushed with the uploads
+    BlasBatch blas_batch; // Built with the uploads, compacted into mesh->blas
+
+    u32 staging_count;
+    u32 staging_capacity;
+    Buffer *staging_buffers;
+    VkCommandBuffer transfer_cmd; // Copies of new buffers and images, on the transfer queue
+    VkCommandBuffer graphics_cmd; // Ownership acquires and atlas writes, on the graphics queue
+    VkCommandBuffer compact_cmd;  // Copies of the BLAS to their compacted size
+    VkSemaphore transfer_done;
+    VkFence fence;
+    u32 mesh_id;
+} MeshLoad;
+
 typedef struct Swapchain {
     VkSwapchainKHR swapchain;
     u32 image_count;
@@ -67,6 +231,64 @@ typedef struct RenderGroup {
     VkClearValue *clear_values;
 } RenderGroup;
 
+// Passes with enough draws are split in chunks recorded by the workers into secondary command
+// buffers
+#define RECORD_CHUNK_SIZE 256 // Draws of the render queue
+#define RECORD_PARALLEL_THRESHOLD (4 * RECORD_CHUNK_SIZE)
+#define RECORD_MAX_CONTEXTS 8
+
+// Secondary command buffers of one recording thread, its pool is reset at the start of a frame
+typedef struct RecordContext {
+    VkCommandPool pool;
+    u32 buffer_count;
+    u32 used; // Since the reset
+    VkCommandBuffer *buffers;
+} RecordContext;
+
+typedef struct RecordChunk {
+    VkCommandBuffer cmd;
+    u32 visible_count;
+    u32 draw_count;
+    DrawPassStats stats;
+} RecordChunk;
+
+// Resources of the frame graph. The transient ones come first, they are placed together in
+// transient_memory and only exist in the modes that use them.
+typedef enum FrameResource {
+    FRAME_RESOURCE_DEPTH, // Multisampled, single sampled modes draw to the resolved depth
+    FRAME_RESOURCE_RESOLVED_DEPTH,
+    FRAME_RESOURCE_COLOR,
+    FRAME_RESOURCE_VELOCITY,
+    FRAME_RESOURCE_FOG_DEPTH,
+    FRAME_RESOURCE_FOG_COLOR,
+    FRAME_TRANSIENT_COUNT,
+    FRAME_RESOURCE_FOG_HISTORY = FRAME_TRANSIENT_COUNT, // Two of them
+    FRAME_RESOURCE_TAA_HISTORY = FRAME_RESOURCE_FOG_HISTORY + 2, // Two of them
+    FRAME_RESOURCE_FROXEL_SCATTERING = FRAME_RESOURCE_TAA_HISTORY + 2,
+    FRAME_RESOURCE_FROXEL_INTEGRATED,
+    FRAME_RESOURCE_SWAPCHAIN,
+    FRAME_RESOURCE_COUNT
+} FrameResource;
+
+typedef enum FramePass {
+    FRAME_PASS_FROXEL_INJECT,
+    FRAME_PASS_FROXEL_INTEGRATE,
+    FRAME_PASS_DEPTH_PREPASS,
+    FRAME_PASS_COLOR,
+    FRAME_PASS_FROXEL_COMPOSITE,
+    FRAME_PASS_FOG_DEPTH,
+    FRAME_PASS_FOG_MARCH,
+    FRAME_PASS_FOG_TEMPORAL,
+    FRAME_PASS_FOG_UPSAMPLE,
+    FRAME_PASS_RESOLVE,
+} FramePass;
+
+typedef struct CullUnit {
+    Mesh *mesh;
+    u32 first; // Index in the bounds arrays
+    u32 count;
+} CullUnit;
+
 typedef struct Renderer {
     PlatformAPI *platform;
 
@@ -77,7 +299,9 @@ typedef struct Renderer {
     VkPhysicalDeviceMemoryProperties memory_properties;
     VkPhysicalDeviceProperties physical_device_properties;
 
-    VkSampleCountFlagBits msaa_level;
+    AntiAliasing anti_aliasing;
+    VkSampleCountFlagBits msaa_level; // Of the scene targets, 1 in TAA
+    VkSampleCountFlagBits msaa_max;   // Highest count the color and depth targets support
 
     VkDevice device;
     u32 graphics_queue_id;
@@ -88,6 +312,7 @@ typedef struct Renderer {
     VkQueue present_queue;
 
     VkCommandPool graphics_command_pool;
+    VkCommandPool transfer_command_pool;
     VkDescriptorPool descriptor_pool;
 
     Swapchain swapchain;
@@ -95,46 +320,165 @@ typedef struct Renderer {
 
     VkSampler texture_sampler;
 
-    Image depth_image;
+    Image depth_image; // Only with MSAA, single sampled targets draw to resolved_depth_image
 
     VkSampler depth_sampler;
     Image resolved_depth_image;
 
-    Image msaa_image;
-
     Buffer camera_info_buffer;
     CameraMatrices camera_info;
 
-    Image shadowmap;
-    VkExtent2D shadowmap_extent;
+    Image shadowmap; // One layer per cascade, image_view sees all of them
+    VkExtent2D shadowmap_extent; // Of each cascade
     VkSampler shadowmap_sampler;
-    VkFramebuffer shadowmap_framebuffer;
-    RenderGroup shadowmap_render_group;
+    VkImageView shadowmap_layer_views[SHADOW_MAX_CASCADES];
+    VkFramebuffer shadowmap_framebuffers[SHADOW_MAX_CASCADES];
+    RenderGroup shadowmap_render_group; // Draws the dynamic casters over the static ones
+    Image shadowmap_static; // Static casters only, copied into shadowmap before the dynamic ones
+    VkImageView shadowmap_static_layer_views[SHADOW_MAX_CASCADES];
+    VkFramebuffer shadowmap_static_framebuffers[SHADOW_MAX_CASCADES];
+    VkRenderPass shadowmap_static_render_pass;
+    Mat4 shadowmap_static_vp[SHADOW_MAX_CASCADES]; // Matrices the static layers were drawn with
+    bool shadowmap_layer_clean[SHADOW_MAX_CASCADES]; // Holds the static casters only
+    bool shadow_static_dirty; // A static caster was added, removed or started moving
+    u32 shadow_dynamic_count; // Instances that moved since they were uploaded
 
     RenderGroup main_render_group;
+    bool depth_prepass; // The main pass only shades the fragments left by the prepass
+    VkRenderPass depth_prepass_render_pass;
+    VkPipeline depth_prepass_pipeline; // With the layout and sets of main_render_group
+    VkFramebuffer depth_prepass_framebuffer; // The depth attachment of color_pass_framebuffer
     // Do we need three of these ?
     VkFramebuffer color_pass_framebuffer;
     Image color_pass_image;
+    // Single sampled modes copy or accumulate color_pass_image into the swapchain image
+    RenderGroup resolve_render_group;
+    VkFramebuffer *resolve_framebuffers; // Per swapchain image, and per history in TAA
+    Image velocity_image; // Only in TAA
+    Image taa_history[2]; // Written and read in turns, taa_history_id is the one written
+    u32 taa_history_id;
+    u32 taa_frame;
 
     RenderGroup volumetric_render_group;
+    FogMarch fog_march; // Read when the volumetric pipeline is created
+    FogResolution fog_resolution;
+    VkExtent2D fog_extent; // Of fog_depth and fog_color
+    VkSampler fog_sampler; // Nearest, the fog passes filter by hand
+    // Only when the fog uses its targets
+    Image fog_depth; // Nearest or farthest depth of the pixels under each texel, alternating
+    Image fog_color;
+    VkFramebuffer fog_depth_framebuffer;
+    VkFramebuffer fog_color_framebuffer;
+    RenderGroup fog_depth_render_group;
+    RenderGroup fog_upsample_render_group;
+    bool fog_temporal;
+    Image fog_history[2]; // Written and read in turns, fog_history_id is the one written
+    VkFramebuffer fog_history_framebuffers[2];
+    u32 fog_history_id;
+    RenderGroup fog_temporal_render_group;
+    FogTechnique fog_technique;
+    Image froxel_scattering; // Light scattered towards the camera in each froxel
+    Image froxel_integrated; // Gathered from the camera to the far side of each froxel
+    VkSampler fog_linear_sampler; // For the froxels and the reprojected fog history
+    RenderGroup froxel_inject_group; // Compute groups have no render pass
+    RenderGroup froxel_integrate_group;
+    RenderGroup froxel_composite_group;
     VkFramebuffer *framebuffers;
 
+    // The screen passes, declared again every frame. The transient targets are placed in
+    // transient_memory by a graph declaring every pass the settings can switch to without
+    // creating the targets again, so the lifetimes of any frame fit in theirs.
+    FrameGraph frame_graph;
+    VkDeviceMemory transient_memory;
+    VkMemoryRequirements transient_requirements[FRAME_TRANSIENT_COUNT];
+    u64 transient_offsets[FRAME_TRANSIENT_COUNT];
+
+    // Materials are deduplicated and never removed. mat_buffer is device local and mirrors
+    // the materials array, it doubles in size when full.
     u32 materials_count;
+    u32 materials_capacity;
+    Material *materials;
     Buffer mat_buffer;
 
     u32 textures_capacity;
-    u32 textures_count;
+    u32 textures_count; // Highest used slot + 1, free slots have a ref_count of 0
     Image *textures;
-
+    TextureEntry *texture_entries;
+    Image fallback_texture; // Bound in the freed slots
+    u32 bound_textures_count; // textures_count when the main render group was created
+    bool texture_pixel_dedup;
+
+    bool texture_atlas_enabled; // Pack the small base color textures in shared pages
+    u32 atlas_page_count;
+    u32 atlas_page_capacity;
+    AtlasPage *atlas_pages;
+    u32 atlas_region_count;
+    u32 atlas_region_capacity;
+    AtlasRegion *atlas_regions;
+
+    // Meshes are packed in meshes[0..mesh_count), destroying one moves the last in its place.
     u32 mesh_capacity;
     u32 mesh_count;
-    Mesh **meshes;
+    Mesh *meshes;
+    HandleMap mesh_handles;
+
+    u32 mesh_load_capacity;
+    MeshLoad **mesh_loads; // NULL for free handles
+
+    // Matrices of the instances being written to the instance buffers
+    u32 instance_scratch_capacity;
+    Mat4 *instance_scratch;
+
+    // Culling is split in units of at most CULL_UNIT_SIZE instances of one primitive. Workers and
+    // the main thread take units until none are left.
+    Vec4 cull_planes[CULL_MAX_VOLUMES * CULL_PLANE_COUNT]; // View volume then shadow cascades
+    u32 cull_volume_count;
+    u32 cull_unit_count;
+    u32 cull_unit_capacity;
+    CullUnit *cull_units;
+    _Atomic u32 cull_next_unit;
+    _Atomic u32 cull_running_jobs;
+    u32 cull_job_count; // Workers helping with big scenes, 0 to cull on the main thread only
+    CullStats cull_stats;
+    RenderQueue render_queue; // Draws of the view passes or of one shadow cascade
+    DrawStats draw_stats;
+    // One context for the main thread and one per worker, a recording thread takes a context
+    // then chunks of the pass until none are left
+    u32 record_job_count; // 0 to record on the main thread only
+    RecordContext record_contexts[RECORD_MAX_CONTEXTS];
+    u32 record_chunk_capacity;
+    RecordChunk *record_chunks; // Of the pass being recorded
+
+    // Fat world boxes of the instances, leaves hold packed MeshInstance handles
+    Bvh scene_tree;
+    u32 trace_job_count; // Workers building the triangle BVHs and tracing the shadow masks
+
+    // Scratch memory of the BLAS builds, shared by every load and grown when a mesh needs more.
+    // Builds on the graphics queue are serialized with a barrier before they reuse it.
+    Buffer accel_scratch;
+    VkDeviceSize accel_scratch_alignment;
+    VkDeviceSize blas_memory;       // Compacted size of the BLAS of every mesh
+    VkDeviceSize blas_memory_saved; // Total released by the compactions
+    Tlas tlas;
+    Tlas empty_tlas; // Bound while tlas has no instances
+    VkAccelerationStructureKHR tlas_bound; // Written in the descriptor sets of the render groups
+    u32 tlas_bound_generation;
 
 } Renderer;
 
+typedef enum DrawFilter {
+    DRAW_ALL = 0,
+    DRAW_STATIC,  // Instances that never moved, cached in the static shadow maps
+    DRAW_DYNAMIC, // Instances drawn over the cached shadows
+} DrawFilter;
+
 struct Frame {
     VkCommandBuffer cmd;
     VkPipelineLayout layout;
+    u8 cull_mask; // Instances without this visibility bit are skipped
+    DrawFilter filter;
+    u32 visible_count;
+    u32 draw_count;
 };
 
 #endif
\ No newline at end of file
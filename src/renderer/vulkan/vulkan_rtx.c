@@ -6,7 +6,6 @@
 /*
  === TODO ===
  CRITICAL
- - Allow creation of blas in series (input a cmd buffer)
 
 
 BACKLOG
@@ -103,32 +102,9 @@ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
 Usage
 
 VulkanShaderBindingTable sbt;
-	Buffer *BLAS_buffers;
-	VkAccelerationStructureKHR *BLAS;
-	Buffer *instance_data_buffers;
-	VkAccelerationStructureGeometryKHR *rtx_geometries;
-	Buffer TLAS_buffer;
-	VkAccelerationStructureKHR TLAS;
-
-sLog("Creating BLAS...");
-// BLAS
-scene->BLAS_buffers = (Buffer *)scalloc(scene->total_primitives_count, sizeof(Buffer));
-scene->instance_data_buffers = (Buffer *)scalloc(scene->total_primitives_count, sizeof(Buffer));
-scene->BLAS = (VkAccelerationStructureKHR *)scalloc(scene->total_primitives_count, sizeof(VkAccelerationStructureKHR));
-scene->rtx_geometries =
-		(VkAccelerationStructureGeometryKHR *)scalloc(scene->total_primitives_count, sizeof(VkAccelerationStructureGeometryKHR));
-const VkDeviceAddress vtx_add = scene->vtx_buffer.address;
-const VkDeviceAddress idx_add = scene->idx_buffer.address;
-for (u32 i = 0; i < scene->total_primitives_count; ++i) {
-	Primitive *p = &scene->primitives[i];
-	CreateBLAS(context, vtx_add + (p->vertex_offset * sizeof(Vertex)), p->vertex_count, idx_add + (p->index_offset * sizeof(u32)),
-			p->index_count / 3, &scene->BLAS_buffers[i], &scene->BLAS[i]);
-	CreateInstanceGeometry(
-			context, scene->transforms[p->node_id], scene->BLAS[i], &scene->instance_data_buffers[i], &scene->rtx_geometries[i]);
-}
-sLog("Creating TLAS...");
-// TLAS
-CreateTLAS(context, scene->total_primitives_count, scene->rtx_geometries, &scene->TLAS_buffer, &scene->TLAS);
+
+// BLAS : built and compacted with the mesh uploads
+// TLAS : renderer->tlas, refit by VulkanDrawFrame, rebuilt when instances are added or removed
 
 sLog("Creating Descriptors...");
 // Descriptors
@@ -137,7 +113,7 @@ scene->set_layouts = (VkDescriptorSetLayout *)scalloc(scene->descriptor_set_coun
 scene->descriptor_sets = (VkDescriptorSet *)scalloc(scene->descriptor_set_count, sizeof(VkDescriptorSet));
 CreateSceneDescriptorSet(context, scene, &scene->set_layouts[0], &scene->descriptor_sets[0]);
 CreateRtxDescriptorSet(
-		context, &scene->TLAS, scene->vtx_buffer.buffer, scene->idx_buffer.buffer, &scene->set_layouts[1], &scene->descriptor_sets[1]);
+		context, &renderer->tlas.structure, scene->vtx_buffer.buffer, scene->idx_buffer.buffer, &scene->set_layouts[1], &scene->descriptor_sets[1]);
 
 BuildLayout(context->device, scene->descriptor_set_count, scene->set_layouts, &scene->layout);
 CreateRtxPipeline(context->device, &scene->layout, &scene->pipeline);
@@ -146,19 +122,6 @@ CreateRtxSbt(context, scene->pipeline, &scene->sbt);
 
 DestroyRtxSbt(context, &scene->sbt);
 
-	for (u32 i = 0; i < scene->total_primitives_count; ++i) {
-		DestroyBuffer(context->device, &scene->BLAS_buffers[i]);
-		DestroyBuffer(context->device, &scene->instance_data_buffers[i]);
-		pfn_vkDestroyAccelerationStructureKHR(context->device, scene->BLAS[i], 0);
-	}
-
-	DestroyBuffer(context->device, &scene->TLAS_buffer);
-	pfn_vkDestroyAccelerationStructureKHR(context->device, scene->TLAS, 0);
-
-	sfree(scene->BLAS_buffers);
-	sfree(scene->instance_data_buffers);
-	sfree(scene->BLAS);
-	sfree(scene->rtx_geometries);
 
 */
 
@@ -475,253 +438,8 @@ CreateRtxPipeline(const VkDevice device, const VkPipelineLayout *layout, VkPipel
 //
 // =========================
 
-internal void CreateBLAS(VulkanRenderer *context,
-                         VkDeviceAddress vtx_address,
-                         const u32 vtx_count,
-                         VkDeviceAddress idx_address,
-                         const u32 triangle_count,
-                         Buffer *buffer,
-                         VkAccelerationStructureKHR *BLAS) {
-    VkAccelerationStructureGeometryKHR geometry = {};
-    geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-    geometry.pNext = NULL;
-    geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-    geometry.geometry.triangles.sType =
-        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
-    geometry.geometry.triangles.pNext = NULL;
-    geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
-    geometry.geometry.triangles.vertexData.deviceAddress = vtx_address;
-    geometry.geometry.triangles.vertexStride = sizeof(Vertex);
-    geometry.geometry.triangles.maxVertex = vtx_count;
-    geometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
-    geometry.geometry.triangles.indexData.deviceAddress = idx_address;
-    geometry.geometry.triangles.transformData.deviceAddress = VK_NULL_HANDLE;
-    geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-
-    VkAccelerationStructureBuildGeometryInfoKHR build_info = {};
-    build_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-    build_info.pNext = NULL;
-    build_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-    build_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-    build_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-    build_info.srcAccelerationStructure = VK_NULL_HANDLE;
-    build_info.geometryCount = 1;
-    build_info.pGeometries = &geometry;
-    build_info.ppGeometries = NULL;
-    build_info.scratchData.deviceAddress = NULL;
-
-    // Query the build size
-    VkAccelerationStructureBuildSizesInfoKHR size_info = {};
-    size_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-    pfn_vkGetAccelerationStructureBuildSizesKHR(context->device,
-                                                VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-                                                &build_info,
-                                                &triangle_count,
-                                                &size_info);
-
-    // Alloc the scratch buffer
-    Buffer scratch;
-    CreateBuffer(context->device,
-                 &context->memory_properties,
-                 size_info.buildScratchSize,
-                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR,
-                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                 &scratch);
-    build_info.scratchData.deviceAddress = scratch.address;
-
-    // Alloc the blas buffer
-    CreateBuffer(context->device,
-                 &context->memory_properties,
-                 size_info.accelerationStructureSize,
-                 VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR,
-                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                 buffer);
-    DEBUGNameBuffer(context->device, buffer, "BLAS");
-
-    VkAccelerationStructureCreateInfoKHR blas_ci = {};
-    blas_ci.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
-    blas_ci.pNext = NULL;
-    blas_ci.createFlags = 0;
-    blas_ci.buffer = buffer->buffer;
-    blas_ci.offset = 0;
-    blas_ci.size = size_info.accelerationStructureSize; // Will be queried below
-    blas_ci.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-    blas_ci.deviceAddress = 0;
-    VkResult result = pfn_vkCreateAccelerationStructureKHR(context->device, &blas_ci, NULL, BLAS);
-    AssertVkResult(result);
-    DEBUGNameObject(context->device, (u64)*BLAS, VK_OBJECT_TYPE_ACCELERATION_STRUCTURE_KHR, "BLAS");
-
-    // Now build it !!
-    build_info.dstAccelerationStructure = *BLAS;
-    VkAccelerationStructureBuildRangeInfoKHR range_info = {triangle_count, 0, 0, 0};
-    VkAccelerationStructureBuildRangeInfoKHR *infos[] = {&range_info};
-
-    VkCommandBuffer cmd_buffer;
-    AllocateCommandBuffers(context->device, context->graphics_command_pool, 1, &cmd_buffer);
-    BeginCommandBuffer(context->device, cmd_buffer, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
-    pfn_vkCmdBuildAccelerationStructuresKHR(cmd_buffer, 1, &build_info, infos);
-    VkMemoryBarrier barrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER,
-                               NULL,
-                               VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
-                               VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR};
-
-    vkCmdPipelineBarrier(cmd_buffer,
-                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
-                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
-                         0,
-                         1,
-                         &barrier,
-                         0,
-                         NULL,
-                         0,
-                         NULL);
-    vkEndCommandBuffer(cmd_buffer);
-    VkSubmitInfo si = {VK_STRUCTURE_TYPE_SUBMIT_INFO, NULL, 0, NULL, 0, 1, &cmd_buffer, 0, NULL};
-    AssertVkResult(vkQueueSubmit(context->graphics_queue, 1, &si, VK_NULL_HANDLE));
-    AssertVkResult(vkQueueWaitIdle(context->graphics_queue));
-
-    vkFreeCommandBuffers(context->device, context->graphics_command_pool, 1, &cmd_buffer);
-    DestroyBuffer(context->device, &scratch);
-}
-
-internal void CreateInstanceGeometry(VulkanRenderer *context,
-                                     Mat4 mat,
-                                     VkAccelerationStructureKHR BLAS,
-                                     Buffer *instance_data,
-                                     VkAccelerationStructureGeometryKHR *geometry) {
-    mat4_transpose(&mat);
-    VkTransformMatrixKHR xform = {};
-    memcpy(&xform, &mat, sizeof(xform));
-
-    VkAccelerationStructureDeviceAddressInfoKHR info = {};
-    info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
-    info.pNext = NULL;
-    info.accelerationStructure = BLAS;
-
-    VkAccelerationStructureInstanceKHR instance = {};
-    instance.transform = xform;
-    instance.instanceCustomIndex = 0;
-    instance.mask = 0xFF;
-    instance.instanceShaderBindingTableRecordOffset = 0;
-    instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
-    instance.accelerationStructureReference =
-        (u64)pfn_vkGetAccelerationStructureDeviceAddressKHR(context->device, &info);
-
-    CreateBuffer(context->device,
-                 &context->memory_properties,
-                 sizeof(VkAccelerationStructureInstanceKHR),
-                 VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
-                     VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                 instance_data);
-    DEBUGNameBuffer(context->device, instance_data, "Instance Data");
-    UploadToBuffer(
-        context->device, instance_data, &instance, sizeof(VkAccelerationStructureInstanceKHR));
-    // TODO : don't create 1 buffer for each instance
-
-    geometry->sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-    geometry->pNext = NULL;
-    geometry->geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
-    geometry->geometry.instances.sType =
-        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
-    geometry->geometry.instances.pNext = NULL;
-    geometry->geometry.instances.arrayOfPointers = VK_FALSE;
-    geometry->geometry.instances.data.deviceAddress = instance_data->address;
-    geometry->flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-}
-
-internal void CreateTLAS(VulkanRenderer *context,
-                         const u32 primitive_count,
-                         VkAccelerationStructureGeometryKHR *geometries,
-                         Buffer *TLAS_buffer,
-                         VkAccelerationStructureKHR *TLAS) {
-    VkAccelerationStructureBuildGeometryInfoKHR build_info = {};
-    build_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-    build_info.pNext = NULL;
-    build_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-    build_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-    build_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-    build_info.srcAccelerationStructure = VK_NULL_HANDLE;
-    build_info.dstAccelerationStructure = VK_NULL_HANDLE; // Set below
-    build_info.geometryCount = primitive_count;
-    build_info.pGeometries = geometries;
-    build_info.ppGeometries = NULL;
-    build_info.scratchData.deviceAddress = NULL; // Set below
-
-    // Get size info
-    VkAccelerationStructureBuildSizesInfoKHR size_info = {};
-    size_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-    pfn_vkGetAccelerationStructureBuildSizesKHR(context->device,
-                                                VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-                                                &build_info,
-                                                &primitive_count,
-                                                &size_info);
-    CreateBuffer(context->device,
-                 &context->memory_properties,
-                 size_info.accelerationStructureSize,
-                 VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR,
-                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                 TLAS_buffer);
-    DEBUGNameBuffer(context->device, TLAS_buffer, "TLAS");
-    Buffer scratch;
-    CreateBuffer(context->device,
-                 &context->memory_properties,
-                 size_info.buildScratchSize,
-                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR,
-                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                 &scratch);
-
-    VkAccelerationStructureCreateInfoKHR create_info = {};
-    create_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
-    create_info.pNext = NULL;
-    create_info.createFlags = 0;
-    create_info.buffer = TLAS_buffer->buffer;
-    create_info.offset = 0;
-    create_info.size = size_info.accelerationStructureSize;
-    create_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-    create_info.deviceAddress = 0;
-    AssertVkResult(pfn_vkCreateAccelerationStructureKHR(context->device, &create_info, NULL, TLAS));
-    DEBUGNameObject(context->device, (u64)*TLAS, VK_OBJECT_TYPE_ACCELERATION_STRUCTURE_KHR, "TLAS");
-
-    // Now build it
-    build_info.dstAccelerationStructure = *TLAS;
-    build_info.scratchData.deviceAddress = scratch.address;
-
-    VkAccelerationStructureBuildRangeInfoKHR range_info = {primitive_count, 0, 0, 0};
-    VkAccelerationStructureBuildRangeInfoKHR *infos[] = {&range_info};
-
-    vkDeviceWaitIdle(context->device);
-
-    VkCommandBuffer cmd_buffer;
-    AllocateCommandBuffers(context->device, context->graphics_command_pool, 1, &cmd_buffer);
-    BeginCommandBuffer(context->device, cmd_buffer, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
-
-    VkMemoryBarrier barrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER,
-                               NULL,
-                               VK_ACCESS_TRANSFER_WRITE_BIT,
-                               VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR};
-
-    vkCmdPipelineBarrier(cmd_buffer,
-                         VK_PIPELINE_STAGE_TRANSFER_BIT,
-                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
-                         0,
-                         1,
-                         &barrier,
-                         0,
-                         NULL,
-                         0,
-                         NULL);
-
-    pfn_vkCmdBuildAccelerationStructuresKHR(cmd_buffer, 1, &build_info, infos);
-    vkEndCommandBuffer(cmd_buffer);
-
-    VkSubmitInfo si = {VK_STRUCTURE_TYPE_SUBMIT_INFO, NULL, 0, NULL, 0, 1, &cmd_buffer, 0, NULL};
-    AssertVkResult(vkQueueSubmit(context->graphics_queue, 1, &si, VK_NULL_HANDLE));
-    AssertVkResult(vkQueueWaitIdle(context->graphics_queue));
-
-    vkFreeCommandBuffers(context->device, context->graphics_command_pool, 1, &cmd_buffer);
-    DestroyBuffer(context->device, &scratch);
-}
+// The BLAS of each primitive and the TLAS over every instance are owned by the renderer, see
+// vulkan_accel.c. The TLAS is refit each frame from the instance transforms.
 
 DLL_EXPORT void VulkanDrawRTXFrame(VulkanRenderer *context, Scene *scene, GameData *game_data) {
     UploadToBuffer(context->device,
@@ -0,0 +1,331 @@
+#include <sl3dge-utils/sl3dge.h>
+
+#include <float.h>
+#include <stdio.h>
+
+#include "renderer/fog_march.h"
+
+// Renders the fog of volumetric.frag on the cpu over a scene with an analytic sun shadow, once
+// with the fixed steps it used to take, once with a FogMarch and once with fewer steps averaged
+// over frames like fog_temporal.frag does, then compares the images to the first one.
+// Usage : fog_diff [output directory], the images and their difference are written there as
+// ppm when given.
+
+#define FOG_WIDTH 320
+#define FOG_HEIGHT 180
+#define FOG_MAX_RELATIVE_RMSE 0.03f
+#define FOG_TEMPORAL_FRAMES 64 // The camera doesn't move, the history is never rejected
+#define FOG_TEMPORAL_BLEND 0.1f // Same as BLEND in fog_temporal.frag
+
+typedef struct FogSphere {
+    Vec3 center;
+    f32 radius;
+} FogSphere;
+
+global const FogSphere fog_occluders[] = {
+    {{0.0f, 6.0f, 40.0f}, 5.0f},
+    {{-18.0f, 12.0f, 70.0f}, 9.0f},
+    {{25.0f, 4.0f, 30.0f}, 4.0f},
+    {{10.0f, 20.0f, 120.0f}, 15.0f},
+    {{-40.0f, 8.0f, 200.0f}, 20.0f},
+};
+
+global const Vec3 fog_density = {0.005f, 0.005f, 0.004f};
+global const Vec3 fog_light_color = {0.99f, 0.72f, 0.07f};
+global const f32 fog_light_intensity = 5.0f;
+global const f32 fog_anisotropy = 0.4f;
+global Vec3 fog_to_sun; // Opposite of the light direction
+
+// Same generator as the shader
+internal u32 FogTea(u32 v0, u32 v1) {
+    u32 s0 = 0;
+    for(u32 n = 0; n < 16; n++) {
+        s0 += 0x9e3779b9;
+        v0 += ((v1 << 4) + 0xa341316c) ^ (v1 + s0) ^ ((v1 >> 5) + 0xc8013ea4);
+        v1 += ((v0 << 4) + 0xad90777d) ^ (v0 + s0) ^ ((v0 >> 5) + 0x7e95761e);
+    }
+    return v0;
+}
+
+internal f32 FogRandom(u32 *prev) {
+    *prev = 1664525u * *prev + 1013904223u;
+    return (f32)(*prev & 0x00FFFFFF) / (f32)0x01000000;
+}
+
+internal f32 FogPhase(const Vec3 diri, const Vec3 diro) {
+    const f32 g = fog_anisotropy;
+    const f32 cos_theta = diri.x * diro.x + diri.y * diro.y + diri.z * diro.z;
+    return PI / 4.0f * (1.0f - g * g) / powf(1.0f + g * g - 2.0f * g * cos_theta, 1.5f);
+}
+
+// Nothing between position and the sun
+internal bool FogSunVisible(const Vec3 position, const Vec3 to_sun) {
+    for(u32 i = 0; i < ARRAY_SIZE(fog_occluders); ++i) {
+        const Vec3 oc = vec3_sub(position, fog_occluders[i].center);
+        const f32 b = oc.x * to_sun.x + oc.y * to_sun.y + oc.z * to_sun.z;
+        const f32 c = oc.x * oc.x + oc.y * oc.y + oc.z * oc.z -
+                      fog_occluders[i].radius * fog_occluders[i].radius;
+        if(c < 0.0f || (b < 0.0f && b * b > c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+internal Vec3 FogAccumulate(Vec3 accum, const f32 step_length, const Vec3 vol_abs, bool lit) {
+    const f32 phase_light = lit ? fog_light_intensity : 0.1f;
+    const Vec3 step_abs = {expf(-fog_density.x * step_length),
+                           expf(-fog_density.y * step_length),
+                           expf(-fog_density.z * step_length)};
+    const Vec3 light = lit ? fog_light_color : (Vec3){1.0f, 1.0f, 1.0f};
+    accum.x += (1.0f - step_abs.x) * vol_abs.x * phase_light * light.x;
+    accum.y += (1.0f - step_abs.y) * vol_abs.y * phase_light * light.y;
+    accum.z += (1.0f - step_abs.z) * vol_abs.z * phase_light * light.z;
+    return accum;
+}
+
+internal Vec3 FogAttenuate(const Vec3 vol_abs, const f32 length) {
+    return (Vec3){vol_abs.x * expf(-fog_density.x * length),
+                  vol_abs.y * expf(-fog_density.y * length),
+                  vol_abs.z * expf(-fog_density.z * length)};
+}
+
+// The march volumetric.frag did before FogMarch
+internal Vec3
+FogReference(const Vec3 start, const Vec3 dir, const f32 distance, u32 seed, u32 *steps) {
+    const f32 total_dist = distance < 500.0f ? distance : 500.0f;
+    const f32 step_length = 0.5f;
+    const i32 step_amount = (i32)(total_dist / step_length);
+    const f32 phase = FogPhase(fog_to_sun, dir);
+
+    Vec3 vol_abs = {1.0f, 1.0f, 1.0f};
+    Vec3 accum = {0};
+    Vec3 position = vec3_add(start, vec3_fmul(dir, step_length * FogRandom(&seed)));
+    for(i32 i = 0; i < step_amount; i++) {
+        vol_abs = FogAttenuate(vol_abs, step_length);
+        accum = FogAccumulate(accum, step_length, vol_abs, FogSunVisible(position, fog_to_sun));
+        position = vec3_add(position, vec3_fmul(dir, step_length));
+    }
+    *steps += step_amount;
+    accum = vec3_fmul(accum, phase);
+    return (Vec3){accum.x * vol_abs.x, accum.y * vol_abs.y, accum.z * vol_abs.z};
+}
+
+// Same as volumetric_fog in volumetric.frag
+internal Vec3 FogAdaptive(const FogMarch *march,
+                          const Vec3 start,
+                          const Vec3 dir,
+                          const f32 distance,
+                          u32 seed,
+                          u32 *steps) {
+    const f32 total_dist = distance < march->max_distance ? distance : march->max_distance;
+    const f32 phase = FogPhase(fog_to_sun, dir);
+    const f32 jitter = FogRandom(&seed);
+
+    Vec3 vol_abs = {1.0f, 1.0f, 1.0f};
+    Vec3 accum = {0};
+    f32 min_step = total_dist / march->max_steps;
+    min_step = min_step > march->min_step ? min_step : march->min_step;
+    f32 t = 0.0f;
+    for(u32 i = 0; i < march->max_steps && t < total_dist; i++) {
+        f32 step_length = t * march->step_growth;
+        step_length = step_length > min_step ? step_length : min_step;
+        step_length = step_length < total_dist - t ? step_length : total_dist - t;
+        const Vec3 position = vec3_add(start, vec3_fmul(dir, t + step_length * jitter));
+
+        accum = FogAccumulate(accum, step_length, vol_abs, FogSunVisible(position, fog_to_sun));
+        vol_abs = FogAttenuate(vol_abs, step_length);
+        t += step_length;
+        ++*steps;
+
+        const f32 max_abs = vol_abs.x > vol_abs.y ? vol_abs.x : vol_abs.y;
+        if((max_abs > vol_abs.z ? max_abs : vol_abs.z) < march->min_transmittance) {
+            break;
+        }
+    }
+    vol_abs = FogAttenuate(vol_abs, total_dist > t ? total_dist - t : 0.0f);
+    accum = vec3_fmul(accum, phase);
+    return (Vec3){accum.x * vol_abs.x, accum.y * vol_abs.y, accum.z * vol_abs.z};
+}
+
+// Camera at the origin looking down +z, the ground is 8 units below. The distance is the one
+// of the depth buffer, the far plane where there is no ground.
+internal void FogPixelRay(const u32 x, const u32 y, Vec3 *start, Vec3 *dir, f32 *distance) {
+    const f32 tan_half_fov = 0.577f;
+    const f32 aspect = (f32)FOG_WIDTH / (f32)FOG_HEIGHT;
+    const f32 u = ((f32)x + 0.5f) / FOG_WIDTH * 2.0f - 1.0f;
+    const f32 v = ((f32)y + 0.5f) / FOG_HEIGHT * 2.0f - 1.0f;
+    *start = (Vec3){0.0f, 8.0f, 0.0f};
+    *dir = vec3_normalize((Vec3){u * tan_half_fov * aspect, -v * tan_half_fov - 0.1f, 1.0f});
+    *distance = dir->y < 0.0f ? -start->y / dir->y : 1000.0f;
+    if(*distance > 1000.0f) {
+        *distance = 1000.0f;
+    }
+}
+
+// Seed of the shader, hashed from the world position of the pixel and the frame
+internal u32 FogSeed(const Vec3 start, const Vec3 dir, const f32 distance, const u32 frame) {
+    const Vec3 world = vec3_add(start, vec3_fmul(dir, distance));
+    const Vec3 rnd_v = vec3_fmul(vec3_add(world, start), 100.0f);
+    f32 a = (rnd_v.x * rnd_v.y * rnd_v.z) / 100.0f;
+    a = a < 2e9f ? (a > -2e9f ? a : -2e9f) : 2e9f;
+    return FogTea(frame, (u32)(i32)a);
+}
+
+internal void FogWritePPM(const char *directory, const char *name, const Vec3 *pixels) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    FILE *file = fopen(path, "wb");
+    if(!file) {
+        sError("Unable to write %s", path);
+        return;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", FOG_WIDTH, FOG_HEIGHT);
+    for(u32 i = 0; i < FOG_WIDTH * FOG_HEIGHT; ++i) {
+        const f32 channels[3] = {pixels[i].x, pixels[i].y, pixels[i].z};
+        for(u32 c = 0; c < 3; ++c) {
+            const f32 value = channels[c] < 1.0f ? channels[c] : 1.0f;
+            fputc((u8)(value * 255.0f + 0.5f), file);
+        }
+    }
+    fclose(file);
+}
+
+// Accumulates frames of the march into the history, each time clamping the history to the range
+// of the 3x3 neighborhood of the new frame before blending it in, like fog_temporal.frag
+internal void FogTemporal(const FogMarch *march, Vec3 *history, Vec3 *current, u32 *steps) {
+    for(u32 frame = 0; frame < FOG_TEMPORAL_FRAMES; ++frame) {
+        for(u32 y = 0; y < FOG_HEIGHT; ++y) {
+            for(u32 x = 0; x < FOG_WIDTH; ++x) {
+                Vec3 start, dir;
+                f32 distance;
+                FogPixelRay(x, y, &start, &dir, &distance);
+                const u32 seed = FogSeed(start, dir, distance, frame);
+                current[y * FOG_WIDTH + x] = FogAdaptive(march, start, dir, distance, seed, steps);
+            }
+        }
+        for(u32 y = 0; y < FOG_HEIGHT; ++y) {
+            for(u32 x = 0; x < FOG_WIDTH; ++x) {
+                const u32 i = y * FOG_WIDTH + x;
+                if(frame == 0) {
+                    history[i] = current[i];
+                    continue;
+                }
+                f32 lowest[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+                f32 highest[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+                for(i32 dy = -1; dy <= 1; ++dy) {
+                    for(i32 dx = -1; dx <= 1; ++dx) {
+                        i32 nx = (i32)x + dx;
+                        i32 ny = (i32)y + dy;
+                        nx = nx < 0 ? 0 : (nx >= FOG_WIDTH ? FOG_WIDTH - 1 : nx);
+                        ny = ny < 0 ? 0 : (ny >= FOG_HEIGHT ? FOG_HEIGHT - 1 : ny);
+                        const Vec3 n = current[ny * FOG_WIDTH + nx];
+                        const f32 channels[3] = {n.x, n.y, n.z};
+                        for(u32 c = 0; c < 3; ++c) {
+                            lowest[c] = channels[c] < lowest[c] ? channels[c] : lowest[c];
+                            highest[c] = channels[c] > highest[c] ? channels[c] : highest[c];
+                        }
+                    }
+                }
+                f32 old[3] = {history[i].x, history[i].y, history[i].z};
+                const f32 new[3] = {current[i].x, current[i].y, current[i].z};
+                for(u32 c = 0; c < 3; ++c) {
+                    old[c] = old[c] < lowest[c] ? lowest[c] : old[c];
+                    old[c] = old[c] > highest[c] ? highest[c] : old[c];
+                    old[c] += (new[c] - old[c]) * FOG_TEMPORAL_BLEND;
+                }
+                history[i] = (Vec3){old[0], old[1], old[2]};
+            }
+        }
+    }
+}
+
+// Relative RMSE of the image against the reference, the difference is scaled up to be visible
+internal f32
+FogCompare(const char *name, const Vec3 *image, const Vec3 *reference, Vec3 *difference) {
+    const u32 pixel_count = FOG_WIDTH * FOG_HEIGHT;
+    f64 squared_error = 0.0;
+    f64 reference_sum = 0.0;
+    f32 max_error = 0.0f;
+    for(u32 i = 0; i < pixel_count; ++i) {
+        const Vec3 d = vec3_sub(image[i], reference[i]);
+        difference[i] = (Vec3){fabsf(d.x) * 10.0f, fabsf(d.y) * 10.0f, fabsf(d.z) * 10.0f};
+        squared_error += d.x * d.x + d.y * d.y + d.z * d.z;
+        reference_sum += reference[i].x + reference[i].y + reference[i].z;
+        const f32 errors[3] = {fabsf(d.x), fabsf(d.y), fabsf(d.z)};
+        for(u32 c = 0; c < 3; ++c) {
+            max_error = errors[c] > max_error ? errors[c] : max_error;
+        }
+    }
+    const f64 rmse = sqrt(squared_error / (pixel_count * 3));
+    const f64 reference_mean = reference_sum / (pixel_count * 3);
+    const f32 relative_rmse = (f32)(rmse / reference_mean);
+    printf("%s : RMSE %.5f (%.2f%% of the mean %.5f), max error %.5f\n",
+           name,
+           rmse,
+           relative_rmse * 100.0f,
+           reference_mean,
+           max_error);
+    return relative_rmse;
+}
+
+int main(const int argc, const char *argv[]) {
+    fog_to_sun = vec3_normalize((Vec3){0.3f, 1.0f, -0.4f});
+
+    const u32 pixel_count = FOG_WIDTH * FOG_HEIGHT;
+    Vec3 *reference = (Vec3 *)sMalloc(pixel_count * sizeof(Vec3));
+    Vec3 *adaptive = (Vec3 *)sMalloc(pixel_count * sizeof(Vec3));
+    Vec3 *temporal = (Vec3 *)sMalloc(pixel_count * sizeof(Vec3));
+    Vec3 *current = (Vec3 *)sMalloc(pixel_count * sizeof(Vec3));
+    Vec3 *difference = (Vec3 *)sMalloc(pixel_count * sizeof(Vec3));
+
+    const FogMarch march = FOG_MARCH_DEFAULT;
+    u32 reference_steps = 0;
+    u32 adaptive_steps = 0;
+    for(u32 y = 0; y < FOG_HEIGHT; ++y) {
+        for(u32 x = 0; x < FOG_WIDTH; ++x) {
+            Vec3 start, dir;
+            f32 distance;
+            FogPixelRay(x, y, &start, &dir, &distance);
+            const u32 seed = FogSeed(start, dir, distance, 0);
+            const u32 i = y * FOG_WIDTH + x;
+            reference[i] = FogReference(start, dir, distance, seed, &reference_steps);
+            adaptive[i] = FogAdaptive(&march, start, dir, distance, seed, &adaptive_steps);
+        }
+    }
+    const FogMarch temporal_march = FOG_MARCH_TEMPORAL;
+    u32 temporal_steps = 0;
+    FogTemporal(&temporal_march, temporal, current, &temporal_steps);
+
+    printf("Steps per pixel : reference %.1f, adaptive %.1f (%.1fx fewer), temporal %.1f per "
+           "frame\n",
+           (f64)reference_steps / pixel_count,
+           (f64)adaptive_steps / pixel_count,
+           (f64)reference_steps / adaptive_steps,
+           (f64)temporal_steps / (pixel_count * FOG_TEMPORAL_FRAMES));
+
+    const f32 temporal_rmse = FogCompare("Temporal", temporal, reference, difference);
+    if(argc > 1) {
+        FogWritePPM(argv[1], "fog_temporal.ppm", temporal);
+        FogWritePPM(argv[1], "fog_temporal_difference.ppm", difference);
+    }
+    const f32 adaptive_rmse = FogCompare("Adaptive", adaptive, reference, difference);
+    if(argc > 1) {
+        FogWritePPM(argv[1], "fog_reference.ppm", reference);
+        FogWritePPM(argv[1], "fog_adaptive.ppm", adaptive);
+        FogWritePPM(argv[1], "fog_difference.ppm", difference);
+    }
+
+    sFree(reference);
+    sFree(adaptive);
+    sFree(temporal);
+    sFree(current);
+    sFree(difference);
+
+    if(adaptive_rmse > FOG_MAX_RELATIVE_RMSE || temporal_rmse > FOG_MAX_RELATIVE_RMSE) {
+        printf("FAILED : more than %.0f%% off the reference\n", FOG_MAX_RELATIVE_RMSE * 100.0f);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
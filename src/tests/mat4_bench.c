@@ -0,0 +1,87 @@
+#include <sl3dge-utils/sl3dge.h>
+
+#include <stdio.h>
+#include <time.h>
+
+#include "renderer/mat4_batch.c"
+
+// Compares the batched kernels against mat4_mul, multiplying instance transforms by a shared
+// node transform like RendererUpdateInstances does.
+
+internal f64 BenchNow() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return (f64)time.tv_sec + (f64)time.tv_nsec * 1e-9;
+}
+
+internal f32 BenchRandom() {
+    return (f32)rand() / (f32)RAND_MAX * 2.0f - 1.0f;
+}
+
+internal f32 BenchMaxError(const u32 count, const Mat4 *a, const Mat4 *b) {
+    f32 max_error = 0.0f;
+    for(u32 i = 0; i < count; ++i) {
+        for(u32 j = 0; j < 16; ++j) {
+            const f32 error = fabsf(a[i].v[j] - b[i].v[j]);
+            if(error > max_error) {
+                max_error = error;
+            }
+        }
+    }
+    return max_error;
+}
+
+int main(const int argc, const char *argv[]) {
+    const u32 counts[] = {10000, 100000, 1000000};
+    const u32 repeats = 10;
+
+    const u32 max_count = counts[ARRAY_SIZE(counts) - 1];
+    Mat4 *instances = (Mat4 *)sMalloc(max_count * sizeof(Mat4));
+    Mat4 *expected = (Mat4 *)sMalloc(max_count * sizeof(Mat4));
+    Mat4 *result = (Mat4 *)sMalloc(max_count * sizeof(Mat4));
+    for(u32 i = 0; i < max_count; ++i) {
+        for(u32 j = 0; j < 16; ++j) {
+            instances[i].v[j] = BenchRandom();
+        }
+    }
+    Mat4 node;
+    for(u32 j = 0; j < 16; ++j) {
+        node.v[j] = BenchRandom();
+    }
+
+    for(u32 c = 0; c < ARRAY_SIZE(counts); ++c) {
+        const u32 count = counts[c];
+
+        f64 start = BenchNow();
+        for(u32 r = 0; r < repeats; ++r) {
+            for(u32 i = 0; i < count; ++i) {
+                expected[i] = mat4_mul(&instances[i], &node);
+            }
+        }
+        const f64 reference = (BenchNow() - start) / repeats;
+        printf("%8d matrices | mat4_mul %8.3f ms\n", count, reference * 1000.0);
+
+        for(u32 kernel = 0; kernel < MAT4_KERNEL_COUNT; ++kernel) {
+            if(!Mat4BatchUseKernel((Mat4Kernel)kernel)) {
+                continue;
+            }
+            start = BenchNow();
+            for(u32 r = 0; r < repeats; ++r) {
+                Mat4BatchMul(count, instances, sizeof(Mat4), &node, 0, result, sizeof(Mat4));
+            }
+            const f64 time = (BenchNow() - start) / repeats;
+            printf("%8d matrices | %-8s %8.3f ms | x%.2f | max error %g\n",
+                   count,
+                   mat4_kernel_names[kernel],
+                   time * 1000.0,
+                   reference / time,
+                   BenchMaxError(count, expected, result));
+        }
+    }
+
+    sFree(instances);
+    sFree(expected);
+    sFree(result);
+
+    return 0;
+}
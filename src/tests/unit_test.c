@@ -3,6 +3,11 @@
 
 #include <stdio.h>
 
+#include "renderer/handles.c"
+#include "renderer/mat4_batch.c"
+#include "renderer/render_queue.c"
+#include "renderer/frame_graph.c"
+
 void TestHuffman() {
     sLog("HUFFMAN");
     u32 source[] = {3, 3, 3, 3, 3, 2, 4, 4};
@@ -63,6 +68,204 @@ void TestVec3() {
     }
 }
 
+void TestRenderQueue() {
+    sLog("RENDER QUEUE");
+    RenderQueue queue = {0};
+    // Pushed out of order, the primitive is the rank each draw must end up at
+    RenderQueuePush(&queue, RenderKey(1, 0, 3, 0, 2), 2, 5);
+    RenderQueuePush(&queue, RenderKey(0, 0, 0, RenderDepthBucket(12.0f), 7), 7, 1);
+    RenderQueuePush(&queue, RenderKey(1, 0, 3, 0, 2), 2, 6);
+    RenderQueuePush(&queue, RenderKey(0, 0, 0, RenderDepthBucket(0.5f), 9), 9, 0);
+    RenderQueuePush(&queue, RenderKey(1, 0, 1, 0, 4), 4, 3);
+    RenderQueuePush(&queue, RenderKey(1, 0, 1, 0, 300), 300, 4);
+    RenderQueuePush(&queue, RenderKey(0, 0, 0, RenderDepthBucket(13.0f), 1), 1, 2);
+    RenderQueueSort(&queue);
+
+    TEST_EQUALS(queue.count, 7, "%u");
+    for(u32 i = 0; i < queue.count; ++i) {
+        TEST_EQUALS(queue.draws[i].primitive, i, "%u");
+    }
+    TEST_EQUALS(RenderKeyPass(queue.draws[0].key), 0, "%u");
+    TEST_EQUALS(RenderKeyPass(queue.draws[6].key), 1, "%u");
+    u32 first, end;
+    RenderQueueRange(&queue, 1, &first, &end);
+    TEST_EQUALS(first, 3, "%u");
+    TEST_EQUALS(end, 7, "%u");
+    RenderQueueRange(&queue, 2, &first, &end);
+    TEST_EQUALS(first, end, "%u");
+    TEST_EQUALS(RenderDepthBucket(-1.0f), 0, "%u");
+    RenderQueueFree(&queue);
+}
+
+void TestFrameGraph() {
+    sLog("FRAME GRAPH");
+    FrameGraph graph;
+    FrameGraphClear(&graph);
+    enum { DEPTH, COLOR, FOG, SWAPCHAIN, FROXELS };
+    FrameGraphTransient(&graph, DEPTH, 100, 16, 0);
+    FrameGraphTransient(&graph, COLOR, 64, 16, 0);
+    FrameGraphTransient(&graph, FOG, 40, 16, 0);
+    FrameGraphImport(
+        &graph, SWAPCHAIN, GRAPH_USE_PRESENT, GRAPH_USE_PRESENT, GRAPH_RESOURCE_OUTPUT);
+    FrameGraphImport(&graph, FROXELS, GRAPH_USE_STORAGE_READ, GRAPH_USE_STORAGE_READ, 0);
+
+    FrameGraphAddPass(&graph, 0, "FROXELS"); // Nothing reads them
+    FrameGraphUse(&graph, FROXELS, GRAPH_USE_STORAGE_WRITE);
+    FrameGraphAddPass(&graph, 1, "COLOR");
+    FrameGraphUse(&graph, DEPTH, GRAPH_USE_DEPTH_WRITE);
+    FrameGraphUse(&graph, COLOR, GRAPH_USE_COLOR_WRITE);
+    FrameGraphAddPass(&graph, 2, "FOG");
+    FrameGraphUse(&graph, FOG, GRAPH_USE_COLOR_WRITE);
+    FrameGraphAddPass(&graph, 3, "COMPOSITE");
+    FrameGraphUse(&graph, FOG, GRAPH_USE_SAMPLED);
+    FrameGraphUse(&graph, COLOR, GRAPH_USE_COLOR_BLEND);
+    FrameGraphAddPass(&graph, 4, "RESOLVE");
+    FrameGraphUse(&graph, FOG, GRAPH_USE_SAMPLED);
+    FrameGraphUse(&graph, COLOR, GRAPH_USE_SAMPLED);
+    FrameGraphUse(&graph, SWAPCHAIN, GRAPH_USE_COLOR_WRITE);
+    FrameGraphCompile(&graph);
+
+    TEST_EQUALS(graph.passes[0].culled, true, "%d");
+    for(u32 p = 1; p < graph.pass_count; ++p) {
+        TEST_EQUALS(graph.passes[p].culled, false, "%d");
+    }
+    TEST_EQUALS(graph.resources[FOG].first_pass, 2, "%u");
+    TEST_EQUALS(graph.resources[FOG].last_pass, 4, "%u");
+    TEST_EQUALS(graph.resources[FROXELS].first_pass, GRAPH_NO_PASS, "%u");
+
+    // The fog lives after the depth, the color with both of them
+    TEST_EQUALS(FrameGraphAlias(&graph), (u64)176, "%llu");
+    TEST_EQUALS(graph.resources[DEPTH].offset, (u64)0, "%llu");
+    TEST_EQUALS(graph.resources[COLOR].offset, (u64)112, "%llu");
+    TEST_EQUALS(graph.resources[FOG].offset, (u64)0, "%llu");
+
+    FrameGraphCompile(&graph);
+    TEST_EQUALS(graph.passes[1].barrier_count, 2, "%u");
+    const GraphBarrier *fog = &graph.barriers[graph.passes[2].barrier_first];
+    TEST_EQUALS(graph.passes[2].barrier_count, 1, "%u");
+    TEST_EQUALS(fog->old_use, GRAPH_USE_NONE, "%d");
+    TEST_EQUALS(fog->src_uses, (1u << GRAPH_USE_NONE) | (1u << GRAPH_USE_DEPTH_WRITE), "%u");
+    TEST_EQUALS(graph.passes[3].barrier_count, 2, "%u");
+    // The fog is read on as is, the color changes use and the swapchain is written whole
+    TEST_EQUALS(graph.passes[4].barrier_count, 2, "%u");
+    const GraphBarrier *swapchain = &graph.barriers[graph.passes[4].barrier_first + 1];
+    TEST_EQUALS(swapchain->resource, SWAPCHAIN, "%u");
+    TEST_EQUALS(swapchain->old_use, GRAPH_USE_NONE, "%d");
+    TEST_EQUALS(graph.final_barrier_count, 1, "%u");
+    const GraphBarrier *present = &graph.barriers[graph.final_barrier_first];
+    TEST_EQUALS(present->old_use, GRAPH_USE_COLOR_WRITE, "%d");
+    TEST_EQUALS(present->new_use, GRAPH_USE_PRESENT, "%d");
+}
+
+void TestHandleMap() {
+    sLog("HANDLE MAP");
+    HandleMap map;
+    HandleMapInit(&map, 2); // Grows on the third add
+    const u32 a = HandleMapAdd(&map, 0);
+    const u32 b = HandleMapAdd(&map, 1);
+    const u32 c = HandleMapAdd(&map, 2);
+    TEST_EQUALS(HandleMapGet(&map, a), 0, "%u");
+    TEST_EQUALS(HandleMapGet(&map, b), 1, "%u");
+    TEST_EQUALS(HandleMapGet(&map, c), 2, "%u");
+
+    // The owner moves its last item into the place of a
+    HandleMapRemove(&map, a, 2);
+    TEST_EQUALS(HandleMapGet(&map, a), UINT_MAX, "%u");
+    TEST_EQUALS(HandleMapGet(&map, b), 1, "%u");
+    TEST_EQUALS(HandleMapGet(&map, c), 0, "%u");
+    TEST_EQUALS(HandleMapHandleOf(&map, 0), c, "%u");
+    TEST_EQUALS(HandleMapHandleOf(&map, 1), b, "%u");
+
+    // The slot of a is reused with the next generation, a stays stale
+    const u32 d = HandleMapAdd(&map, 2);
+    TEST_EQUALS(d & HANDLE_INDEX_MASK, a & HANDLE_INDEX_MASK, "%u");
+    TEST_EQUALS(d >> HANDLE_INDEX_BITS, (a >> HANDLE_INDEX_BITS) + 1, "%u");
+    TEST_EQUALS(HandleMapGet(&map, a), UINT_MAX, "%u");
+    TEST_EQUALS(HandleMapGet(&map, d), 2, "%u");
+    TEST_EQUALS(HandleMapHandleOf(&map, 2), d, "%u");
+
+    // Removing the last item moves nothing
+    HandleMapRemove(&map, d, 2);
+    TEST_EQUALS(HandleMapGet(&map, d), UINT_MAX, "%u");
+    TEST_EQUALS(HandleMapGet(&map, c), 0, "%u");
+    TEST_EQUALS(HandleMapGet(&map, b), 1, "%u");
+    HandleMapFree(&map);
+}
+
+internal f32 TestMat4Error(const Mat4 *a, const Mat4 *b) {
+    f32 max_error = 0.0f;
+    for(u32 j = 0; j < 16; ++j) {
+        const f32 error = fabsf(a->v[j] - b->v[j]);
+        if(error > max_error) {
+            max_error = error;
+        }
+    }
+    return max_error;
+}
+
+void TestMat4Batch() {
+    sLog("MAT4 BATCH");
+    enum { COUNT = 37 };
+    Mat4 lhs[COUNT];
+    Mat4 rhs[COUNT];
+    Mat4 expected[COUNT];
+    Mat4 result[COUNT];
+    srand(1);
+    for(u32 i = 0; i < COUNT; ++i) {
+        for(u32 j = 0; j < 16; ++j) {
+            lhs[i].v[j] = (f32)rand() / (f32)RAND_MAX * 2.0f - 1.0f;
+            rhs[i].v[j] = (f32)rand() / (f32)RAND_MAX * 2.0f - 1.0f;
+        }
+    }
+
+    // Every kernel the cpu has, with its own and a shared rhs
+    for(u32 kernel = 0; kernel < MAT4_KERNEL_COUNT; ++kernel) {
+        if(!Mat4BatchUseKernel((Mat4Kernel)kernel)) {
+            continue;
+        }
+        sLog("%s", mat4_kernel_names[kernel]);
+        Mat4BatchMul(COUNT, lhs, sizeof(Mat4), rhs, sizeof(Mat4), result, sizeof(Mat4));
+        for(u32 i = 0; i < COUNT; ++i) {
+            expected[i] = mat4_mul(&lhs[i], &rhs[i]);
+            TEST_EQUALS(TestMat4Error(&expected[i], &result[i]) < 1e-5f, true, "%d");
+        }
+        Mat4BatchMul(COUNT, lhs, sizeof(Mat4), rhs, 0, result, sizeof(Mat4));
+        for(u32 i = 0; i < COUNT; ++i) {
+            expected[i] = mat4_mul(&lhs[i], &rhs[0]);
+            TEST_EQUALS(TestMat4Error(&expected[i], &result[i]) < 1e-5f, true, "%d");
+        }
+    }
+    Mat4BatchInit();
+
+    // Rotated, translated and scaled on every axis, mirrored on x
+    const Vec3 t = {3.0f, -2.0f, 5.0f};
+    const Quat r = {0.5f, 0.5f, 0.5f, 0.5f};
+    const Vec3 s = {-1.5f, 2.0f, 0.5f};
+    Mat4 m;
+    trs_to_mat4(&m, &t, &r, &s);
+
+    Mat4 inverse;
+    Mat4AffineInverse(&m, &inverse);
+    const Mat4 identity = mat4_identity();
+    const Mat4 product = mat4_mul(&inverse, &m);
+    TEST_EQUALS(TestMat4Error(&product, &identity) < 1e-5f, true, "%d");
+
+    // The normal matrix columns against the transform columns give |det| * identity, a negative
+    // diagonal would flip the normals of the mirrored instance
+    Mat4 normal;
+    Mat4NormalMatrix(&m, &normal);
+    const f32 abs_det = fabsf(s.x * s.y * s.z);
+    for(u32 i = 0; i < 3; ++i) {
+        for(u32 j = 0; j < 3; ++j) {
+            const f32 dot = normal.m[i][0] * m.m[j][0] + normal.m[i][1] * m.m[j][1] +
+                            normal.m[i][2] * m.m[j][2];
+            const f32 expected_dot = i == j ? abs_det : 0.0f;
+            TEST_EQUALS(fabsf(dot - expected_dot) < 1e-5f, true, "%d");
+        }
+    }
+    TEST_EQUALS(normal.m[3][3], 1.0f, "%.2f");
+}
+
 int main(const int argc, const char *argv[]) {
     TEST_BEGIN();
     //TestVec3();
@@ -72,6 +275,10 @@ int main(const int argc, const char *argv[]) {
     TEST_EQUALS(result, 0b10001101, "%X");
 
     TestHuffman();
+    TestRenderQueue();
+    TestFrameGraph();
+    TestHandleMap();
+    TestMat4Batch();
 
     TEST_END();
 